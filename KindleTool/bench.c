@@ -0,0 +1,592 @@
+//
+//  bench.c
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+#include "bench.h"
+
+// Monotonic wall clock time, in seconds
+static double bench_now(void)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+#endif
+}
+
+// Pseudo-random data, restricted to 6 bits per byte, so that gzip has *something* to chew on (roughly 3:4)
+static void bench_fill(unsigned char *bytes, size_t length)
+{
+    uint32_t x = 0x4B696E64;    // "Kind"
+    size_t i;
+
+    for(i = 0; i < length; i++)
+    {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        bytes[i] = (unsigned char)(0x20 + (x & 0x3F));
+    }
+}
+
+// How many files of file_size we need to make up length
+static unsigned int bench_num_files(const BenchOptions *opts)
+{
+    size_t count = opts->length / opts->file_size;
+
+    return count > 0 ? (unsigned int)count : 1;
+}
+
+// md() over the whole data set, a block at a time
+static int bench_md(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    size_t offset;
+    size_t length;
+
+    for(offset = 0; offset < ctx->opts->length; offset += length)
+    {
+        length = ctx->opts->length - offset < ctx->block_size ? ctx->opts->length - offset : ctx->block_size;
+        md(ctx->work + offset, length);
+        *bytes += length;
+        (*ops)++;
+    }
+
+    return 0;
+}
+
+// Same thing for dm()
+static int bench_dm(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    size_t offset;
+    size_t length;
+
+    for(offset = 0; offset < ctx->opts->length; offset += length)
+    {
+        length = ctx->opts->length - offset < ctx->block_size ? ctx->opts->length - offset : ctx->block_size;
+        dm(ctx->work + offset, length);
+        *bytes += length;
+        (*ops)++;
+    }
+
+    return 0;
+}
+
+// A full munger() stream, file to file (with kt_block_size & kt_threads set by bench_run)
+static int bench_munger(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    rewind(ctx->stream_in);
+    rewind(ctx->stream_out);
+    if(munger(ctx->stream_in, ctx->stream_out, ctx->opts->length, false) < 0)
+        return -1;
+    fflush(ctx->stream_out);
+    *bytes += ctx->opts->length;
+    (*ops)++;
+
+    return 0;
+}
+
+static int bench_demunger(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    rewind(ctx->stream_in);
+    rewind(ctx->stream_out);
+    if(demunger(ctx->stream_in, ctx->stream_out, ctx->opts->length, false) < 0)
+        return -1;
+    fflush(ctx->stream_out);
+    *bytes += ctx->opts->length;
+    (*ops)++;
+
+    return 0;
+}
+
+// md5_sum() over as many files as it takes to make up the data set
+static int bench_md5_sum(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    char md5[MD5_HASH_LENGTH + 1];
+    unsigned int files = bench_num_files(ctx->opts);
+    unsigned int i;
+
+    for(i = 0; i < files; i++)
+    {
+        rewind(ctx->file_in);
+        if(md5_sum(ctx->file_in, md5) < 0)
+            return -1;
+        *bytes += ctx->opts->file_size;
+        (*ops)++;
+    }
+
+    return 0;
+}
+
+// Same for sign_file(), i.e., SHA-256 + RSA with the default key, like each file of a package
+static int bench_sign_file(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    unsigned int files = bench_num_files(ctx->opts);
+    unsigned int i;
+
+    for(i = 0; i < files; i++)
+    {
+        rewind(ctx->file_in);
+        rewind(ctx->sig_out);
+        if(sign_file(ctx->file_in, &ctx->signer, ctx->sig_out) < 0)
+            return -1;
+        *bytes += ctx->opts->file_size;
+        (*ops)++;
+    }
+
+    return 0;
+}
+
+// libarchive write callback: either throw everything away, or keep it in our in-memory tarball
+static la_ssize_t bench_archive_write(struct archive *a __attribute__((unused)), void *userdata, const void *buffer, size_t length)
+{
+    struct bench_ctx *ctx = userdata;
+    unsigned char *tgz;
+
+    if(ctx->tgz_alloc == 0)
+        return (la_ssize_t)length;
+
+    if(ctx->tgz_size + length > ctx->tgz_alloc)
+    {
+        if((tgz = realloc(ctx->tgz, (ctx->tgz_size + length) * 2)) == NULL)
+        {
+            fprintf(stderr, "Error allocating tarball buffer: %s.\n", strerror(errno));
+            return -1;
+        }
+        ctx->tgz = tgz;
+        ctx->tgz_alloc = (ctx->tgz_size + length) * 2;
+    }
+    memcpy(ctx->tgz + ctx->tgz_size, buffer, length);
+    ctx->tgz_size += length;
+
+    return (la_ssize_t)length;
+}
+
+// Write our files to a gzipped tarball, set up like in kindle_create_package_archive
+static int bench_write_tarball(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops, bool keep)
+{
+    struct archive *a;
+    struct archive_entry *entry;
+    char pathname[32];
+    unsigned int files = bench_num_files(ctx->opts);
+    unsigned int i;
+    size_t offset;
+    size_t length;
+
+    if(keep)
+    {
+        ctx->tgz_size = 0;
+        ctx->tgz_alloc = ctx->opts->length;
+        if((ctx->tgz = malloc(ctx->tgz_alloc)) == NULL)
+        {
+            fprintf(stderr, "Error allocating tarball buffer: %s.\n", strerror(errno));
+            return -1;
+        }
+    }
+
+    a = archive_write_new();
+    archive_write_add_filter_gzip(a);
+    archive_write_set_format_gnutar(a);
+    archive_write_set_bytes_per_block(a, DEFAULT_BYTES_PER_BLOCK);
+    archive_write_set_bytes_in_last_block(a, -1);
+    if(archive_write_open(a, ctx, NULL, bench_archive_write, NULL) != ARCHIVE_OK)
+    {
+        fprintf(stderr, "archive_write_open() failed: %s.\n", archive_error_string(a));
+        archive_write_free(a);
+        return -1;
+    }
+
+    entry = archive_entry_new();
+    for(i = 0; i < files; i++)
+    {
+        snprintf(pathname, sizeof(pathname), "bench/file_%u", i);
+        archive_entry_clear(entry);
+        archive_entry_set_pathname(entry, pathname);
+        archive_entry_set_filetype(entry, AE_IFREG);
+        archive_entry_set_perm(entry, 0644);
+        archive_entry_set_size(entry, (int64_t)ctx->opts->file_size);
+        if(archive_write_header(a, entry) != ARCHIVE_OK)
+        {
+            fprintf(stderr, "archive_write_header() failed: %s.\n", archive_error_string(a));
+            goto cleanup;
+        }
+        // Spread the files over our data set, so we're not compressing the exact same thing over & over
+        for(offset = 0; offset < ctx->opts->file_size; offset += length)
+        {
+            length = ctx->opts->file_size - offset < ctx->block_size ? ctx->opts->file_size - offset : ctx->block_size;
+            if(archive_write_data(a, ctx->data + ((size_t)i * ctx->opts->file_size + offset) % (ctx->opts->length - length + 1), length) < 0)
+            {
+                fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
+                goto cleanup;
+            }
+        }
+        *bytes += ctx->opts->file_size;
+        (*ops)++;
+    }
+    archive_entry_free(entry);
+    if(archive_write_close(a) != ARCHIVE_OK)
+    {
+        fprintf(stderr, "archive_write_close() failed: %s.\n", archive_error_string(a));
+        archive_write_free(a);
+        return -1;
+    }
+    archive_write_free(a);
+    // Don't keep anything on later runs
+    ctx->tgz_alloc = 0;
+
+    return 0;
+
+cleanup:
+    archive_entry_free(entry);
+    archive_write_free(a);
+    ctx->tgz_alloc = 0;
+    return -1;
+}
+
+static int bench_gzip_write(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    return bench_write_tarball(ctx, bytes, ops, false);
+}
+
+// Read back (gunzip, untar & read each file) our in-memory tarball, a block at a time. Nothing actually hits the disk.
+static int bench_tar_extract(struct bench_ctx *ctx, uint64_t *bytes, uint64_t *ops)
+{
+    struct archive *a;
+    struct archive_entry *entry;
+    la_ssize_t length;
+    int r;
+
+    a = archive_read_new();
+    archive_read_support_format_tar(a);
+    archive_read_support_format_gnutar(a);
+    archive_read_support_filter_gzip(a);
+    if(archive_read_open_memory(a, ctx->tgz, ctx->tgz_size) != ARCHIVE_OK)
+    {
+        fprintf(stderr, "archive_read_open_memory() failed: %s.\n", archive_error_string(a));
+        archive_read_free(a);
+        return -1;
+    }
+    while((r = archive_read_next_header(a, &entry)) == ARCHIVE_OK)
+    {
+        while((length = archive_read_data(a, ctx->scratch, ctx->block_size)) > 0)
+            *bytes += (uint64_t)length;
+        if(length < 0)
+            break;
+        (*ops)++;
+    }
+    if(r != ARCHIVE_EOF)
+    {
+        fprintf(stderr, "Error reading tarball: %s.\n", archive_error_string(a));
+        archive_read_free(a);
+        return -1;
+    }
+    archive_read_free(a);
+
+    return 0;
+}
+
+// Run a kernel with the given block size & thread count, as many times as it takes to fill BENCH_MIN_TIME, and record the results
+static int bench_run(struct bench_ctx *ctx, const char *kernel, bench_fn fn, size_t block_size, unsigned int threads, BenchResult **results, unsigned int *num_results)
+{
+    BenchResult result;
+    BenchResult *tmp;
+    double start;
+
+    result.kernel = kernel;
+    result.block_size = block_size;
+    result.threads = threads;
+    result.bytes = 0;
+    result.ops = 0;
+
+    ctx->block_size = block_size;
+    kt_block_size = block_size;
+    kt_threads = threads;
+    start = bench_now();
+    do
+    {
+        if(fn(ctx, &result.bytes, &result.ops) < 0)
+        {
+            fprintf(stderr, "Benchmark '%s' failed.\n", kernel);
+            return -1;
+        }
+        result.seconds = bench_now() - start;
+    }
+    while(result.seconds < BENCH_MIN_TIME);
+
+    if((tmp = realloc(*results, (*num_results + 1) * sizeof(*tmp))) == NULL)
+    {
+        fprintf(stderr, "Error allocating results: %s.\n", strerror(errno));
+        return -1;
+    }
+    *results = tmp;
+    (*results)[(*num_results)++] = result;
+    if(!ctx->opts->json)
+        bench_print_result(&result);
+
+    return 0;
+}
+
+static void bench_print_header(const BenchOptions *opts)
+{
+    unsigned int features = kt_cpu_features();
+
+    printf("KindleTool %s benchmark, %zu bytes per pass, %zu bytes per file.\n", KT_VERSION, opts->length, opts->file_size);
+    printf("CPU features:%s%s%s%s%s%s%s\n\n", (features & KT_CPU_SSE2 ? " sse2" : ""), (features & KT_CPU_AVX2 ? " avx2" : ""), (features & KT_CPU_AVX512BW ? " avx512bw" : ""), (features & KT_CPU_NEON ? " neon" : ""), (features & KT_CPU_SHANI ? " sha-ni" : ""), (features & KT_CPU_ARM_SHA2 ? " arm-sha2" : ""), (features == 0 ? " none" : ""));
+    printf("%-16s %10s %8s %12s %12s\n", "Kernel", "Block", "Threads", "MB/s", "ops/s");
+}
+
+static void bench_print_result(const BenchResult *result)
+{
+    char block[32];
+
+    // Keep block sizes readable
+    if(result->block_size % (1024 * 1024) == 0)
+        snprintf(block, sizeof(block), "%zuM", result->block_size / (1024 * 1024));
+    else if(result->block_size % 1024 == 0)
+        snprintf(block, sizeof(block), "%zuK", result->block_size / 1024);
+    else
+        snprintf(block, sizeof(block), "%zu", result->block_size);
+    printf("%-16s %10s %8u %12.2f %12.2f\n", result->kernel, block, result->threads, (double)result->bytes / result->seconds / 1e6, (double)result->ops / result->seconds);
+    fflush(stdout);
+}
+
+static void bench_print_json(const BenchOptions *opts, const BenchResult *results, unsigned int num_results)
+{
+    unsigned int features = kt_cpu_features();
+    unsigned int i;
+
+    printf("{\n");
+    printf("  \"version\": \"%s\",\n", KT_VERSION);
+    printf("  \"cpu_features\": { \"sse2\": %s, \"avx2\": %s, \"avx512bw\": %s, \"neon\": %s, \"sha_ni\": %s, \"arm_sha2\": %s },\n", (features & KT_CPU_SSE2 ? "true" : "false"), (features & KT_CPU_AVX2 ? "true" : "false"), (features & KT_CPU_AVX512BW ? "true" : "false"), (features & KT_CPU_NEON ? "true" : "false"), (features & KT_CPU_SHANI ? "true" : "false"), (features & KT_CPU_ARM_SHA2 ? "true" : "false"));
+    printf("  \"length\": %zu,\n", opts->length);
+    printf("  \"file_size\": %zu,\n", opts->file_size);
+    printf("  \"results\": [\n");
+    for(i = 0; i < num_results; i++)
+    {
+        printf("    { \"kernel\": \"%s\", \"block_size\": %zu, \"threads\": %u, \"bytes\": %llu, \"ops\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.2f, \"ops_per_s\": %.2f }%s\n", results[i].kernel, results[i].block_size, results[i].threads, (unsigned long long)results[i].bytes, (unsigned long long)results[i].ops, results[i].seconds, (double)results[i].bytes / results[i].seconds / 1e6, (double)results[i].ops / results[i].seconds, (i < num_results - 1 ? "," : ""));
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+int kindle_bench_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "length", required_argument, NULL, 'l' },
+        { "file-size", required_argument, NULL, 'f' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { "json", no_argument, NULL, 'j' },
+        { NULL, 0, NULL, 0 }
+    };
+    static const struct
+    {
+        const char *name;
+        bench_fn fn;
+        bool threaded;
+    } kernels[] =
+    {
+        { "md", bench_md, false },
+        { "dm", bench_dm, false },
+        { "munger", bench_munger, true },
+        { "demunger", bench_demunger, true },
+        { "md5_sum", bench_md5_sum, false },
+        { "sign_file", bench_sign_file, false },
+        { "gzip_write", bench_gzip_write, false },
+        { "tar_extract", bench_tar_extract, false },
+    };
+    BenchOptions bench_opts;
+    struct bench_ctx ctx;
+    BenchResult *results = NULL;
+    unsigned int num_results = 0;
+    struct rsa_private_key rsa_pkey;
+    unsigned int saved_threads = kt_threads;
+    size_t saved_block_size = kt_block_size;
+    size_t max_block_size;
+    unsigned int online_cpus;
+    unsigned int threads;
+    uint64_t bytes = 0;
+    uint64_t ops = 0;
+    unsigned int k;
+    unsigned int b;
+    unsigned int t;
+    int ret = -1;
+
+    memset(&bench_opts, 0, sizeof(bench_opts));
+    bench_opts.length = BENCH_DEFAULT_LENGTH;
+    bench_opts.file_size = BENCH_DEFAULT_FILE_SIZE;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.opts = &bench_opts;
+
+    while((opt = getopt_long(argc, argv, "l:f:S:T:j", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'l':
+                if(kt_parse_size(optarg, "length", &bench_opts.length) < 0)
+                    return -1;
+                break;
+            case 'f':
+                if(kt_parse_size(optarg, "file size", &bench_opts.file_size) < 0)
+                    return -1;
+                break;
+            case 'S':
+                if(bench_opts.num_block_sizes >= BENCH_MAX_BLOCK_SIZES)
+                {
+                    fprintf(stderr, "Too many block sizes (%d at most).\n", BENCH_MAX_BLOCK_SIZES);
+                    return -1;
+                }
+                if(kt_parse_size(optarg, "block size", &bench_opts.block_sizes[bench_opts.num_block_sizes]) < 0)
+                    return -1;
+                bench_opts.num_block_sizes++;
+                break;
+            case 'T':
+                if(bench_opts.num_threads >= BENCH_MAX_THREADS)
+                {
+                    fprintf(stderr, "Too many thread counts (%d at most).\n", BENCH_MAX_THREADS);
+                    return -1;
+                }
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
+                bench_opts.threads[bench_opts.num_threads++] = kt_threads;
+                break;
+            case 'j':
+                bench_opts.json = true;
+                break;
+            case ':':
+                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    // Defaults: a few typical buffer sizes, and 1 to one thread per CPU, in powers of two
+    if(bench_opts.num_block_sizes == 0)
+    {
+        bench_opts.block_sizes[bench_opts.num_block_sizes++] = 4 * 1024;
+        bench_opts.block_sizes[bench_opts.num_block_sizes++] = 64 * 1024;
+        bench_opts.block_sizes[bench_opts.num_block_sizes++] = DEFAULT_STREAM_BLOCK_SIZE;
+    }
+    if(bench_opts.num_threads == 0)
+    {
+        kt_parse_threads("0");
+        online_cpus = kt_threads;
+        for(threads = 1; threads < online_cpus && bench_opts.num_threads < BENCH_MAX_THREADS - 1; threads *= 2)
+            bench_opts.threads[bench_opts.num_threads++] = threads;
+        bench_opts.threads[bench_opts.num_threads++] = online_cpus;
+    }
+    if(bench_opts.file_size > bench_opts.length)
+        bench_opts.file_size = bench_opts.length;
+    max_block_size = 0;
+    for(b = 0; b < bench_opts.num_block_sizes; b++)
+    {
+        if(bench_opts.block_sizes[b] > max_block_size)
+            max_block_size = bench_opts.block_sizes[b];
+    }
+
+    // Set everything up
+    if((ctx.data = malloc(bench_opts.length)) == NULL || (ctx.work = malloc(bench_opts.length)) == NULL || (ctx.scratch = malloc(max_block_size)) == NULL)
+    {
+        fprintf(stderr, "Error allocating benchmark buffers: %s.\n", strerror(errno));
+        goto cleanup;
+    }
+    bench_fill(ctx.data, bench_opts.length);
+    memcpy(ctx.work, ctx.data, bench_opts.length);
+    if((ctx.stream_in = tmpfile()) == NULL || (ctx.stream_out = tmpfile()) == NULL || (ctx.file_in = tmpfile()) == NULL || (ctx.sig_out = tmpfile()) == NULL)
+    {
+        fprintf(stderr, "Cannot create temporary files: %s.\n", strerror(errno));
+        goto cleanup;
+    }
+    if(fwrite(ctx.data, sizeof(unsigned char), bench_opts.length, ctx.stream_in) < bench_opts.length || fwrite(ctx.data, sizeof(unsigned char), bench_opts.file_size, ctx.file_in) < bench_opts.file_size || fflush(ctx.stream_in) != 0 || fflush(ctx.file_in) != 0)
+    {
+        fprintf(stderr, "Cannot write temporary files: %s.\n", strerror(errno));
+        goto cleanup;
+    }
+    // The signer borrows it, so it's only cleared on our way out
+    rsa_pkey = get_default_key();
+    if(kt_rsa_signer_init(&ctx.signer, &rsa_pkey) != 0)
+    {
+        rsa_private_key_clear(&rsa_pkey);
+        goto cleanup;
+    }
+    ctx.block_size = DEFAULT_BYTES_PER_BLOCK;
+    if(bench_write_tarball(&ctx, &bytes, &ops, true) < 0)
+        goto cleanup;
+
+    // And go!
+    if(!bench_opts.json)
+        bench_print_header(&bench_opts);
+    for(k = 0; k < sizeof(kernels) / sizeof(*kernels); k++)
+    {
+        for(b = 0; b < bench_opts.num_block_sizes; b++)
+        {
+            // Only the stream kernels know how to use more than one thread
+            for(t = 0; t < (kernels[k].threaded ? bench_opts.num_threads : 1); t++)
+            {
+                if(bench_run(&ctx, kernels[k].name, kernels[k].fn, bench_opts.block_sizes[b], (kernels[k].threaded ? bench_opts.threads[t] : 1), &results, &num_results) < 0)
+                    goto cleanup;
+            }
+        }
+    }
+    if(bench_opts.json)
+        bench_print_json(&bench_opts, results, num_results);
+    ret = 0;
+
+cleanup:
+    if(ctx.signer.key != NULL)
+        rsa_private_key_clear(&rsa_pkey);
+    kt_threads = saved_threads;
+    kt_block_size = saved_block_size;
+    free(results);
+    free(ctx.tgz);
+    free(ctx.scratch);
+    free(ctx.work);
+    free(ctx.data);
+    if(ctx.stream_in != NULL)
+        fclose(ctx.stream_in);
+    if(ctx.stream_out != NULL)
+        fclose(ctx.stream_out);
+    if(ctx.file_in != NULL)
+        fclose(ctx.file_in);
+    if(ctx.sig_out != NULL)
+        fclose(ctx.sig_out);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
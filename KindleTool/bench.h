@@ -0,0 +1,93 @@
+//
+//  bench.h
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef KINDLEBENCH
+#define KINDLEBENCH
+
+#define BENCH_DEFAULT_LENGTH (32 * 1024 * 1024)
+#define BENCH_DEFAULT_FILE_SIZE (1024 * 1024)
+#define BENCH_MIN_TIME 0.25     // In seconds, we repeat each run until we've been at it for at least that long
+#define BENCH_MAX_BLOCK_SIZES 8
+#define BENCH_MAX_THREADS 16
+
+typedef struct
+{
+    size_t length;                                  // Size of the data set for each pass
+    size_t file_size;                               // Size of each file, for the per-file kernels
+    size_t block_sizes[BENCH_MAX_BLOCK_SIZES];
+    unsigned int num_block_sizes;
+    unsigned int threads[BENCH_MAX_THREADS];
+    unsigned int num_threads;
+    bool json;
+} BenchOptions;
+
+typedef struct
+{
+    const char *kernel;
+    size_t block_size;
+    unsigned int threads;
+    uint64_t bytes;
+    uint64_t ops;
+    double seconds;
+} BenchResult;
+
+// State shared by all our kernels
+struct bench_ctx
+{
+    BenchOptions *opts;
+    unsigned char *data;                            // opts->length bytes of test data
+    unsigned char *work;                            // A copy of it, for md() & dm() to mangle in place
+    unsigned char *scratch;                         // Block sized work buffer
+    FILE *stream_in;                                // opts->length bytes of test data, as a file
+    FILE *stream_out;
+    FILE *file_in;                                  // opts->file_size bytes of test data, as a file
+    FILE *sig_out;
+    struct kt_rsa_signer signer;
+    unsigned char *tgz;                             // In-memory tarball, for the extraction test
+    size_t tgz_size;
+    size_t tgz_alloc;
+    size_t block_size;                              // For the current run
+};
+
+typedef int (*bench_fn)(struct bench_ctx *, uint64_t *, uint64_t *);
+
+static double bench_now(void);
+static void bench_fill(unsigned char *, size_t);
+static unsigned int bench_num_files(const BenchOptions *);
+
+static int bench_md(struct bench_ctx *, uint64_t *, uint64_t *);
+static int bench_dm(struct bench_ctx *, uint64_t *, uint64_t *);
+static int bench_munger(struct bench_ctx *, uint64_t *, uint64_t *);
+static int bench_demunger(struct bench_ctx *, uint64_t *, uint64_t *);
+static int bench_md5_sum(struct bench_ctx *, uint64_t *, uint64_t *);
+static int bench_sign_file(struct bench_ctx *, uint64_t *, uint64_t *);
+static la_ssize_t bench_archive_write(struct archive *, void *, const void *, size_t);
+static int bench_write_tarball(struct bench_ctx *, uint64_t *, uint64_t *, bool);
+static int bench_gzip_write(struct bench_ctx *, uint64_t *, uint64_t *);
+static int bench_tar_extract(struct bench_ctx *, uint64_t *, uint64_t *);
+
+static int bench_run(struct bench_ctx *, const char *, bench_fn, size_t, unsigned int, BenchResult **, unsigned int *);
+static void bench_print_header(const BenchOptions *);
+static void bench_print_result(const BenchResult *);
+static void bench_print_json(const BenchOptions *, const BenchResult *, unsigned int);
+
+#endif
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,457 @@
+//
+//  cache.c
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+#include "cache.h"
+
+// Hash & signature cache, for when we keep rebuilding packages out of the same, mostly unchanged, trees (cf. create --cache-dir).
+// It's a single text file in the cache directory, one line per file & key: 'fingerprint size mtime nsec inode md5 sha256 sig path'.
+// We only care about the entries for the key we're signing with, anything else is written back untouched.
+// A file is only considered unchanged if its size, mtime & inode all match, and --cache-verify double checks its content, too.
+// Without a directory, it only lives in memory (cf. create --watch).
+// NOTE: The whole file gets rewritten (atomically) when we're done, so concurrent builds sharing a cache just mean the last one wins.
+
+// SHA-256 of the key's modulus, which is all the public half boils down to for our purposes
+static void key_fingerprint(const struct rsa_private_key *key, char *fingerprint)
+{
+    mpz_t n;
+    char *hex;
+    struct kt_sha256_ctx sha256;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    mpz_init(n);
+    mpz_mul(n, key->p, key->q);
+    hex = malloc(mpz_sizeinbase(n, 16) + 2);
+    if(hex != NULL)
+    {
+        mpz_get_str(hex, 16, n);
+        kt_sha256_init(&sha256);
+        kt_sha256_update(&sha256, strlen(hex), (const uint8_t *)hex);
+        kt_sha256_digest(&sha256, digest);
+        free(hex);
+    }
+    else
+    {
+        memset(digest, 0, sizeof(digest));
+    }
+    mpz_clear(n);
+    base16_encode_update(fingerprint, SHA256_DIGEST_SIZE, digest);
+    fingerprint[KEY_FINGERPRINT_LENGTH] = '\0';
+}
+
+// FNV-1a
+static size_t hash_path(const char *path)
+{
+    uint32_t hash = 2166136261U;
+
+    while(*path != '\0')
+    {
+        hash ^= (unsigned char) *path++;
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+static struct kt_cache_entry *find_entry(struct kt_hash_cache *cache, const char *path)
+{
+    size_t i;
+
+    if(cache->index_size == 0)
+        return NULL;
+    for(i = hash_path(path) & (cache->index_size - 1); cache->index[i] != 0; i = (i + 1) & (cache->index_size - 1))
+    {
+        if(strcmp(cache->entries[cache->index[i] - 1].path, path) == 0)
+            return &cache->entries[cache->index[i] - 1];
+    }
+
+    return NULL;
+}
+
+// Append a new entry for path (which it takes ownership of, even on failure), the caller fills in the rest
+static struct kt_cache_entry *add_entry(struct kt_hash_cache *cache, char *path)
+{
+    size_t i;
+
+    if(cache->count == cache->size)
+    {
+        struct kt_cache_entry *entries;
+
+        cache->size = cache->size ? cache->size * 2 : 256;
+        if((entries = realloc(cache->entries, cache->size * sizeof(*entries))) == NULL)
+        {
+            free(path);
+            return NULL;
+        }
+        cache->entries = entries;
+    }
+    // Keep the index at most half full, so that the probes stay short
+    if((cache->count + 1) * 2 > cache->index_size)
+    {
+        size_t *index;
+        size_t index_size = cache->index_size ? cache->index_size * 2 : 512;
+        size_t j;
+
+        if((index = calloc(index_size, sizeof(*index))) == NULL)
+        {
+            free(path);
+            return NULL;
+        }
+        for(j = 0; j < cache->count; j++)
+        {
+            for(i = hash_path(cache->entries[j].path) & (index_size - 1); index[i] != 0; i = (i + 1) & (index_size - 1))
+                ;
+            index[i] = j + 1;
+        }
+        free(cache->index);
+        cache->index = index;
+        cache->index_size = index_size;
+    }
+    for(i = hash_path(path) & (cache->index_size - 1); cache->index[i] != 0; i = (i + 1) & (cache->index_size - 1))
+        ;
+    cache->index[i] = cache->count + 1;
+    cache->entries[cache->count].path = path;
+
+    return &cache->entries[cache->count++];
+}
+
+// Decode exactly len bytes worth of hex
+static int parse_hex(const char *hex, size_t len, uint8_t *out)
+{
+    struct base16_decode_ctx ctx;
+    size_t out_len = len;
+
+    if(strlen(hex) != BASE16_ENCODE_LENGTH(len))
+        return -1;
+    base16_decode_init(&ctx);
+    if(!base16_decode_update(&ctx, &out_len, out, BASE16_ENCODE_LENGTH(len), hex) || !base16_decode_final(&ctx) || out_len != len)
+        return -1;
+
+    return 0;
+}
+
+// Parse one of our lines (in place). Returns 1 if it's for another key, -1 if it's garbage.
+static int parse_entry(char *line, struct kt_hash_cache *cache)
+{
+    struct kt_cache_entry entry;
+    struct kt_cache_entry *slot;
+    char *fields[8];
+    char *path;
+    char *p = line;
+    long long size, mtime, nsec, ino;
+    unsigned int i;
+
+    for(i = 0; i < 8; i++)
+    {
+        fields[i] = p;
+        if((p = strchr(p, ' ')) == NULL)
+            return -1;
+        *p++ = '\0';
+    }
+    path = p;
+    if(strcmp(fields[0], cache->fingerprint) != 0)
+        return 1;
+    if(*path == '\0' || sscanf(fields[1], "%lld", &size) != 1 || sscanf(fields[2], "%lld", &mtime) != 1 || sscanf(fields[3], "%lld", &nsec) != 1 || sscanf(fields[4], "%lld", &ino) != 1)
+        return -1;
+    if(strlen(fields[5]) != MD5_HASH_LENGTH || parse_hex(fields[6], SHA256_DIGEST_SIZE, entry.sha256) != 0)
+        return -1;
+    entry.sig_size = strlen(fields[7]) / 2;
+    if(entry.sig_size == 0 || entry.sig_size > CERTIFICATE_2K_SIZE || parse_hex(fields[7], entry.sig_size, entry.sig) != 0)
+        return -1;
+    memcpy(entry.md5, fields[5], MD5_HASH_LENGTH + 1);
+    entry.size = size;
+    entry.mtime = mtime;
+    entry.mtime_nsec = nsec;
+    entry.ino = ino;
+    // Should a path show up twice, the last one wins
+    if((slot = find_entry(cache, path)) == NULL)
+    {
+        if((entry.path = strdup(path)) == NULL || (slot = add_entry(cache, entry.path)) == NULL)
+            return -1;
+    }
+    entry.path = slot->path;
+    *slot = entry;
+
+    return 0;
+}
+
+static int write_entry_line(FILE *file, const char *fingerprint, const struct kt_cache_entry *entry)
+{
+    char sha256[BASE16_ENCODE_LENGTH(SHA256_DIGEST_SIZE) + 1];
+    char sig[BASE16_ENCODE_LENGTH(CERTIFICATE_2K_SIZE) + 1];
+
+    base16_encode_update(sha256, SHA256_DIGEST_SIZE, entry->sha256);
+    sha256[BASE16_ENCODE_LENGTH(SHA256_DIGEST_SIZE)] = '\0';
+    base16_encode_update(sig, entry->sig_size, entry->sig);
+    sig[BASE16_ENCODE_LENGTH(entry->sig_size)] = '\0';
+
+    return fprintf(file, "%s %lld %lld %lld %lld %s %s %s %s\n", fingerprint, (long long) entry->size, (long long) entry->mtime, (long long) entry->mtime_nsec, (long long) entry->ino, entry->md5, sha256, sig, entry->path) < 0 ? -1 : 0;
+}
+
+// Load (or start) the cache in dirname (NULL for an in-memory one) for files signed with key
+kt_hash_cache *kt_hash_cache_open(const char *dirname, const struct rsa_private_key *key)
+{
+    kt_hash_cache *cache;
+    char *filename;
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    struct stat st;
+
+    if(dirname == NULL)
+    {
+        if((cache = calloc(1, sizeof(*cache))) == NULL)
+        {
+            fprintf(stderr, "Cannot allocate memory for the cache.\n");
+            return NULL;
+        }
+        key_fingerprint(key, cache->fingerprint);
+        return cache;
+    }
+    if(stat(dirname, &st) != 0)
+    {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        if(mkdir(dirname) != 0)
+#else
+        if(mkdir(dirname, 0755) != 0)
+#endif
+        {
+            fprintf(stderr, "Cannot create cache directory '%s': %s.\n", dirname, strerror(errno));
+            return NULL;
+        }
+    }
+    else if(!S_ISDIR(st.st_mode))
+    {
+        fprintf(stderr, "Cache directory '%s' is not a directory.\n", dirname);
+        return NULL;
+    }
+
+    if((cache = calloc(1, sizeof(*cache))) == NULL || (cache->dirname = strdup(dirname)) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for the cache.\n");
+        free(cache);
+        return NULL;
+    }
+    key_fingerprint(key, cache->fingerprint);
+
+    if((filename = malloc(strlen(dirname) + 1 + strlen(HASH_CACHE_FILE_NAME) + 1)) == NULL)
+    {
+        kt_hash_cache_close(cache, false);
+        return NULL;
+    }
+    sprintf(filename, "%s/%s", dirname, HASH_CACHE_FILE_NAME);
+    // No cache yet is fine, we'll just miss a lot
+    if((file = fopen(filename, "rb")) != NULL)
+    {
+        while((len = kt_getline(&line, &line_size, file)) > 0)
+        {
+            if(line[len - 1] != '\n')
+                continue;
+            line[len - 1] = '\0';
+            // The lines meant for other keys are left alone, we'll copy them over from the file as it is when we save ours
+            if(strncmp(line, cache->fingerprint, KEY_FINGERPRINT_LENGTH) != 0)
+                continue;
+            if(parse_entry(line, cache) < 0)
+            {
+                fprintf(stderr, "Skipping invalid entry in cache '%s'.\n", filename);
+            }
+        }
+        free(line);
+        fclose(file);
+    }
+    free(filename);
+
+    return cache;
+}
+
+// Whether cache is the one for files signed with key
+bool kt_hash_cache_for_key(const kt_hash_cache *cache, const struct rsa_private_key *key)
+{
+    char fingerprint[KEY_FINGERPRINT_LENGTH + 1];
+
+    key_fingerprint(key, fingerprint);
+    return strcmp(fingerprint, cache->fingerprint) == 0;
+}
+
+// Fill in md5, sha256 & sig (sig_size bytes) from the cache if we've already seen that exact file. Keeps track of hits & misses.
+bool kt_hash_cache_lookup(kt_hash_cache *cache, const KTCacheKey *key, char *md5, uint8_t *sha256, unsigned char *sig, size_t sig_size)
+{
+    struct kt_cache_entry *entry = find_entry(cache, key->path);
+
+    if(entry == NULL || entry->size != key->size || entry->mtime != key->mtime || entry->mtime_nsec != key->mtime_nsec || entry->ino != key->ino || entry->sig_size != sig_size)
+    {
+        cache->misses++;
+        return false;
+    }
+    memcpy(md5, entry->md5, MD5_HASH_LENGTH + 1);
+    memcpy(sha256, entry->sha256, SHA256_DIGEST_SIZE);
+    memcpy(sig, entry->sig, sig_size);
+    cache->hits++;
+
+    return true;
+}
+
+// Fill in md5 & sha256 from the cache if we've already seen that exact file, whatever it was signed with (cf. create with several --key).
+// Doesn't count as a hit nor a miss, those are for the lookups that save us a signature.
+bool kt_hash_cache_lookup_digests(kt_hash_cache *cache, const KTCacheKey *key, char *md5, uint8_t *sha256)
+{
+    struct kt_cache_entry *entry = find_entry(cache, key->path);
+
+    if(entry == NULL || entry->size != key->size || entry->mtime != key->mtime || entry->mtime_nsec != key->mtime_nsec || entry->ino != key->ino)
+        return false;
+    memcpy(md5, entry->md5, MD5_HASH_LENGTH + 1);
+    memcpy(sha256, entry->sha256, SHA256_DIGEST_SIZE);
+
+    return true;
+}
+
+// A hit turned out not to match the file's content after all (cf. --cache-verify), count it as a miss
+void kt_hash_cache_reject(kt_hash_cache *cache)
+{
+    cache->hits--;
+    cache->misses++;
+}
+
+// Remember what we've just computed for a file
+int kt_hash_cache_store(kt_hash_cache *cache, const KTCacheKey *key, const char *md5, const uint8_t *sha256, const unsigned char *sig, size_t sig_size)
+{
+    struct kt_cache_entry *entry;
+
+    // We couldn't read that back
+    if(strchr(key->path, '\n') != NULL || sig_size > CERTIFICATE_2K_SIZE)
+        return -1;
+    if((entry = find_entry(cache, key->path)) == NULL)
+    {
+        char *path = strdup(key->path);
+
+        if(path == NULL || (entry = add_entry(cache, path)) == NULL)
+            return -1;
+    }
+    entry->size = key->size;
+    entry->mtime = key->mtime;
+    entry->mtime_nsec = key->mtime_nsec;
+    entry->ino = key->ino;
+    memcpy(entry->md5, md5, MD5_HASH_LENGTH);
+    entry->md5[MD5_HASH_LENGTH] = '\0';
+    memcpy(entry->sha256, sha256, SHA256_DIGEST_SIZE);
+    memcpy(entry->sig, sig, sig_size);
+    entry->sig_size = sig_size;
+
+    return 0;
+}
+
+// Print how many lookups hit since the last report
+void kt_hash_cache_report(kt_hash_cache *cache)
+{
+    if(cache == NULL)
+        return;
+    fprintf(stderr, "Cache: %u hits, %u misses.\n", cache->hits, cache->misses);
+    cache->hits = 0;
+    cache->misses = 0;
+}
+
+// Write the cache back (if save is set, and it has a directory), and free it
+int kt_hash_cache_close(kt_hash_cache *cache, bool save)
+{
+    char *filename = NULL;
+    char *tmpname = NULL;
+    int fd;
+    FILE *file = NULL;
+    FILE *current;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+    size_t i;
+    int ret = 0;
+
+    if(cache == NULL)
+        return 0;
+
+    if(save && cache->dirname != NULL)
+    {
+        filename = malloc(strlen(cache->dirname) + 1 + strlen(HASH_CACHE_FILE_NAME) + 1);
+        tmpname = malloc(strlen(cache->dirname) + 1 + strlen(HASH_CACHE_FILE_NAME) + 7 + 1);
+        if(filename == NULL || tmpname == NULL)
+        {
+            ret = -1;
+            goto cleanup;
+        }
+        sprintf(filename, "%s/%s", cache->dirname, HASH_CACHE_FILE_NAME);
+        sprintf(tmpname, "%s.XXXXXX", filename);
+        // Write it alongside, and swap it in once it's complete, so that nobody ever sees half a cache
+        if((fd = mkstemp(tmpname)) == -1 || (file = fdopen(fd, "wb")) == NULL)
+        {
+            fprintf(stderr, "Cannot write cache '%s': %s.\n", filename, strerror(errno));
+            if(fd != -1)
+            {
+                close(fd);
+                unlink(tmpname);
+            }
+            ret = -1;
+            goto cleanup;
+        }
+        // Keep the lines for other keys as they are *now*, another cache might have saved its own since we loaded ours
+        if((current = fopen(filename, "rb")) != NULL)
+        {
+            while(ret == 0 && (len = kt_getline(&line, &line_size, current)) > 0)
+            {
+                if(line[len - 1] != '\n' || strncmp(line, cache->fingerprint, KEY_FINGERPRINT_LENGTH) == 0)
+                    continue;
+                if(fputs(line, file) == EOF)
+                    ret = -1;
+            }
+            free(line);
+            fclose(current);
+        }
+        for(i = 0; i < cache->count && ret == 0; i++)
+            ret = write_entry_line(file, cache->fingerprint, &cache->entries[i]);
+        if(fclose(file) != 0)
+            ret = -1;
+        if(ret == 0)
+        {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+            // rename won't replace an existing file there
+            unlink(filename);
+#endif
+            if(rename(tmpname, filename) != 0)
+                ret = -1;
+        }
+        if(ret != 0)
+        {
+            fprintf(stderr, "Cannot write cache '%s': %s.\n", filename, strerror(errno));
+            unlink(tmpname);
+        }
+    }
+
+cleanup:
+    free(filename);
+    free(tmpname);
+    for(i = 0; i < cache->count; i++)
+        free(cache->entries[i].path);
+    free(cache->entries);
+    free(cache->index);
+    free(cache->dirname);
+    free(cache);
+
+    return ret;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,63 @@
+//
+//  cache.h
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef KINDLECACHE
+#define KINDLECACHE
+
+#define KEY_FINGERPRINT_LENGTH BASE16_ENCODE_LENGTH(SHA256_DIGEST_SIZE)
+
+// What we remember about a file we've signed with our key
+struct kt_cache_entry
+{
+    char *path;
+    int64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t ino;
+    char md5[MD5_HASH_LENGTH + 1];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+    unsigned char sig[CERTIFICATE_2K_SIZE];
+    size_t sig_size;
+};
+
+struct kt_hash_cache
+{
+    char *dirname;
+    char fingerprint[KEY_FINGERPRINT_LENGTH + 1];   // Of the public half of the key we sign with
+    struct kt_cache_entry *entries;                 // In no particular order
+    size_t count;
+    size_t size;
+    size_t *index;                                  // Open addressing hash table of the entries by path: entry number + 1, 0 when free
+    size_t index_size;                              // A power of two, at least twice count
+    unsigned int hits;
+    unsigned int misses;
+};
+
+static void key_fingerprint(const struct rsa_private_key *, char *);
+static size_t hash_path(const char *);
+static struct kt_cache_entry *find_entry(struct kt_hash_cache *, const char *);
+static struct kt_cache_entry *add_entry(struct kt_hash_cache *, char *);
+static int parse_hex(const char *, size_t, uint8_t *);
+static int parse_entry(char *, struct kt_hash_cache *);
+static int write_entry_line(FILE *, const char *, const struct kt_cache_entry *);
+
+#endif
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
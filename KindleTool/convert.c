@@ -85,7 +85,7 @@ static int kindle_read_bundle_header(UpdateHeader *header, FILE *input)
     return 0;
 }
 
-static int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const bool fake_sign, const bool unwrap_only, FILE *unwrap_output, char *header_md5)
+static int kindle_convert_bundle(FILE *input, FILE *output, FILE *sig_output, const bool fake_sign, const bool unwrap_only, FILE *unwrap_output, char *header_md5)
 {
     UpdateHeader header;
     BundleVersion bundle_version;
@@ -147,7 +147,7 @@ static int kindle_convert(FILE *input, FILE *output, FILE *sig_output, const boo
             }
             else
             {
-                return kindle_convert(input, output, sig_output, fake_sign, 0, NULL, header_md5);
+                return kindle_convert_bundle(input, output, sig_output, fake_sign, 0, NULL, header_md5);
             }
             break;
         case OTAUpdate:
@@ -640,22 +640,11 @@ static int kindle_convert_recovery_v2(FILE *input, FILE *output, const bool fake
     return demunger(input, output, 0, fake_sign);
 }
 
-int kindle_convert_main(int argc, char *argv[])
+// Convert every package in opts->input_list. Doesn't touch opts, so it's safe to run several of these at once, as long as they each have their own.
+int kindle_convert(const KTConvertOptions *opts)
 {
-    int opt;
-    int opt_index;
-    static const struct option opts[] =
-    {
-        { "stdout", no_argument, NULL, 'c' },
-        { "info", no_argument, NULL, 'i' },
-        { "keep", no_argument, NULL, 'k' },
-        { "sig", no_argument, NULL, 's' },
-        { "unsigned", no_argument, NULL, 'u' },
-        { "unwrap", no_argument, NULL, 'w' },
-        { NULL, 0, NULL, 0 }
-    };
     FILE *input;
-    FILE *output = NULL;
+    FILE *output = opts->output;
     FILE *sig_output = NULL;
     FILE *unwrap_output = NULL;
     const char *in_name;
@@ -664,52 +653,19 @@ int kindle_convert_main(int argc, char *argv[])
     char *unwrapped_name = NULL;
     size_t len;
     struct stat st;
-    bool info_only = false;
-    bool keep_ori = false;
-    bool extract_sig = false;
-    bool fake_sign = false;
-    bool unwrap_only = false;
+    bool info_only = opts->info_only;
+    bool keep_ori = opts->keep_ori;
+    bool extract_sig = opts->extract_sig;
+    bool fake_sign = opts->fake_sign;
+    bool unwrap_only = opts->unwrap_only;
+    bool to_stream;
     unsigned int ext_offset = 0;
+    unsigned int ui;
     bool fail = true;
     char header_md5[MD5_HASH_LENGTH + 1];
+    KTSettings saved_settings;
 
-    while((opt = getopt_long(argc, argv, "icksuw", opts, &opt_index)) != -1)
-    {
-        switch(opt)
-        {
-            case 'i':
-                info_only = true;
-                break;
-            case 'k':
-                keep_ori = true;
-                break;
-            case 'c':
-                output = stdout;
-                break;
-            case 's':
-                extract_sig = true;
-                break;
-            case 'u':
-                fake_sign = true;
-                break;
-            case 'w':
-                unwrap_only = true;
-                break;
-            case ':':
-                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
-                return -1;
-                break;
-            case '?':
-                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
-                return -1;
-                break;
-            default:
-                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
-                return -1;
-                break;
-        }
-    }
-    // Don't try to output to stdout or extract/unwrap the package sig if we asked for info only
+    // Don't try to output to a stream or extract/unwrap the package sig if we asked for info only
     if(info_only)
     {
         output = NULL;
@@ -727,100 +683,64 @@ int kindle_convert_main(int argc, char *argv[])
     {
         output = NULL;
     }
+    // Otherwise, without a stream, each package gets converted to its own file
+    to_stream = (output != NULL);
+
+    if(opts->input_count == 0)
+    {
+        fprintf(stderr, "No input specified.\n");
+        return -1;
+    }
 
-    if(optind < argc)
+    // Switch this thread over to our own settings for the duration of the job
+    kt_settings_get(&saved_settings);
+    kt_settings_set(&opts->settings);
+
+    // Iterate over the file(s) we passed (stream output is probably pretty dumb when passing multiple files...)
+    for(ui = 0; ui < opts->input_count; ui++)
     {
-        // Iterate over non-options (the file(s) we passed) (stdout output is probably pretty dumb when passing multiple files...)
-        while(optind < argc)
+        fail = false;
+        in_name = opts->input_list[ui];
+        // Check that a valid package input properly ends in .bin or .stgz, unless we just want to parse the header
+        if(!info_only && (!IS_BIN(in_name) && !IS_STGZ(in_name)))
+        {
+            fprintf(stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' userdata package.\n", in_name);
+            fail = true;
+            continue;   // It's fatal, go away
+        }
+        // Set the appropriate file extension offset...
+        if(IS_STGZ(in_name))
+            ext_offset = 1;
+        else
+            ext_offset = 0;
+        if(!info_only && !unwrap_only && !to_stream) // Not info only, not unwrap only AND not stdout
         {
-            fail = false;
-            in_name = argv[optind++];
-            // Check that a valid package input properly ends in .bin or .stgz, unless we just want to parse the header
-            if(!info_only && (!IS_BIN(in_name) && !IS_STGZ(in_name)))
+            len = strlen(in_name);
+            out_name = malloc(len + 1 + (13 - ext_offset));
+            memcpy(out_name, in_name, len - (4 + ext_offset));
+            out_name[len - (4 + ext_offset)] = 0;    // . => \0
+            strncat(out_name, "_converted.tar.gz", 17);
+            if((output = fopen(out_name, "wb")) == NULL)
             {
-                fprintf(stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' userdata package.\n", in_name);
+                fprintf(stderr, "Cannot open output '%s' for writing.\n", out_name);
                 fail = true;
+                free(out_name);
                 continue;   // It's fatal, go away
             }
-            // Set the appropriate file extension offset...
-            if(IS_STGZ(in_name))
-                ext_offset = 1;
-            else
-                ext_offset = 0;
-            if(!info_only && !unwrap_only && output != stdout) // Not info only, not unwrap only AND not stdout
-            {
-                len = strlen(in_name);
-                out_name = malloc(len + 1 + (13 - ext_offset));
-                memcpy(out_name, in_name, len - (4 + ext_offset));
-                out_name[len - (4 + ext_offset)] = 0;    // . => \0
-                strncat(out_name, "_converted.tar.gz", 17);
-                if((output = fopen(out_name, "wb")) == NULL)
-                {
-                    fprintf(stderr, "Cannot open output '%s' for writing.\n", out_name);
-                    fail = true;
-                    free(out_name);
-                    continue;   // It's fatal, go away
-                }
-            }
-            if(extract_sig) // We want the payload sig (implies not info only)
-            {
-                len = strlen(in_name);
-                sig_name = malloc(len + 1 + (1 - ext_offset));
-                memcpy(sig_name, in_name, len - (4 + ext_offset));
-                sig_name[len - (4 + ext_offset)] = 0;  // . => \0
-                strncat(sig_name, ".psig", 5);
-                if((sig_output = fopen(sig_name, "wb")) == NULL)
-                {
-                    fprintf(stderr, "Cannot open signature output '%s' for writing.\n", sig_name);
-                    fail = true;
-                    if(!info_only && !unwrap_only && output != stdout)
-                    {
-                        if(output != NULL)
-                        {
-                            fclose(output);
-                            unlink(out_name);
-                        }
-                        free(out_name);
-                    }
-                    free(sig_name);
-                    continue;   // It's fatal, go away
-                }
-            }
-            if(unwrap_only)     // We want an unwrapped package (implies not info only)
-            {
-                len = strlen(in_name);
-                unwrapped_name = malloc(len + 1 + (10 - ext_offset));
-                memcpy(unwrapped_name, in_name, len - (4 + ext_offset));
-                unwrapped_name[len - (4 + ext_offset)] = 0;  // . => \0
-                // If input is an userdata package, we can safely assume we'll end up with a tarballl
-                if(ext_offset)
-                    strncat(unwrapped_name, "_unwrapped.tgz", 14);
-                else
-                    strncat(unwrapped_name, "_unwrapped.bin", 14);
-                if((unwrap_output = fopen(unwrapped_name, "wb")) == NULL)
-                {
-                    fprintf(stderr, "Cannot open unwrapped package output '%s' for writing.\n", unwrapped_name);
-                    fail = true;
-                    free(unwrapped_name);
-                    if(extract_sig)
-                    {
-                        if(sig_output != NULL)
-                        {
-                            fclose(sig_output);
-                            unlink(sig_name);
-                        }
-                        free(sig_name);
-                    }
-                    continue;   // It's fatal, go away
-                }
-            }
-            if((input = fopen(in_name, "rb")) == NULL)
+        }
+        if(extract_sig) // We want the payload sig (implies not info only)
+        {
+            len = strlen(in_name);
+            sig_name = malloc(len + 1 + (1 - ext_offset));
+            memcpy(sig_name, in_name, len - (4 + ext_offset));
+            sig_name[len - (4 + ext_offset)] = 0;  // . => \0
+            strncat(sig_name, ".psig", 5);
+            if((sig_output = fopen(sig_name, "wb")) == NULL)
             {
-                fprintf(stderr, "Cannot open input '%s' for reading.\n", in_name);
+                fprintf(stderr, "Cannot open signature output '%s' for writing.\n", sig_name);
                 fail = true;
-                if(!info_only && !unwrap_only && output != stdout)
+                if(!info_only && !unwrap_only && !to_stream)
                 {
-                    // Don't leave 0-byte files behind...
                     if(output != NULL)
                     {
                         fclose(output);
@@ -828,6 +748,26 @@ int kindle_convert_main(int argc, char *argv[])
                     }
                     free(out_name);
                 }
+                free(sig_name);
+                continue;   // It's fatal, go away
+            }
+        }
+        if(unwrap_only)     // We want an unwrapped package (implies not info only)
+        {
+            len = strlen(in_name);
+            unwrapped_name = malloc(len + 1 + (10 - ext_offset));
+            memcpy(unwrapped_name, in_name, len - (4 + ext_offset));
+            unwrapped_name[len - (4 + ext_offset)] = 0;  // . => \0
+            // If input is an userdata package, we can safely assume we'll end up with a tarballl
+            if(ext_offset)
+                strncat(unwrapped_name, "_unwrapped.tgz", 14);
+            else
+                strncat(unwrapped_name, "_unwrapped.bin", 14);
+            if((unwrap_output = fopen(unwrapped_name, "wb")) == NULL)
+            {
+                fprintf(stderr, "Cannot open unwrapped package output '%s' for writing.\n", unwrapped_name);
+                fail = true;
+                free(unwrapped_name);
                 if(extract_sig)
                 {
                     if(sig_output != NULL)
@@ -837,88 +777,111 @@ int kindle_convert_main(int argc, char *argv[])
                     }
                     free(sig_name);
                 }
-                if(unwrap_only)
-                {
-                    if(unwrap_output != NULL)
-                    {
-                        fclose(unwrap_output);
-                        unlink(unwrapped_name);
-                    }
-                    free(unwrapped_name);
-                }
                 continue;   // It's fatal, go away
             }
-            // If we're outputting to stdout, set a dummy human readable output name
-            if(!info_only && output == stdout)
-            {
-                out_name = strdup("standard output");
-            }
-            // Print a recap of what we're doing
-            if(info_only)
-            {
-                fprintf(stderr, "Checking %s%s package '%s'.\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
-            }
-            else if(unwrap_only)
-            {
-                fprintf(stderr, "Unwrapping %s package '%s' to '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name, unwrapped_name);
-            }
-            else
-            {
-                fprintf(stderr, "Converting %s%s package '%s' to '%s' (%s, %s).\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name, out_name, (extract_sig ? "with sig" : "without sig"), (keep_ori ? "keep input" : "delete input"));
-            }
-            if(kindle_convert(input, output, sig_output, fake_sign, unwrap_only, unwrap_output, header_md5) < 0)
-            {
-                fprintf(stderr, "Error converting %s package '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
-                if(output != NULL && output != stdout)
-                    unlink(out_name); // Clean up our mess, if we made one
-                fail = true;
-            }
-            if(output != stdout && !info_only && !keep_ori && !fail) // If output was some file, and we didn't ask to keep it, and we didn't fail to convert it, delete the original
-                unlink(in_name);
-
-            // Clean up behind us
-            if(!info_only && !unwrap_only)
+        }
+        if((input = fopen(in_name, "rb")) == NULL)
+        {
+            fprintf(stderr, "Cannot open input '%s' for reading.\n", in_name);
+            fail = true;
+            if(!info_only && !unwrap_only && !to_stream)
             {
+                // Don't leave 0-byte files behind...
+                if(output != NULL)
+                {
+                    fclose(output);
+                    unlink(out_name);
+                }
                 free(out_name);
             }
-            if(output != NULL && output != stdout)
-            {
-                fclose(output);
-            }
-            if(input != NULL)
-                fclose(input);
-            if(sig_output != NULL)
-                fclose(sig_output);
-            if(unwrap_output != NULL)
-                fclose(unwrap_output);
-            // Remove empty sigs (since we have to open the fd before calling kindle_convert, we end up with an empty file for packages that aren't wrapped in an UpdateSignature)
             if(extract_sig)
             {
-                stat(sig_name, &st);
-                if(st.st_size == 0)
+                if(sig_output != NULL)
+                {
+                    fclose(sig_output);
                     unlink(sig_name);
+                }
                 free(sig_name);
             }
-            // Same thing for unwrapped packages...
             if(unwrap_only)
             {
-                stat(unwrapped_name, &st);
-                if(st.st_size == 0)
+                if(unwrap_output != NULL)
+                {
+                    fclose(unwrap_output);
                     unlink(unwrapped_name);
+                }
                 free(unwrapped_name);
             }
+            continue;   // It's fatal, go away
+        }
+        // If we're outputting to stdout, set a dummy human readable output name
+        if(!info_only && to_stream)
+        {
+            out_name = strdup(output == stdout ? "standard output" : "output stream");
+        }
+        // Print a recap of what we're doing
+        if(info_only)
+        {
+            fprintf(stderr, "Checking %s%s package '%s'.\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
+        }
+        else if(unwrap_only)
+        {
+            fprintf(stderr, "Unwrapping %s package '%s' to '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name, unwrapped_name);
+        }
+        else
+        {
+            fprintf(stderr, "Converting %s%s package '%s' to '%s' (%s, %s).\n", (fake_sign ? "fake " : ""), (IS_STGZ(in_name) ? "userdata" : "update"), in_name, out_name, (extract_sig ? "with sig" : "without sig"), (keep_ori ? "keep input" : "delete input"));
+        }
+        if(kindle_convert_bundle(input, output, sig_output, fake_sign, unwrap_only, unwrap_output, header_md5) < 0)
+        {
+            fprintf(stderr, "Error converting %s package '%s'.\n", (IS_STGZ(in_name) ? "userdata" : "update"), in_name);
+            if(output != NULL && !to_stream)
+                unlink(out_name); // Clean up our mess, if we made one
+            fail = true;
+        }
+        if(!to_stream && !info_only && !keep_ori && !fail) // If output was some file, and we didn't ask to keep it, and we didn't fail to convert it, delete the original
+            unlink(in_name);
 
-            // If we're not the last file, throw an LF to untangle the output
-            if(optind < argc)
-                fprintf(stderr, "\n");
+        // Clean up behind us
+        if(!info_only && !unwrap_only)
+        {
+            free(out_name);
         }
-    }
-    else
-    {
-        fprintf(stderr, "No input specified.\n");
-        return -1;
+        if(output != NULL && !to_stream)
+        {
+            fclose(output);
+        }
+        if(input != NULL)
+            fclose(input);
+        if(sig_output != NULL)
+            fclose(sig_output);
+        if(unwrap_output != NULL)
+            fclose(unwrap_output);
+        // Remove empty sigs (since we have to open the fd before calling kindle_convert, we end up with an empty file for packages that aren't wrapped in an UpdateSignature)
+        if(extract_sig)
+        {
+            stat(sig_name, &st);
+            if(st.st_size == 0)
+                unlink(sig_name);
+            free(sig_name);
+        }
+        // Same thing for unwrapped packages...
+        if(unwrap_only)
+        {
+            stat(unwrapped_name, &st);
+            if(st.st_size == 0)
+                unlink(unwrapped_name);
+            free(unwrapped_name);
+        }
+
+        // If we're not the last file, throw an LF to untangle the output
+        if(ui < opts->input_count - 1)
+            fprintf(stderr, "\n");
     }
 
+    kt_release_pool();
+    kt_settings_set(&saved_settings);
+
     // Return
     if(fail)
         return -1;
@@ -926,6 +889,89 @@ int kindle_convert_main(int argc, char *argv[])
         return 0;
 }
 
+// Parse a convert command line (starting at the command itself) into convert_opts. input_list points into argv.
+// NOTE: Relies on getopt, so this one is *not* reentrant (unlike kindle_convert)!
+int kindle_convert_parse_options(int argc, char *argv[], KTConvertOptions *convert_opts)
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "stdout", no_argument, NULL, 'c' },
+        { "info", no_argument, NULL, 'i' },
+        { "keep", no_argument, NULL, 'k' },
+        { "sig", no_argument, NULL, 's' },
+        { "unsigned", no_argument, NULL, 'u' },
+        { "unwrap", no_argument, NULL, 'w' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    memset(convert_opts, 0, sizeof(*convert_opts));
+    while((opt = getopt_long(argc, argv, "icksuwS:T:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'i':
+                convert_opts->info_only = true;
+                break;
+            case 'k':
+                convert_opts->keep_ori = true;
+                break;
+            case 'c':
+                convert_opts->output = stdout;
+                break;
+            case 's':
+                convert_opts->extract_sig = true;
+                break;
+            case 'u':
+                convert_opts->fake_sign = true;
+                break;
+            case 'w':
+                convert_opts->unwrap_only = true;
+                break;
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    return -1;
+                break;
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
+                break;
+            case ':':
+                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    // Everything that's left is a package
+    convert_opts->input_list = &argv[optind];
+    convert_opts->input_count = (unsigned int) (argc - optind);
+    // Pick up whatever --block-size/--threads did to our settings
+    kt_settings_get(&convert_opts->settings);
+
+    return 0;
+}
+
+int kindle_convert_main(int argc, char *argv[])
+{
+    KTConvertOptions opts;
+
+    if(kindle_convert_parse_options(argc, argv, &opts) != 0)
+        return -1;
+
+    return kindle_convert(&opts);
+}
+
 // Heavily inspired from libarchive's tar/read.c ;)
 static int libarchive_extract(const char *filename, const char *prefix)
 {
@@ -1004,32 +1050,35 @@ cleanup:
     return 1;
 }
 
-int kindle_extract_main(int argc, char *argv[])
+// Parse an extract command line (starting at the command itself) into extract_opts, which point into argv.
+// NOTE: Relies on getopt, so this one is *not* reentrant (unlike kindle_extract)!
+int kindle_extract_parse_options(int argc, char *argv[], KTExtractOptions *extract_opts)
 {
     int opt;
     int opt_index;
     static const struct option opts[] =
     {
         { "unsigned", no_argument, NULL, 'u' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
         { NULL, 0, NULL, 0 }
     };
-    bool fake_sign = false;
-
-    char *bin_filename = NULL;
-    char tgz_filename[] = KT_TMPDIR "/kindletool_extract_tgz_XXXXXX";
-    char *output_dir = NULL;
-    FILE *bin_input;
-    int tgz_fd;
-    FILE *tgz_output;
-    char header_md5[MD5_HASH_LENGTH + 1] = {'\0'};
-    char actual_md5[MD5_HASH_LENGTH + 1] = {'\0'};
 
-    while((opt = getopt_long(argc, argv, "u", opts, &opt_index)) != -1)
+    memset(extract_opts, 0, sizeof(*extract_opts));
+    while((opt = getopt_long(argc, argv, "uS:T:", opts, &opt_index)) != -1)
     {
         switch(opt)
         {
             case 'u':
-                fake_sign = true;
+                extract_opts->fake_sign = true;
+                break;
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    return -1;
+                break;
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
                 break;
             case ':':
                 fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
@@ -1050,44 +1099,59 @@ int kindle_extract_main(int argc, char *argv[])
     if(optind < argc && (optind + 2) == argc)
     {
         // We know exactly what we need, and in what order
-        bin_filename = argv[optind];
-        output_dir = argv[optind + 1];
+        extract_opts->input = argv[optind];
+        extract_opts->output_dir = argv[optind + 1];
     }
     else
     {
         fprintf(stderr, "Invalid number of arguments (need input & output).\n");
         return -1;
     }
-    // Double validation, and make GCC happy
+    // Pick up whatever --block-size/--threads did to our settings
+    kt_settings_get(&extract_opts->settings);
+
+    return 0;
+}
+
+// Extract a package (or just check its integrity if there's no output directory). Doesn't touch opts, so it's safe to run several of these at once.
+int kindle_extract(const KTExtractOptions *opts)
+{
+    const char *bin_filename = opts->input;
+    const char *output_dir = opts->output_dir;
+    const char *package_type;
+    char tgz_filename[] = KT_TMPDIR "/kindletool_extract_tgz_XXXXXX";
+    FILE *bin_input = NULL;
+    int tgz_fd;
+    FILE *tgz_output = NULL;
+    char header_md5[MD5_HASH_LENGTH + 1] = {'\0'};
+    char actual_md5[MD5_HASH_LENGTH + 1] = {'\0'};
+    KTSettings saved_settings;
+    int ret = -1;
+
     if(bin_filename == NULL)
     {
         fprintf(stderr, "Input filename isn't set!\n");
         return -1;
     }
-    if(output_dir == NULL)
-    {
-        fprintf(stderr, "Output directory isn't set!\n");
-        return -1;
-    }
-
     // Check that input properly ends in .bin or .stgz
     if(!IS_BIN(bin_filename) && !IS_STGZ(bin_filename) && !IS_TARBALL(bin_filename) && !IS_TGZ(bin_filename))
     {
         fprintf(stderr, "Input file '%s' is neither a '.bin' update package nor a '.stgz' or '.tar.gz'/'.tgz' userdata package.\n", bin_filename);
         return -1;
     }
+    package_type = (IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update";
     // NOTE: Do some sanity checks for output directory handling?
     // The 'rewrite pathname entry' cheap method we currently use is pretty 'dumb' (it assumes the path is correct, creating it if need be),
     // but the other (more correct?) way to handle this (chdir) would need some babysitting (cf. bsdtar's *_chdir() in tar/util.c)...
     if((bin_input = fopen(bin_filename, "rb")) == NULL)
     {
-        fprintf(stderr, "Cannot open input %s package '%s': %s.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename, strerror(errno));
+        fprintf(stderr, "Cannot open input %s package '%s': %s.\n", package_type, bin_filename, strerror(errno));
         return -1;
     }
     // Use a non-racey tempfile, hopefully... (Heavily inspired from http://www.tldp.org/HOWTO/Secure-Programs-HOWTO/avoid-race.html)
     // We always create them in P_tmpdir (usually /tmp or /var/tmp), and rely on the OS implementation to handle the umask,
     // it'll cost us less LOC that way since I don't really want to introduce a dedicated utility function for tempfile handling...
-    // NOTE: Probably still racey on MinGW, according to libarchive, but, meh, and we're not multithreaded... See the ifdef in kindle_tool.h for more details.
+    // NOTE: Probably still racey on MinGW, according to libarchive, but, meh... See the ifdef in kindle_tool.h for more details.
     tgz_fd = mkstemp(tgz_filename);
     if(tgz_fd == -1)
     {
@@ -1103,46 +1167,65 @@ int kindle_extract_main(int argc, char *argv[])
         unlink(tgz_filename);
         return -1;
     }
+
+    // Switch this thread over to our own settings for the duration of the job
+    kt_settings_get(&saved_settings);
+    kt_settings_set(&opts->settings);
+
     // Print a recap of what we're about to do
-    fprintf(stderr, "Extracting %s package '%s' to '%s'.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename, output_dir);
-    if(kindle_convert(bin_input, tgz_output, NULL, fake_sign, 0, NULL, header_md5) < 0)
+    if(output_dir != NULL)
+        fprintf(stderr, "Extracting %s package '%s' to '%s'.\n", package_type, bin_filename, output_dir);
+    else
+        fprintf(stderr, "Verifying %s package '%s'.\n", package_type, bin_filename);
+    if(kindle_convert_bundle(bin_input, tgz_output, NULL, opts->fake_sign, 0, NULL, header_md5) < 0)
     {
-        fprintf(stderr, "Error converting %s package '%s'.\n", ((IS_STGZ(bin_filename) || IS_TARBALL(bin_filename) || IS_TGZ(bin_filename)) ? "userdata" : "update"), bin_filename);
-        fclose(bin_input);
-        fclose(tgz_output);
-        return -1;
+        fprintf(stderr, "Error converting %s package '%s'.\n", package_type, bin_filename);
+        goto cleanup;
     }
-    fclose(bin_input);
     // When appropriate, check the integrity of the tarball, thanks to the md5 hash stored in the package's header...
-    if(!fake_sign && strlen(header_md5) != 0)
+    if(!opts->fake_sign && strlen(header_md5) != 0)
     {
         // First, calculate the hash of what we've just extracted...
         rewind(tgz_output);
         if(md5_sum(tgz_output, actual_md5) < 0)
         {
             fprintf(stderr, "Error calculating MD5 of package.\n");
-            fclose(tgz_output);
-            unlink(tgz_filename);
-            return -1;
+            goto cleanup;
         }
         // ...And compare it against the one stored in the package's header.
         if(strcmp(header_md5, actual_md5) != 0)
         {
             fprintf(stderr, "Integrity check failed! Header: '%s' vs Package: '%s'.\n", header_md5, actual_md5);
-            fclose(tgz_output);
-            unlink(tgz_filename);
-            return -1;
+            goto cleanup;
         }
     }
     fclose(tgz_output);
-    if(libarchive_extract(tgz_filename, output_dir) < 0)
+    tgz_output = NULL;
+    if(output_dir != NULL && libarchive_extract(tgz_filename, output_dir) < 0)
     {
         fprintf(stderr, "Error extracting temp tarball '%s' to '%s'.\n", tgz_filename, output_dir);
-        unlink(tgz_filename);
-        return -1;
+        goto cleanup;
     }
+    ret = 0;
+
+cleanup:
+    fclose(bin_input);
+    if(tgz_output != NULL)
+        fclose(tgz_output);
     unlink(tgz_filename);
-    return 0;
+    kt_release_pool();
+    kt_settings_set(&saved_settings);
+    return ret;
+}
+
+int kindle_extract_main(int argc, char *argv[])
+{
+    KTExtractOptions opts;
+
+    if(kindle_extract_parse_options(argc, argv, &opts) != 0)
+        return -1;
+
+    return kindle_extract(&opts);
 }
 
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -29,7 +29,7 @@ static const char *convert_magic_number(char *);
 static char *to_base(int64_t, unsigned int);
 
 static int kindle_read_bundle_header(UpdateHeader *, FILE *);
-static int kindle_convert(FILE *, FILE *, FILE *, const bool, const bool, FILE *, char *);
+static int kindle_convert_bundle(FILE *, FILE *, FILE *, const bool, const bool, FILE *, char *);
 static int kindle_convert_ota_update_v2(FILE *, FILE *, const bool, char *);
 static int kindle_convert_signature(UpdateHeader *, FILE *, FILE *);
 static int kindle_convert_ota_update(UpdateHeader *, FILE *, FILE *, const bool, char *);
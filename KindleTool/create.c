@@ -21,7 +21,7 @@
 //  along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //
 
-#include "kindle_tool.h"
+#include "libkindletool.h"
 #include "create.h"
 
 static const char *convert_bundle_version(BundleVersion bundlev)
@@ -44,7 +44,11 @@ static const char *convert_bundle_version(BundleVersion bundlev)
     }
 }
 
-static struct rsa_private_key get_default_key(void)
+// Parsed once by parse_default_key, everyone gets their own copy of it
+static pthread_once_t default_key_once = PTHREAD_ONCE_INIT;
+static struct rsa_private_key default_key;
+
+static void parse_default_key(void)
 {
     // Make nettle happy... (Array created from the bin2h (grub2 has one) output of pkcs1-conv on our pem file)
     static const uint8_t sign_key_sexp[] =
@@ -94,65 +98,143 @@ static struct rsa_private_key get_default_key(void)
         0xb5, 0xac, 0x3c, 0xcc, 0x29, 0x29, 0x29
     };
 
-    struct rsa_private_key rsa_pkey;
-    rsa_private_key_init(&rsa_pkey);
+    rsa_private_key_init(&default_key);
 
-    if(!rsa_keypair_from_sexp(NULL, &rsa_pkey, 0, sizeof(sign_key_sexp), sign_key_sexp))
+    if(!rsa_keypair_from_sexp(NULL, &default_key, 0, sizeof(sign_key_sexp), sign_key_sexp))
     {
         fprintf(stderr, "Invalid default private key!\n");
         // In the unlikely event this ever happens, it'll be caught later on in sign_file ;).
     }
+}
+
+// Copy a private key into an already initialized one
+static void copy_private_key(struct rsa_private_key *dst, const struct rsa_private_key *src)
+{
+    dst->size = src->size;
+    mpz_set(dst->d, src->d);
+    mpz_set(dst->p, src->p);
+    mpz_set(dst->q, src->q);
+    mpz_set(dst->a, src->a);
+    mpz_set(dst->b, src->b);
+    mpz_set(dst->c, src->c);
+}
+
+struct rsa_private_key get_default_key(void)
+{
+    struct rsa_private_key rsa_pkey;
+
+    pthread_once(&default_key_once, parse_default_key);
+    rsa_private_key_init(&rsa_pkey);
+    copy_private_key(&rsa_pkey, &default_key);
 
     return rsa_pkey;
 }
 
-static int sign_file(FILE *in_file, struct rsa_private_key *rsa_pkey, FILE *sigout_file)
+// The PEM keys we've already loaded, when kt_enable_key_cache was called (i.e., by serve). Reloaded when the file changes.
+struct key_cache_entry
 {
-    unsigned char buffer[BUFFER_SIZE];
+    char *filename;
+    time_t mtime;
+    struct rsa_private_key key;
+    struct key_cache_entry *next;
+};
+static pthread_mutex_t key_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct key_cache_entry *key_cache = NULL;
+static bool key_cache_enabled = false;
+
+void kt_enable_key_cache(void)
+{
+    pthread_mutex_lock(&key_cache_lock);
+    key_cache_enabled = true;
+    pthread_mutex_unlock(&key_cache_lock);
+}
+
+// Load a PEM private key into an already initialized key, going through the cache if it's enabled
+int kt_load_private_key(char *filename, struct rsa_private_key *rsa_pkey)
+{
+    struct key_cache_entry *cached;
+    struct stat st;
+    int ret = 0;
+
+    pthread_mutex_lock(&key_cache_lock);
+    if(!key_cache_enabled || stat(filename, &st) != 0)
+    {
+        pthread_mutex_unlock(&key_cache_lock);
+        return nettle_rsa_privkey_from_pem(filename, rsa_pkey);
+    }
+    for(cached = key_cache; cached != NULL; cached = cached->next)
+    {
+        if(strcmp(cached->filename, filename) == 0)
+            break;
+    }
+    if(cached == NULL)
+    {
+        // Without a cache entry, we can still load it the usual way
+        if((cached = calloc(1, sizeof(*cached))) == NULL || (cached->filename = strdup(filename)) == NULL)
+        {
+            free(cached);
+            pthread_mutex_unlock(&key_cache_lock);
+            return nettle_rsa_privkey_from_pem(filename, rsa_pkey);
+        }
+        rsa_private_key_init(&cached->key);
+        cached->next = key_cache;
+        key_cache = cached;
+    }
+    else if(cached->mtime == st.st_mtime)
+    {
+        copy_private_key(rsa_pkey, &cached->key);
+        pthread_mutex_unlock(&key_cache_lock);
+        return 0;
+    }
+    // New or modified key, (re)load it. We hold the lock in the meantime, so it's only ever parsed once.
+    if((ret = nettle_rsa_privkey_from_pem(filename, &cached->key)) == 0)
+    {
+        cached->mtime = st.st_mtime;
+        copy_private_key(rsa_pkey, &cached->key);
+    }
+    else
+    {
+        // Make sure we try again next time
+        cached->mtime = 0;
+    }
+    pthread_mutex_unlock(&key_cache_lock);
+
+    return ret;
+}
+
+int sign_file(FILE *in_file, const struct kt_rsa_signer *signer, FILE *sigout_file)
+{
+    unsigned char *buffer;
     size_t len;
-    struct sha256_ctx hash;
-    mpz_t sig;
-    // NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway...
+    struct kt_sha256_ctx hash;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    // NOTE: Don't do this at home, kids! We can get away with it because we know we can't use keys > 2K anyway (kt_rsa_signer_init made sure of it)...
     unsigned char raw_sig[CERTIFICATE_2K_SIZE];
-    size_t siglen;
 
-    // Like we just said, handle 2K keys at most!
-    if(rsa_pkey->size > CERTIFICATE_2K_SIZE)
+    if((buffer = malloc(kt_block_size)) == NULL)
     {
-        fprintf(stderr, "RSA key is too large (2K at most)!\n");
+        fprintf(stderr, "Error allocating hashing buffer: %s.\n", strerror(errno));
         return -1;
     }
-
-    sha256_init(&hash);
-    while((len = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, in_file)) > 0)
+    kt_sha256_init(&hash);
+    while((len = fread(buffer, sizeof(unsigned char), kt_block_size, in_file)) > 0)
     {
-        sha256_update(&hash, len, buffer);
+        kt_sha256_update(&hash, len, buffer);
     }
+    free(buffer);
     if(ferror(in_file) != 0)
     {
         fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
         return -1;
     }
-    mpz_init(sig);
-    if(!rsa_sha256_sign(rsa_pkey, &hash, sig))
-    {
-        fprintf(stderr, "RSA key is too small!\n");
-        mpz_clear(sig);
-        return -1;
-    }
-
-    // NOTE: mpz_out_raw outputs a format that doesn't quite fit our needs (it prepends 4 bytes of size info)... Do it ourselves with mpz_export!
-    mpz_export(raw_sig, &siglen, 1, sizeof(unsigned char *), 1, 0, sig);   // Words of the proper amount of bytes for the host, most significant word & byte first (BE), full words.
-    mpz_clear(sig);
-    // Check that the sig looks sane...
-    if(siglen * sizeof(unsigned char *) != rsa_pkey->size)
+    kt_sha256_digest(&hash, digest);
+    if(kt_sign_digest(signer, digest, raw_sig) != 0)
     {
-        fprintf(stderr, "Signature is too short (or too large?) for our key!\n");
         return -1;
     }
 
     // And finally, write our sig!
-    if(fwrite(raw_sig, sizeof(unsigned char), rsa_pkey->size, sigout_file) < rsa_pkey->size)
+    if(fwrite(raw_sig, sizeof(unsigned char), signer->size, sigout_file) < signer->size)
     {
         fprintf(stderr, "Error writing signature file: %s.\n", strerror(errno));
         return -1;
@@ -162,74 +244,368 @@ static int sign_file(FILE *in_file, struct rsa_private_key *rsa_pkey, FILE *sigo
 }
 
 // As usual, largely based on libarchive's doc, examples, and source ;)
-static int metadata_filter(struct archive *a, void *_data __attribute__((unused)), struct archive_entry *entry)
+// Set up what the walk leaves out, once per archive: our own exclude list, and whatever the user asked for (cf. --exclude & --exclude-from)
+static int exclude_init(struct ktexclude *exclude, char **patterns, const unsigned int count)
+{
+    unsigned int i;
+
+    exclude->files = archive_match_new();
+    exclude->dirs = NULL;
+    // Exclude *.sig files in a case insensitive way, to avoid duplicates
+    if(archive_match_exclude_pattern(exclude->files, "./*\\.[Ss][Ii][Gg]$") != ARCHIVE_OK)
+        fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(exclude->files));
+    // Exclude *.dat too, to avoid ending up with multiple bundlefiles!
+    if(archive_match_exclude_pattern(exclude->files, "./*\\.[Dd][Aa][Tt]$") != ARCHIVE_OK)    // NOTE: If we wanted to be more lenient, we could exclude "./update*\\.[Dd][Aa][Tt]$" instead
+        fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(exclude->files));
+    // Exclude *nix hidden files, too?
+    // NOTE: The ARCHIVE_READDISK_MAC_COPYFILE flag for read_disk is disabled by default, so we should already be creating 'sane' archives on OS X, without the crazy ._* acl/xattr files ;)
+    // On the other hand, if the user passed us a self-built tarball, we can't do anything about it. OS X users: export COPYFILE_DISABLE=1 is your friend!
+    /*
+    if(archive_match_exclude_pattern(exclude->files, "./\\.*$") != ARCHIVE_OK)
+        fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(exclude->files));
+    */
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    // NOTE: Exclude our own tempfiles, since we create them in PWD, because otherwise, depending on what the user uses as input (i.e., * or .), we might inadvertently snarf them up...
+    //       Right now, the only one susceptible of being part of our directory walking is our own tarball temporary file...
+    if(archive_match_exclude_pattern(exclude->files, "^kindletool_create_tarball_*") != ARCHIVE_OK)
+        fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(exclude->files));
+#endif
+
+    // The user's apply to directories, too (we won't even walk those)
+    if(count > 0)
+        exclude->dirs = archive_match_new();
+    for(i = 0; i < count; i++)
+    {
+        if(archive_match_exclude_pattern(exclude->files, patterns[i]) != ARCHIVE_OK || archive_match_exclude_pattern(exclude->dirs, patterns[i]) != ARCHIVE_OK)
+        {
+            fprintf(stderr, "Invalid exclude pattern '%s'.\n", patterns[i]);
+            exclude_free(exclude);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void exclude_free(struct ktexclude *exclude)
+{
+    archive_match_free(exclude->files);
+    archive_match_free(exclude->dirs);
+    exclude->files = NULL;
+    exclude->dirs = NULL;
+}
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Copy the first len chars of str (and a NUL) to our arena, returns NULL on failure
+static const char *arena_strndup(struct ktarena *arena, const char *str, size_t len)
+{
+    struct ktarena_block *block = arena->head;
+    size_t size;
+    char *copy;
+
+    if(block == NULL || block->size - block->used < len + 1)
+    {
+        // Start a new block (a bigger one if need be, the rest of the previous one is just wasted)
+        size = (len + 1 > ARENA_BLOCK_SIZE) ? len + 1 : ARENA_BLOCK_SIZE;
+        if((block = malloc(sizeof(*block) + size)) == NULL)
+            return NULL;
+        block->next = arena->head;
+        block->size = size;
+        block->used = 0;
+        arena->head = block;
+    }
+    copy = block->data + block->used;
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    block->used += len + 1;
+
+    return copy;
+}
+
+static void arena_free(struct ktarena *arena)
+{
+    struct ktarena_block *block;
+
+    while((block = arena->head) != NULL)
+    {
+        arena->head = block->next;
+        free(block);
+    }
+}
+
+// Whether to leave entry out of the archive (and not walk it, if it's a directory)
+static bool is_excluded(struct ktexclude *exclude, struct archive_entry *entry)
 {
     struct archive *matching;
     int r;
 
-    // Don't exclude directories!
-    if(archive_read_disk_can_descend(a))
+    // Only exclude directories if we were explicitly asked to
+    if(archive_entry_filetype(entry) == AE_IFDIR)
     {
-        // It's a directory, don't even try to perform pattern matching, just walk it
-        archive_read_disk_descend(a);
-        return 1;
+        if(exclude->dirs == NULL)
+            return false;
+        matching = exclude->dirs;
     }
     else
     {
-        // Exclude *.sig files in a case insensitive way, to avoid duplicates
-        matching = archive_match_new();
-        if(archive_match_exclude_pattern(matching, "./*\\.[Ss][Ii][Gg]$") != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-        // Exclude *.dat too, to avoid ending up with multiple bundlefiles!
-        if(archive_match_exclude_pattern(matching, "./*\\.[Dd][Aa][Tt]$") != ARCHIVE_OK)    // NOTE: If we wanted to be more lenient, we could exclude "./update*\\.[Dd][Aa][Tt]$" instead
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-        // Exclude *nix hidden files, too?
-        // NOTE: The ARCHIVE_READDISK_MAC_COPYFILE flag for read_disk is disabled by default, so we should already be creating 'sane' archives on OS X, without the crazy ._* acl/xattr files ;)
-        // On the other hand, if the user passed us a self-built tarball, we can't do anything about it. OS X users: export COPYFILE_DISABLE=1 is your friend!
-        /*
-        if(archive_match_exclude_pattern(matching, "./\\.*$") != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
-        */
-#if defined(_WIN32) && !defined(__CYGWIN__)
-        // NOTE: Exclude our own tempfiles, since we create them in PWD, because otherwise, depending on what the user uses as input (i.e., * or .), we might inadvertently snarf them up...
-        //       Right now, the only one susceptible of being part of our directory walking is our own tarball temporary file...
-        if(archive_match_exclude_pattern(matching, "^kindletool_create_tarball_*") != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(matching));
+        matching = exclude->files;
+    }
+
+    r = archive_match_path_excluded(matching, entry);
+    if(r < 0)
+    {
+        fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(matching));
+        return true;
+    }
+    return r != 0;
+}
+
+static void walk_free(struct ktwalk *walk)
+{
+    size_t i;
+    size_t j;
+
+    for(i = 0; i < walk->count; i++)
+    {
+        free(walk->nodes[i].path);
+        free(walk->nodes[i].symlink);
+    }
+    free(walk->nodes);
+    if(walk->dirs != NULL)
+    {
+        for(i = 0; i < walk->level_count; i++)
+        {
+            for(j = 0; j < walk->dirs[i].count; j++)
+            {
+                free(walk->dirs[i].children[j].path);
+                free(walk->dirs[i].children[j].symlink);
+            }
+            free(walk->dirs[i].children);
+        }
+    }
+    free(walk->dirs);
+    free(walk->level);
+    memset(walk, 0, sizeof(*walk));
+}
+
+// Stat dirname/name (or just dirname, if name is NULL), and remember what we found in dir. Sets errno & returns -1 on failure.
+static int walk_add(struct ktwalk_dir *dir, const char *dirname, const char *name)
+{
+    struct ktwalk_node *node;
+    struct ktwalk_node *children;
+    size_t len = strlen(dirname);
+    char *path;
+    ssize_t link_len;
+
+    if(dir->count == dir->size)
+    {
+        dir->size = dir->size ? dir->size * 2 : 16;
+        if((children = realloc(dir->children, dir->size * sizeof(*children))) == NULL)
+            return -1;
+        dir->children = children;
+    }
+    if(name == NULL)
+    {
+        // libarchive strips trailing path separators, do the same
+        while(len > 1 && dirname[len - 1] == '/')
+            len--;
+        if((path = malloc(len + 1)) == NULL)
+            return -1;
+        memcpy(path, dirname, len);
+        path[len] = '\0';
+    }
+    else
+    {
+        if((path = malloc(len + 1 + strlen(name) + 1)) == NULL)
+            return -1;
+        sprintf(path, "%s/%s", dirname, name);
+    }
+    node = &dir->children[dir->count];
+    memset(node, 0, sizeof(*node));
+    node->path = path;
+    node->name = (name == NULL) ? path : path + len + 1;
+    if(lstat(path, &node->st) != 0)
+    {
+        free(path);
+        return -1;
+    }
+#ifdef S_ISLNK
+    if(S_ISLNK(node->st.st_mode))
+    {
+        if((node->symlink = malloc((size_t) node->st.st_size + 1)) == NULL || (link_len = readlink(path, node->symlink, (size_t) node->st.st_size + 1)) < 0)
+        {
+            free(node->symlink);
+            free(path);
+            return -1;
+        }
+        node->symlink[(link_len > node->st.st_size) ? node->st.st_size : link_len] = '\0';
+    }
+#else
+    (void) link_len;
 #endif
+    dir->count++;
 
-        r = archive_match_path_excluded(matching, entry);
-        if(r < 0)
+    return 0;
+}
+
+// Read (& stat everything in) the index-th directory of our current level
+static void walk_read_dir(void *arg, size_t index)
+{
+    struct ktwalk *walk = arg;
+    struct ktwalk_dir *dir = &walk->dirs[index];
+    const char *dirname = walk->nodes[walk->level[index]].path;
+    DIR *d;
+    struct dirent *de;
+
+    if((d = opendir(dirname)) == NULL)
+    {
+        dir->failed_path = dirname;
+        dir->failed_errno = errno;
+        return;
+    }
+    while((de = readdir(d)) != NULL)
+    {
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if(walk_add(dir, dirname, de->d_name) != 0)
         {
-            fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(matching));
-            archive_match_free(matching);
-            return 0;
+            dir->failed_path = dirname;
+            dir->failed_errno = errno;
+            break;
         }
-        if(r)
+    }
+    closedir(d);
+}
+
+static int compare_walk_nodes(const void *a, const void *b)
+{
+    return strcmp(((const struct ktwalk_node *)a)->name, ((const struct ktwalk_node *)b)->name);
+}
+
+// Find everything we'll need to archive in input_filename, stat'ing & reading as many directories at once as we have threads (that's mostly waiting on the filesystem).
+// Every directory's children end up sorted by name, so that the archive doesn't depend on the order the filesystem (or our threads) handed them to us in.
+static int walk_tree(struct kttar *kttar, struct ktwalk *walk, const char *input_filename)
+{
+    struct ktwalk_dir root;
+    struct ktwalk_node *nodes;
+    struct ktwalk_node *node;
+    struct ktwalk_dir *dir;
+    struct archive_entry *entry;
+    size_t *next_level = NULL;
+    size_t next_count;
+    size_t i;
+    size_t j;
+    kt_pool *pool = NULL;
+    int ret = -1;
+
+    memset(walk, 0, sizeof(*walk));
+    memset(&root, 0, sizeof(root));
+    if(walk_add(&root, input_filename, NULL) != 0)
+    {
+        fprintf(stderr, "Cannot read '%s': %s.\n", input_filename, strerror(errno));
+        free(root.children);
+        return -1;
+    }
+    walk->nodes = root.children;
+    walk->count = walk->size = 1;
+
+    // Directories are matched against our exclude list before we even read them
+    entry = archive_entry_new();
+    archive_entry_copy_pathname(entry, walk->nodes[0].path);
+    archive_entry_set_mode(entry, walk->nodes[0].st.st_mode);
+    walk->nodes[0].excluded = is_excluded(&kttar->exclude, entry);
+    if(S_ISDIR(walk->nodes[0].st.st_mode) && !walk->nodes[0].excluded)
+    {
+        if((walk->level = malloc(sizeof(*walk->level))) == NULL)
+            goto cleanup;
+        walk->level[0] = 0;
+        walk->level_count = 1;
+    }
+
+    while(walk->level_count > 0)
+    {
+        if((walk->dirs = calloc(walk->level_count, sizeof(*walk->dirs))) == NULL)
+            goto cleanup;
+        if(kt_threads > 1 && walk->level_count > 1)
+            pool = kt_get_pool();
+        if(pool != NULL)
         {
-            // Skip original bundle/sig files to avoid duplicates
-            fprintf(stderr, "! %s\n", archive_entry_pathname(entry));
-            archive_match_free(matching);
-            return 0;
+            kt_pool_parallel_for(pool, walk->level_count, walk_read_dir, walk);
         }
         else
         {
-            // We're a nice, proper file, carry on ;)
-            archive_match_free(matching);
-            return 1;
+            for(i = 0; i < walk->level_count; i++)
+                walk_read_dir(walk, i);
+        }
+
+        // Now that everything's been read, put it in order, and figure out what we'll have to read next
+        next_count = 0;
+        for(i = 0; i < walk->level_count; i++)
+        {
+            dir = &walk->dirs[i];
+            if(dir->failed_path != NULL)
+            {
+                // NOTE: We don't want to end up with an incomplete archive, abort.
+                fprintf(stderr, "Cannot read directory '%s': %s.\n", dir->failed_path, strerror(dir->failed_errno));
+                goto cleanup;
+            }
+            if(dir->count > 0)
+                qsort(dir->children, dir->count, sizeof(*dir->children), compare_walk_nodes);
+            if(walk->count + dir->count > walk->size)
+            {
+                walk->size = (walk->count + dir->count) * 2;
+                if((nodes = realloc(walk->nodes, walk->size * sizeof(*nodes))) == NULL)
+                    goto cleanup;
+                walk->nodes = nodes;
+            }
+            walk->nodes[walk->level[i]].first_child = walk->count;
+            walk->nodes[walk->level[i]].child_count = dir->count;
+            for(j = 0; j < dir->count; j++)
+            {
+                // The nodes own it now
+                node = &walk->nodes[walk->count++];
+                *node = dir->children[j];
+                dir->children[j].path = NULL;
+                dir->children[j].symlink = NULL;
+                archive_entry_copy_pathname(entry, node->path);
+                archive_entry_set_mode(entry, node->st.st_mode);
+                node->excluded = is_excluded(&kttar->exclude, entry);
+                if(S_ISDIR(node->st.st_mode) && !node->excluded)
+                {
+                    if((next_level = realloc(next_level, (next_count + 1) * sizeof(*next_level))) == NULL)
+                        goto cleanup;
+                    next_level[next_count++] = walk->count - 1;
+                }
+            }
         }
+        for(i = 0; i < walk->level_count; i++)
+            free(walk->dirs[i].children);
+        free(walk->dirs);
+        walk->dirs = NULL;
+        free(walk->level);
+        walk->level = next_level;
+        walk->level_count = next_count;
+        next_level = NULL;
     }
+    ret = 0;
+
+cleanup:
+    free(next_level);
+    archive_entry_free(entry);
+    return ret;
 }
 
 // Write a single file (or directory or other filesystem object) to the archive [from libarchive's tar/write.c].
-static int write_file(struct kttar *kttar, struct archive *a, struct archive *in_a, struct archive_entry *entry)
+static int write_file(struct kttar *kttar, struct archive *a, int fd, struct archive_entry *entry)
 {
-    if(write_entry(kttar, a, in_a, entry) != 0)
+    if(write_entry(kttar, a, fd, entry) != 0)
         return 1;
     return 0;
 }
 
 // Write a single entry to the archive [from libarchive's tar/write.c].
-static int write_entry(struct kttar *kttar, struct archive *a, struct archive *in_a, struct archive_entry *entry)
+static int write_entry(struct kttar *kttar, struct archive *a, int fd, struct archive_entry *entry)
 {
     int e;
 
@@ -246,303 +622,752 @@ static int write_entry(struct kttar *kttar, struct archive *a, struct archive *i
     // to inform us that the archive body won't get stored. In that case, just skip the write.
     if(e >= ARCHIVE_WARN && archive_entry_size(entry) > 0)
     {
-        if(copy_file_data_block(kttar, a, in_a, entry) != 0)
+        if(copy_file_data_block(kttar, a, fd, entry) != 0)
             return 1;
     }
     return 0;
 }
 
 // Helper function to copy file to archive [from libarchive's tar/write.c].
-static int copy_file_data_block(struct kttar *kttar, struct archive *a, struct archive *in_a, struct archive_entry *entry)
+static int copy_file_data_block(struct kttar *kttar, struct archive *a, int fd, struct archive_entry *entry)
 {
-    size_t bytes_read;
+    int64_t remaining = archive_entry_size(entry);
+    ssize_t bytes_read;
     ssize_t bytes_written;
-    int64_t offset, progress = 0;
-    unsigned char *null_buff = NULL;
-    const void *buff;
-    int r;
 
-    while((r = archive_read_data_block(in_a, &buff, &bytes_read, &offset)) == ARCHIVE_OK)
+    // Never write more than what the header says we would
+    while(remaining > 0)
     {
-        if(offset > progress)
+        bytes_read = read(fd, kttar->buff, (remaining < (int64_t) kttar->buff_size) ? (size_t) remaining : kttar->buff_size);
+        if(bytes_read < 0)
         {
-            int64_t sparse = offset - progress;
-            size_t ns;
-
-            if(null_buff == NULL)
-            {
-                null_buff = kttar->buff;
-                memset(null_buff, 0, kttar->buff_size);
-            }
-
-            while(sparse > 0)
-            {
-                if(sparse > (int64_t)kttar->buff_size)
-                    ns = kttar->buff_size;
-                else
-                    ns = (size_t)sparse;
-                bytes_written = archive_write_data(a, null_buff, ns);
-                if(bytes_written < 0)
-                {
-                    // Write failed; this is bad
-                    fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
-                    return -1;
-                }
-                if((size_t)bytes_written < ns)
-                {
-                    // Write was truncated; warn but continue.
-                    fprintf(stderr, "%s: Truncated write; file may have grown while being archived.\n", archive_entry_pathname(entry));
-                    return 0;
-                }
-                progress += bytes_written;
-                sparse -= bytes_written;
-            }
+            if(errno == EINTR)
+                continue;
+            fprintf(stderr, "Cannot read '%s': %s.\n", archive_entry_sourcepath(entry), strerror(errno));
+            return -1;
+        }
+        if(bytes_read == 0)
+        {
+            // libarchive would pad it, but then our hashes wouldn't match what's in the archive
+            fprintf(stderr, "%s: File shrank while being archived.\n", archive_entry_pathname(entry));
+            return -1;
         }
 
-        bytes_written = archive_write_data(a, buff, bytes_read);
+        bytes_written = archive_write_data(a, kttar->buff, (size_t)bytes_read);
         if(bytes_written < 0)
         {
             // Write failed; this is bad
             fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
             return -1;
         }
-        if((size_t)bytes_written < bytes_read)
+        if((size_t)bytes_written < (size_t)bytes_read)
         {
             // Write was truncated; warn but continue.
             fprintf(stderr, "%s: Truncated write; file may have grown while being archived.\n", archive_entry_pathname(entry));
             return 0;
         }
-        progress += bytes_written;
-    }
-    if(r < ARCHIVE_WARN)
-    {
-        fprintf(stderr, "archive_read_data_block() failed: %s.\n", archive_error_string(a));
-        return -1;
+        if(kttar->hash_data)
+        {
+            md5_update(&kttar->md5, (size_t)bytes_written, kttar->buff);
+            kt_sha256_update(&kttar->sha256, (size_t)bytes_written, kttar->buff);
+        }
+        remaining -= bytes_written;
     }
     return 0;
 }
 
-// Helper function to populate & write entries from a read_disk_open loop, tailored to our needs (helps avoiding code duplication, since we're doing this in two passes)
-static int create_from_archive_read_disk(struct kttar *kttar, struct archive *a, char *input_filename, bool first_pass, char *signame, const unsigned int real_blocksize)
+// Wrap up the hashes of the file copy_file_data_block just archived (the index-th one of to_sign_and_bundle_list)
+static void finish_file_data_hash(struct kttar *kttar, unsigned int index)
 {
-    int r;
-    bool is_exec = false;
-    bool is_kernel = false;
-    char *original_path = NULL;
-    char *tweaked_path = NULL;
+    uint8_t digest[MD5_DIGEST_SIZE];
 
-    struct archive *disk;
-    struct archive_entry *entry;
+    md5_digest(&kttar->md5, MD5_DIGEST_SIZE, digest);
+    base16_encode_update(kttar->md5s[index], MD5_DIGEST_SIZE, digest);
+    kttar->md5s[index][MD5_HASH_LENGTH] = '\0';
+    kt_sha256_digest(&kttar->sha256, kttar->digests[index]);
+}
 
-    disk = archive_read_disk_new();
-    entry = archive_entry_new();
+static void sign_digest_task(void *arg, size_t index)
+{
+    struct sign_job *job = arg;
 
-    if(first_pass)
+    // We already have its sig
+    if(job->kttar->cached[index])
+        return;
+    if(kt_sign_digest(job->kttar->signer, job->kttar->digests[index], job->kttar->sigs[index]) != 0)
     {
-        // Perform pattern matching in a metadata filter to apply our exclude list to reguar files
-        // NOTE: We're not using archive_read_disk_set_matching anymore because it does *pattern* matching too early to determine if we're a directory...
-        archive_read_disk_set_metadata_filter_callback(disk, metadata_filter, NULL);
+        pthread_mutex_lock(&job->lock);
+        job->failed = true;
+        pthread_mutex_unlock(&job->lock);
     }
-    archive_read_disk_set_standard_lookup(disk);
+}
+
+// Sign the first count files we hashed during the walk, kt_jobs at a time.
+// Each file gets its own slot in sigs, so the order they end up in the package doesn't depend on which one was done first.
+static int sign_file_digests(struct kttar *kttar, unsigned int count)
+{
+    struct sign_job job = { kttar, PTHREAD_MUTEX_INITIALIZER, false };
+    kt_pool *pool = NULL;
+    unsigned int i;
 
-    r = archive_read_disk_open(disk, input_filename);
-    if(r != ARCHIVE_OK)
+    if(kt_jobs > 1 && count > 1)
+        pool = kt_pool_new(kt_jobs < count ? kt_jobs : count);
+    if(pool != NULL)
     {
-        fprintf(stderr, "archive_read_disk_open() failed: %s.\n", archive_error_string(disk));
-        archive_read_free(disk);
-        archive_entry_free(entry);
-        return 1;
+        kt_pool_parallel_for(pool, count, sign_digest_task, &job);
+        kt_pool_free(pool);
+    }
+    else
+    {
+        for(i = 0; i < count; i++)
+            sign_digest_task(&job, i);
     }
+    pthread_mutex_destroy(&job.lock);
+    if(job.failed)
+        return -1;
 
-    for(;;)
+    // Remember what we've just signed for next time
+    if(kttar->cache != NULL)
     {
-        archive_entry_clear(entry);
-        r = archive_read_next_header2(disk, entry);
-        if(r == ARCHIVE_EOF)
-            break;
-        else if(r != ARCHIVE_OK)
+        for(i = 0; i < count; i++)
         {
-            fprintf(stderr, "archive_read_next_header2() failed: %s", archive_error_string(disk));
-            if(r == ARCHIVE_FATAL)
-            {
-                fprintf(stderr, " (FATAL).\n");
-                goto cleanup;
-            }
-            else if(r < ARCHIVE_WARN)
-            {
-                fprintf(stderr, " (FAILED).\n");
-                // NOTE: We don't want to end up with an incomplete archive, abort.
-                goto cleanup;
-            }
+            if(kttar->cached[i])
+                continue;
+            kttar->cache_keys[i].path = kttar->to_sign_and_bundle_list[i];
+            kt_hash_cache_store(kttar->cache, &kttar->cache_keys[i], kttar->md5s[i], kttar->digests[i], kttar->sigs[i], kttar->signer->size);
         }
+    }
 
-        if(!first_pass)
-        {
-            // Fix the entry pathname, we used a tempfile... (if we're in legacy mode, signame has already been set to the tweaked path ;))
-            archive_entry_copy_pathname(entry, signame);
-        }
-        else
-        {
-            // Tweak the pathname if we were asked to behave like Yifan's KindleTool...
-            if(kttar->tweak_pointer_index != 0)
-            {
-                // Handle the 'root' source directory itself..
-                // NOTE: We check that strlen <= pointer_index because libarchive strips trailing path separators in the entry pathname, but we might have passed one on the CL, so pointer_index might be larger than strlen ;)
-                if(archive_entry_filetype(entry) == AE_IFDIR && strlen(archive_entry_pathname(entry)) <= kttar->tweak_pointer_index)
-                {
-                    // Print what we're stripping, ala GNU tar...
-                    fprintf(stderr, "kindletool: Removing leading '%s/' from member names.\n", archive_entry_pathname(entry));
-                    // Just skip it, we don't need a redundant and explicit root directory entry in our tarball...
-                    archive_read_disk_descend(disk);
-                    continue;
-                }
-                else
-                {
-                    original_path = strdup(archive_entry_pathname(entry));
-                    // Try to handle a trailing path separator properly... NOTE: This probably isn't very robust. Also, no need to handle MinGW, it already spectacularly fails to handle this case ^^
-                    if(original_path[kttar->tweak_pointer_index] == '/')
-                    {
-                        // We found a path separator, skip it, too
-                        tweaked_path = original_path + (kttar->tweak_pointer_index + 1);
-                    }
-                    else
-                    {
-                        tweaked_path = original_path + kttar->tweak_pointer_index;
-                    }
-                    archive_entry_copy_pathname(entry, tweaked_path);
-                }
-            }
-        }
+    return 0;
+}
 
-        // And then override a bunch of stuff (namely, uig/guid/chmod)
-        archive_entry_set_uid(entry, 0);
-        archive_entry_set_uname(entry, "root");
-        archive_entry_set_gid(entry, 0);
-        archive_entry_set_gname(entry, "root");
+// Write a regular file we've built in memory (i.e., a signature or the bundle index) to the archive, without going through a tempfile
+static int write_memory_entry(struct archive *a, const char *pathname, const void *data, size_t size)
+{
+    struct archive_entry *entry;
+    int e;
 
-        if(first_pass)
-        {
-            // If we have a regular file, and it's a script, make it executable (probably overkill, but hey :))
-            if(archive_entry_filetype(entry) == AE_IFREG && (IS_SCRIPT(archive_entry_pathname(entry)) || IS_SHELL(archive_entry_pathname(entry))))
-            {
-                archive_entry_set_perm(entry, 0755);
-                // It's a script, keep track of it
-                is_exec = true;
-                kttar->has_script = is_exec;
-                is_kernel = false;
-            }
-            // If we have a regular file, and it's a kernel, and we're a recovery update, keep track of it
-            else if(archive_entry_filetype(entry) == AE_IFREG && real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(archive_entry_pathname(entry)))
-            {
-                archive_entry_set_perm(entry, 0644);
-                is_exec = false;
-                // It's a kernel, keep track of it
-                is_kernel = true;
-            }
-            // If we have a directory, make it searchable...
-            else if(archive_entry_filetype(entry) == AE_IFDIR)
-            {
-                archive_entry_set_perm(entry, 0755);
-                is_exec = false;
-                is_kernel = false;
-            }
-            else
-            {
-                archive_entry_set_perm(entry, 0644);
-                is_exec = false;
-                is_kernel = false;
-            }
+    entry = archive_entry_new();
+    archive_entry_copy_pathname(entry, pathname);
+    archive_entry_set_filetype(entry, AE_IFREG);
+    archive_entry_set_perm(entry, 0644);
+    archive_entry_set_uid(entry, 0);
+    archive_entry_set_uname(entry, "root");
+    archive_entry_set_gid(entry, 0);
+    archive_entry_set_gname(entry, "root");
+    archive_entry_set_mtime(entry, time(NULL), 0);
+    archive_entry_set_size(entry, (int64_t) size);
 
-            // Non-regular files get archived with zero size.
-            if(archive_entry_filetype(entry) != AE_IFREG)
-                archive_entry_set_size(entry, 0);
-        }
+    // Print what we're adding, ala bsdtar
+    fprintf(stderr, "a %s\n", pathname);
+
+    e = archive_write_header(a, entry);
+    if(e != ARCHIVE_OK)
+        fprintf(stderr, "archive_write_header() failed: %s.\n", archive_error_string(a));
+    if(e == ARCHIVE_FATAL)
+    {
+        archive_entry_free(entry);
+        return 1;
+    }
+    if(e >= ARCHIVE_WARN && size > 0)
+    {
+        if(archive_write_data(a, data, size) < (ssize_t) size)
+        {
+            fprintf(stderr, "archive_write_data() failed: %s.\n", archive_error_string(a));
+            archive_entry_free(entry);
+            return 1;
+        }
+    }
+
+    archive_entry_free(entry);
+    return 0;
+}
+
+// Make room for one more file in each of our per-file lists, doubling them as needed
+static int grow_file_lists(struct kttar *kttar)
+{
+    unsigned int size;
+    void *p;
+
+    if(kttar->sign_and_bundle_index < kttar->sign_and_bundle_size)
+        return 0;
+    size = kttar->sign_and_bundle_size ? kttar->sign_and_bundle_size * 2 : 256;
+    // NOTE: Each of them stays valid (if too small) if a later one fails, so we can still free everything on our way out
+    if((p = realloc(kttar->to_sign_and_bundle_list, size * sizeof(*kttar->to_sign_and_bundle_list))) == NULL)
+        return -1;
+    kttar->to_sign_and_bundle_list = p;
+    if((p = realloc(kttar->tweaked_to_sign_and_bundle_list, size * sizeof(*kttar->tweaked_to_sign_and_bundle_list))) == NULL)
+        return -1;
+    kttar->tweaked_to_sign_and_bundle_list = p;
+    if((p = realloc(kttar->md5s, size * sizeof(*kttar->md5s))) == NULL)
+        return -1;
+    kttar->md5s = p;
+    if((p = realloc(kttar->digests, size * sizeof(*kttar->digests))) == NULL)
+        return -1;
+    kttar->digests = p;
+    if((p = realloc(kttar->sigs, size * sizeof(*kttar->sigs))) == NULL)
+        return -1;
+    kttar->sigs = p;
+    if((p = realloc(kttar->sizes, size * sizeof(*kttar->sizes))) == NULL)
+        return -1;
+    kttar->sizes = p;
+    if((p = realloc(kttar->cached, size * sizeof(*kttar->cached))) == NULL)
+        return -1;
+    kttar->cached = p;
+    if((p = realloc(kttar->cache_keys, size * sizeof(*kttar->cache_keys))) == NULL)
+        return -1;
+    kttar->cache_keys = p;
+    kttar->sign_and_bundle_size = size;
+
+    return 0;
+}
+
+// Append the index-th file we've archived to our in-memory bundle index
+static int append_index_entry(struct kttar *kttar, unsigned int index, const unsigned int real_blocksize)
+{
+    const char *path = kttar->to_sign_and_bundle_list[index];
+    const char *name;
+    const char *sep;
+    char *new_data;
+    size_t new_size;
+    int file_type;
+    int len;
+
+    // FWIW, the format is as follows: file_type_id md5sum file_name blocksize file_display_name
+    // where the id is 1 for kernel images (in recovery updates only), 129 for install scripts, and 128 for assets, and the blocksize is based on the file size relative to the update type blocksize.
+    file_type = (real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(path)) ? 1 : ((IS_SCRIPT(path) || IS_SHELL(path)) ? 129 : 128);
+    // The last field is a display name, take a hint from the Python tool, and use the file's basename with a simple suffix
+    // We know it's a file, so there's no trailing separator to worry about, and unlike basename(), this leaves path alone
+    // And we're using the tweaked pathname in case we're in legacy mode ;)
+    for(name = path, sep = path; *sep != '\0'; sep++)
+    {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        if(*sep == '/' || *sep == '\\')
+#else
+        if(*sep == '/')
+#endif
+            name = sep + 1;
+    }
+    len = snprintf(NULL, 0, "%d %s %s %lld %s_ktool_file\n", file_type, kttar->md5s[index], kttar->tweaked_to_sign_and_bundle_list[index], (long long) kttar->sizes[index] / real_blocksize, name);
+    if(len < 0)
+        return -1;
+    // Make room for it (and snprintf's NUL), doubling our buffer as needed
+    if(kttar->index_length + (size_t) len + 1 > kttar->index_size)
+    {
+        new_size = kttar->index_size ? kttar->index_size : 4096;
+        while(kttar->index_length + (size_t) len + 1 > new_size)
+            new_size *= 2;
+        if((new_data = realloc(kttar->index_data, new_size)) == NULL)
+            return -1;
+        kttar->index_data = new_data;
+        kttar->index_size = new_size;
+    }
+    snprintf(kttar->index_data + kttar->index_length, (size_t) len + 1, "%d %s %s %lld %s_ktool_file\n", file_type, kttar->md5s[index], kttar->tweaked_to_sign_and_bundle_list[index], (long long) kttar->sizes[index] / real_blocksize, name);
+    kttar->index_length += (size_t) len;
+
+    return 0;
+}
+
+// Helper function to populate & write entries from a walk of input_filename, tailored to our needs (helps avoiding code duplication, since we're doing this in two passes)
+static int create_from_disk(struct kttar *kttar, struct archive *a, char *input_filename, const unsigned int real_blocksize)
+{
+    bool is_exec = false;
+    bool is_kernel = false;
+    const char *original_path = NULL;
+    const char *tweaked_path = NULL;
+    const char *path;
+    unsigned int index;
+    bool cache_hit;
+    bool digests_hit;
+    KTCacheKey cache_key;
+    char cached_md5[MD5_HASH_LENGTH + 1];
+    uint8_t cached_digest[SHA256_DIGEST_SIZE];
+    unsigned char cached_sig[CERTIFICATE_2K_SIZE];
+
+    struct ktwalk walk;
+    struct ktwalk_node *node;
+    size_t *stack = NULL;
+    size_t depth = 0;
+    size_t i;
+    int fd = -1;
+    struct archive_entry *entry;
+
+    // Find everything first (that's the part that's mostly waiting on the filesystem, so we do it concurrently)
+    if(walk_tree(kttar, &walk, input_filename) != 0)
+    {
+        walk_free(&walk);
+        return 1;
+    }
+    if((stack = malloc(walk.count * sizeof(*stack))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for directory walk.\n");
+        walk_free(&walk);
+        return 1;
+    }
+    entry = archive_entry_new();
+
+    // Then archive it, depth first, in order
+    stack[depth++] = 0;
+    while(depth > 0)
+    {
+        node = &walk.nodes[stack[--depth]];
+        if(node->excluded)
+        {
+            // Skip original bundle/sig files to avoid duplicates (and whatever else we were asked to leave out)
+            fprintf(stderr, "! %s\n", node->path);
+            continue;
+        }
+        for(i = node->child_count; i > 0; i--)
+            stack[depth++] = node->first_child + i - 1;
+
+        // We don't care about who owns it, so don't even ask (we'd override it anyway)
+        archive_entry_clear(entry);
+        archive_entry_copy_pathname(entry, node->path);
+        archive_entry_copy_sourcepath(entry, node->path);
+        archive_entry_copy_stat(entry, &node->st);
+        if(node->symlink != NULL)
+            archive_entry_copy_symlink(entry, node->symlink);
+
+        // Tweak the pathname if we were asked to behave like Yifan's KindleTool...
+        if(kttar->tweak_pointer_index != 0)
+        {
+            // Handle the 'root' source directory itself..
+            // NOTE: We check that strlen <= pointer_index because libarchive strips trailing path separators in the entry pathname, but we might have passed one on the CL, so pointer_index might be larger than strlen ;)
+            if(archive_entry_filetype(entry) == AE_IFDIR && strlen(archive_entry_pathname(entry)) <= kttar->tweak_pointer_index)
+            {
+                // Print what we're stripping, ala GNU tar...
+                fprintf(stderr, "kindletool: Removing leading '%s/' from member names.\n", archive_entry_pathname(entry));
+                // Just skip it, we don't need a redundant and explicit root directory entry in our tarball...
+                continue;
+            }
+            else
+            {
+                // The walk keeps it around for us
+                original_path = node->path;
+                // Try to handle a trailing path separator properly... NOTE: This probably isn't very robust. Also, no need to handle MinGW, it already spectacularly fails to handle this case ^^
+                if(original_path[kttar->tweak_pointer_index] == '/')
+                {
+                    // We found a path separator, skip it, too
+                    tweaked_path = original_path + (kttar->tweak_pointer_index + 1);
+                }
+                else
+                {
+                    tweaked_path = original_path + kttar->tweak_pointer_index;
+                }
+                archive_entry_copy_pathname(entry, tweaked_path);
+            }
+        }
+
+        // And then override a bunch of stuff (namely, uig/guid/chmod)
+        archive_entry_set_uid(entry, 0);
+        archive_entry_set_uname(entry, "root");
+        archive_entry_set_gid(entry, 0);
+        archive_entry_set_gname(entry, "root");
+
+        // If we have a regular file, and it's a script, make it executable (probably overkill, but hey :))
+        if(archive_entry_filetype(entry) == AE_IFREG && (IS_SCRIPT(archive_entry_pathname(entry)) || IS_SHELL(archive_entry_pathname(entry))))
+        {
+            archive_entry_set_perm(entry, 0755);
+            // It's a script, keep track of it
+            is_exec = true;
+            kttar->has_script = is_exec;
+            is_kernel = false;
+        }
+        // If we have a regular file, and it's a kernel, and we're a recovery update, keep track of it
+        else if(archive_entry_filetype(entry) == AE_IFREG && real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(archive_entry_pathname(entry)))
+        {
+            archive_entry_set_perm(entry, 0644);
+            is_exec = false;
+            // It's a kernel, keep track of it
+            is_kernel = true;
+        }
+        // If we have a directory, make it searchable...
+        else if(archive_entry_filetype(entry) == AE_IFDIR)
+        {
+            archive_entry_set_perm(entry, 0755);
+            is_exec = false;
+            is_kernel = false;
+        }
         else
         {
             archive_entry_set_perm(entry, 0644);
+            is_exec = false;
+            is_kernel = false;
         }
 
-        archive_read_disk_descend(disk);
+        // Non-regular files get archived with zero size.
+        if(archive_entry_filetype(entry) != AE_IFREG)
+            archive_entry_set_size(entry, 0);
+
         // Print what we're adding, ala bsdtar
         fprintf(stderr, "a %s%s\n", archive_entry_pathname(entry), (is_kernel ? "\t\t|<" : (is_exec ? "\t\t<-" : "")));
 
-        // Write our entry to the archive, completely through libarchive, to avoid having to open our entry file again, which would fail on non POSIX systems...
-        if(write_file(kttar, a, disk, entry) != 0)
+        // Hash regular files on the way in, we'll need their MD5 for the index, and a signature
+        kttar->hash_data = (archive_entry_filetype(entry) == AE_IFREG);
+        cache_hit = false;
+        digests_hit = false;
+        if(kttar->hash_data && kttar->cache != NULL)
+        {
+            // Unless we've already done that in a previous run, and the file hasn't changed since
+            cache_key.path = archive_entry_sourcepath(entry);
+            cache_key.size = archive_entry_size(entry);
+            cache_key.mtime = archive_entry_mtime(entry);
+            cache_key.mtime_nsec = archive_entry_mtime_nsec(entry);
+            cache_key.ino = archive_entry_ino64(entry);
+            cache_hit = kt_hash_cache_lookup(kttar->cache, &cache_key, cached_md5, cached_digest, cached_sig, kttar->signer->size);
+            // Or if we've just hashed it for another key, in which case we only have to sign it (we'd hash it again in paranoid mode anyway)
+            if(!cache_hit && !kttar->cache_verify && kttar->digest_cache != NULL)
+                digests_hit = kt_hash_cache_lookup_digests(kttar->digest_cache, &cache_key, cached_md5, cached_digest);
+            // We'll still hash it in paranoid mode, to make sure
+            if((cache_hit || digests_hit) && !kttar->cache_verify)
+                kttar->hash_data = false;
+        }
+        if(kttar->hash_data)
+        {
+            md5_init(&kttar->md5);
+            kt_sha256_init(&kttar->sha256);
+        }
+        // Write our entry to the archive
+        if(archive_entry_filetype(entry) == AE_IFREG && archive_entry_size(entry) > 0 && (fd = open(node->path, O_RDONLY | O_BINARY)) == -1)
+        {
+            fprintf(stderr, "Cannot open '%s': %s.\n", node->path, strerror(errno));
+            goto cleanup;
+        }
+        if(write_file(kttar, a, fd, entry) != 0)
             goto cleanup;
+        if(fd != -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+        kttar->hash_data = false;
 
-        if(first_pass)
+        // If we just added a regular file, keep track of it, we'll need to sign it, add it to the index, and put the sig in our tarball
+        if(archive_entry_filetype(entry) == AE_IFREG)
         {
-            // If we just added a regular file, hash it, sign it, add it to the index, and put the sig in our tarball
-            if(archive_entry_filetype(entry) == AE_IFREG)
+            // We've already hashed it while copying it, so just keep track of it. We'll sign it & write its sig & index entry later, once we're done walking.
+            // We only keep a single copy of its path around: in legacy mode, the tweaked one is just a suffix of it.
+            if(grow_file_lists(kttar) != 0 || (path = arena_strndup(&kttar->paths, node->path, strlen(node->path))) == NULL)
+            {
+                fprintf(stderr, "Cannot allocate memory to keep track of '%s'.\n", node->path);
+                goto cleanup;
+            }
+            index = kttar->sign_and_bundle_index++;
+            kttar->to_sign_and_bundle_list[index] = path;
+            kttar->tweaked_to_sign_and_bundle_list[index] = (tweaked_path != NULL) ? path + (tweaked_path - original_path) : path;
+            kttar->sizes[index] = archive_entry_size(entry);
+            kttar->cached[index] = false;
+            if(kttar->cache != NULL)
+                kttar->cache_keys[index] = cache_key;
+            if(cache_hit && kttar->cache_verify)
             {
-                // But just build a filelist for now, and do it later, I'm not up to refactoring sign_file & md5_sum to be useable during copy_file_data_block...
-                // We can't just do it now with the current sign_file & md5_sum implementation because we'd need to open() the input file (to sign & hash it),
-                // while it's already open through libarchive's read_disk API. That's apparently not possible on non POSIX systems.
-                // (You get a very helpful 'Permission denied' error on Windows...)
-                kttar->to_sign_and_bundle_list = realloc(kttar->to_sign_and_bundle_list, ++kttar->sign_and_bundle_index * sizeof(char *));
-                // And do the same with our tweaked pathname for legacy mode...
-                kttar->tweaked_to_sign_and_bundle_list = realloc(kttar->tweaked_to_sign_and_bundle_list, kttar->sign_and_bundle_index * sizeof(char *));
-                // Use the correct paths if we tweaked the entry pathname...
-                if(kttar->tweak_pointer_index != 0)
+                // Double-check the cache against what we've actually read
+                finish_file_data_hash(kttar, index);
+                if(memcmp(kttar->md5s[index], cached_md5, MD5_HASH_LENGTH) == 0 && memcmp(kttar->digests[index], cached_digest, SHA256_DIGEST_SIZE) == 0)
                 {
-                    kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(original_path);
-                    kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(tweaked_path);
+                    memcpy(kttar->sigs[index], cached_sig, kttar->signer->size);
+                    kttar->cached[index] = true;
                 }
                 else
                 {
-                    kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(archive_entry_pathname(entry));
-                    kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(archive_entry_pathname(entry));
+                    fprintf(stderr, "Stale cache entry for '%s', signing it again.\n", cache_key.path);
+                    kt_hash_cache_reject(kttar->cache);
                 }
             }
+            else if(cache_hit)
+            {
+                memcpy(kttar->md5s[index], cached_md5, MD5_HASH_LENGTH + 1);
+                memcpy(kttar->digests[index], cached_digest, SHA256_DIGEST_SIZE);
+                memcpy(kttar->sigs[index], cached_sig, kttar->signer->size);
+                kttar->cached[index] = true;
+            }
+            else if(digests_hit)
+            {
+                memcpy(kttar->md5s[index], cached_md5, MD5_HASH_LENGTH + 1);
+                memcpy(kttar->digests[index], cached_digest, SHA256_DIGEST_SIZE);
+            }
+            else
+            {
+                finish_file_data_hash(kttar, index);
+            }
         }
-        else
-        {
-            // Delete the file once we're done, be it a signature or the bundlefile
-            unlink(input_filename);
-        }
-        free(original_path);
+        original_path = NULL;
         tweaked_path = NULL;
     }
 
-    archive_read_close(disk);
-    archive_read_free(disk);
+    free(stack);
+    walk_free(&walk);
     archive_entry_free(entry);
 
     return 0;
 
 cleanup:
-    free(original_path);
-    tweaked_path = NULL;
-    archive_read_close(disk);
-    archive_read_free(disk);
+    if(fd != -1)
+        close(fd);
+    free(stack);
+    walk_free(&walk);
     archive_entry_free(entry);
 
     return 1;
 }
 
+// Write a bit of the (compressed) intermediate tarball out, and hash it on the way, so we don't have to read it back later
+static int tarball_output(struct kttarball *tarball, const unsigned char *p, size_t length)
+{
+    ssize_t written;
+
+    md5_update(&tarball->md5, length, p);
+    while(length > 0)
+    {
+        written = write(tarball->fd, p, length);
+        if(written < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += written;
+        length -= (size_t) written;
+    }
+
+    return 0;
+}
+
+// Deflate a single chunk of the current batch (raw deflate, we handle the gzip wrapping ourselves).
+// Every chunk but the last one ends on a sync flush, so that they can just be glued together.
+static void gzip_compress_chunk(void *arg, size_t index)
+{
+    struct kttarball *tarball = arg;
+    struct ktgzip_chunk *chunk = &tarball->gz_chunks[index];
+    z_stream strm;
+    int r;
+
+    chunk->crc = crc32(0L, chunk->in, (uInt) chunk->in_len);
+
+    memset(&strm, 0, sizeof(strm));
+    if(deflateInit2(&strm, tarball->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        chunk->failed = true;
+        return;
+    }
+    if(chunk->dict_len > 0)
+        deflateSetDictionary(&strm, chunk->dict, (uInt) chunk->dict_len);
+    strm.next_in = chunk->in;
+    strm.avail_in = (uInt) chunk->in_len;
+    strm.next_out = chunk->out;
+    strm.avail_out = (uInt) chunk->out_size;
+    r = deflate(&strm, chunk->last ? Z_FINISH : Z_SYNC_FLUSH);
+    // We made sure our output buffer was large enough for anything deflate could throw at us, so we should be done in one go
+    chunk->failed = (chunk->last ? r != Z_STREAM_END : r != Z_OK) || strm.avail_in != 0 || strm.avail_out == 0;
+    chunk->out_len = chunk->out_size - strm.avail_out;
+    deflateEnd(&strm);
+}
+
+// Compress what we've buffered, and write it out, in order. If it's the last batch, finish the gzip stream, too.
+static int gzip_flush(struct kttarball *tarball, bool last)
+{
+    unsigned int i;
+    unsigned int nchunks;
+    size_t offset;
+    size_t keep;
+    kt_pool *pool = NULL;
+    unsigned char trailer[8];
+
+    // Split the batch in chunks, each of them primed with whatever came right before it
+    nchunks = 0;
+    for(offset = 0; offset < tarball->gz_length || (last && nchunks == 0); offset += GZIP_CHUNK_SIZE)
+    {
+        struct ktgzip_chunk *chunk = &tarball->gz_chunks[nchunks++];
+
+        chunk->in = tarball->gz_buff + tarball->gz_history + offset;
+        chunk->in_len = tarball->gz_length - offset < GZIP_CHUNK_SIZE ? tarball->gz_length - offset : GZIP_CHUNK_SIZE;
+        chunk->dict_len = tarball->gz_history + offset < GZIP_DICT_SIZE ? tarball->gz_history + offset : GZIP_DICT_SIZE;
+        chunk->dict = chunk->in - chunk->dict_len;
+        chunk->last = false;
+        chunk->failed = false;
+    }
+    if(nchunks == 0)
+        return 0;
+    tarball->gz_chunks[nchunks - 1].last = last;
+
+    if(kt_threads > 1 && nchunks > 1)
+        pool = kt_get_pool();
+    if(pool != NULL)
+    {
+        kt_pool_parallel_for(pool, nchunks, gzip_compress_chunk, tarball);
+    }
+    else
+    {
+        for(i = 0; i < nchunks; i++)
+            gzip_compress_chunk(tarball, i);
+    }
+
+    for(i = 0; i < nchunks; i++)
+    {
+        struct ktgzip_chunk *chunk = &tarball->gz_chunks[i];
+
+        if(chunk->failed)
+        {
+            fprintf(stderr, "Error compressing intermediate tarball.\n");
+            return -1;
+        }
+        if(tarball_output(tarball, chunk->out, chunk->out_len) != 0)
+            return -1;
+        tarball->gz_crc = crc32_combine(tarball->gz_crc, chunk->crc, (z_off_t) chunk->in_len);
+        tarball->gz_isize += (uLong) chunk->in_len;
+    }
+
+    if(last)
+    {
+        // gzip trailer: CRC32 & size of the uncompressed data (mod 2^32), LE
+        for(i = 0; i < 4; i++)
+        {
+            trailer[i] = (unsigned char) (tarball->gz_crc >> (8 * i));
+            trailer[4 + i] = (unsigned char) (tarball->gz_isize >> (8 * i));
+        }
+        return tarball_output(tarball, trailer, sizeof(trailer));
+    }
+
+    // Keep the tail end of what we've just compressed around, to prime the next batch with
+    keep = tarball->gz_history + tarball->gz_length < GZIP_DICT_SIZE ? tarball->gz_history + tarball->gz_length : GZIP_DICT_SIZE;
+    memmove(tarball->gz_buff, tarball->gz_buff + tarball->gz_history + tarball->gz_length - keep, keep);
+    tarball->gz_history = keep;
+    tarball->gz_length = 0;
+
+    return 0;
+}
+
+static void gzip_free(struct kttarball *tarball)
+{
+    unsigned int i;
+
+    if(tarball->gz_chunks != NULL)
+    {
+        for(i = 0; i < tarball->gz_nchunks; i++)
+            free(tarball->gz_chunks[i].out);
+        free(tarball->gz_chunks);
+        tarball->gz_chunks = NULL;
+    }
+    free(tarball->gz_buff);
+    tarball->gz_buff = NULL;
+}
+
+// libarchive open callback for the intermediate tarball: set our compressor up, and write the gzip header
+static int tarball_open(struct archive *a, void *client_data)
+{
+    struct kttarball *tarball = client_data;
+    // No mtime, no name, so that we only depend on what we archive. XFL depends on the compression level, like gzip does it. OS is Unix.
+    unsigned char header[10] = { 0x1f, 0x8b, Z_DEFLATED, 0, 0, 0, 0, 0, 0, 3 };
+    unsigned int i;
+
+    header[8] = tarball->level == 9 ? 2 : (tarball->level == 1 ? 4 : 0);
+
+    // A couple chunks per thread, to keep everyone busy
+    tarball->gz_nchunks = 2 * (kt_threads > 1 ? kt_threads : 1);
+    tarball->gz_batch_size = (size_t) tarball->gz_nchunks * GZIP_CHUNK_SIZE;
+    tarball->gz_history = 0;
+    tarball->gz_length = 0;
+    tarball->gz_crc = crc32(0L, Z_NULL, 0);
+    tarball->gz_isize = 0;
+    tarball->gz_buff = malloc(GZIP_DICT_SIZE + tarball->gz_batch_size);
+    tarball->gz_chunks = calloc(tarball->gz_nchunks, sizeof(*tarball->gz_chunks));
+    if(tarball->gz_buff == NULL || tarball->gz_chunks == NULL)
+    {
+        archive_set_error(a, ENOMEM, "Cannot allocate memory for compression");
+        gzip_free(tarball);
+        return ARCHIVE_FATAL;
+    }
+    for(i = 0; i < tarball->gz_nchunks; i++)
+    {
+        // Room for the worst case, plus the sync flush marker & an empty final block
+        tarball->gz_chunks[i].out_size = compressBound(GZIP_CHUNK_SIZE) + 64;
+        if((tarball->gz_chunks[i].out = malloc(tarball->gz_chunks[i].out_size)) == NULL)
+        {
+            archive_set_error(a, ENOMEM, "Cannot allocate memory for compression");
+            gzip_free(tarball);
+            return ARCHIVE_FATAL;
+        }
+    }
+
+    if(tarball_output(tarball, header, sizeof(header)) != 0)
+    {
+        archive_set_error(a, errno, "Write error");
+        gzip_free(tarball);
+        return ARCHIVE_FATAL;
+    }
+
+    return ARCHIVE_OK;
+}
+
+// libarchive write callback for the intermediate tarball: buffer what the tar writer hands us, and compress it a batch at a time
+static la_ssize_t tarball_write(struct archive *a, void *client_data, const void *buff, size_t length)
+{
+    struct kttarball *tarball = client_data;
+    const unsigned char *p = buff;
+    size_t left = length;
+    size_t count;
+
+    if(tarball->gz_buff == NULL)
+    {
+        archive_set_error(a, EINVAL, "Compressor isn't set up");
+        return -1;
+    }
+    while(left > 0)
+    {
+        // Only flush a full batch once we know there's more to come: the last chunk of data has to be the one that finishes the stream,
+        // otherwise a tarball whose size happens to be a multiple of the batch size would end with an extra empty chunk, and the output would depend on -T.
+        if(tarball->gz_length == tarball->gz_batch_size && gzip_flush(tarball, false) != 0)
+        {
+            archive_set_error(a, errno, "Write error");
+            return -1;
+        }
+        count = tarball->gz_batch_size - tarball->gz_length;
+        if(count > left)
+            count = left;
+        memcpy(tarball->gz_buff + tarball->gz_history + tarball->gz_length, p, count);
+        tarball->gz_length += count;
+        p += count;
+        left -= count;
+    }
+
+    return (la_ssize_t) length;
+}
+
+// libarchive close callback for the intermediate tarball: compress whatever's left, and finish the gzip stream
+static int tarball_close(struct archive *a, void *client_data)
+{
+    struct kttarball *tarball = client_data;
+    int r = ARCHIVE_OK;
+
+    if(tarball->gz_buff != NULL && gzip_flush(tarball, true) != 0)
+    {
+        archive_set_error(a, errno, "Write error");
+        r = ARCHIVE_FATAL;
+    }
+    gzip_free(tarball);
+
+    return r;
+}
+
 // Archiving code inspired from libarchive tar/write.c ;).
-static int kindle_create_package_archive(const int outfd, char **filename, const unsigned int total_files, struct rsa_private_key *rsa_pkey_file, const unsigned int legacy, const unsigned int real_blocksize)
+static int kindle_create_package_archive(struct kttarball *tarball, char **filename, const unsigned int total_files, const struct kt_rsa_signer *signer, const unsigned int legacy, const unsigned int real_blocksize, const int compression_level, kt_hash_cache *cache, const bool cache_verify, kt_hash_cache *digest_cache, char **excludes, const unsigned int exclude_count)
 {
     struct archive *a;
     struct kttar *kttar, kttar_storage;
     unsigned int i;
-    FILE *file;
-    FILE *sigfile;
-    char md5[MD5_HASH_LENGTH + 1];
-    uint8_t bundlefile_status = 0;
     size_t pathlen;
     char *signame = NULL;
-    char sigabsolutepath[] = KT_TMPDIR "/kindletool_create_sig_XXXXXX";
-    int sigfd;
-    char *pathnamecpy = NULL;
-    char bundle_filename[] = KT_TMPDIR "/kindletool_create_idx_XXXXXX";
-    int bundle_fd = -1;
-    FILE *bundlefile = NULL;
+    unsigned char index_sig[CERTIFICATE_2K_SIZE];
+    uint8_t digest[MD5_DIGEST_SIZE];
     struct stat st;
 
     // Use a pointer for consistency, but stack-allocated storage for ease of cleanup.
     kttar = &kttar_storage;
     memset(kttar, 0, sizeof(*kttar));
+    kttar->signer = signer;
+    kttar->cache = cache;
+    kttar->cache_verify = cache_verify;
+    kttar->digest_cache = digest_cache;
     // Choose a suitable copy buffer size
     kttar->buff_size = 64 * 1024;
     while(kttar->buff_size < (size_t) DEFAULT_BYTES_PER_BLOCK)
@@ -558,14 +1383,37 @@ static int kindle_create_package_archive(const int outfd, char **filename, const
     }
 
     a = archive_write_new();
-    archive_write_add_filter_gzip(a);
+    // We handle the gzip compression ourselves, on as many threads as we're allowed to, cf. tarball_write
+    archive_write_add_filter_none(a);
     archive_write_set_format_gnutar(a);
 
     // These should be the default (cf. archive_write_new @ libarchive/archive_write.c), but reset them to be on the safe side...
     archive_write_set_bytes_per_block(a, DEFAULT_BYTES_PER_BLOCK);
-    archive_write_set_bytes_in_last_block(a, -1);
+    // Don't pad the last block of a regular file (that's what archive_write_open_fd would have done for us)
+    archive_write_set_bytes_in_last_block(a, 1);
+    // And don't archive our own tarball if it happens to live in one of our input directories
+    if(fstat(tarball->fd, &st) == 0)
+        archive_write_set_skip_file(a, (la_int64_t) st.st_dev, (la_int64_t) st.st_ino);
+
+    tarball->hashed = false;
+    // We only ever produce the plain tarball, it's up to the caller to munge it if it wants to share that, too
+    tarball->munged = NULL;
+    md5_init(&tarball->md5);
+    tarball->level = compression_level;
+    tarball->gz_buff = NULL;
+    tarball->gz_chunks = NULL;
+    if(archive_write_open(a, tarball, tarball_open, tarball_write, tarball_close) != ARCHIVE_OK)
+    {
+        fprintf(stderr, "archive_write_open() failed: %s.\n", archive_error_string(a));
+        archive_write_free(a);
+        gzip_free(tarball);
+        free(kttar->buff);
+        return 1;
+    }
 
-    archive_write_open_fd(a, outfd);
+    // Build our exclude list once for the whole walk
+    if(exclude_init(&kttar->exclude, excludes, exclude_count) != 0)
+        goto cleanup;
 
     // Loop over our input files/directories...
     for(i = 0; i < total_files; i++)
@@ -582,179 +1430,72 @@ static int kindle_create_package_archive(const int outfd, char **filename, const
             }
         }
 
-        // Populate & write our entries from read_disk_open's directory walking...
-        if(create_from_archive_read_disk(kttar, a, filename[i], true, NULL, real_blocksize) != 0)
+        // Populate & write our entries from our directory walk...
+        if(create_from_disk(kttar, a, filename[i], real_blocksize) != 0)
             goto cleanup;
     }
 
-    // Add our bundle index to the end of the list...
-    // And we'll be creating it in a tempfile, to add to the fun...
-    bundle_fd = mkstemp(bundle_filename);
-    if(bundle_fd == -1)
-    {
-        fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
-        goto cleanup;
-    }
-    if((bundlefile = fdopen(bundle_fd, "w+b")) == NULL)
+    // Sign everything we've hashed along the way
+    if(sign_file_digests(kttar, kttar->sign_and_bundle_index) != 0)
     {
-        fprintf(stderr, "Cannot open temp bundlefile '%s' for writing: %s.\n", bundle_filename, strerror(errno));
-        close(bundle_fd);
-        unlink(bundle_filename);
+        fprintf(stderr, "Cannot sign package files.\n");
         goto cleanup;
     }
-    // Now that it's there, mark it as open and created
-    bundlefile_status = BUNDLE_OPEN | BUNDLE_CREATED;
-    // And append it as the last file...
-    kttar->to_sign_and_bundle_list = realloc(kttar->to_sign_and_bundle_list, ++kttar->sign_and_bundle_index * sizeof(char *));
-    kttar->to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(bundle_filename);
-    // We'll never tweak the bundlefile pathname, but we rely on this being sane & consistent, so set it
-    kttar->tweaked_to_sign_and_bundle_list = realloc(kttar->tweaked_to_sign_and_bundle_list, kttar->sign_and_bundle_index * sizeof(char *));
-    kttar->tweaked_to_sign_and_bundle_list[kttar->sign_and_bundle_index - 1] = strdup(bundle_filename);
 
-    // And now loop again over the stuff we need to sign, hash & bundle...
-    for(i = 0; i <= kttar->sign_and_bundle_index; i++)
+    // Then add each file's sig, straight from memory, and the bundle index along with it...
+    for(i = 0; i < kttar->sign_and_bundle_index; i++)
     {
-        // Dirty hack ahoy. If we're the last file in our list, that means we're the bundlefile, close our fd
-        if(i == kttar->sign_and_bundle_index - 1)
-        {
-            fclose(bundlefile);
-            // It's closed, remove our flag
-            bundlefile_status &= (uint8_t)~BUNDLE_OPEN;
-        }
+        // Always use the tweaked paths (they're properly set to the real path when we're not in legacy mode)
+        pathlen = strlen(kttar->tweaked_to_sign_and_bundle_list[i]);
+        signame = malloc(pathlen + 4 + 1);
+        snprintf(signame, pathlen + 4 + 1, "%s.sig", kttar->tweaked_to_sign_and_bundle_list[i]);
+        if(write_memory_entry(a, signame, kttar->sigs[i], signer->size) != 0)
+            goto cleanup;
+        free(signame);
+        signame = NULL;
 
-        // Dirty hack, the return. We loop twice on the bundlefile, once to sign it, and once to archive it...
-        if(i == kttar->sign_and_bundle_index)
+        if(append_index_entry(kttar, i, real_blocksize) != 0)
         {
-            // It's the second time we're looping over the bundlefile, just archive it
-            // Just set the correct pathnames...
-            signame = strdup(INDEX_FILE_NAME);
-            // NOTE: Fragile, sigabsolutepath & bundle_filename need to be of the same length...
-            strcpy(sigabsolutepath, bundle_filename);
+            fprintf(stderr, "Cannot write to index file.\n");
+            goto cleanup;
         }
-        else
-        {
-            // First things first, if we're not the bundlefile, we're gonna need our size for a field of the bundlefile, so get on that...
-            if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
-            {
-                // We're out of a libarchive read loop, so do a stat call ourselves
-                stat(kttar->to_sign_and_bundle_list[i], &st);
-            }
+    }
 
-            // Go on as usual, hash, sign & bundle :)
-            if((file = fopen(kttar->to_sign_and_bundle_list[i], "rb")) == NULL)
-            {
-                fprintf(stderr, "Cannot open '%s' for reading: %s!\n", kttar->to_sign_and_bundle_list[i], strerror(errno));
-                // Avoid a double free (beginning from the second iteration, since we freed signame at the end of the first iteration, but it's not allocated yet, and cleanup will try to free...)
-                signame = NULL;
-                goto cleanup;
-            }
-            // Don't hash our bundlefile
-            if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
-            {
-                if(md5_sum(file, md5) != 0)
-                {
-                    fprintf(stderr, "Cannot calculate hash sum for '%s'.\n", kttar->to_sign_and_bundle_list[i]);
-                    fclose(file);
-                    // Avoid a double free, bis.
-                    signame = NULL;
-                    goto cleanup;
-                }
-                md5[MD5_HASH_LENGTH] = 0;
-                rewind(file);
-            }
-
-            // If we're the bundlefile, fix the relative path to not use the tempfile path...
-            if((bundlefile_status & BUNDLE_OPEN) != BUNDLE_OPEN)
-            {
-                pathlen = strlen(INDEX_FILE_NAME);
-                signame = malloc(pathlen + 4 + 1);
-                strncpy(signame, INDEX_FILE_NAME, pathlen + 4 + 1);
-                strncat(signame, ".sig", 4);
-            }
-            else
-            {
-                // Always use the tweaked paths (they're properly set to the real path when we're not in legacy mode)
-                pathlen = strlen(kttar->tweaked_to_sign_and_bundle_list[i]);
-                signame = malloc(pathlen + 4 + 1);
-                strncpy(signame, kttar->tweaked_to_sign_and_bundle_list[i], pathlen + 4 + 1);
-                strncat(signame, ".sig", 4);
-            }
-            // Create our sigfile in a tempfile
-            // We have to make sure mkstemp's template is reset first...
-            strcpy(sigabsolutepath, KT_TMPDIR "/kindletool_create_sig_XXXXXX");
-            sigfd = mkstemp(sigabsolutepath);
-            if(sigfd == -1)
-            {
-                fprintf(stderr, "Couldn't open temporary signature file: %s.\n", strerror(errno));
-                fclose(file);
-                goto cleanup;
-            }
-            if((sigfile = fdopen(sigfd, "wb")) == NULL)
-            {
-                fprintf(stderr, "Cannot open temp signature file '%s' for writing: %s.\n", signame, strerror(errno));
-                fclose(file);
-                close(sigfd);
-                unlink(sigabsolutepath);
-                goto cleanup;
-            }
-            if(sign_file(file, rsa_pkey_file, sigfile) < 0)
-            {
-                fprintf(stderr, "Cannot sign '%s'.\n", kttar->to_sign_and_bundle_list[i]);
-                fclose(file);
-                fclose(sigfile);
-                unlink(sigabsolutepath);   // Delete empty/broken sigfile
-                goto cleanup;
-            }
-
-            // Don't add the bundlefile to itself
-            if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
-            {
-                // The last field is a display name, take a hint from the Python tool, and use the file's basename with a simple suffix
-                // Use a copy of to_sign_and_bundle_list[i] to get our basename, since the POSIX implementation may alter its arg, and that would be very bad...
-                // And we're using the tweaked pathname in case we're in legacy mode ;)
-                pathnamecpy = strdup(kttar->to_sign_and_bundle_list[i]);
-                // Only flag kernels in recovery update...
-                // FWIW, the format is as follows: file_type_id md5sum file_name blocksize file_display_name
-                // where the id is 1 for kernel images (in recovery updates only), 129 for install scripts, and 128 for assets, and the blocksize is based on the file size relative to the update type blocksize.
-                if(fprintf(bundlefile, "%d %s %s %lld %s_ktool_file\n", ((real_blocksize == RECOVERY_BLOCK_SIZE && IS_UIMAGE(kttar->to_sign_and_bundle_list[i]) ? 1 : (IS_SCRIPT(kttar->to_sign_and_bundle_list[i]) || IS_SHELL(kttar->to_sign_and_bundle_list[i])) ? 129 : 128)), md5, kttar->tweaked_to_sign_and_bundle_list[i], (long long) st.st_size / real_blocksize, basename(pathnamecpy)) < 0)
-                {
-                    fprintf(stderr, "Cannot write to index file.\n");
-                    // Cleanup a bit before crapping out
-                    fclose(file);
-                    fclose(sigfile);
-                    unlink(sigabsolutepath);
-                    free(pathnamecpy);
-                    goto cleanup;
-                }
-                free(pathnamecpy);
-            }
-
-            // Cleanup
-            fclose(file);
-            fclose(sigfile);
-        }
-
-        // And now, for the fun part! Append our sigfile to the archive...
-        // Populate & write our entries...
-        if(create_from_archive_read_disk(kttar, a, sigabsolutepath, false, signame, real_blocksize) != 0)
-        {
-            unlink(sigabsolutepath);
-            goto cleanup;
-        }
-
-        // Cleanup
-        free(signame);
-    }
+    // And finally, sign the bundle index, and add it as the last file...
+    if(kt_sign_buffer(signer, (const unsigned char *) kttar->index_data, kttar->index_length, index_sig) != 0)
+    {
+        fprintf(stderr, "Cannot sign index file.\n");
+        goto cleanup;
+    }
+    if(write_memory_entry(a, INDEX_FILE_NAME ".sig", index_sig, signer->size) != 0)
+        goto cleanup;
+    if(write_memory_entry(a, INDEX_FILE_NAME, kttar->index_data, kttar->index_length) != 0)
+        goto cleanup;
 
+    free(kttar->md5s);
+    free(kttar->digests);
+    free(kttar->sigs);
+    free(kttar->sizes);
+    free(kttar->cached);
+    free(kttar->cache_keys);
+    free(kttar->index_data);
     free(kttar->buff);
-    for(i = 0; i < kttar->sign_and_bundle_index; i++)
-        free(kttar->to_sign_and_bundle_list[i]);
+    exclude_free(&kttar->exclude);
     free(kttar->to_sign_and_bundle_list);
-    for(i = 0; i < kttar->sign_and_bundle_index; i++)
-        free(kttar->tweaked_to_sign_and_bundle_list[i]);
     free(kttar->tweaked_to_sign_and_bundle_list);
-    archive_write_close(a);
+    arena_free(&kttar->paths);
+    // This flushes the last bits through tarball_write & tarball_close, so make sure it went fine before trusting our hashes
+    if(archive_write_close(a) != ARCHIVE_OK)
+    {
+        fprintf(stderr, "archive_write_close() failed: %s.\n", archive_error_string(a));
+        archive_write_free(a);
+        gzip_free(tarball);
+        return 1;
+    }
     archive_write_free(a);
+    md5_digest(&tarball->md5, MD5_DIGEST_SIZE, digest);
+    base16_encode_update(tarball->md5_hex, MD5_DIGEST_SIZE, digest);
+    tarball->hashed = true;
 
     // Print a warning if no script was detected (in an OTA update)...
     if(!kttar->has_script && real_blocksize == BLOCK_SIZE)
@@ -774,135 +1515,43 @@ static int kindle_create_package_archive(const int outfd, char **filename, const
     return 0;
 
 cleanup:
-    // Close & remove the bundlefile if we crapped out in the middle of processing
-    if((bundlefile_status & BUNDLE_OPEN) == BUNDLE_OPEN)
-    {
-        fclose(bundlefile);
-        unlink(bundle_filename);
-    }
-    else
-    {
-        // And if it's not open anymore, but was created, remove it too (that's a short window of time, namely, when we're looping over the bundlefile itself & its sigfile)
-        if((bundlefile_status & BUNDLE_CREATED) == BUNDLE_CREATED)
-        {
-            unlink(bundle_filename);
-        }
-    }
     // Free what we might have alloc'ed
     free(signame);
+    free(kttar->md5s);
+    free(kttar->digests);
+    free(kttar->sigs);
+    free(kttar->sizes);
+    free(kttar->cached);
+    free(kttar->cache_keys);
+    free(kttar->index_data);
     // The big stuff, too...
     free(kttar->buff);
-    if(kttar->sign_and_bundle_index > 0)
-    {
-        for(i = 0; i < kttar->sign_and_bundle_index; i++)
-            free(kttar->to_sign_and_bundle_list[i]);
-        free(kttar->to_sign_and_bundle_list);
-        for(i = 0; i < kttar->sign_and_bundle_index; i++)
-            free(kttar->tweaked_to_sign_and_bundle_list[i]);
-        free(kttar->tweaked_to_sign_and_bundle_list);
-    }
+    exclude_free(&kttar->exclude);
+    free(kttar->to_sign_and_bundle_list);
+    free(kttar->tweaked_to_sign_and_bundle_list);
+    arena_free(&kttar->paths);
     archive_write_close(a);
     archive_write_free(a);
+    gzip_free(tarball);
     return 1;
 }
 
-static int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output, const bool fake_sign)
+static int kindle_create_package(UpdateInformation *info, FILE *input_tgz, const struct kttarball *tarball, FILE *output, const bool fake_sign)
 {
-    unsigned char buffer[BUFFER_SIZE];
-    size_t count;
-    FILE *temp;
-
     switch(info->version)
     {
         case OTAUpdateV2:
-            if((temp = tmpfile()) == NULL)
-            {
-                fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-                return -1;
-            }
-            if(kindle_create_ota_update_v2(info, input_tgz, temp, fake_sign) < 0) // Create the update
-            {
-                fprintf(stderr, "Error creating update package.\n");
-                fclose(temp);
-                return -1;
-            }
-            rewind(temp); // Rewind the file before reading back
-            if(!fake_sign)
-            {
-                if(kindle_create_signature(info, temp, output) < 0) // Write the signature (unless we asked for an unsigned package)
-                {
-                    fprintf(stderr, "Error signing update package.\n");
-                    fclose(temp);
-                    return -1;
-                }
-                rewind(temp); // Rewind the file before writing it to output
-            }
-            // write the update
-            while((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0)
-            {
-                if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
-                {
-                    fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
-                    fclose(temp);
-                    return -1;
-                }
-            }
-            if(ferror(temp) != 0)
-            {
-                fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
-                fclose(temp);
-                return -1;
-            }
-            fclose(temp);
-            return 0;
+            return kindle_create_enveloped_bundle(info, input_tgz, tarball, output, fake_sign);
             break;
         case OTAUpdate:
-            return kindle_create_ota_update(info, input_tgz, output, fake_sign);
+            return kindle_create_bundle(info, input_tgz, tarball, output, fake_sign, NULL);
             break;
         case RecoveryUpdate:
             // NOTE: I'm gonna assume that this, even FB02 @ rev. 2, shouldn't be wrapped in an UpdateSignature...
-            return kindle_create_recovery(info, input_tgz, output, fake_sign);
+            return kindle_create_bundle(info, input_tgz, tarball, output, fake_sign, NULL);
             break;
         case RecoveryUpdateV2:
-            if((temp = tmpfile()) == NULL)
-            {
-                fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-                return -1;
-            }
-            if(kindle_create_recovery_v2(info, input_tgz, temp, fake_sign) < 0)
-            {
-                fprintf(stderr, "Error creating update package.\n");
-                fclose(temp);
-                return -1;
-            }
-            rewind(temp);
-            if(!fake_sign)
-            {
-                if(kindle_create_signature(info, temp, output) < 0)
-                {
-                    fprintf(stderr, "Error signing update package.\n");
-                    fclose(temp);
-                    return -1;
-                }
-                rewind(temp);
-            }
-            while((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0)
-            {
-                if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
-                {
-                    fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
-                    fclose(temp);
-                    return -1;
-                }
-            }
-            if(ferror(temp) != 0)
-            {
-                fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
-                fclose(temp);
-                return -1;
-            }
-            fclose(temp);
-            return 0;
+            return kindle_create_enveloped_bundle(info, input_tgz, tarball, output, fake_sign);
             break;
         case UpdateSignature:
             // NOTE: Should only be reached when building a signed userdata package
@@ -914,17 +1563,9 @@ static int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output,
             }
             rewind(input_tgz);
             // ...And then simply append the input tarball as-is
-            while((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, input_tgz)) > 0)
-            {
-                if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
-                {
-                    fprintf(stderr, "Error appending userdata tarball to output: %s.\n", strerror(errno));
-                    return -1;
-                }
-            }
-            if(ferror(input_tgz) != 0)
+            if(copy_payload(input_tgz, output, NULL) < 0)
             {
-                fprintf(stderr, "Error reading original userdata tarball update: %s.\n", strerror(errno));
+                fprintf(stderr, "Error appending userdata tarball to output.\n");
                 return -1;
             }
             return 0;
@@ -937,358 +1578,1395 @@ static int kindle_create(UpdateInformation *info, FILE *input_tgz, FILE *output,
     return -1;
 }
 
-static int kindle_create_ota_update_v2(UpdateInformation *info, FILE *input_tgz, FILE *output, const bool fake_sign)
+// OTA V2 & Recovery V2: the bundle, wrapped in an SP01 envelope with its signature (unless we asked for an unsigned package)
+static int kindle_create_enveloped_bundle(UpdateInformation *info, FILE *input_tgz, const struct kttarball *tarball, FILE *output, const bool fake_sign)
 {
-    size_t header_size;
-    unsigned char *header;
-    size_t hindex = 0;
-    int i;
-    FILE *demunged_tgz;
-    size_t str_len;
-
-    demunged_tgz = NULL;
-
-    // First part of the set sized data
-    header_size = MAGIC_NUMBER_LENGTH + OTA_UPDATE_V2_BLOCK_SIZE;
-    header = malloc(header_size);
-    strncpy((char *)header, info->magic_number, MAGIC_NUMBER_LENGTH);
-    hindex += MAGIC_NUMBER_LENGTH;
-    memcpy(&header[hindex], &info->source_revision, sizeof(uint64_t)); // Source
-    hindex += sizeof(uint64_t);
-    memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t)); // Target
-    hindex += sizeof(uint64_t);
-    memcpy(&header[hindex], &info->num_devices, sizeof(uint16_t)); // Device count
-    hindex += sizeof(uint16_t);
-
-    // Next, we write the devices
-    header_size += info->num_devices * sizeof(uint16_t);
-    header = realloc(header, header_size);
-    for(i = 0; i < info->num_devices; i++)
-    {
-        memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t)); // Device
-        hindex += sizeof(uint16_t);
-    }
-
-    // Part two of the set sized data
-    header_size += OTA_UPDATE_V2_PART_2_BLOCK_SIZE;
-    header = realloc(header, header_size);
-    memcpy(&header[hindex], &info->critical, sizeof(uint8_t)); // Critical
-    hindex += sizeof(uint8_t);
-    memset(&header[hindex], 0, sizeof(uint8_t)); // 1 byte padding
-    hindex += sizeof(uint8_t);
+    unsigned char buffer[BUFFER_SIZE];
+    size_t count;
+    FILE *temp;
+    struct stat st;
 
-    // Even if we asked for a fake package, the Kindle still expects a proper package...
-    // Sum a temp deobfuscated tarball to fake it ;)
+    // No envelope to write, so no need to go through a tempfile...
     if(fake_sign)
+        return kindle_create_bundle(info, input_tgz, tarball, output, fake_sign, NULL);
+    // And if we can seek in our output, we can fill the signature in after the fact, so don't go through a tempfile either
+    if(fstat(fileno(output), &st) == 0 && S_ISREG(st.st_mode) && ftello(output) >= 0)
+        return kindle_create_signed_bundle(info, input_tgz, tarball, output);
+
+    if((temp = tmpfile()) == NULL)
     {
-        if((demunged_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            free(header);
-            return -1;
-        }
-        demunger(input_tgz, demunged_tgz, 0, false);
-        rewind(input_tgz);
-        rewind(demunged_tgz);
-        if(md5_sum(demunged_tgz, (char *)&header[hindex]) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of fake package.\n");
-            free(header);
-            return -1;
-        }
-        fclose(demunged_tgz);
+        fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
+        return -1;
     }
-    else
+    if(kindle_create_bundle(info, input_tgz, tarball, temp, fake_sign, NULL) < 0) // Create the update
+    {
+        fprintf(stderr, "Error creating update package.\n");
+        fclose(temp);
+        return -1;
+    }
+    rewind(temp); // Rewind the file before reading back
+    if(kindle_create_signature(info, temp, output) < 0) // Write the signature
     {
-        if(md5_sum(input_tgz, (char *)&header[hindex]) < 0) // md5 hash
+        fprintf(stderr, "Error signing update package.\n");
+        fclose(temp);
+        return -1;
+    }
+    rewind(temp); // Rewind the file before writing it to output
+    // write the update
+    while((count = fread(buffer, sizeof(unsigned char), BUFFER_SIZE, temp)) > 0)
+    {
+        if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
-            free(header);
+            fprintf(stderr, "Error writing update to output: %s.\n", strerror(errno));
+            fclose(temp);
             return -1;
         }
-        rewind(input_tgz); // Reset input for later reading
     }
+    if(ferror(temp) != 0)
+    {
+        fprintf(stderr, "Error reading generated update: %s.\n", strerror(errno));
+        fclose(temp);
+        return -1;
+    }
+    fclose(temp);
+    return 0;
+}
 
-    md(&header[hindex], MD5_HASH_LENGTH); // Obfuscate md5 hash
-    hindex += MD5_HASH_LENGTH;
-    memcpy(&header[hindex], &info->num_meta, sizeof(uint16_t)); // num_meta, cannot be casted
-    hindex += sizeof(uint16_t);
+// OTA V2 & Recovery V2, for seekable outputs: leave room for the signature in the envelope, hash the bundle while we're writing it right after it, then go back to fill the signature in
+static int kindle_create_signed_bundle(UpdateInformation *info, FILE *input_tgz, const struct kttarball *tarball, FILE *output)
+{
+    KTBundleHeader header;
+    struct kt_sha256_ctx sha256;
+    uint8_t digest[SHA256_DIGEST_SIZE];
+    unsigned char raw_sig[CERTIFICATE_2K_SIZE];
+    off_t sig_offset;
 
-    // Next, we write the meta strings
-    for(i = 0; i < info->num_meta; i++)
+    kindle_fill_header(info, UpdateSignature, &header);
+    memcpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH); // Write magic number
+    if(kindle_write_header(&header, output, NULL) < 0)
+    {
+        return -1;
+    }
+    // Keep a blank spot for the signature...
+    memset(raw_sig, 0, sizeof(raw_sig));
+    if((sig_offset = ftello(output)) < 0 || fwrite(raw_sig, sizeof(unsigned char), info->signer.size, output) < info->signer.size)
     {
-        str_len = strlen(info->metastrings[i]);
-        header_size += str_len + sizeof(uint16_t);
-        header = realloc(header, header_size);
-        // String length: little endian -> big endian
-        // FIXME: While otaup expects this endianness switch, it would seem that otacheck doesn't, and chokes with an headerTooShortInMetadataField error as soon as we pass more than one metastring...
-        //        If we don't switch the endianness, otacheck passes, but otaup chokes... >_<"
-        memcpy(&header[hindex], &((uint8_t *)&str_len)[1], sizeof(uint8_t));
-        hindex += sizeof(uint8_t);
-        memcpy(&header[hindex], &((uint8_t *)&str_len)[0], sizeof(uint8_t));
-        hindex += sizeof(uint8_t);
-        md((unsigned char *)info->metastrings[i], str_len); // Obfuscate meta string
-        // FIXME: Should this really be munged? Following otaup would point to yes, but I've never seen an update with meta strings in the wild, and the aforementionned issue with the string length doesn't help...
-        strncpy((char *)&header[hindex], info->metastrings[i], str_len);
-        hindex += str_len;
+        fprintf(stderr, "Error writing update signature: %s.\n", strerror(errno));
+        return -1;
     }
 
-    // Now, we write the header to the file
-    if(fwrite(header, sizeof(unsigned char), header_size, output) < header_size)
+    // Then the update itself, hashing it on the way
+    kt_sha256_init(&sha256);
+    if(kindle_create_bundle(info, input_tgz, tarball, output, false, &sha256) < 0)
     {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-        free(header);
+        fprintf(stderr, "Error creating update package.\n");
+        return -1;
+    }
+    kt_sha256_digest(&sha256, digest);
+
+    // And now we know what to sign
+    if(kt_sign_digest(&info->signer, digest, raw_sig) != 0)
+    {
+        fprintf(stderr, "Error signing update package payload.\n");
+        return -1;
+    }
+    if(fseeko(output, sig_offset, SEEK_SET) != 0 || fwrite(raw_sig, sizeof(unsigned char), info->signer.size, output) < info->signer.size || fseeko(output, 0, SEEK_END) != 0)
+    {
+        fprintf(stderr, "Error writing update signature: %s.\n", strerror(errno));
         return -1;
     }
 
-    // Write the actual update
-    free(header);
-    return munger(input_tgz, output, 0, fake_sign);
+    return 0;
 }
 
-static int kindle_create_signature(UpdateInformation *info, FILE *input_bin, FILE *output)
+// Fill in a bundle header from our update information (the MD5 hash is left to the caller)
+static void kindle_fill_header(UpdateInformation *info, BundleVersion version, KTBundleHeader *header)
 {
-    UpdateHeader header; // Header to write
+    memset(header, 0, sizeof(KTBundleHeader));
+    header->version = version;
+    memcpy(header->magic_number, info->magic_number, MAGIC_NUMBER_LENGTH);
+    header->source_revision = info->source_revision;
+    header->target_revision = info->target_revision;
+    header->num_devices = info->num_devices;
+    header->devices = info->devices;
+    header->optional = info->optional;
+    header->critical = info->critical;
+    header->num_meta = info->num_meta;
+    header->metastrings = info->metastrings;
+    header->magic_1 = info->magic_1;
+    header->magic_2 = info->magic_2;
+    header->minor = info->minor;
+    header->header_rev = info->header_rev;
+    header->platform = info->platform;
+    header->board = info->board;
+    header->certificate_number = info->certificate_number;
+}
+
+// Also feeds the header to sha256, if it's not NULL
+static int kindle_write_header(const KTBundleHeader *header, FILE *output, struct kt_sha256_ctx *sha256)
+{
+    unsigned char *buffer;
+    size_t header_size;
 
-    memset(&header, 0, sizeof(UpdateHeader)); // Zero init
-    strncpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH); // Write magic number
-    header.data.signature.certificate_number = (uint32_t)info->certificate_number; // 4 byte certificate number
-    if(fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE, output) < MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE)
+    if(kt_header_encode(header, &buffer, &header_size) < 0)
     {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
         return -1;
     }
-    // Write signature to output
-    if(sign_file(input_bin, &info->sign_pkey, output) < 0)
+    if(sha256 != NULL)
+        kt_sha256_update(sha256, header_size, buffer);
+    if(fwrite(buffer, sizeof(unsigned char), header_size, output) < header_size)
     {
-        fprintf(stderr, "Error signing update package payload.\n");
+        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
+        free(buffer);
         return -1;
     }
+    free(buffer);
     return 0;
 }
 
-static int kindle_create_ota_update(UpdateInformation *info, FILE *input_tgz, FILE *output, const bool fake_sign)
+// OTA, OTA V2, Recovery & Recovery V2: a header with the MD5 hash of the package, followed by the munged package
+static int kindle_create_bundle(UpdateInformation *info, FILE *input_tgz, const struct kttarball *tarball, FILE *output, const bool fake_sign, struct kt_sha256_ctx *sha256)
 {
-    UpdateHeader header;
-    FILE *obfuscated_tgz;
+    KTBundleHeader header;
 
-    obfuscated_tgz = NULL;
-
-    memset(&header, 0, sizeof(UpdateHeader)); // Zero init
-    strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH); // Magic number
-    header.data.ota_update.source_revision = (uint32_t)info->source_revision; // Source
-    header.data.ota_update.target_revision = (uint32_t)info->target_revision; // Target
-    header.data.ota_update.device = (uint16_t)info->devices[0]; // Device
-    header.data.ota_update.optional = (unsigned char)info->optional; // Optional
+    kindle_fill_header(info, info->version, &header);
 
+    // Even if we asked for a fake package, the Kindle still expects a proper package...
+    // Sum a deobfuscated tarball to fake it ;) (on the fly, no need to actually write it anywhere)
     if(fake_sign)
     {
-        if((obfuscated_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            return -1;
-        }
-        demunger(input_tgz, obfuscated_tgz, 0, false);
-        rewind(input_tgz);
-        rewind(obfuscated_tgz);
-        if(md5_sum(obfuscated_tgz, header.data.ota_update.md5_sum) < 0)
+        if(demunged_md5_sum(input_tgz, header.md5_sum) < 0)
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
+            fprintf(stderr, "Error calculating MD5 of fake package.\n");
             return -1;
         }
-        fclose(obfuscated_tgz);
+        rewind(input_tgz); // Reset input for later reading
+    }
+    else if(tarball != NULL && tarball->hashed)
+    {
+        // We've hashed it while we were building it, no need to read it again
+        memcpy(header.md5_sum, tarball->md5_hex, MD5_HASH_LENGTH);
     }
     else
     {
-        if(md5_sum(input_tgz, header.data.ota_update.md5_sum) < 0)
+        if(md5_sum(input_tgz, header.md5_sum) < 0) // md5 hash
         {
-            fprintf(stderr, "Error calculating MD5 of input tgz.\n");
+            fprintf(stderr, "Error calculating MD5 of package.\n");
             return -1;
         }
-        rewind(input_tgz); // Rewind input
+        rewind(input_tgz); // Reset input for later reading
     }
-    md((unsigned char *)header.data.ota_update.md5_sum, MD5_HASH_LENGTH); // Obfuscate md5 hash
 
-    // Write header to output
-    if(fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE, output) < MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE)
+    if(kindle_write_header(&header, output, sha256) < 0)
     {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
         return -1;
     }
 
-    // Write package to output
-    return munger(input_tgz, output, 0, fake_sign);
+    // Write the actual update (unless it's already been munged for us)
+    if(tarball != NULL && tarball->munged != NULL)
+    {
+        rewind(tarball->munged);
+        return copy_payload(tarball->munged, output, sha256);
+    }
+    return munger_hash(input_tgz, output, 0, fake_sign, sha256);
 }
 
-static int kindle_create_recovery(UpdateInformation *info, FILE *input_tgz, FILE *output, const bool fake_sign)
+// Copy the rest of input to output, hashing it on the way if sha256 isn't NULL.
+// Otherwise, on Linux, when both are regular files, let the kernel do it with copy_file_range, which at least saves a round-trip through userland (and can be a server-side copy on NFS & co).
+// NOTE: Don't expect a reflink, the payload doesn't start on a block boundary in our output.
+static int copy_payload(FILE *input, FILE *output, struct kt_sha256_ctx *sha256)
 {
-    UpdateHeader header;
-    FILE *obfuscated_tgz;
-
-    obfuscated_tgz = NULL;
-
-    memset(&header, 0, sizeof(UpdateHeader)); // Zero init
-
-    strncpy(header.magic_number, info->magic_number, MAGIC_NUMBER_LENGTH); // Magic number
-    header.data.recovery_update.magic_1 = (uint32_t)info->magic_1; // Magic 1
-    header.data.recovery_update.magic_2 = (uint32_t)info->magic_2; // Magic 2
-    header.data.recovery_update.minor = (uint32_t)info->minor; // Minor
+    unsigned char *buffer;
+    size_t count;
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    int64_t in_offset;
+    ssize_t copied = 0;
+    struct stat st;
+    struct stat out_st;
 
-    // Handle FB02 with a V2 Header Rev. Different length, but still fixed...
-    if(info->header_rev == 2)
+    // Go through the syscall directly, older libcs don't have a wrapper for it
+    if(sha256 == NULL && fstat(fileno(output), &out_st) == 0 && S_ISREG(out_st.st_mode) && fstat(fileno(input), &st) == 0 && S_ISREG(st.st_mode) && fflush(output) == 0 && (in_offset = ftello(input)) >= 0)
     {
-        // NOTE: It expects some new stuff that I'm not too sure about... Here be dragons.
-        header.data.recovery_h2_update.platform = (uint32_t)info->platform;
-        header.data.recovery_h2_update.header_rev = (uint32_t)info->header_rev;
-        header.data.recovery_h2_update.board = (uint32_t)info->board;
+        while(in_offset < st.st_size && (copied = syscall(SYS_copy_file_range, fileno(input), &in_offset, fileno(output), NULL, (size_t) (st.st_size - in_offset), 0U)) > 0)
+            ;
+        // Let stdio catch up with where the kernel left both files
+        if(fseeko(input, (off_t) in_offset, SEEK_SET) != 0 || fseeko(output, 0, SEEK_CUR) != 0)
+        {
+            fprintf(stderr, "Error copying payload: %s.\n", strerror(errno));
+            return -1;
+        }
+        // Done, or we do the rest ourselves (f.g., on an old kernel, or across filesystems on an older one)
+        if(copied >= 0 && in_offset >= st.st_size)
+            return 0;
     }
-    else
+#endif
+
+    if((buffer = malloc(kt_block_size)) == NULL)
     {
-        // Assume what we did before was okay, and put a device id in there...
-        header.data.recovery_update.device = (uint32_t)info->devices[0]; // Device
+        fprintf(stderr, "Cannot allocate memory for copy buffer.\n");
+        return -1;
     }
-
-    if(fake_sign)
+    while((count = fread(buffer, sizeof(unsigned char), kt_block_size, input)) > 0)
     {
-        if((obfuscated_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            return -1;
-        }
-        demunger(input_tgz, obfuscated_tgz, 0, false);
-        rewind(input_tgz);
-        rewind(obfuscated_tgz);
-        if(md5_sum(obfuscated_tgz, header.data.recovery_update.md5_sum) < 0)
+        if(sha256 != NULL)
+            kt_sha256_update(sha256, count, buffer);
+        if(fwrite(buffer, sizeof(unsigned char), count, output) < count)
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
+            fprintf(stderr, "Error writing payload: %s.\n", strerror(errno));
+            free(buffer);
             return -1;
         }
-        fclose(obfuscated_tgz);
     }
-    else
+    free(buffer);
+    if(ferror(input) != 0)
     {
-        if(md5_sum(input_tgz, header.data.recovery_update.md5_sum) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of input tgz.\n");
-            return -1;
-        }
-        rewind(input_tgz); // Rewind input
+        fprintf(stderr, "Error reading payload: %s.\n", strerror(errno));
+        return -1;
     }
-    md((unsigned char *)header.data.recovery_update.md5_sum, MD5_HASH_LENGTH); // Obfuscate md5 hash
 
-    // Write header to output
-    if(fwrite(&header, sizeof(unsigned char), MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE, output) < MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE)
+    return 0;
+}
+
+static int kindle_create_signature(UpdateInformation *info, FILE *input_bin, FILE *output)
+{
+    KTBundleHeader header; // Header to write
+
+    kindle_fill_header(info, UpdateSignature, &header);
+    memcpy(header.magic_number, "SP01", MAGIC_NUMBER_LENGTH); // Write magic number
+    // We append the signature ourselves, straight from the stream
+    if(kindle_write_header(&header, output, NULL) < 0)
     {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
         return -1;
     }
-
-    // Write package to output
-    return munger(input_tgz, output, 0, fake_sign);
+    // Write signature to output
+    if(sign_file(input_bin, &info->signer, output) < 0)
+    {
+        fprintf(stderr, "Error signing update package payload.\n");
+        return -1;
+    }
+    return 0;
 }
 
-static int kindle_create_recovery_v2(UpdateInformation *info, FILE *input_tgz, FILE *output, const bool fake_sign)
+// Default options for a given update type, matching what the CLI does before parsing any switches
+int kindle_create_init_options(KTCreateOptions *options, BundleVersion version)
 {
-    size_t header_size;
-    unsigned char *header;
-    size_t hindex = 0;
-    int i;
-    FILE *demunged_tgz;
-    unsigned char recovery_num_devices;
+    memset(options, 0, sizeof(*options));
+    options->info.version = version;
+    options->info.target_revision = UINT64_MAX;
+    options->info.certificate_number = CertificateDeveloper;
+    options->compression_level = DEFAULT_COMPRESSION_LEVEL;
+    switch(version)
+    {
+        case OTAUpdateV2:
+            strncpy(options->info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+            break;
+        case OTAUpdate:
+            strncpy(options->info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+            options->info.target_revision = UINT32_MAX;
+            break;
+        case RecoveryUpdateV2:
+            // FB03 is at header_rev 0, don't force it to 2
+            strncpy(options->info.magic_number, "FB03", MAGIC_NUMBER_LENGTH);
+            break;
+        case RecoveryUpdate:
+            strncpy(options->info.magic_number, "FB02", MAGIC_NUMBER_LENGTH);
+            options->info.target_revision = UINT32_MAX;
+            break;
+        case UpdateSignature:
+            // For reference only, since we only support converting an existing tarball, we don't really care about that...
+            //strncpy(options->info.magic_number, "SP01", MAGIC_NUMBER_LENGTH);
+            break;
+        case UnknownUpdate:
+        default:
+            fprintf(stderr, "Invalid update type (%s).\n", convert_bundle_version(version));
+            return -1;
+    }
+    options->info.sign_pkey = get_default_key();
+    options->output = stdout;
+    kt_settings_get(&options->settings);
+    return 0;
+}
 
-    demunged_tgz = NULL;
+// Frees everything we (or the caller) allocated in options
+void kindle_create_free_options(KTCreateOptions *options)
+{
+    unsigned int ui;
 
-    // Its total size is fixed, but some stuff inside are variable/padded...
-    header_size = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
-    header = malloc(header_size);
-    // Zero init everything first...
-    memset(header, 0, header_size);
+    for(ui = 0; ui < options->input_count; ui++)
+        free(options->input_list[ui]);
+    free(options->input_list);
+    options->input_list = NULL;
+    options->input_count = 0;
+    free(options->info.devices);
+    options->info.devices = NULL;
+    options->info.num_devices = 0;
+    for(ui = 0; ui < options->info.num_meta; ui++)
+        free(options->info.metastrings[ui]);
+    free(options->info.metastrings);
+    options->info.metastrings = NULL;
+    options->info.num_meta = 0;
+    rsa_private_key_clear(&options->info.sign_pkey);
+    free(options->fanout);
+    options->fanout = NULL;
+    options->fanout_count = 0;
+    for(ui = 0; ui < options->key_count; ui++)
+        rsa_private_key_clear(&options->keys[ui].sign_pkey);
+    free(options->keys);
+    options->keys = NULL;
+    options->key_count = 0;
+    for(ui = 0; ui < options->exclude_count; ui++)
+        free(options->excludes[ui]);
+    free(options->excludes);
+    options->excludes = NULL;
+    options->exclude_count = 0;
+}
 
-    strncpy((char *)header, info->magic_number, MAGIC_NUMBER_LENGTH);
-    hindex += MAGIC_NUMBER_LENGTH;
-    hindex += sizeof(uint32_t); // Padding
-    memcpy(&header[hindex], &info->target_revision, sizeof(uint64_t)); // Target
-    hindex += sizeof(uint64_t);
+// Open a package file for writing. When atomic is set (i.e., by --watch), we actually write to a temporary file alongside it (*tmpname),
+// which kindle_create_close_output only swaps in once the package is complete, so that a failed (or half-done) rebuild never clobbers the last good one.
+static FILE *kindle_create_open_output(const char *filename, const bool atomic, char **tmpname)
+{
+    FILE *output;
+    int fd = -1;
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    mode_t mask;
+#endif
 
-    // Even if we asked for a fake package, the Kindle still expects a proper package...
-    // Sum a temp deobfuscated tarball to fake it ;)
-    if(fake_sign)
+    *tmpname = NULL;
+    if(!atomic)
     {
-        if((demunged_tgz = tmpfile()) == NULL)
-        {
-            fprintf(stderr, "Error opening temp file: %s.\n", strerror(errno));
-            free(header);
-            return -1;
-        }
-        demunger(input_tgz, demunged_tgz, 0, false);
-        rewind(input_tgz);
-        rewind(demunged_tgz);
-        if(md5_sum(demunged_tgz, (char *)&header[hindex]) < 0)
-        {
-            fprintf(stderr, "Error calculating MD5 of fake package.\n");
-            free(header);
-            return -1;
-        }
-        fclose(demunged_tgz);
+        if((output = fopen(filename, "wb")) == NULL)
+            fprintf(stderr, "Cannot create output package file '%s': %s.\n", filename, strerror(errno));
+        return output;
     }
-    else
+    if((*tmpname = malloc(strlen(filename) + 7 + 1)) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for output filename.\n");
+        return NULL;
+    }
+    sprintf(*tmpname, "%s.XXXXXX", filename);
+    if((fd = mkstemp(*tmpname)) == -1 || (output = fdopen(fd, "wb")) == NULL)
     {
-        if(md5_sum(input_tgz, (char *)&header[hindex]) < 0) // md5 hash
+        fprintf(stderr, "Cannot create output package file '%s': %s.\n", *tmpname, strerror(errno));
+        if(fd != -1)
         {
-            fprintf(stderr, "Error calculating MD5 of package.\n");
-            free(header);
-            return -1;
+            close(fd);
+            unlink(*tmpname);
         }
-        rewind(input_tgz); // Reset input for later reading
+        free(*tmpname);
+        *tmpname = NULL;
+        return NULL;
     }
+#if !defined(_WIN32) || defined(__CYGWIN__)
+    // mkstemp keeps it private, but it should end up like any other file we create
+    mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+#endif
 
-    md(&header[hindex], MD5_HASH_LENGTH); // Obfuscate md5 hash
-    hindex += MD5_HASH_LENGTH;
-
-    memcpy(&header[hindex], &info->magic_1, sizeof(uint32_t));          // Magic 1
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->magic_2, sizeof(uint32_t));          // Magic 2
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->minor, sizeof(uint32_t));            // Minor
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->platform, sizeof(uint32_t));         // Platform
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->header_rev, sizeof(uint32_t));       // Header rev
-    hindex += sizeof(uint32_t);
-    memcpy(&header[hindex], &info->board, sizeof(uint32_t));            // Board
-    hindex += sizeof(uint32_t);
+    return output;
+}
 
-    hindex += sizeof(uint32_t); // Padding
-    hindex += sizeof(uint16_t); // ... Padding
-    hindex += sizeof(uint8_t);  // And more weird padding
-    recovery_num_devices = (uint8_t)info->num_devices;  // u16 to u8...
-    memcpy(&header[hindex], &recovery_num_devices, sizeof(uint8_t));    // Device count
-    hindex += sizeof(uint8_t);
+// Close a package file opened by kindle_create_open_output, and if it was a temporary one, put it in place if ok is set (or throw it away otherwise).
+// Returns -1 if it was already a failure, or if we couldn't finish writing it.
+static int kindle_create_close_output(FILE *output, const char *filename, char *tmpname, const bool ok)
+{
+    int ret = ok ? 0 : -1;
 
-    for(i = 0; i < info->num_devices; i++)
+    if(fclose(output) != 0 && ret == 0)
     {
-        memcpy(&header[hindex], &info->devices[i], sizeof(uint16_t));   // Device
-        hindex += sizeof(uint16_t);
+        fprintf(stderr, "Cannot write update to '%s': %s.\n", filename, strerror(errno));
+        ret = -1;
     }
-
-    // Now, we write the header to the file
-    if(fwrite(header, sizeof(unsigned char), header_size, output) < header_size)
+    if(tmpname != NULL)
     {
-        fprintf(stderr, "Error writing update header: %s.\n", strerror(errno));
-        free(header);
-        return -1;
+        if(ret == 0)
+        {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+            // rename won't replace an existing file there
+            unlink(filename);
+#endif
+            if(rename(tmpname, filename) != 0)
+            {
+                fprintf(stderr, "Cannot write update to '%s': %s.\n", filename, strerror(errno));
+                ret = -1;
+            }
+        }
+        if(ret != 0)
+            unlink(tmpname);
+        free(tmpname);
     }
 
-    // Write the actual update
-    free(header);
-    return munger(input_tgz, output, 0, fake_sign);
+    return ret;
 }
 
-int kindle_create_main(int argc, char *argv[])
+// The update information of a --fanout package: what we were asked for, except for the update type (and its defaults)
+static int kindle_create_fanout_info(const KTCreateOptions *options, const UpdateInformation *main_info, BundleVersion version, UpdateInformation *info)
 {
-    int opt;
-    int opt_index;
-    static const struct option opts[] =
+    KTCreateOptions defaults;
+
+    if(kindle_create_init_options(&defaults, version) != 0)
+        return -1;
+    *info = options->info;
+    info->version = version;
+    info->sign_pkey = main_info->sign_pkey;
+    info->signer = main_info->signer;
+    // Keep the magic number we were given if it's one of that type's, otherwise use its default
+    if(get_bundle_version(info->magic_number) != version)
+        memcpy(info->magic_number, defaults.info.magic_number, MAGIC_NUMBER_LENGTH);
+    if(!options->target_rev_set)
+        info->target_revision = defaults.info.target_revision;
+    kindle_create_free_options(&defaults);
+    // We're going to mess with the device list, so work on our own copy of it
+    info->devices = NULL;
+    if(info->num_devices > 0)
+    {
+        if((info->devices = malloc(info->num_devices * sizeof(Device))) == NULL)
+            return -1;
+        memcpy(info->devices, options->info.devices, info->num_devices * sizeof(Device));
+    }
+    if(kindle_create_check_info(info, options, version == UpdateSignature, options->enforce_ota && version == OTAUpdateV2) != 0)
+    {
+        free(info->devices);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Build the intermediate tarball for artifact->blocksize (the files themselves are in the cache by now, so it's mostly a matter of compressing them again)
+static int kindle_create_fanout_artifact(const KTCreateOptions *options, UpdateInformation *info, kt_hash_cache *cache, struct ktartifact *artifact)
+{
+    int fd;
+
+    if((artifact->filename = strdup(KT_TMPDIR "/kindletool_create_tarball_XXXXXX")) == NULL || (fd = mkstemp(artifact->filename)) == -1)
+    {
+        fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
+        return -1;
+    }
+    fprintf(stderr, "Building the intermediate archive for %s packages.\n", (artifact->blocksize == RECOVERY_BLOCK_SIZE ? "recovery" : "OTA"));
+    memset(&artifact->tarball, 0, sizeof(artifact->tarball));
+    artifact->tarball.fd = fd;
+    if(kindle_create_package_archive(&artifact->tarball, options->input_list, options->input_count, &info->signer, options->legacy, artifact->blocksize, options->compression_level, cache, options->cache_verify, NULL, options->excludes, options->exclude_count) != 0)
+    {
+        fprintf(stderr, "Failed to create intermediate archive '%s'.\n", artifact->filename);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    kt_hash_cache_report(cache);
+    if((artifact->tgz = fopen(artifact->filename, "rb")) == NULL)
+    {
+        fprintf(stderr, "Cannot read input tarball '%s': %s.\n", artifact->filename, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+// Build our package, and every --fanout one, doing as little as possible more than once:
+// the files are only hashed & signed once (through cache), a tarball is only built & hashed once per block size (the bundle index depends on it),
+// and munged once for all the bundles wrapped around it. Only the headers & envelopes differ.
+static int kindle_create_fanout(const KTCreateOptions *options, UpdateInformation *info, FILE *input_tgz, const struct kttarball *tarball, FILE *output, kt_hash_cache *cache, const unsigned int real_blocksize)
+{
+    struct ktartifact artifacts[2];
+    struct ktartifact *artifact;
+    UpdateInformation fanout_info;
+    UpdateInformation *target = info;
+    FILE *target_output = output;
+    char *target_tmpname = NULL;
+    BundleVersion version;
+    unsigned int blocksize;
+    unsigned int i;
+    int ret = -1;
+
+    memset(artifacts, 0, sizeof(artifacts));
+    // We've already built the tarball for our own package
+    artifacts[0].blocksize = real_blocksize;
+    artifacts[0].tgz = input_tgz;
+    if(tarball != NULL && tarball->hashed)
+    {
+        memcpy(artifacts[0].tarball.md5_hex, tarball->md5_hex, MD5_HASH_LENGTH);
+    }
+    else
+    {
+        // We were handed a tarball, hash it once for everybody
+        if(md5_sum(input_tgz, artifacts[0].tarball.md5_hex) < 0)
+        {
+            fprintf(stderr, "Error calculating MD5 of package.\n");
+            return -1;
+        }
+        rewind(input_tgz);
+    }
+    artifacts[0].tarball.hashed = true;
+
+    // Figure out which tarball each package needs, and how many bundles share it
+    for(i = 0; i <= options->fanout_count; i++)
+    {
+        version = (i == 0) ? info->version : options->fanout[i - 1].version;
+        // A prebuilt tarball is used as-is whatever the update type, and a signed userdata package just reuses ours
+        blocksize = (version == RecoveryUpdate || version == RecoveryUpdateV2) ? RECOVERY_BLOCK_SIZE : BLOCK_SIZE;
+        artifact = (tarball == NULL || version == UpdateSignature || blocksize == real_blocksize) ? &artifacts[0] : &artifacts[1];
+        artifact->blocksize = (artifact == &artifacts[0]) ? real_blocksize : blocksize;
+        if(version != UpdateSignature)
+            artifact->bundles++;
+    }
+
+    for(i = 0; i <= options->fanout_count; i++)
+    {
+        if(i > 0)
+        {
+            if(kindle_create_fanout_info(options, info, options->fanout[i - 1].version, &fanout_info) != 0)
+                goto cleanup;
+            target = &fanout_info;
+            fprintf(stderr, "Building %s (%.*s) package '%s' from the same payload.\n", convert_bundle_version(target->version), MAGIC_NUMBER_LENGTH, (target->version == UpdateSignature ? "SP01" : target->magic_number), options->fanout[i - 1].output_filename);
+            if((target_output = kindle_create_open_output(options->fanout[i - 1].output_filename, options->watch, &target_tmpname)) == NULL)
+            {
+                free(fanout_info.devices);
+                goto cleanup;
+            }
+        }
+        blocksize = (target->version == RecoveryUpdate || target->version == RecoveryUpdateV2) ? RECOVERY_BLOCK_SIZE : BLOCK_SIZE;
+        artifact = (tarball == NULL || target->version == UpdateSignature || blocksize == real_blocksize) ? &artifacts[0] : &artifacts[1];
+        if(artifact->tgz == NULL && kindle_create_fanout_artifact(options, info, cache, artifact) != 0)
+            goto target_error;
+        // Munge it once for every bundle that wraps it
+        if(target->version != UpdateSignature && artifact->bundles > 1 && artifact->tarball.munged == NULL)
+        {
+            rewind(artifact->tgz);
+            if((artifact->tarball.munged = tmpfile()) == NULL || munger(artifact->tgz, artifact->tarball.munged, 0, false) < 0)
+            {
+                fprintf(stderr, "Cannot munge the package payload.\n");
+                goto target_error;
+            }
+        }
+        rewind(artifact->tgz);
+        if(kindle_create_package(target, artifact->tgz, &artifact->tarball, target_output, false) < 0)
+        {
+            fprintf(stderr, "Cannot write update to output.\n");
+            goto target_error;
+        }
+        if(i > 0)
+        {
+            free(fanout_info.devices);
+            if(kindle_create_close_output(target_output, options->fanout[i - 1].output_filename, target_tmpname, true) != 0)
+                goto cleanup;
+        }
+    }
+    ret = 0;
+    goto cleanup;
+
+target_error:
+    if(i > 0)
+    {
+        free(fanout_info.devices);
+        kindle_create_close_output(target_output, options->fanout[i - 1].output_filename, target_tmpname, false);
+    }
+cleanup:
+    for(i = 0; i < 2; i++)
+    {
+        if(artifacts[i].tarball.munged != NULL)
+            fclose(artifacts[i].tarball.munged);
+        // The first one is our caller's
+        if(i > 0 && artifacts[i].tgz != NULL)
+            fclose(artifacts[i].tgz);
+        if(artifacts[i].filename != NULL)
+        {
+            if(!options->keep_archive)
+                unlink(artifacts[i].filename);
+            free(artifacts[i].filename);
+        }
+    }
+
+    return ret;
+}
+
+// Where the package signed with key_filename goes: in a directory named after that key, alongside our main package (so it keeps a name the Kindle will pick up)
+static char *kindle_create_key_output(const char *output_filename, const char *key_filename)
+{
+    const char *output_base;
+    const char *key_base;
+    const char *key_ext;
+    size_t key_len;
+    char *filename;
+
+    output_base = strrchr(output_filename, '/');
+    output_base = (output_base == NULL) ? output_filename : output_base + 1;
+    key_base = strrchr(key_filename, '/');
+    key_base = (key_base == NULL) ? key_filename : key_base + 1;
+    // Without its extension
+    key_ext = strrchr(key_base, '.');
+    key_len = (key_ext == NULL || key_ext == key_base) ? strlen(key_base) : (size_t) (key_ext - key_base);
+    if((filename = malloc((size_t) (output_base - output_filename) + key_len + 1 + strlen(output_base) + 1)) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for output filename.\n");
+        return NULL;
+    }
+    sprintf(filename, "%.*s%.*s/%s", (int) (output_base - output_filename), output_filename, (int) key_len, key_base, output_base);
+
+    return filename;
+}
+
+// Build our package again for every other --key we were given. It's the same files, so we've already hashed them (they're in cache), and only have to sign them again.
+// The payload itself differs (it holds the sigs), except if we were handed a tarball, in which case it's only hashed & munged once for everyone.
+static int kindle_create_other_keys(const KTCreateOptions *options, const UpdateInformation *info, const char *output_filename, FILE *input_tgz, const struct kttarball *tarball, kt_hash_cache *cache, const unsigned int real_blocksize)
+{
+    UpdateInformation key_info;
+    struct kttarball key_tarball;
+    struct kttarball shared_tarball;
+    kt_hash_cache *other_cache = NULL;
+    char *key_output = NULL;
+    char *tarball_filename = NULL;
+    char *sep;
+    FILE *key_tgz = NULL;
+    FILE *output = NULL;
+    char *output_tmpname = NULL;
+    struct stat st;
+    int fd;
+    unsigned int i;
+    int r;
+    int ret = -1;
+
+    memset(&shared_tarball, 0, sizeof(shared_tarball));
+    if(tarball == NULL)
+    {
+        rewind(input_tgz);
+        if(md5_sum(input_tgz, shared_tarball.md5_hex) < 0)
+        {
+            fprintf(stderr, "Error calculating MD5 of package.\n");
+            return -1;
+        }
+        shared_tarball.hashed = true;
+        rewind(input_tgz);
+        if(info->version != UpdateSignature && ((shared_tarball.munged = tmpfile()) == NULL || munger(input_tgz, shared_tarball.munged, 0, false) < 0))
+        {
+            fprintf(stderr, "Cannot munge the package payload.\n");
+            goto cleanup;
+        }
+    }
+
+    for(i = 0; i < options->key_count; i++)
+    {
+        key_info = *info;
+        key_info.sign_pkey = options->keys[i].sign_pkey;
+        key_info.certificate_number = options->keys[i].certificate_number;
+        if(kt_rsa_signer_init(&key_info.signer, &key_info.sign_pkey) != 0)
+        {
+            fprintf(stderr, "Cannot use private key '%s' for signing.\n", options->keys[i].key_filename);
+            goto cleanup;
+        }
+        if((key_output = kindle_create_key_output(output_filename, options->keys[i].key_filename)) == NULL)
+            goto cleanup;
+        // Make room for it
+        sep = strrchr(key_output, '/');
+        *sep = '\0';
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        if(stat(key_output, &st) != 0 && mkdir(key_output) != 0)
+#else
+        if(stat(key_output, &st) != 0 && mkdir(key_output, 0755) != 0)
+#endif
+        {
+            fprintf(stderr, "Cannot create output directory '%s': %s.\n", key_output, strerror(errno));
+            goto cleanup;
+        }
+        *sep = '/';
+        fprintf(stderr, "Building '%s' (signed with '%s', cert %d).\n", key_output, options->keys[i].key_filename, key_info.certificate_number);
+
+        if(tarball != NULL)
+        {
+            // Every file needs a sig from this key, and we'll remember those, too
+            if((other_cache = kt_hash_cache_open(options->cache_dir, &key_info.sign_pkey)) == NULL)
+                goto cleanup;
+            if((tarball_filename = strdup(KT_TMPDIR "/kindletool_create_tarball_XXXXXX")) == NULL || (fd = mkstemp(tarball_filename)) == -1)
+            {
+                fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
+                goto cleanup;
+            }
+            memset(&key_tarball, 0, sizeof(key_tarball));
+            key_tarball.fd = fd;
+            if(kindle_create_package_archive(&key_tarball, options->input_list, options->input_count, &key_info.signer, options->legacy, real_blocksize, options->compression_level, other_cache, options->cache_verify, cache, options->excludes, options->exclude_count) != 0)
+            {
+                fprintf(stderr, "Failed to create intermediate archive '%s'.\n", tarball_filename);
+                close(fd);
+                goto cleanup;
+            }
+            close(fd);
+            kt_hash_cache_report(other_cache);
+            if((key_tgz = fopen(tarball_filename, "rb")) == NULL)
+            {
+                fprintf(stderr, "Cannot read input tarball '%s': %s.\n", tarball_filename, strerror(errno));
+                goto cleanup;
+            }
+        }
+        else
+        {
+            key_tarball = shared_tarball;
+            key_tgz = input_tgz;
+            rewind(key_tgz);
+        }
+
+        if((output = kindle_create_open_output(key_output, options->watch, &output_tmpname)) == NULL)
+            goto cleanup;
+        if(kindle_create_package(&key_info, key_tgz, &key_tarball, output, false) < 0)
+        {
+            fprintf(stderr, "Cannot write update to output.\n");
+            goto cleanup;
+        }
+        r = kindle_create_close_output(output, key_output, output_tmpname, true);
+        output = NULL;
+        output_tmpname = NULL;
+        if(r != 0)
+            goto cleanup;
+
+        // Failing to update the cache only means a slower next run
+        kt_hash_cache_close(other_cache, true);
+        other_cache = NULL;
+        if(key_tgz != input_tgz)
+            fclose(key_tgz);
+        key_tgz = NULL;
+        if(tarball_filename != NULL && !options->keep_archive)
+            unlink(tarball_filename);
+        free(tarball_filename);
+        tarball_filename = NULL;
+        free(key_output);
+        key_output = NULL;
+    }
+    ret = 0;
+
+cleanup:
+    if(output != NULL)
+        kindle_create_close_output(output, key_output, output_tmpname, false);
+    if(key_tgz != NULL && key_tgz != input_tgz)
+        fclose(key_tgz);
+    kt_hash_cache_close(other_cache, false);
+    if(tarball_filename != NULL)
+    {
+        unlink(tarball_filename);
+        free(tarball_filename);
+    }
+    free(key_output);
+    if(shared_tarball.munged != NULL)
+        fclose(shared_tarball.munged);
+
+    return ret;
+}
+
+// Check that info makes sense for its update type, and fix up what we can (f.g., the magic number)
+static int kindle_create_check_info(UpdateInformation *info, const KTCreateOptions *options, const bool userdata_only, const bool enforce_ota)
+{
+    // Signed userdata packages are very peculiar, handle them on their own...
+    if(userdata_only)
+    {
+        // Needs to be a signed package
+        if(info->version != UpdateSignature)
+        {
+            fprintf(stderr, "Invalid update type (%s) for an userdata package.\n", convert_bundle_version(info->version));
+            return -1;
+        }
+    }
+    else
+    {
+        // Did we want to enforce an OTA bundle type?
+        if(enforce_ota)
+        {
+            // Only makes sense for ota2...
+            if(info->version != OTAUpdateV2)
+            {
+                fprintf(stderr, "Invalid update type (%s). Enforcing the versioned OTA bundle type only makes sense for OTA V2.\n", convert_bundle_version(info->version));
+                return -1;
+            }
+            // We of course need the versioned ota bundle type...
+            strncpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+            // But also a source & target version!
+            if( !options->source_rev_set ){
+                info->source_revision = 2443670049;       // FW 5.5.0
+            }
+            if( !options->target_rev_set ){
+                info->target_revision = 1 + 3202090019;   // FW 5.8.10
+            }
+            // NOTE: Don't expece those to be entirely consistent when crossing devices (f.g., the Touch's FW 5.3.7.3 has a higher OTA build number than the KV's FW 5.5.0)
+        }
+        // Musn't be *only* a sig envelope...
+        if(info->version == UpdateSignature)
+        {
+            fprintf(stderr, "Invalid update type (%s) for an update package.\n", convert_bundle_version(info->version));
+            return -1;
+        }
+        // Validation (Allow 0 devices in Recovery V2 & FB02 h2, allow multiple devices in OTA V2 & Recovery V2)
+        if((info->num_devices < 1 && (info->version != RecoveryUpdateV2 && (info->version != RecoveryUpdate || info->header_rev != 2))) || ((info->version != OTAUpdateV2 && info->version != RecoveryUpdateV2) && info->num_devices > 1))
+        {
+            fprintf(stderr, "Invalid number of supported devices (%d) for this update type (%s).\n", info->num_devices, convert_bundle_version(info->version));
+            return -1;
+        }
+        if((info->version != OTAUpdateV2 && info->version != RecoveryUpdateV2) && (info->source_revision > UINT32_MAX || info->target_revision > UINT32_MAX))
+        {
+            fprintf(stderr, "Source/target revision for this update type (%s) cannot exceed %u.\n", convert_bundle_version(info->version), UINT32_MAX);
+            return -1;
+        }
+        // When building an ota update with ota2 only devices, don't try to use non ota v1 bundle versions, reset it @ FC02, or shit happens.
+        if(info->version == OTAUpdate)
+        {
+            // OTA V1 only supports one device, we don't need to loop (fix anything newer than a K3GB)
+            if(info->devices[0] > Kindle3WiFi3GEurope && (strncmp(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH) != 0 && strncmp(info->magic_number, "FD03", MAGIC_NUMBER_LENGTH) != 0))
+            {
+                // FC04 is hardcoded when we set K4 as a device, and FD04 when we ask for a K5 and up, so fix it silently.
+                strncpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+            }
+        }
+        // Same thing with recovery updates
+        if(info->version == RecoveryUpdate)
+        {
+            // It's called FB02.2 for a reason... Plus, we can have a null/none device with it, so we avoid the same blowup as the RecoveryV2 check ;).
+            if((info->header_rev == 2 || info->devices[0] > Kindle3WiFi3GEurope) && (strncmp(info->magic_number, "FB01", MAGIC_NUMBER_LENGTH) != 0 && strncmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) != 0))
+            {
+                strncpy(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH);
+            }
+        }
+        // Same thing with recovery updates v2
+        if(info->version == RecoveryUpdateV2)
+        {
+            // Make sure we have a sane magic number... We either don't yet have one set when not specifying any device, or what's set corresponds to OTA update types when specifying anything since the K4...
+            if(strncmp(info->magic_number, "FB03", MAGIC_NUMBER_LENGTH) != 0)
+            {
+                // NOTE: This effectively prevents us from setting a custom magic number. Which is not really something you'd want to do in this case anyway...
+                strncpy(info->magic_number, "FB03", MAGIC_NUMBER_LENGTH);
+            }
+        }
+        // We need a platform id, board id (& header rev?) for recovery2
+        if(info->version == RecoveryUpdateV2)
+        {
+            if(strcmp(convert_platform_id(info->platform), "Unknown") == 0)
+            {
+                fprintf(stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info->version));
+                return -1;
+            }
+            if(strcmp(convert_board_id(info->board), "Unknown") == 0)
+            {
+                fprintf(stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info->version));
+                return -1;
+            }
+            // Don't bother for header rev? We don't for other potentially optional flags in recovery, so...
+        }
+        // We need a platform id & board id for recovery FB02 V2
+        if(info->version == RecoveryUpdate)
+        {
+            if(strncmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2 && strcmp(convert_platform_id(info->platform), "Unknown") == 0)
+            {
+                fprintf(stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info->version));
+                return -1;
+            }
+            if(strncmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2 && strcmp(convert_board_id(info->board), "Unknown") == 0)
+            {
+                fprintf(stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info->version));
+                return -1;
+            }
+        }
+        // Right now, we don't use device at all for FB02.2, so reset it to none to have a consistent recap... FIXME?
+        if(info->version == RecoveryUpdate)
+        {
+            if(strncmp(info->magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info->header_rev == 2 && info->num_devices > 0)
+            {
+                info->num_devices = 0;
+                info->devices[info->num_devices] = KindleUnknown;
+            }
+        }
+        // We of course need a full magic number... As magic_number is not NULL terminated, we cannot use strlen, so let one of our helper functions do the job...
+        if(get_bundle_version(info->magic_number) == UnknownUpdate)
+        {
+            fprintf(stderr, "You need to set a valid bundle version for this update type (%s), '%s' is invalid.\n", convert_bundle_version(info->version), info->magic_number);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Check that our output name follows the proper naming scheme for that kind of package (data.stgz for userdata packages)
+static int kindle_create_check_output_name(const char *output_filename, const BundleVersion version, const bool userdata)
+{
+    char *valid_update_file_pattern = NULL;
+    struct archive_entry *entry;
+    struct archive *match;
+    int r;
+
+    // Use libarchive's pattern matching, because it handles ./ in a smart way
+    match = archive_match_new();
+    entry = archive_entry_new();
+
+    // Handle signed & fake userdata packages...
+    if(userdata)
+    {
+        valid_update_file_pattern = strdup("./data\\.stgz$");
+    }
+    else
+    {
+        // Recovery updates must be lowercase!
+        if(version == RecoveryUpdate || version == RecoveryUpdateV2)
+        {
+            valid_update_file_pattern = strdup("./update*\\.bin$");
+        }
+        else
+        {
+            valid_update_file_pattern = strdup("./[Uu]pdate*\\.bin$");
+        }
+    }
+    if(archive_match_exclude_pattern(match, valid_update_file_pattern) != ARCHIVE_OK)
+        fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(match));
+    free(valid_update_file_pattern);
+
+    archive_entry_copy_pathname(entry, output_filename);
+
+    r = archive_match_path_excluded(match, entry);
+    if(r != 1)
+    {
+        if(r < 0)
+        {
+            fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(match));
+        }
+        fprintf(stderr, "Your output file '%s' needs to follow the proper naming scheme (%s) in order to be picked up by the Kindle.\n", output_filename, userdata ? "data.stgz" : "update*.bin");
+        archive_entry_free(entry);
+        archive_match_free(match);
+        return -1;
+    }
+
+    // Cleanup
+    archive_entry_free(entry);
+    archive_match_free(match);
+
+    return 0;
+}
+
+// Build a package according to options. Doesn't touch options at all, so it's safe to run several of these at once, as long as they each have their own.
+int kindle_create(const KTCreateOptions *options)
+{
+    UpdateInformation info = options->info;
+    KTSettings saved_settings;
+    FILE *input = NULL;
+    FILE *output = options->output;
+    int i;
+    char *output_filename = NULL;
+    char *output_tmpname = NULL;
+    char **input_list = options->input_list;
+    unsigned int input_index = options->input_count;
+    char *tarball_filename = NULL;
+    int tarball_fd = -1;
+    struct kttarball tarball;
+    kt_hash_cache *cache = NULL;
+    bool keep_archive = options->keep_archive;
+    bool skip_archive = false;
+    bool fake_sign = options->fake_sign;
+    bool userdata_only = options->userdata_only;
+    bool enforce_ota = options->enforce_ota;
+    bool legacy = options->legacy;
+    unsigned int real_blocksize;
+    UpdateInformation fanout_info;
+    int j;
+
+    // We're going to mess with the device list, so work on our own copy of it
+    info.devices = NULL;
+    if(options->info.num_devices > 0)
+    {
+        info.devices = malloc(options->info.num_devices * sizeof(Device));
+        memcpy(info.devices, options->info.devices, options->info.num_devices * sizeof(Device));
+    }
+    if(options->output_filename != NULL)
+        output_filename = strdup(options->output_filename);
+
+    // Switch this thread over to our own settings for the duration of the job
+    kt_settings_get(&saved_settings);
+    kt_settings_set(&options->settings);
+
+    // Recovery updates use a different block size
+    if(info.version == RecoveryUpdate || info.version == RecoveryUpdateV2)
+        real_blocksize = RECOVERY_BLOCK_SIZE;
+    else
+        real_blocksize = BLOCK_SIZE;
+
+    if(kindle_create_check_info(&info, options, userdata_only, enforce_ota) != 0)
+        goto do_error;
+    // Every --fanout package is built around the payload of a regular signed update package, so check that those make sense, too, before we start working
+    if(options->fanout_count > 0 && (fake_sign || userdata_only))
+    {
+        fprintf(stderr, "Building other packages from the same payload is only supported for signed update packages.\n");
+        goto do_error;
+    }
+    for(i = 0; i < (int) options->fanout_count; i++)
+    {
+        if(kindle_create_fanout_info(options, &info, options->fanout[i].version, &fanout_info) != 0)
+            goto do_error;
+        free(fanout_info.devices);
+        if(kindle_create_check_output_name(options->fanout[i].output_filename, options->fanout[i].version, options->fanout[i].version == UpdateSignature) != 0)
+            goto do_error;
+    }
+    // Same thing for the packages signed with our other keys
+    if(options->key_count > 0 && (fake_sign || options->fanout_count > 0 || output_filename == NULL))
+    {
+        fprintf(stderr, "Signing with several keys is only supported for signed packages written to a file, without --fanout.\n");
+        goto do_error;
+    }
+    for(i = 1; i < (int) options->key_count; i++)
+    {
+        // Keys with the same name would overwrite each other's package
+        for(j = 0; j < i; j++)
+        {
+            char *a = kindle_create_key_output(output_filename, options->keys[i].key_filename);
+            char *b = kindle_create_key_output(output_filename, options->keys[j].key_filename);
+            bool same = (a == NULL || b == NULL || strcmp(a, b) == 0);
+
+            if(same)
+                fprintf(stderr, "Keys '%s' & '%s' would both be used to build '%s'.\n", options->keys[j].key_filename, options->keys[i].key_filename, (a != NULL ? a : "?"));
+            free(a);
+            free(b);
+            if(same)
+                goto do_error;
+        }
+    }
+
+    // If we don't actually build an archive, legacy mode makes no sense
+    if(skip_archive)
+    {
+        legacy = false;
+    }
+
+    if(input_index == 0)
+    {
+        fprintf(stderr, "No input/output specified.\n");
+        goto do_error;
+    }
+
+    // While we're at it, check that our output name follows the proper naming scheme when creating a valid update package
+    if(output_filename != NULL)
+    {
+        if(kindle_create_check_output_name(output_filename, info.version, fake_sign || userdata_only) != 0)
+            goto do_error;
+
+        // Check to see if we can write to our output file (do it now instead of earlier, this way the pattern matching has been done, and we potentially avoid fopen squishing a file we meant as input, not output)
+        if((output = kindle_create_open_output(output_filename, options->watch, &output_tmpname)) == NULL)
+            goto do_error;
+    }
+    else
+    {
+        if(output == NULL)
+        {
+            fprintf(stderr, "No output specified.\n");
+            goto do_error;
+        }
+        // If we're really outputting to stdout, fix the output filename
+        output_filename = strdup(output == stdout ? "standard output" : "output stream");
+    }
+
+    // If we only provided a single input file, and it's a tarball, assume it's properly packaged, and just sign/munge it. (Restore backwards compatibilty with ixtab's tools, among other things)
+    if(input_index == 1)
+    {
+        if(IS_TGZ(input_list[0]) || IS_TARBALL(input_list[0]))
+        {
+            // NOTE: There's no real check besides the file extension...
+            skip_archive = true;
+            // Use it as our tarball...
+            tarball_filename = strdup(input_list[0]);
+        }
+    }
+
+    // Don't try to build an unsigned package if we didn't feed a single proper tarball
+    if(fake_sign && !skip_archive)
+    {
+        fprintf(stderr, "You need to feed me a single tarball to build an unsigned package.\n");
+        goto do_error;
+    }
+
+    // Same thing when building a signed userdata package
+    if(userdata_only && !skip_archive)
+    {
+        fprintf(stderr, "You need to feed me a single tarball to build a signed userdata package.\n");
+        goto do_error;
+    }
+
+    // If we need to build a tarball, do it in a tempfile
+    if(!skip_archive)
+    {
+        // We need a proper mkstemp template
+        tarball_filename = strdup(KT_TMPDIR "/kindletool_create_tarball_XXXXXX");
+        tarball_fd = mkstemp(tarball_filename);
+        if(tarball_fd == -1)
+        {
+            fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
+            goto do_error;
+        }
+    }
+
+    // Recap (to stderr, in order not to mess stuff up if we output to stdout) what we're building
+    // Again, a signed userdata package is the ugly duckling...
+    if(userdata_only)
+    {
+        fprintf(stderr, "Building userdata package '%s' directly from '%s' (signed with cert %d).\n", output_filename, tarball_filename, info.certificate_number);
+    }
+    else
+    {
+        fprintf(stderr, "Building %s%s%s (%.*s) update package '%s'%s%s%s%s for", (legacy ? "(in legacy mode) " : ""), (fake_sign ? "fake " : ""), (convert_bundle_version(info.version)), MAGIC_NUMBER_LENGTH, info.magic_number, output_filename, (skip_archive ? " directly from " : ""), (skip_archive ? "'" : ""), (skip_archive ? tarball_filename : ""), (skip_archive ? "'" : ""));
+        // If we have specific device IDs, list them
+        if(info.num_devices > 0)
+        {
+            fprintf(stderr, " %hd device%s (",  info.num_devices, (info.num_devices > 1 ? "s" : ""));
+            // Loop over devices
+            for(i = 0; i < info.num_devices; i++)
+            {
+                fprintf(stderr, "%s", convert_device_id(info.devices[i]));
+                if(i != info.num_devices - 1)
+                    fprintf(stderr, ", ");
+            }
+            fprintf(stderr, "),");
+        }
+        else
+        {
+            fprintf(stderr, " no specific device,");
+        }
+        // Don't print settings not applicable to our update type...
+        switch(info.version)
+        {
+            case OTAUpdateV2:
+                if(info.target_revision == UINT64_MAX)
+                    fprintf(stderr, " Min. OTA: %llu, Target OTA: MAX, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
+                else
+                    fprintf(stderr, " Min. OTA: %llu, Target OTA: %llu, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, (long long) info.target_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
+                // Loop over meta
+                for(i = 0; i < info.num_meta; i++)
+                {
+                    fprintf(stderr, "%s", info.metastrings[i]);
+                    if(i != info.num_meta - 1)
+                        fprintf(stderr, "; ");
+                    else
+                        fprintf(stderr, ").\n");
+                }
+                break;
+            case OTAUpdate:
+                if(info.target_revision == UINT32_MAX)
+                    fprintf(stderr, " Min. OTA: %llu, Target OTA: MAX, Optional: %hhu.\n", (long long) info.source_revision, info.optional);
+                else
+                    fprintf(stderr, " Min. OTA: %llu, Target OTA: %llu, Optional: %hhu.\n", (long long) info.source_revision, (long long) info.target_revision, info.optional);
+                break;
+            case RecoveryUpdate:
+                fprintf(stderr, " Minor: %d, Magic 1: %d, Magic 2: %d", info.minor, info.magic_1, info.magic_2);
+                if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev > 0)
+                    fprintf(stderr, ", Header Rev: %llu, Platform: %s, Board: %s.\n", (long long) info.header_rev, convert_platform_id(info.platform), convert_board_id(info.board));
+                else
+                    fprintf(stderr, ".\n");
+                break;
+            case RecoveryUpdateV2:
+                if(info.target_revision == UINT64_MAX)
+                    fprintf(stderr, " Target OTA: MAX");
+                else
+                    fprintf(stderr, " Target OTA: %llu", (long long) info.target_revision);
+                fprintf(stderr, ", Minor: %d, Magic 1: %d, Magic 2: %d, Header Rev: %llu, Cert: %d, Platform: %s, Board: %s.\n", info.minor, info.magic_1, info.magic_2, (long long) info.header_rev, info.certificate_number, convert_platform_id(info.platform), convert_board_id(info.board));
+                break;
+            case UnknownUpdate:
+            default:
+                fprintf(stderr, "\n\n!!!!\nUnknown update type, we shouldn't ever hit this!\n!!!!\n");
+                break;
+        }
+    }
+
+    // Do the expensive part of the key setup once, we'll be reusing it for every signature in this package (unless we don't sign anything)
+    if(!fake_sign && kt_rsa_signer_init(&info.signer, &info.sign_pkey) != 0)
+    {
+        fprintf(stderr, "Cannot use private key for signing.\n");
+        if(!skip_archive)
+        {
+            close(tarball_fd);
+            unlink(tarball_filename);
+        }
+        goto do_error;
+    }
+
+    // Create our package archive, sigfile & bundlefile included
+    if(!skip_archive)
+    {
+        memset(&tarball, 0, sizeof(tarball));
+        tarball.fd = tarball_fd;
+        // Reuse the hashes & sigs of the files we've already signed with this key, if we were asked to keep track of them
+        if(options->cache != NULL)
+            cache = options->cache;
+        else if(options->cache_dir != NULL && (cache = kt_hash_cache_open(options->cache_dir, &info.sign_pkey)) == NULL)
+        {
+            close(tarball_fd);
+            unlink(tarball_filename);
+            goto do_error;
+        }
+        // The --fanout packages that need a tarball of their own & the packages for our other keys will need them again
+        else if(cache == NULL && (options->fanout_count > 0 || options->key_count > 0) && (cache = kt_hash_cache_open(NULL, &info.sign_pkey)) == NULL)
+        {
+            close(tarball_fd);
+            unlink(tarball_filename);
+            goto do_error;
+        }
+        if(kindle_create_package_archive(&tarball, input_list, input_index, &info.signer, legacy, real_blocksize, options->compression_level, cache, options->cache_verify, NULL, options->excludes, options->exclude_count) != 0)
+        {
+            fprintf(stderr, "Failed to create intermediate archive '%s'.\n", tarball_filename);
+            // Delete the borked files
+            close(tarball_fd);
+            unlink(tarball_filename);
+            goto do_error;
+        }
+        // We opened it, we need to close it ;)
+        close(tarball_fd);
+        kt_hash_cache_report(cache);
+    }
+
+    // And finally, build our package :)
+    if((input = fopen(tarball_filename, "rb")) == NULL)
+    {
+        fprintf(stderr, "Cannot read input tarball '%s': %s.\n", tarball_filename, strerror(errno));
+        goto do_error;
+    }
+    if(options->fanout_count > 0)
+    {
+        if(kindle_create_fanout(options, &info, input, (skip_archive ? NULL : &tarball), output, cache, real_blocksize) < 0)
+            goto do_error;
+    }
+    else if(kindle_create_package(&info, input, (skip_archive ? NULL : &tarball), output, fake_sign) < 0)
+    {
+        fprintf(stderr, "Cannot write update to output.\n");
+        goto do_error;
+    }
+    if(options->key_count > 0 && kindle_create_other_keys(options, &info, output_filename, input, (skip_archive ? NULL : &tarball), cache, real_blocksize) < 0)
+        goto do_error;
+    // We're done, put our package in place (if it isn't there already)
+    if(output != options->output)
+    {
+        if(kindle_create_close_output(output, output_filename, output_tmpname, true) != 0)
+        {
+            output = NULL;
+            goto do_error;
+        }
+        output = NULL;
+    }
+
+    // Cleanup
+    // Failing to update the cache only means a slower next run
+    if(cache != options->cache)
+        kt_hash_cache_close(cache, true);
+    free(info.devices);
+    fclose(input);
+    free(output_filename);
+    // Remove tarball, unless we asked to keep it, or we used an existent tarball as sole input
+    if(!keep_archive && !skip_archive)
+        unlink(tarball_filename);
+    free(tarball_filename);
+    kt_release_pool();
+    kt_settings_set(&saved_settings);
+
+    return 0;
+
+do_error:
+    if(cache != options->cache)
+        kt_hash_cache_close(cache, false);
+    if(output != NULL && output != options->output)
+        kindle_create_close_output(output, output_filename, output_tmpname, false);
+    free(output_filename);
+    free(info.devices);
+    if(input != NULL)
+        fclose(input);
+    free(tarball_filename);
+    kt_release_pool();
+    kt_settings_set(&saved_settings);
+    return -1;
+}
+
+// Update type, as passed on the commandline
+static BundleVersion kindle_create_parse_type(const char *type)
+{
+    if(strncmp(type, "ota2", 4) == 0)
+        return OTAUpdateV2;
+    else if(strncmp(type, "ota", 3) == 0)
+        return OTAUpdate;
+    else if(strncmp(type, "recovery2", 9) == 0)
+        return RecoveryUpdateV2;
+    else if(strncmp(type, "recovery", 8) == 0)
+        return RecoveryUpdate;
+    else if(strncmp(type, "sig", 3) == 0)
+        return UpdateSignature;
+    else
+        return UnknownUpdate;
+}
+
+// Add a copy of pattern to our exclude list
+static int kindle_create_add_exclude(const char *pattern, KTCreateOptions *options)
+{
+    char **excludes;
+    char *copy;
+
+    if((copy = strdup(pattern)) == NULL || (excludes = realloc(options->excludes, (options->exclude_count + 1) * sizeof(char *))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for exclude pattern '%s'.\n", pattern);
+        free(copy);
+        return -1;
+    }
+    options->excludes = excludes;
+    options->excludes[options->exclude_count++] = copy;
+
+    return 0;
+}
+
+// Add every line of filename (one pattern per line, like tar's --exclude-from) to our exclude list
+static int kindle_create_read_excludes(const char *filename, KTCreateOptions *options)
+{
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t len;
+
+    if((file = fopen(filename, "rb")) == NULL)
+    {
+        fprintf(stderr, "Cannot open exclude list '%s': %s.\n", filename, strerror(errno));
+        return -1;
+    }
+    while((len = kt_getline(&line, &line_size, file)) > 0)
+    {
+        // Handle both LF & CRLF line endings
+        while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if(len == 0)
+            continue;
+        if(kindle_create_add_exclude(line, options) != 0)
+        {
+            free(line);
+            fclose(file);
+            return -1;
+        }
+    }
+    free(line);
+    fclose(file);
+
+    return 0;
+}
+
+// The index-th signing key (counting the main one as 0), allocated on demand, since a --cert may come before its --key
+static KTSigningKey *kindle_create_key_slot(KTCreateOptions *options, unsigned int index)
+{
+    KTSigningKey *keys;
+
+    while(options->key_count < index)
+    {
+        if((keys = realloc(options->keys, (options->key_count + 1) * sizeof(*keys))) == NULL)
+        {
+            fprintf(stderr, "Cannot allocate memory for signing keys.\n");
+            return NULL;
+        }
+        options->keys = keys;
+        memset(&options->keys[options->key_count], 0, sizeof(*keys));
+        rsa_private_key_init(&options->keys[options->key_count].sign_pkey);
+        options->keys[options->key_count].certificate_number = CertificateDeveloper;
+        options->key_count++;
+    }
+
+    return &options->keys[index - 1];
+}
+
+// Parse a create command line (starting at the command itself) into options, which are freed on failure.
+// NOTE: Relies on getopt, so this one is *not* reentrant (unlike kindle_create)!
+int kindle_create_parse_options(int argc, char *argv[], KTCreateOptions *options)
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
     {
         { "device", required_argument, NULL, 'd' },
         { "key", required_argument, NULL, 'k' },
@@ -1310,30 +2988,25 @@ int kindle_create_main(int argc, char *argv[])
         { "userdata", no_argument, NULL, 'U' },
         { "ota", no_argument, NULL, 'O' },
         { "legacy", no_argument, NULL, 'C' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "compression-level", required_argument, NULL, 'z' },
+        { "cache-dir", required_argument, NULL, 'D' },
+        { "cache-verify", no_argument, NULL, 'P' },
+        { "watch", no_argument, NULL, 'W' },
+        { "fanout", required_argument, NULL, 'F' },
+        { "exclude", required_argument, NULL, 'e' },
+        { "exclude-from", required_argument, NULL, 'E' },
         { NULL, 0, NULL, 0 }
     };
-    UpdateInformation info = {"\0\0\0\0", UnknownUpdate, get_default_key(), 0, UINT64_MAX, 0, 0, 0, 0, NULL, 0, 0, 0, CertificateDeveloper, 0, 0, 0, NULL };
-    FILE *input = NULL;
-    FILE *output = stdout;
-    int i;
-    char sourceRevFlag=0, targetRevFlag=0;
-    unsigned int ui;
-    char *output_filename = NULL;
-    char **input_list = NULL;
-    unsigned int input_index = 0;
-    char *tarball_filename = NULL;
-    char *valid_update_file_pattern = NULL;
-    int tarball_fd = -1;
-    bool keep_archive = false;
-    bool skip_archive = false;
-    bool fake_sign = false;
-    bool userdata_only = false;
-    bool enforce_ota = false;
-    bool legacy = false;
-    unsigned int real_blocksize;
-    struct archive_entry *entry;
-    struct archive *match;
-    int r;
+    UpdateInformation *info = &options->info;
+    BundleVersion version;
+    char *sep;
+    char *type;
+    KTSigningKey *key;
+    unsigned int key_count = 0;
+    unsigned int cert_count = 0;
 
     // Skip command
     argv++;
@@ -1345,48 +3018,16 @@ int kindle_create_main(int argc, char *argv[])
         fprintf(stderr, "Not enough arguments.\n");
         return -1;
     }
-    if(strncmp(argv[0], "ota2", 4) == 0)
-    {
-        info.version = OTAUpdateV2;
-        strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-        real_blocksize = BLOCK_SIZE;
-    }
-    else if(strncmp(argv[0], "ota", 3) == 0)
-    {
-        info.version = OTAUpdate;
-        strncpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-        info.target_revision = UINT32_MAX;
-        real_blocksize = BLOCK_SIZE;
-    }
-    else if(strncmp(argv[0], "recovery2", 9) == 0)
-    {
-        info.version = RecoveryUpdateV2;
-        strncpy(info.magic_number, "FB03", MAGIC_NUMBER_LENGTH);
-        real_blocksize = RECOVERY_BLOCK_SIZE;
-        // FB03 is at header_rev 0, don't force it to 2
-    }
-    else if(strncmp(argv[0], "recovery", 8) == 0)
-    {
-        info.version = RecoveryUpdate;
-        strncpy(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH);
-        info.target_revision = UINT32_MAX;
-        real_blocksize = RECOVERY_BLOCK_SIZE;
-    }
-    else if(strncmp(argv[0], "sig", 3) == 0)
-    {
-        info.version = UpdateSignature;
-        // For reference only, since we only support converting an existing tarball, we don't really care about that...
-        //strncpy(info.magic_number, "SP01", MAGIC_NUMBER_LENGTH);
-        real_blocksize = BLOCK_SIZE;
-    }
-    else
+    if((version = kindle_create_parse_type(argv[0])) == UnknownUpdate)
     {
         fprintf(stderr, "'%s' is not a valid update type.\n", argv[0]);
-        goto do_error;
+        return -1;
     }
+    if(kindle_create_init_options(options, version) != 0)
+        return -1;
 
     // Arguments
-    while((opt = getopt_long(argc, argv, "d:k:b:s:t:1:2:m:p:B:h:c:o:r:x:auUOC", opts, &opt_index)) != -1)
+    while((opt = getopt_long(argc, argv, "d:k:b:s:t:1:2:m:p:B:h:c:o:r:x:auUOCS:T:j:z:D:PWF:e:E:", opts, &opt_index)) != -1)
     {
         switch(opt)
         {
@@ -1394,528 +3035,528 @@ int kindle_create_main(int argc, char *argv[])
                 // The aliases handle their memory allocation on their own, in one shot.
                 if(strcmp(optarg, "kindle4") == 0)
                 {
-                    strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 2;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle4NonTouch;
-                    info.devices[info.num_devices++] = Kindle4NonTouchBlack;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = Kindle4NonTouch;
+                    info->devices[info->num_devices++] = Kindle4NonTouchBlack;
                 }
                 else if(strcmp(optarg, "touch") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 3 + kt_with_unknown_devcodes;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle5TouchWiFi;
-                    info.devices[info.num_devices++] = Kindle5TouchWiFi3G;
-                    info.devices[info.num_devices++] = Kindle5TouchWiFi3GEurope;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = Kindle5TouchWiFi;
+                    info->devices[info->num_devices++] = Kindle5TouchWiFi3G;
+                    info->devices[info->num_devices++] = Kindle5TouchWiFi3GEurope;
                     if(kt_with_unknown_devcodes)
-                        info.devices[info.num_devices++] = Kindle5TouchUnknown;
+                        info->devices[info->num_devices++] = Kindle5TouchUnknown;
                 }
                 else if(strcmp(optarg, "paperwhite") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 6;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GBrazil;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3G;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GBrazil;
                 }
                 else if(strcmp(optarg, "paperwhite2") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 12 + (kt_with_unknown_devcodes * 2);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFiJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GRussia;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi4GBInternational;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GB;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBBrazil;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFiJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GRussia;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi4GBInternational;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GBEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GB;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GBCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GBBrazil;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF4;
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF9;
+                        info->devices[info->num_devices++] = KindlePaperWhite2Unknown_0xF4;
+                        info->devices[info->num_devices++] = KindlePaperWhite2Unknown_0xF9;
                     }
                 }
                 else if(strcmp(optarg, "basic") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 2;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleBasic;
-                    info.devices[info.num_devices++] = KindleBasicKiwi;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindleBasic;
+                    info->devices[info->num_devices++] = KindleBasicKiwi;
                 }
                 else if(strcmp(optarg, "voyage") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 5 + (kt_with_unknown_devcodes * 1);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleVoyageWiFi;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3G;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3GEurope;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3GJapan;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3GMexico;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindleVoyageWiFi;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3G;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3GEurope;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3GJapan;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3GMexico;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x4F;
+                        info->devices[info->num_devices++] = KindleVoyageUnknown_0x4F;
                     }
                 }
                 else if(strcmp(optarg, "paperwhite3") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 8 + (kt_with_unknown_devcodes * 4);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GMexico;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GJapan;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3G;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GMexico;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WhiteWiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WhiteWiFi3GJapan;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KD;
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KE;
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KF;
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KG;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KD;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KE;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KF;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KG;
                     }
                 }
                 else if(strcmp(optarg, "oasis") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 3 + (kt_with_unknown_devcodes * 3);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleOasisWiFi;
-                    info.devices[info.num_devices++] = KindleOasisWiFi3G;
-                    info.devices[info.num_devices++] = KindleOasisWiFi3GEurope;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindleOasisWiFi;
+                    info->devices[info->num_devices++] = KindleOasisWiFi3G;
+                    info->devices[info->num_devices++] = KindleOasisWiFi3GEurope;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindleOasisUnknown_0GR;
-                        info.devices[info.num_devices++] = KindleOasisUnknown_0GS;
-                        info.devices[info.num_devices++] = KindleOasisUnknown_0GT;
+                        info->devices[info->num_devices++] = KindleOasisUnknown_0GR;
+                        info->devices[info->num_devices++] = KindleOasisUnknown_0GS;
+                        info->devices[info->num_devices++] = KindleOasisUnknown_0GT;
                     }
                 }
                 else if(strcmp(optarg, "basic2") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 2 + (kt_with_unknown_devcodes * 1);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleBasic2;
-                    info.devices[info.num_devices++] = KindleBasic2White;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindleBasic2;
+                    info->devices[info->num_devices++] = KindleBasic2White;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindleBasic2Unknown_0DU;
+                        info->devices[info->num_devices++] = KindleBasic2Unknown_0DU;
                     }
                 }
                 else if(strcmp(optarg, "kindle5") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 3 + kt_with_unknown_devcodes + 6 + 12 + (kt_with_unknown_devcodes * 2) + 2 + 5 + (kt_with_unknown_devcodes * 1) + 8 + (kt_with_unknown_devcodes * 4) + 3 + (kt_with_unknown_devcodes * 3) + 2 + (kt_with_unknown_devcodes * 1);
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
                     // K5
-                    info.devices[info.num_devices++] = Kindle5TouchWiFi;
-                    info.devices[info.num_devices++] = Kindle5TouchWiFi3G;
-                    info.devices[info.num_devices++] = Kindle5TouchWiFi3GEurope;
+                    info->devices[info->num_devices++] = Kindle5TouchWiFi;
+                    info->devices[info->num_devices++] = Kindle5TouchWiFi3G;
+                    info->devices[info->num_devices++] = Kindle5TouchWiFi3GEurope;
                     if(kt_with_unknown_devcodes)
-                        info.devices[info.num_devices++] = Kindle5TouchUnknown;
+                        info->devices[info->num_devices++] = Kindle5TouchUnknown;
                     // PW1
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhiteWiFi3GBrazil;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3G;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhiteWiFi3GBrazil;
                     // PW2
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFiJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GRussia;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi4GBInternational;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GB;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite2WiFi3G4GBBrazil;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFiJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GRussia;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi4GBInternational;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GBEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GB;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GBCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhite2WiFi3G4GBBrazil;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF4;
-                        info.devices[info.num_devices++] = KindlePaperWhite2Unknown_0xF9;
+                        info->devices[info->num_devices++] = KindlePaperWhite2Unknown_0xF4;
+                        info->devices[info->num_devices++] = KindlePaperWhite2Unknown_0xF9;
                     }
                     // KT2
-                    info.devices[info.num_devices++] = KindleBasic;
-                    info.devices[info.num_devices++] = KindleBasicKiwi;
+                    info->devices[info->num_devices++] = KindleBasic;
+                    info->devices[info->num_devices++] = KindleBasicKiwi;
                     // KV
-                    info.devices[info.num_devices++] = KindleVoyageWiFi;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3G;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3GEurope;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3GJapan;
-                    info.devices[info.num_devices++] = KindleVoyageWiFi3GMexico;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3G;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3GEurope;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3GJapan;
+                    info->devices[info->num_devices++] = KindleVoyageWiFi3GMexico;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindleVoyageUnknown_0x4F;
+                        info->devices[info->num_devices++] = KindleVoyageUnknown_0x4F;
                     }
                     // Black PW3
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GJapan;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GCanada;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3G;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GEurope;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WiFi3GMexico;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GCanada;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3G;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GEurope;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WiFi3GMexico;
                     // White PW3
-                    info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi;
-                    info.devices[info.num_devices++] = KindlePaperWhite3WhiteWiFi3GJapan;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WhiteWiFi;
+                    info->devices[info->num_devices++] = KindlePaperWhite3WhiteWiFi3GJapan;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KD;
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KE;
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KF;
-                        info.devices[info.num_devices++] = KindlePW3WhiteUnknown_0KG;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KD;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KE;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KF;
+                        info->devices[info->num_devices++] = KindlePW3WhiteUnknown_0KG;
                     }
                     // Oasis
-                    info.devices[info.num_devices++] = KindleOasisWiFi;
-                    info.devices[info.num_devices++] = KindleOasisWiFi3G;
-                    info.devices[info.num_devices++] = KindleOasisWiFi3GEurope;
+                    info->devices[info->num_devices++] = KindleOasisWiFi;
+                    info->devices[info->num_devices++] = KindleOasisWiFi3G;
+                    info->devices[info->num_devices++] = KindleOasisWiFi3GEurope;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindleOasisUnknown_0GR;
-                        info.devices[info.num_devices++] = KindleOasisUnknown_0GS;
-                        info.devices[info.num_devices++] = KindleOasisUnknown_0GT;
+                        info->devices[info->num_devices++] = KindleOasisUnknown_0GR;
+                        info->devices[info->num_devices++] = KindleOasisUnknown_0GS;
+                        info->devices[info->num_devices++] = KindleOasisUnknown_0GT;
                     }
                     // KT3
-                    info.devices[info.num_devices++] = KindleBasic2;
-                    info.devices[info.num_devices++] = KindleBasic2White;
+                    info->devices[info->num_devices++] = KindleBasic2;
+                    info->devices[info->num_devices++] = KindleBasic2White;
                     if(kt_with_unknown_devcodes)
                     {
-                        info.devices[info.num_devices++] = KindleBasic2Unknown_0DU;
+                        info->devices[info->num_devices++] = KindleBasic2Unknown_0DU;
                     }
                 }
                 else if(kt_with_unknown_devcodes && (strcmp(optarg, "unknown") == 0 || strcmp(optarg, "datamined") == 0))
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);      // Meh?
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);      // Meh?
                     unsigned int num_aliased_devices = 7;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x16;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x21;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x07;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x0B;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x0C;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x0D;
-                    info.devices[info.num_devices++] = ValidKindleUnknown_0x99;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x16;
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x21;
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x07;
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x0B;
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x0C;
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x0D;
+                    info->devices[info->num_devices++] = ValidKindleUnknown_0x99;
                 }
                 else if(strcmp(optarg, "kindle2") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 2;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle2US;
-                    info.devices[info.num_devices++] = Kindle2International;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = Kindle2US;
+                    info->devices[info->num_devices++] = Kindle2International;
                 }
                 else if(strcmp(optarg, "kindledx") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 3;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = KindleDXUS;
-                    info.devices[info.num_devices++] = KindleDXInternational;
-                    info.devices[info.num_devices++] = KindleDXGraphite;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = KindleDXUS;
+                    info->devices[info->num_devices++] = KindleDXInternational;
+                    info->devices[info->num_devices++] = KindleDXGraphite;
                 }
                 else if(strcmp(optarg, "kindle3") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 3;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle3WiFi;
-                    info.devices[info.num_devices++] = Kindle3WiFi3G;
-                    info.devices[info.num_devices++] = Kindle3WiFi3GEurope;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = Kindle3WiFi;
+                    info->devices[info->num_devices++] = Kindle3WiFi3G;
+                    info->devices[info->num_devices++] = Kindle3WiFi3GEurope;
                 }
                 else if(strcmp(optarg, "legacy") == 0)
                 {
-                    strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                    strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     unsigned int num_aliased_devices = 2 + 3 + 3;
-                    info.devices = realloc(info.devices, (info.num_devices + num_aliased_devices) * sizeof(Device));
-                    info.devices[info.num_devices++] = Kindle2US;
-                    info.devices[info.num_devices++] = Kindle2International;
-                    info.devices[info.num_devices++] = KindleDXUS;
-                    info.devices[info.num_devices++] = KindleDXInternational;
-                    info.devices[info.num_devices++] = KindleDXGraphite;
-                    info.devices[info.num_devices++] = Kindle3WiFi;
-                    info.devices[info.num_devices++] = Kindle3WiFi3G;
-                    info.devices[info.num_devices++] = Kindle3WiFi3GEurope;
+                    info->devices = realloc(info->devices, (info->num_devices + num_aliased_devices) * sizeof(Device));
+                    info->devices[info->num_devices++] = Kindle2US;
+                    info->devices[info->num_devices++] = Kindle2International;
+                    info->devices[info->num_devices++] = KindleDXUS;
+                    info->devices[info->num_devices++] = KindleDXInternational;
+                    info->devices[info->num_devices++] = KindleDXGraphite;
+                    info->devices[info->num_devices++] = Kindle3WiFi;
+                    info->devices[info->num_devices++] = Kindle3WiFi3G;
+                    info->devices[info->num_devices++] = Kindle3WiFi3GEurope;
                 }
                 else
                 {
-                    info.devices = realloc(info.devices, ++info.num_devices * sizeof(Device));
+                    info->devices = realloc(info->devices, ++info->num_devices * sizeof(Device));
                     // K1
                     if(strcmp(optarg, "k1") == 0)
-                        info.devices[info.num_devices - 1] = Kindle1;
+                        info->devices[info->num_devices - 1] = Kindle1;
                     // K2
                     else if(strcmp(optarg, "k2") == 0)
-                        info.devices[info.num_devices - 1] = Kindle2US;
+                        info->devices[info->num_devices - 1] = Kindle2US;
                     else if(strcmp(optarg, "k2i") == 0)
-                        info.devices[info.num_devices - 1] = Kindle2International;
+                        info->devices[info->num_devices - 1] = Kindle2International;
                     // DX
                     else if(strcmp(optarg, "dx") == 0)
-                        info.devices[info.num_devices - 1] = KindleDXUS;
+                        info->devices[info->num_devices - 1] = KindleDXUS;
                     else if(strcmp(optarg, "dxi") == 0)
-                        info.devices[info.num_devices - 1] = KindleDXInternational;
+                        info->devices[info->num_devices - 1] = KindleDXInternational;
                     else if(strcmp(optarg, "dxg") == 0)
-                        info.devices[info.num_devices - 1] = KindleDXGraphite;
+                        info->devices[info->num_devices - 1] = KindleDXGraphite;
                     // K3
                     else if(strcmp(optarg, "k3w") == 0)
-                        info.devices[info.num_devices - 1] = Kindle3WiFi;
+                        info->devices[info->num_devices - 1] = Kindle3WiFi;
                     else if(strcmp(optarg, "k3g") == 0)
-                        info.devices[info.num_devices - 1] = Kindle3WiFi3G;
+                        info->devices[info->num_devices - 1] = Kindle3WiFi3G;
                     else if(strcmp(optarg, "k3gb") == 0)
-                        info.devices[info.num_devices - 1] = Kindle3WiFi3GEurope;
+                        info->devices[info->num_devices - 1] = Kindle3WiFi3GEurope;
                     // K4
                     else if(strcmp(optarg, "k4") == 0)
                     {
-                        info.devices[info.num_devices - 1] = Kindle4NonTouch;
-                        strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = Kindle4NonTouch;
+                        strncpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "k4b") == 0)
                     {
-                        info.devices[info.num_devices - 1] = Kindle4NonTouchBlack;
-                        strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = Kindle4NonTouchBlack;
+                        strncpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
                     }
                     // KT
                     // NOTE: Magic number switch to 'versionless' update types here... FW >= 5.6.1 apparently dropped support for these...
                     else if(strcmp(optarg, "k5w") == 0)
                     {
-                        info.devices[info.num_devices - 1] = Kindle5TouchWiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = Kindle5TouchWiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "k5g") == 0)
                     {
-                        info.devices[info.num_devices - 1] = Kindle5TouchWiFi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = Kindle5TouchWiFi3G;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "k5gb") == 0)
                     {
-                        info.devices[info.num_devices - 1] = Kindle5TouchWiFi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = Kindle5TouchWiFi3GEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "k5u") == 0)
                     {
-                        info.devices[info.num_devices - 1] = Kindle5TouchUnknown;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = Kindle5TouchUnknown;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // PW1
                     else if(strcmp(optarg, "pw") == 0 || strcmp(optarg, "kpw") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhiteWiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pwg") == 0 || strcmp(optarg, "kpwg") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhiteWiFi3G;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pwgc") == 0 || strcmp(optarg, "kpwgc") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhiteWiFi3GCanada;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pwgb") == 0 || strcmp(optarg, "kpwgb") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhiteWiFi3GEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pwgj") == 0 || strcmp(optarg, "kpwgj") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhiteWiFi3GJapan;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pwgbr") == 0 || strcmp(optarg, "kpwgbr") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhiteWiFi3GBrazil;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhiteWiFi3GBrazil;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // PW2
                     else if(strcmp(optarg, "pw2") == 0 || strcmp(optarg, "kpw2") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2j") == 0 || strcmp(optarg, "kpw2j") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFiJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFiJapan;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2g") == 0 || strcmp(optarg, "kpw2g") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3G;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gc") == 0 || strcmp(optarg, "kpw2gc") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3GCanada;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gb") == 0 || strcmp(optarg, "kpw2gb") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3GEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gr") == 0 || strcmp(optarg, "kpw2gr") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GRussia;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3GRussia;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gj") == 0 || strcmp(optarg, "kpw2gj") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3GJapan;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2il") == 0 || strcmp(optarg, "kpw2il") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi4GBInternational;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi4GBInternational;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gbl") == 0 || strcmp(optarg, "kpw2gbl") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GBEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3G4GBEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gl") == 0 || strcmp(optarg, "kpw2gl") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GB;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3G4GB;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gcl") == 0 || strcmp(optarg, "kpw2gcl") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GBCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3G4GBCanada;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw2gbrl") == 0 || strcmp(optarg, "kpw2gbrl") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite2WiFi3G4GBBrazil;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite2WiFi3G4GBBrazil;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // KT2
                     else if(strcmp(optarg, "kt2") == 0 || strcmp(optarg, "bk") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleBasic;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleBasic;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "kt2a") == 0 || strcmp(optarg, "bka") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleBasicKiwi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleBasicKiwi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // KV
                     else if(strcmp(optarg, "kv") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleVoyageWiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleVoyageWiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "kvg") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleVoyageWiFi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleVoyageWiFi3G;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "kvgb") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleVoyageWiFi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleVoyageWiFi3GEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "kvgj") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleVoyageWiFi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleVoyageWiFi3GJapan;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "kvgm") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleVoyageWiFi3GMexico;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleVoyageWiFi3GMexico;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // Black PW3
                     else if(strcmp(optarg, "pw3") == 0 || strcmp(optarg, "kpw3") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw3g") == 0 || strcmp(optarg, "kpw3g") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WiFi3G;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw3gj") == 0 || strcmp(optarg, "kpw3gj") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WiFi3GJapan;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw3gc") == 0 || strcmp(optarg, "kpw3gc") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GCanada;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WiFi3GCanada;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw3gb") == 0 || strcmp(optarg, "kpw3gb") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WiFi3GEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw3gm") == 0 || strcmp(optarg, "kpw3gm") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WiFi3GMexico;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WiFi3GMexico;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // White PW3
                     else if(strcmp(optarg, "pw3w") == 0 || strcmp(optarg, "kpw3w") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WhiteWiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WhiteWiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "pw3wgj") == 0 || strcmp(optarg, "kpw3wgj") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindlePaperWhite3WhiteWiFi3GJapan;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindlePaperWhite3WhiteWiFi3GJapan;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // Oasis
                     else if(strcmp(optarg, "koa") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleOasisWiFi;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleOasisWiFi;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "koag") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleOasisWiFi3G;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleOasisWiFi3G;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "koagb") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleOasisWiFi3GEurope;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleOasisWiFi3GEurope;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // KT3
                     else if(strcmp(optarg, "kt3") == 0 )
                     {
-                        info.devices[info.num_devices - 1] = KindleBasic2;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleBasic2;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     else if(strcmp(optarg, "kt3w") == 0 )
                     {
-                        info.devices[info.num_devices - 1] = KindleBasic2White;
-                        strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                        info->devices[info->num_devices - 1] = KindleBasic2White;
+                        strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                     }
                     // N/A
                     else if(strcmp(optarg, "none") == 0)
                     {
-                        info.devices[info.num_devices - 1] = KindleUnknown;
+                        info->devices[info->num_devices - 1] = KindleUnknown;
                         // We *really* mean no devices, so reset num_devices ;).
-                        info.num_devices = 0;
+                        info->num_devices = 0;
                     }
                     else if(strcmp(optarg, "auto") == 0 || strcmp(optarg, "current") == 0)
                     {
@@ -1948,19 +3589,19 @@ int kindle_create_main(int argc, char *argv[])
                         else
                         {
                             // Yay, known valid device code :)
-                            info.devices[info.num_devices - 1] = dev_code;
+                            info->devices[info->num_devices - 1] = dev_code;
                             // Roughly guess a decent magic number...
                             if(dev_code < Kindle4NonTouch)
                             {
-                                strncpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+                                strncpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
                             }
                             else if(dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack)
                             {
-                                strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                                strncpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
                             }
                             else
                             {
-                                strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                                strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                             }
                         }
                     }
@@ -1985,19 +3626,19 @@ int kindle_create_main(int argc, char *argv[])
                         else
                         {
                             // Yay, known valid device code :)
-                            info.devices[info.num_devices - 1] = dev_code;
+                            info->devices[info->num_devices - 1] = dev_code;
                             // Roughly guess a decent magic number...
                             if(dev_code < Kindle4NonTouch)
                             {
-                                strncpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
+                                strncpy(info->magic_number, "FC02", MAGIC_NUMBER_LENGTH);
                             }
                             else if(dev_code == Kindle4NonTouch || dev_code == Kindle4NonTouchBlack)
                             {
-                                strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
+                                strncpy(info->magic_number, "FC04", MAGIC_NUMBER_LENGTH);
                             }
                             else
                             {
-                                strncpy(info.magic_number, "FD04", MAGIC_NUMBER_LENGTH);
+                                strncpy(info->magic_number, "FD04", MAGIC_NUMBER_LENGTH);
                             }
                         }
                     }
@@ -2005,25 +3646,25 @@ int kindle_create_main(int argc, char *argv[])
                 break;
             case 'p':
                 if(strcmp(optarg, "unspecified") == 0)
-                    info.platform = Plat_Unspecified;
+                    info->platform = Plat_Unspecified;
                 else if(strcmp(optarg, "mario") == 0)
-                    info.platform = MarioDeprecated;
+                    info->platform = MarioDeprecated;
                 else if(strcmp(optarg, "luigi") == 0)
-                    info.platform = Luigi;
+                    info->platform = Luigi;
                 else if(strcmp(optarg, "banjo") == 0)
-                    info.platform = Banjo;
+                    info->platform = Banjo;
                 else if(strcmp(optarg, "yoshi") == 0)
-                    info.platform = Yoshi;
+                    info->platform = Yoshi;
                 else if(strcmp(optarg, "yoshime-proto") == 0 || strcmp(optarg, "yoshime-p") == 0)
-                    info.platform = YoshimeProto;
+                    info->platform = YoshimeProto;
                 else if(strcmp(optarg, "yoshime") == 0)
-                    info.platform = Yoshime;
+                    info->platform = Yoshime;
                 else if(strcmp(optarg, "wario") == 0)
-                    info.platform = Wario;
+                    info->platform = Wario;
                 else if(strcmp(optarg, "duet") == 0)
-                    info.platform = Duet;
+                    info->platform = Duet;
                 else if(strcmp(optarg, "heisenberg") == 0)
-                    info.platform = Heisenberg;
+                    info->platform = Heisenberg;
                 else
                 {
                     fprintf(stderr, "Unknown platform %s.\n", optarg);
@@ -2032,11 +3673,11 @@ int kindle_create_main(int argc, char *argv[])
                 break;
             case 'B':
                 if(strcmp(optarg, "unspecified") == 0)
-                    info.board = Board_Unspecified;
+                    info->board = Board_Unspecified;
                 else if(strcmp(optarg, "tequila") == 0)
-                    info.board = Tequila;
+                    info->board = Tequila;
                 else if(strcmp(optarg, "whitney") == 0)
-                    info.board = Whitney;
+                    info->board = Whitney;
                 else
                 {
                     fprintf(stderr, "Unknown board %s.\n", optarg);
@@ -2044,48 +3685,69 @@ int kindle_create_main(int argc, char *argv[])
                 }
                 break;
             case 'h':
-                info.header_rev = (uint32_t) atoi(optarg);
+                info->header_rev = (uint32_t) atoi(optarg);
                 break;
             case 'k':
-                if(nettle_rsa_privkey_from_pem(optarg, &info.sign_pkey) != 0)
+                // The first one replaces the default key, the others each get a package of their own
+                if(key_count++ == 0)
+                {
+                    if(kt_load_private_key(optarg, &info->sign_pkey) != 0)
+                    {
+                        fprintf(stderr, "Key '%s' cannot be loaded.\n", optarg);
+                        goto do_error;
+                    }
+                    break;
+                }
+                if((key = kindle_create_key_slot(options, key_count - 1)) == NULL)
+                    goto do_error;
+                if(kt_load_private_key(optarg, &key->sign_pkey) != 0)
                 {
                     fprintf(stderr, "Key '%s' cannot be loaded.\n", optarg);
                     goto do_error;
                 }
+                key->key_filename = optarg;
                 break;
             case 'b':
-                strncpy(info.magic_number, optarg, MAGIC_NUMBER_LENGTH);
-                if((info.version = get_bundle_version(optarg)) == UnknownUpdate)
+                strncpy(info->magic_number, optarg, MAGIC_NUMBER_LENGTH);
+                if((info->version = get_bundle_version(optarg)) == UnknownUpdate)
                 {
                     fprintf(stderr, "Invalid bundle version %s.\n", optarg);
                     goto do_error;
                 }
                 break;
             case 's':
-                info.source_revision = strtoull(optarg, NULL, 0);
-                sourceRevFlag = 1;
+                info->source_revision = strtoull(optarg, NULL, 0);
+                options->source_rev_set = true;
                 break;
             case 't':
-                info.target_revision = strtoull(optarg, NULL, 0);
-                targetRevFlag = 1;
+                info->target_revision = strtoull(optarg, NULL, 0);
+                options->target_rev_set = true;
                 break;
             case '1':
-                info.magic_1 = (uint32_t) atoi(optarg);
+                info->magic_1 = (uint32_t) atoi(optarg);
                 break;
             case '2':
-                info.magic_2 = (uint32_t) atoi(optarg);
+                info->magic_2 = (uint32_t) atoi(optarg);
                 break;
             case 'm':
-                info.minor = (uint32_t) atoi(optarg);
+                info->minor = (uint32_t) atoi(optarg);
                 break;
             case 'c':
-                info.certificate_number = (CertificateNumber) atoi(optarg);
+                // Paired with the --key in the same position
+                if(cert_count++ == 0)
+                {
+                    info->certificate_number = (CertificateNumber) atoi(optarg);
+                    break;
+                }
+                if((key = kindle_create_key_slot(options, cert_count - 1)) == NULL)
+                    goto do_error;
+                key->certificate_number = (CertificateNumber) atoi(optarg);
                 break;
             case 'o':
-                info.optional = (uint8_t) atoi(optarg);
+                info->optional = (uint8_t) atoi(optarg);
                 break;
             case 'r':
-                info.critical = (uint8_t) atoi(optarg);
+                info->critical = (uint8_t) atoi(optarg);
                 break;
             case 'x':
                 if(strchr(optarg, '=') == NULL) // A metastring must contain an '=' character (remember, it's a key=value pair ;))
@@ -2098,23 +3760,82 @@ int kindle_create_main(int argc, char *argv[])
                     fprintf(stderr, "Metastring too long. Max length: %d, input: %s\n", 0xFFFF, optarg);
                     goto do_error;
                 }
-                info.metastrings = realloc(info.metastrings, ++info.num_meta * sizeof(char *));
-                info.metastrings[info.num_meta - 1] = strdup(optarg);
+                info->metastrings = realloc(info->metastrings, ++info->num_meta * sizeof(char *));
+                info->metastrings[info->num_meta - 1] = strdup(optarg);
                 break;
             case 'a':
-                keep_archive = true;
+                options->keep_archive = true;
                 break;
             case 'u':
-                fake_sign = true;
+                options->fake_sign = true;
                 break;
             case 'U':
-                userdata_only = true;
+                options->userdata_only = true;
                 break;
             case 'O':
-                enforce_ota = true;
+                options->enforce_ota = true;
                 break;
             case 'C':
-                legacy = true;
+                options->legacy = true;
+                break;
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    goto do_error;
+                break;
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    goto do_error;
+                break;
+            case 'j':
+                if(kt_parse_jobs(optarg) < 0)
+                    goto do_error;
+                break;
+            case 'z':
+                if(optarg[0] < '0' || optarg[0] > '9' || optarg[1] != '\0')
+                {
+                    fprintf(stderr, "Invalid compression level '%s' (must be between 0 and 9).\n", optarg);
+                    goto do_error;
+                }
+                options->compression_level = optarg[0] - '0';
+                break;
+            case 'D':
+                options->cache_dir = optarg;
+                break;
+            case 'P':
+                options->cache_verify = true;
+                break;
+            case 'W':
+                options->watch = true;
+                break;
+            case 'F':
+                // type:output
+                if((sep = strchr(optarg, ':')) == NULL || sep[1] == '\0')
+                {
+                    fprintf(stderr, "Invalid fanout package '%s' (must be type:output).\n", optarg);
+                    goto do_error;
+                }
+                if((type = malloc((size_t) (sep - optarg) + 1)) == NULL)
+                    goto do_error;
+                memcpy(type, optarg, (size_t) (sep - optarg));
+                type[sep - optarg] = '\0';
+                version = kindle_create_parse_type(type);
+                free(type);
+                if(version != OTAUpdateV2 && version != RecoveryUpdateV2 && version != UpdateSignature)
+                {
+                    fprintf(stderr, "Invalid fanout package type in '%s' (must be ota2, recovery2 or sig).\n", optarg);
+                    goto do_error;
+                }
+                options->fanout = realloc(options->fanout, ++options->fanout_count * sizeof(*options->fanout));
+                options->fanout[options->fanout_count - 1].version = version;
+                options->fanout[options->fanout_count - 1].output_filename = sep + 1;
+                break;
+            case 'e':
+                if(kindle_create_add_exclude(optarg, options) != 0)
+                    goto do_error;
+                break;
+            case 'E':
+                if(kindle_create_read_excludes(optarg, options) != 0)
+                    goto do_error;
                 break;
             case ':':
                 fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
@@ -2131,402 +3852,576 @@ int kindle_create_main(int argc, char *argv[])
         }
     }
 
-    // Signed userdata packages are very peculiar, handle them on their own...
-    if(userdata_only)
+    // Every package needs to know which cert to check its signatures against
+    if((key_count > 1 || cert_count > 1) && key_count != cert_count)
     {
-        // Needs to be a signed package
-        if(info.version != UpdateSignature)
-        {
-            fprintf(stderr, "Invalid update type (%s) for an userdata package.\n", convert_bundle_version(info.version));
-            goto do_error;
-        }
+        fprintf(stderr, "Every --key needs its own --cert when signing with several keys (got %u keys & %u certs).\n", key_count, cert_count);
+        goto do_error;
     }
-    else
+
+    // Iterate over non-options (the file(s) we passed)
+    while(optind < argc)
     {
-        // Did we want to enforce an OTA bundle type?
-        if(enforce_ota)
-        {
-            // Only makes sense for ota2...
-            if(info.version != OTAUpdateV2)
-            {
-                fprintf(stderr, "Invalid update type (%s). Enforcing the versioned OTA bundle type only makes sense for OTA V2.\n", convert_bundle_version(info.version));
-                goto do_error;
-            }
-            // We of course need the versioned ota bundle type...
-            strncpy(info.magic_number, "FC04", MAGIC_NUMBER_LENGTH);
-            // But also a source & target version!
-            if( sourceRevFlag == 0 ){
-                info.source_revision = 2443670049;       // FW 5.5.0
-            }
-            if( targetRevFlag == 0 ){
-                info.target_revision = 1 + 3202090019;   // FW 5.8.10
-            }
-            // NOTE: Don't expece those to be entirely consistent when crossing devices (f.g., the Touch's FW 5.3.7.3 has a higher OTA build number than the KV's FW 5.5.0)
-        }
-        // Musn't be *only* a sig envelope...
-        if(info.version == UpdateSignature)
-        {
-            fprintf(stderr, "Invalid update type (%s) for an update package.\n", convert_bundle_version(info.version));
-            goto do_error;
-        }
-        // Validation (Allow 0 devices in Recovery V2 & FB02 h2, allow multiple devices in OTA V2 & Recovery V2)
-        if((info.num_devices < 1 && (info.version != RecoveryUpdateV2 && (info.version != RecoveryUpdate || info.header_rev != 2))) || ((info.version != OTAUpdateV2 && info.version != RecoveryUpdateV2) && info.num_devices > 1))
-        {
-            fprintf(stderr, "Invalid number of supported devices (%d) for this update type (%s).\n", info.num_devices, convert_bundle_version(info.version));
-            goto do_error;
-        }
-        if((info.version != OTAUpdateV2 && info.version != RecoveryUpdateV2) && (info.source_revision > UINT32_MAX || info.target_revision > UINT32_MAX))
-        {
-            fprintf(stderr, "Source/target revision for this update type (%s) cannot exceed %u.\n", convert_bundle_version(info.version), UINT32_MAX);
-            goto do_error;
-        }
-        // When building an ota update with ota2 only devices, don't try to use non ota v1 bundle versions, reset it @ FC02, or shit happens.
-        if(info.version == OTAUpdate)
-        {
-            // OTA V1 only supports one device, we don't need to loop (fix anything newer than a K3GB)
-            if(info.devices[0] > Kindle3WiFi3GEurope && (strncmp(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH) != 0 && strncmp(info.magic_number, "FD03", MAGIC_NUMBER_LENGTH) != 0))
-            {
-                // FC04 is hardcoded when we set K4 as a device, and FD04 when we ask for a K5 and up, so fix it silently.
-                strncpy(info.magic_number, "FC02", MAGIC_NUMBER_LENGTH);
-            }
-        }
-        // Same thing with recovery updates
-        if(info.version == RecoveryUpdate)
-        {
-            // It's called FB02.2 for a reason... Plus, we can have a null/none device with it, so we avoid the same blowup as the RecoveryV2 check ;).
-            if((info.header_rev == 2 || info.devices[0] > Kindle3WiFi3GEurope) && (strncmp(info.magic_number, "FB01", MAGIC_NUMBER_LENGTH) != 0 && strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) != 0))
-            {
-                strncpy(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH);
-            }
-        }
-        // Same thing with recovery updates v2
-        if(info.version == RecoveryUpdateV2)
-        {
-            // Make sure we have a sane magic number... We either don't yet have one set when not specifying any device, or what's set corresponds to OTA update types when specifying anything since the K4...
-            if(strncmp(info.magic_number, "FB03", MAGIC_NUMBER_LENGTH) != 0)
-            {
-                // NOTE: This effectively prevents us from setting a custom magic number. Which is not really something you'd want to do in this case anyway...
-                strncpy(info.magic_number, "FB03", MAGIC_NUMBER_LENGTH);
-            }
-        }
-        // We need a platform id, board id (& header rev?) for recovery2
-        if(info.version == RecoveryUpdateV2)
+        // The last one will always be our output (but only check if we have at least one input file, we might really want to output to stdout)
+        if(optind == argc - 1 && options->input_count > 0)
         {
-            if(strcmp(convert_platform_id(info.platform), "Unknown") == 0)
-            {
-                fprintf(stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info.version));
-                goto do_error;
-            }
-            if(strcmp(convert_board_id(info.board), "Unknown") == 0)
-            {
-                fprintf(stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info.version));
-                goto do_error;
-            }
-            // Don't bother for header rev? We don't for other potentially optional flags in recovery, so...
+            // If it's a single dash, output to stdout (like tar cf -)
+            if(strcmp(argv[optind], "-") != 0)
+                options->output_filename = argv[optind];
+            optind++;
         }
-        // We need a platform id & board id for recovery FB02 V2
-        if(info.version == RecoveryUpdate)
+        else
         {
-            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && strcmp(convert_platform_id(info.platform), "Unknown") == 0)
-            {
-                fprintf(stderr, "You need to set a platform for this update type (%s).\n", convert_bundle_version(info.version));
-                goto do_error;
-            }
-            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && strcmp(convert_board_id(info.board), "Unknown") == 0)
-            {
-                fprintf(stderr, "You need to set a board for this update type (%s).\n", convert_bundle_version(info.version));
-                goto do_error;
-            }
+            // Build a list of all our input files/dirs, libarchive will do most of the heavy lifting for us (Cf. http://stackoverflow.com/questions/1182534/#1182649)
+            options->input_list = realloc(options->input_list, ++options->input_count * sizeof(char *));
+            options->input_list[options->input_count - 1] = strdup(argv[optind++]);
         }
-        // Right now, we don't use device at all for FB02.2, so reset it to none to have a consistent recap... FIXME?
-        if(info.version == RecoveryUpdate)
+    }
+    // Pick up whatever --block-size/--threads did to our settings
+    kt_settings_get(&options->settings);
+
+    return 0;
+
+do_error:
+    kindle_create_free_options(options);
+    return -1;
+}
+
+#ifdef __linux__
+// Resolve filename like realpath, except that only as much of its directory as already exists has to (cf. kindle_create_other_keys)
+static char *watch_resolve(const char *filename)
+{
+    char *head;
+    char *sep;
+    char *real = NULL;
+    char *path;
+    const char *tail = filename;
+
+    if((head = strdup(filename)) == NULL)
+        return NULL;
+    while((sep = strrchr(head, '/')) != NULL)
+    {
+        *sep = '\0';
+        if((real = realpath(sep == head ? "/" : head, NULL)) != NULL)
         {
-            if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev == 2 && info.num_devices > 0)
-            {
-                info.num_devices = 0;
-                info.devices[info.num_devices] = KindleUnknown;
-            }
+            tail = filename + (sep - head) + 1;
+            break;
         }
-        // We of course need a full magic number... As magic_number is not NULL terminated, we cannot use strlen, so let one of our helper functions do the job...
-        if(get_bundle_version(info.magic_number) == UnknownUpdate)
+    }
+    free(head);
+    if(real == NULL && (real = realpath(".", NULL)) == NULL)
+        return NULL;
+    if((path = malloc(strlen(real) + 1 + strlen(tail) + 1)) != NULL)
+        sprintf(path, "%s/%s", (strcmp(real, "/") == 0 ? "" : real), tail);
+    free(real);
+
+    return path;
+}
+
+// Don't trigger ourselves when we write filename
+static int watch_ignore(struct ktwatch *watch, const char *filename)
+{
+    char **ignore;
+    char *path;
+
+    if((path = watch_resolve(filename)) == NULL)
+    {
+        fprintf(stderr, "Cannot resolve '%s': %s.\n", filename, strerror(errno));
+        return -1;
+    }
+    if((ignore = realloc(watch->ignore, (watch->ignore_count + 1) * sizeof(*ignore))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for watch list.\n");
+        free(path);
+        return -1;
+    }
+    watch->ignore = ignore;
+    watch->ignore[watch->ignore_count++] = path;
+
+    return 0;
+}
+
+// Whether the (resolved) path is something we write ourselves. A directory counts if we write something in there (i.e., a --key one, or the cache's).
+static bool watch_ignored(const struct ktwatch *watch, const char *path, bool is_dir)
+{
+    size_t len = strlen(path);
+    size_t ignore_len;
+    size_t i;
+
+    if(watch->cache_file != NULL && (strncmp(path, watch->cache_file, strlen(watch->cache_file)) == 0 || (is_dir && strncmp(watch->cache_file, path, len) == 0 && watch->cache_file[len] == '/')))
+        return true;
+    for(i = 0; i < watch->ignore_count; i++)
+    {
+        ignore_len = strlen(watch->ignore[i]);
+        // Including the temporary file we build it in, cf. kindle_create_open_output
+        if(strncmp(path, watch->ignore[i], ignore_len) == 0 && (path[ignore_len] == '\0' || (path[ignore_len] == '.' && strlen(path + ignore_len) == 7)))
+            return true;
+        if(is_dir && strncmp(watch->ignore[i], path, len) == 0 && watch->ignore[i][len] == '/')
+            return true;
+    }
+
+    return false;
+}
+
+// Watch a single directory. Keep its resolved path around, we'll need it to watch what gets created in there later, and to recognize our own output.
+static int watch_add(struct ktwatch *watch, const char *path, const char *only)
+{
+    struct ktwatch_dir *dirs;
+    char *real;
+    size_t i;
+    int wd;
+
+    if((wd = inotify_add_watch(watch->fd, path, WATCH_EVENTS)) == -1)
+    {
+        fprintf(stderr, "Cannot watch '%s': %s.\n", path, strerror(errno));
+        return -1;
+    }
+    // We might already be watching it (inotify hands us the same wd back), in which case a full watch trumps a single file one
+    for(i = 0; i < watch->count; i++)
+    {
+        if(watch->dirs[i].wd == wd)
         {
-            fprintf(stderr, "You need to set a valid bundle version for this update type (%s), '%s' is invalid.\n", convert_bundle_version(info.version), info.magic_number);
-            goto do_error;
+            if(only == NULL)
+                watch->dirs[i].only = NULL;
+            return 0;
         }
     }
-
-    // If we don't actually build an archive, legacy mode makes no sense
-    if(skip_archive)
+    if((dirs = realloc(watch->dirs, (watch->count + 1) * sizeof(*dirs))) == NULL)
     {
-        legacy = false;
+        fprintf(stderr, "Cannot allocate memory for watch list.\n");
+        return -1;
+    }
+    watch->dirs = dirs;
+    if((real = realpath(path, NULL)) == NULL)
+    {
+        fprintf(stderr, "Cannot watch '%s': %s.\n", path, strerror(errno));
+        return -1;
     }
+    watch->dirs[watch->count].path = real;
+    watch->dirs[watch->count].wd = wd;
+    watch->dirs[watch->count].only = only;
+    watch->count++;
+
+    return 0;
+}
+
+// Watch a directory, and every directory below it
+static int watch_tree(struct ktwatch *watch, const char *dirname)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char *path;
+    int ret = 0;
 
-    if(optind < argc)
+    if(watch_add(watch, dirname, NULL) != 0)
+        return -1;
+    // It may already be gone again, we'll hear about it
+    if((dir = opendir(dirname)) == NULL)
+        return 0;
+    while(ret == 0 && (de = readdir(dir)) != NULL)
     {
-        // Iterate over non-options (the file(s) we passed)
-        while(optind < argc)
+        if(strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        if((path = malloc(strlen(dirname) + 1 + strlen(de->d_name) + 1)) == NULL)
         {
-            // The last one will always be our output (but only check if we have at least one input file, we might really want to output to stdout)
-            if(optind == argc - 1 && input_index > 0)
-            {
-                output_filename = strdup(argv[optind++]);
-                // If it's a single dash, output to stdout (like tar cf -)
-                if(strcmp(output_filename, "-") == 0)
-                {
-                    free(output_filename);
-                    output_filename = NULL;
-                }
-            }
-            else
-            {
-                // Build a list of all our input files/dirs, libarchive will do most of the heavy lifting for us (Cf. http://stackoverflow.com/questions/1182534/#1182649)
-                input_list = realloc(input_list, ++input_index * sizeof(char *));
-                input_list[input_index - 1] = strdup(argv[optind++]);
-            }
+            ret = -1;
+            break;
+        }
+        sprintf(path, "%s/%s", dirname, de->d_name);
+        if(lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+            ret = watch_tree(watch, path);
+        free(path);
+    }
+    closedir(dir);
+
+    return ret;
+}
+
+// Wait up to timeout ms (-1 for ever) for inotify events, and flag changed if any of them concerns our input.
+// Returns 0 on timeout, 1 if we got some events, and -1 on error.
+static int watch_read(struct ktwatch *watch, int timeout, bool *changed)
+{
+    struct pollfd pfd = { watch->fd, POLLIN, 0 };
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    ssize_t len;
+    char *p;
+    char *path;
+    bool ignored;
+    size_t i;
+    int r;
+
+    if((r = poll(&pfd, 1, timeout)) <= 0)
+    {
+        if(r < 0 && errno != EINTR)
+        {
+            fprintf(stderr, "Cannot wait for changes: %s.\n", strerror(errno));
+            return -1;
         }
+        return 0;
     }
-    else
+    if((len = read(watch->fd, buf, sizeof(buf))) <= 0)
     {
-        fprintf(stderr, "No input/output specified.\n");
-        goto do_error;
+        if(len < 0 && (errno == EINTR || errno == EAGAIN))
+            return 1;
+        fprintf(stderr, "Cannot read inotify events: %s.\n", strerror(errno));
+        return -1;
     }
 
-    // While we're at it, check that our output name follows the proper naming scheme when creating a valid update package
-    if(output_filename != NULL)
+    for(p = buf; p < buf + len; p += sizeof(struct inotify_event) + event->len)
     {
-        // Use libarchive's pattern matching, because it handles ./ in a smart way
-        match = archive_match_new();
-        entry = archive_entry_new();
-
-        // Handle signed & fake userdata packages...
-        if(fake_sign || userdata_only)
+        event = (const struct inotify_event *) (void *) p;
+        if(event->mask & IN_Q_OVERFLOW)
         {
-            valid_update_file_pattern = strdup("./data\\.stgz$");
+            // We lost track of things, just rebuild
+            *changed = true;
+            continue;
         }
-        else
+        for(i = 0; i < watch->count; i++)
         {
-            // Recovery updates must be lowercase!
-            if(info.version == RecoveryUpdate || info.version == RecoveryUpdateV2)
-            {
-                valid_update_file_pattern = strdup("./update*\\.bin$");
-            }
-            else
-            {
-                valid_update_file_pattern = strdup("./[Uu]pdate*\\.bin$");
-            }
+            if(watch->dirs[i].wd == event->wd)
+                break;
         }
-        if(archive_match_exclude_pattern(match, valid_update_file_pattern) != ARCHIVE_OK)
-            fprintf(stderr, "archive_match_exclude_pattern() failed: %s.\n", archive_error_string(match));
-        free(valid_update_file_pattern);
-
-        archive_entry_copy_pathname(entry, output_filename);
-
-        r = archive_match_path_excluded(match, entry);
-        if(r != 1)
+        if(i == watch->count)
+            continue;
+        if(event->len > 0)
         {
-            if(r < 0)
-            {
-                fprintf(stderr, "archive_match_path_excluded() failed: %s.\n", archive_error_string(match));
-            }
-            fprintf(stderr, "Your output file '%s' needs to follow the proper naming scheme (%s) in order to be picked up by the Kindle.\n", output_filename, (fake_sign || userdata_only) ? "data.stgz" : "update*.bin");
-            archive_entry_free(entry);
-            archive_match_free(match);
-            goto do_error;
+            if(watch->dirs[i].only != NULL && strcmp(event->name, watch->dirs[i].only) != 0)
+                continue;
+            if((path = malloc(strlen(watch->dirs[i].path) + 1 + strlen(event->name) + 1)) == NULL)
+                return -1;
+            sprintf(path, "%s/%s", watch->dirs[i].path, event->name);
+            // Don't trigger ourselves with our own output (or the cache, if it lives in there)
+            ignored = watch_ignored(watch, path, (event->mask & IN_ISDIR) != 0);
+            // Start watching new directories, too
+            r = 0;
+            if(watch->dirs[i].only == NULL && (event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                r = watch_tree(watch, path);
+            free(path);
+            if(r != 0)
+                return -1;
+            if(ignored)
+                continue;
         }
+        *changed = true;
+    }
 
-        // Cleanup
-        archive_entry_free(entry);
-        archive_match_free(match);
+    return 1;
+}
+#endif
 
-        // Check to see if we can write to our output file (do it now instead of earlier, this way the pattern matching has been done, and we potentially avoid fopen squishing a file we meant as input, not output)
-        if((output = fopen(output_filename, "wb")) == NULL)
-        {
-            fprintf(stderr, "Cannot create output package file '%s': %s.\n", output_filename, strerror(errno));
-            goto do_error;
-        }
+// Build the package once, then rebuild it every time our input changes (once it has settled down), until we're killed.
+// We keep the hashes & sigs of the files we've already seen in memory (unless we've got a --cache-dir), so a rebuild only has to hash & sign what actually changed.
+static int kindle_create_watch(KTCreateOptions *options)
+{
+#ifdef __linux__
+    struct ktwatch watch;
+    struct stat st;
+    char *dircopy = NULL;
+    char *filename;
+    unsigned int i;
+    bool changed;
+    int r;
+    int ret = -1;
+
+    memset(&watch, 0, sizeof(watch));
+    if(options->output_filename == NULL || options->input_count == 0)
+    {
+        fprintf(stderr, "You need to specify both your input and an output file to watch for changes.\n");
+        return -1;
     }
-    else
+    if((watch.fd = inotify_init1(IN_CLOEXEC)) == -1)
     {
-        // If we're really outputting to stdout, fix the output filename
-        output_filename = strdup("standard output");
+        fprintf(stderr, "Cannot initialize inotify: %s.\n", strerror(errno));
+        return -1;
     }
-
-    // If we only provided a single input file, and it's a tarball, assume it's properly packaged, and just sign/munge it. (Restore backwards compatibilty with ixtab's tools, among other things)
-    if(input_index == 1)
+    // Everything we're about to write, be it in our input or not
+    if(watch_ignore(&watch, options->output_filename) != 0)
+        goto cleanup;
+    for(i = 0; i < options->fanout_count; i++)
     {
-        if(IS_TGZ(input_list[0]) || IS_TARBALL(input_list[0]))
+        if(watch_ignore(&watch, options->fanout[i].output_filename) != 0)
+            goto cleanup;
+    }
+    for(i = 0; i < options->key_count; i++)
+    {
+        if((filename = kindle_create_key_output(options->output_filename, options->keys[i].key_filename)) == NULL)
+            goto cleanup;
+        r = watch_ignore(&watch, filename);
+        free(filename);
+        if(r != 0)
+            goto cleanup;
+    }
+    if(options->cache_dir != NULL)
+    {
+        if((filename = malloc(strlen(options->cache_dir) + 1 + strlen(HASH_CACHE_FILE_NAME) + 1)) == NULL)
+            goto cleanup;
+        sprintf(filename, "%s/%s", options->cache_dir, HASH_CACHE_FILE_NAME);
+        watch.cache_file = watch_resolve(filename);
+        free(filename);
+        if(watch.cache_file == NULL)
+            goto cleanup;
+    }
+    for(i = 0; i < options->input_count; i++)
+    {
+        if(stat(options->input_list[i], &st) != 0)
         {
-            // NOTE: There's no real check besides the file extension...
-            skip_archive = true;
-            // Use it as our tarball...
-            tarball_filename = strdup(input_list[0]);
+            fprintf(stderr, "Cannot watch '%s': %s.\n", options->input_list[i], strerror(errno));
+            goto cleanup;
+        }
+        if(S_ISDIR(st.st_mode))
+        {
+            if(watch_tree(&watch, options->input_list[i]) != 0)
+                goto cleanup;
+        }
+        else
+        {
+            // Watch the directory it's in, editors tend to replace files instead of writing them in place
+            // NOTE: only points to the input's basename, which lives in input_list[i] for as long as we do
+            dircopy = strdup(options->input_list[i]);
+            r = watch_add(&watch, dirname(dircopy), basename(options->input_list[i]));
+            free(dircopy);
+            if(r != 0)
+                goto cleanup;
         }
     }
+    if(options->cache_dir == NULL && (options->cache = kt_hash_cache_open(NULL, &options->info.sign_pkey)) == NULL)
+        goto cleanup;
 
-    // Don't try to build an unsigned package if we didn't feed a single proper tarball
-    if(fake_sign && !skip_archive)
+    for(;;)
     {
-        fprintf(stderr, "You need to feed me a single tarball to build an unsigned package.\n");
-        goto do_error;
+        if(kindle_create(options) != 0)
+            fprintf(stderr, "Failed to build '%s', waiting for the next change.\n", options->output_filename);
+        fprintf(stderr, "Watching %zu directories for changes, hit Ctrl-C to stop.\n", watch.count);
+        // Wait for something to happen, and then for things to calm down
+        changed = false;
+        while((r = watch_read(&watch, changed ? WATCH_SETTLE_DELAY : -1, &changed)) > 0)
+            ;
+        if(r < 0)
+            break;
+        fprintf(stderr, "\nChanges detected, rebuilding '%s'.\n", options->output_filename);
     }
 
-    // Same thing when building a signed userdata package
-    if(userdata_only && !skip_archive)
+cleanup:
+    kt_hash_cache_close(options->cache, false);
+    options->cache = NULL;
+    for(i = 0; i < watch.count; i++)
+        free(watch.dirs[i].path);
+    free(watch.dirs);
+    for(i = 0; i < watch.ignore_count; i++)
+        free(watch.ignore[i]);
+    free(watch.ignore);
+    free(watch.cache_file);
+    close(watch.fd);
+
+    return ret;
+#else
+    (void) options;
+    fprintf(stderr, "Watching for changes is only supported on Linux.\n");
+    return -1;
+#endif
+}
+
+// The in-memory cache for files signed with key, shared by every entry signed with it
+static kt_hash_cache *manifest_cache(struct ktmanifest *manifest, const struct rsa_private_key *key)
+{
+    kt_hash_cache **caches;
+    unsigned int i;
+
+    for(i = 0; i < manifest->cache_count; i++)
     {
-        fprintf(stderr, "You need to feed me a single tarball to build a signed userdata package.\n");
-        goto do_error;
+        if(kt_hash_cache_for_key(manifest->caches[i], key))
+            return manifest->caches[i];
     }
+    if((caches = realloc(manifest->caches, (manifest->cache_count + 1) * sizeof(*caches))) == NULL)
+        return NULL;
+    manifest->caches = caches;
+    if((manifest->caches[manifest->cache_count] = kt_hash_cache_open(NULL, key)) == NULL)
+        return NULL;
 
-    // If we need to build a tarball, do it in a tempfile
-    if(!skip_archive)
+    return manifest->caches[manifest->cache_count++];
+}
+
+// Build a single manifest entry (args being a create command line, starting with the command)
+static int manifest_build(struct ktmanifest *manifest, int argc, char **args)
+{
+    KTCreateOptions options;
+    int ret;
+
+    // Every entry starts from our own settings, not from whatever the previous one asked for
+    kt_settings_set(&manifest->settings);
+    kt_reset_getopt();
+    if(kindle_create_parse_options(argc, args, &options) != 0)
+        return -1;
+    if(options.watch)
     {
-        // We need a proper mkstemp template
-        tarball_filename = strdup(KT_TMPDIR "/kindletool_create_tarball_XXXXXX");
-        tarball_fd = mkstemp(tarball_filename);
-        if(tarball_fd == -1)
-        {
-            fprintf(stderr, "Couldn't open temporary tarball file: %s.\n", strerror(errno));
-            goto do_error;
-        }
+        fprintf(stderr, "Watching for changes isn't supported in a manifest.\n");
+        kindle_create_free_options(&options);
+        return -1;
     }
-
-    // Recap (to stderr, in order not to mess stuff up if we output to stdout) what we're building
-    // Again, a signed userdata package is the ugly duckling...
-    if(userdata_only)
+    if(options.output_filename == NULL)
     {
-        fprintf(stderr, "Building userdata package '%s' directly from '%s' (signed with cert %d).\n", output_filename, tarball_filename, info.certificate_number);
+        fprintf(stderr, "Manifest entries need an output file.\n");
+        kindle_create_free_options(&options);
+        return -1;
     }
-    else
+    // Files we've already hashed & signed with the same key for a previous entry don't need to be done again
+    if(options.cache_dir == NULL)
+        options.cache_dir = manifest->cache_dir;
+    if(options.cache_dir == NULL)
+        options.cache = manifest_cache(manifest, &options.info.sign_pkey);
+    options.cache_verify = options.cache_verify || manifest->cache_verify;
+    ret = kindle_create(&options);
+    kindle_create_free_options(&options);
+
+    return ret;
+}
+
+// Build every package described in a manifest, one per line, each line written like the arguments of a create command (e.g., 'ota2 -d kindle5 /some/dir update_k5.bin'),
+// split like a serve job. Blank lines & lines starting with a # are ignored. Everything runs in this process, on the same thread pool, and the files shared between entries are only hashed & signed once per key.
+static int kindle_create_manifest_main(int argc, char *argv[])
+{
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
     {
-        fprintf(stderr, "Building %s%s%s (%.*s) update package '%s'%s%s%s%s for", (legacy ? "(in legacy mode) " : ""), (fake_sign ? "fake " : ""), (convert_bundle_version(info.version)), MAGIC_NUMBER_LENGTH, info.magic_number, output_filename, (skip_archive ? " directly from " : ""), (skip_archive ? "'" : ""), (skip_archive ? tarball_filename : ""), (skip_archive ? "'" : ""));
-        // If we have specific device IDs, list them
-        if(info.num_devices > 0)
-        {
-            fprintf(stderr, " %hd device%s (",  info.num_devices, (info.num_devices > 1 ? "s" : ""));
-            // Loop over devices
-            for(i = 0; i < info.num_devices; i++)
-            {
-                fprintf(stderr, "%s", convert_device_id(info.devices[i]));
-                if(i != info.num_devices - 1)
-                    fprintf(stderr, ", ");
-            }
-            fprintf(stderr, "),");
-        }
-        else
-        {
-            fprintf(stderr, " no specific device,");
-        }
-        // Don't print settings not applicable to our update type...
-        switch(info.version)
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { "jobs", required_argument, NULL, 'j' },
+        { "cache-dir", required_argument, NULL, 'D' },
+        { "cache-verify", no_argument, NULL, 'P' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct ktmanifest manifest;
+    const char *manifest_filename;
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    char **args;
+    int count;
+    unsigned int lineno = 0;
+    unsigned int built = 0;
+    unsigned int failed = 0;
+    unsigned int i;
+
+    memset(&manifest, 0, sizeof(manifest));
+    while((opt = getopt_long(argc, argv, "S:T:j:D:P", opts, &opt_index)) != -1)
+    {
+        switch(opt)
         {
-            case OTAUpdateV2:
-                if(info.target_revision == UINT64_MAX)
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: MAX, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
-                else
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: %llu, Critical: %hhu, Cert: %d, %hd Metadata%s", (long long) info.source_revision, (long long) info.target_revision, info.critical, info.certificate_number, info.num_meta, (info.num_meta ? " (" : ".\n"));
-                // Loop over meta
-                for(i = 0; i < info.num_meta; i++)
-                {
-                    fprintf(stderr, "%s", info.metastrings[i]);
-                    if(i != info.num_meta - 1)
-                        fprintf(stderr, "; ");
-                    else
-                        fprintf(stderr, ").\n");
-                }
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    return -1;
                 break;
-            case OTAUpdate:
-                if(info.target_revision == UINT32_MAX)
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: MAX, Optional: %hhu.\n", (long long) info.source_revision, info.optional);
-                else
-                    fprintf(stderr, " Min. OTA: %llu, Target OTA: %llu, Optional: %hhu.\n", (long long) info.source_revision, (long long) info.target_revision, info.optional);
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
                 break;
-            case RecoveryUpdate:
-                fprintf(stderr, " Minor: %d, Magic 1: %d, Magic 2: %d", info.minor, info.magic_1, info.magic_2);
-                if(strncmp(info.magic_number, "FB02", MAGIC_NUMBER_LENGTH) == 0 && info.header_rev > 0)
-                    fprintf(stderr, ", Header Rev: %llu, Platform: %s, Board: %s.\n", (long long) info.header_rev, convert_platform_id(info.platform), convert_board_id(info.board));
-                else
-                    fprintf(stderr, ".\n");
+            case 'j':
+                if(kt_parse_jobs(optarg) < 0)
+                    return -1;
                 break;
-            case RecoveryUpdateV2:
-                if(info.target_revision == UINT64_MAX)
-                    fprintf(stderr, " Target OTA: MAX");
-                else
-                    fprintf(stderr, " Target OTA: %llu", (long long) info.target_revision);
-                fprintf(stderr, ", Minor: %d, Magic 1: %d, Magic 2: %d, Header Rev: %llu, Cert: %d, Platform: %s, Board: %s.\n", info.minor, info.magic_1, info.magic_2, (long long) info.header_rev, info.certificate_number, convert_platform_id(info.platform), convert_board_id(info.board));
+            case 'D':
+                manifest.cache_dir = optarg;
+                break;
+            case 'P':
+                manifest.cache_verify = true;
+                break;
+            case ':':
+                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
                 break;
-            case UnknownUpdate:
             default:
-                fprintf(stderr, "\n\n!!!!\nUnknown update type, we shouldn't ever hit this!\n!!!!\n");
+                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
                 break;
         }
     }
-
-    // Create our package archive, sigfile & bundlefile included
-    if(!skip_archive)
+    if(optind != argc - 1)
     {
-        if(kindle_create_package_archive(tarball_fd, input_list, input_index, &info.sign_pkey, legacy, real_blocksize) != 0)
-        {
-            fprintf(stderr, "Failed to create intermediate archive '%s'.\n", tarball_filename);
-            // Delete the borked files
-            close(tarball_fd);
-            unlink(tarball_filename);
-            goto do_error;
-        }
-        // We opened it, we need to close it ;)
-        close(tarball_fd);
+        fprintf(stderr, "Invalid number of arguments (need manifest).\n");
+        return -1;
+    }
+    manifest_filename = argv[optind];
+    if(strcmp(manifest_filename, "-") == 0)
+        file = stdin;
+    else if((file = fopen(manifest_filename, "r")) == NULL)
+    {
+        fprintf(stderr, "Cannot open manifest '%s': %s.\n", manifest_filename, strerror(errno));
+        return -1;
     }
+    // Room for the command we prepend to each entry, too
+    if((args = malloc((MANIFEST_MAX_ARGS + 1) * sizeof(*args))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for manifest arguments.\n");
+        if(file != stdin)
+            fclose(file);
+        return -1;
+    }
+    args[0] = (char *) (uintptr_t) "create";
+    kt_settings_get(&manifest.settings);
+    // Spin our pool up once, and keep it around for every package
+    kt_keep_pool(true);
 
-    // And finally, build our package :)
-    if((input = fopen(tarball_filename, "rb")) == NULL)
+    while(kt_getline(&line, &line_size, file) != -1)
     {
-        fprintf(stderr, "Cannot read input tarball '%s': %s.\n", tarball_filename, strerror(errno));
-        goto do_error;
+        lineno++;
+        if((count = kt_split_args(line, args + 1, MANIFEST_MAX_ARGS)) == 0 || (count > 0 && args[1][0] == '#'))
+            continue;
+        fprintf(stderr, "Building manifest entry from line %u of '%s'.\n", lineno, manifest_filename);
+        if(count > 0 && manifest_build(&manifest, count + 1, args) == 0)
+        {
+            built++;
+        }
+        else
+        {
+            fprintf(stderr, "Failed to build manifest entry from line %u of '%s'.\n", lineno, manifest_filename);
+            failed++;
+        }
+        fprintf(stderr, "\n");
     }
-    if(kindle_create(&info, input, output, fake_sign) < 0)
+    if(ferror(file))
     {
-        fprintf(stderr, "Cannot write update to output.\n");
-        goto do_error;
+        fprintf(stderr, "Cannot read manifest '%s': %s.\n", manifest_filename, strerror(errno));
+        failed++;
     }
+    fprintf(stderr, "Built %u of %u packages from manifest '%s'.\n", built, built + failed, manifest_filename);
 
-    // Cleanup
-    for(ui = 0; ui < input_index; ui++)
-        free(input_list[ui]);
-    free(input_list);
-    free(info.devices);
-    for(i = 0; i < info.num_meta; i++)
-        free(info.metastrings[i]);
-    free(info.metastrings);
-    rsa_private_key_clear(&info.sign_pkey);
-    fclose(input);
-    if(output != stdout)
-        fclose(output);
-    free(output_filename);
-    // Remove tarball, unless we asked to keep it, or we used an existent tarball as sole input
-    if(!keep_archive && !skip_archive)
-        unlink(tarball_filename);
-    free(tarball_filename);
+    kt_settings_set(&manifest.settings);
+    kt_keep_pool(false);
+    for(i = 0; i < manifest.cache_count; i++)
+        kt_hash_cache_close(manifest.caches[i], false);
+    free(manifest.caches);
+    free(args);
+    free(line);
+    if(file != stdin)
+        fclose(file);
 
-    return 0;
+    return failed > 0 ? -1 : 0;
+}
 
-do_error:
-    if(input_index > 0)
-    {
-        for(ui = 0; ui < input_index; ui++)
-            free(input_list[ui]);
-        free(input_list);
-    }
-    free(output_filename);
-    free(info.devices);
-    for(i = 0; i < info.num_meta; i++)
-        free(info.metastrings[i]);
-    free(info.metastrings);
-    rsa_private_key_clear(&info.sign_pkey);
-    if(input != NULL)
-        fclose(input);
-    if(output != NULL && output != stdout)
-        fclose(output);
-    free(tarball_filename);
-    return -1;
+int kindle_create_main(int argc, char *argv[])
+{
+    KTCreateOptions options;
+    int ret;
+
+    // Many packages at once
+    if(argc > 1 && strcmp(argv[1], "manifest") == 0)
+        return kindle_create_manifest_main(argc - 1, argv + 1);
+    if(kindle_create_parse_options(argc, argv, &options) != 0)
+        return -1;
+    if(options.watch)
+        ret = kindle_create_watch(&options);
+    else
+        ret = kindle_create(&options);
+    kindle_create_free_options(&options);
+
+    return ret;
 }
 
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
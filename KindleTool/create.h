@@ -24,58 +24,249 @@
 #ifndef KINDLECREATE
 #define KINDLECREATE
 
-typedef struct
+// A chunk of our string pool, cf. arena_strndup
+struct ktarena_block
 {
-    char magic_number[MAGIC_NUMBER_LENGTH];
-    BundleVersion version;
-    struct rsa_private_key sign_pkey;
-    uint64_t source_revision;
-    uint64_t target_revision;
-    uint32_t magic_1;
-    uint32_t magic_2;
-    uint32_t minor;
-    uint16_t num_devices;
-    Device *devices;
-    Platform platform;
-    Board board;
-    uint32_t header_rev;
-    CertificateNumber certificate_number;
-    unsigned char optional;
-    unsigned char critical;
-    uint16_t num_meta;
-    char **metastrings;
-} UpdateInformation;
+    struct ktarena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+// Strings that live as long as the package we're building does: we never free them one by one, only all at once, cf. arena_free
+struct ktarena
+{
+    struct ktarena_block *head;                     // The one we're currently filling
+};
+
+// What the directory walk leaves out, cf. is_excluded
+struct ktexclude
+{
+    struct archive *files;                          // Our own exclude list (sigs & bundlefiles), and the user's
+    struct archive *dirs;                           // Only the user's, NULL if there's none (we never leave out a directory on our own)
+};
+
+// Something we've found on disk while walking our input, cf. walk_tree
+struct ktwalk_node
+{
+    char *path;
+    const char *name;                               // Points into path
+    struct stat st;
+    char *symlink;                                  // Its target, for symlinks
+    bool excluded;
+    size_t first_child;                             // Directories only: their children (sorted by name) are nodes[first_child] to nodes[first_child + child_count - 1]
+    size_t child_count;
+};
+
+// What we've found in a single directory (read on its own, possibly concurrently with others), cf. walk_read_dir
+struct ktwalk_dir
+{
+    struct ktwalk_node *children;
+    size_t count;
+    size_t size;
+    const char *failed_path;                        // NULL if everything went fine
+    int failed_errno;
+};
+
+// A whole input tree, read one level of directories at a time
+struct ktwalk
+{
+    struct ktwalk_node *nodes;                      // nodes[0] is the input itself
+    size_t count;
+    size_t size;
+    size_t *level;                                  // The directories (indices in nodes) we're reading right now
+    size_t level_count;
+    struct ktwalk_dir *dirs;                        // One per directory in level
+};
 
 // This is modeled after libarchive's bsdtar...
 struct kttar
 {
     unsigned char *buff;
     size_t buff_size;
-    char **to_sign_and_bundle_list;
-    char **tweaked_to_sign_and_bundle_list;
+    const char **to_sign_and_bundle_list;           // In paths
+    const char **tweaked_to_sign_and_bundle_list;   // Points inside the matching to_sign_and_bundle_list entry
     unsigned int sign_and_bundle_index;
+    unsigned int sign_and_bundle_size;              // How many files all of our per-file lists have room for, cf. grow_file_lists
+    struct ktarena paths;
     bool has_script;
     size_t tweak_pointer_index;
+    // We hash & sign the files we archive while we're copying them, so we only have to read them once
+    const struct kt_rsa_signer *signer;
+    bool hash_data;                                 // Whether copy_file_data_block should feed what it copies to md5 & sha256
+    struct md5_ctx md5;
+    struct kt_sha256_ctx sha256;
+    char (*md5s)[MD5_HASH_LENGTH + 1];              // One per entry of to_sign_and_bundle_list
+    uint8_t (*digests)[SHA256_DIGEST_SIZE];
+    unsigned char (*sigs)[CERTIFICATE_2K_SIZE];     // Filled by sign_file_digests, once we're done walking (unless cached)
+    int64_t *sizes;
+    // Files we've already hashed & signed in a previous run, cf. cache.c
+    kt_hash_cache *cache;                           // NULL if we don't use one
+    bool cache_verify;
+    kt_hash_cache *digest_cache;                    // Where to find the md5 & digest of files signed with another key, NULL for none
+    bool *cached;                                   // Whether that file's md5, digest & sig came straight from the cache
+    KTCacheKey *cache_keys;                         // Only path is left unset, it's in to_sign_and_bundle_list
+    struct ktexclude exclude;                       // Built once per walk, cf. exclude_init
+    // The bundle index, built in memory, cf. append_index_entry
+    char *index_data;
+    size_t index_length;
+    size_t index_size;
 };
 
-static const char *convert_bundle_version(BundleVersion);
+// One block of the intermediate tarball, deflated on its own, cf. gzip_compress_chunk
+struct ktgzip_chunk
+{
+    const unsigned char *in;
+    size_t in_len;
+    const unsigned char *dict;                      // The data right before it, to keep the compression ratio up
+    size_t dict_len;
+    unsigned char *out;
+    size_t out_size;
+    size_t out_len;
+    uLong crc;
+    bool last;
+    bool failed;
+};
 
-static struct rsa_private_key get_default_key(void);
-static int sign_file(FILE *, struct rsa_private_key *, FILE *);
+// The intermediate tarball, compressed & hashed while libarchive writes it, cf. tarball_write
+struct kttarball
+{
+    int fd;
+    bool hashed;                                    // Set once md5_hex covers the whole tarball
+    struct md5_ctx md5;
+    char md5_hex[MD5_HASH_LENGTH];
+    // pigz-style gzip: we deflate GZIP_CHUNK_SIZE blocks on our thread pool, a batch at a time, and stitch them back together in order
+    int level;
+    unsigned char *gz_buff;                         // Up to GZIP_DICT_SIZE bytes of history, followed by the current batch
+    size_t gz_history;
+    size_t gz_length;
+    size_t gz_batch_size;
+    struct ktgzip_chunk *gz_chunks;
+    unsigned int gz_nchunks;
+    uLong gz_crc;
+    uLong gz_isize;
+    FILE *munged;                                   // The tarball, already munged once for every bundle wrapped around it (cf. --fanout), NULL to munge it on the fly
+};
 
-static int metadata_filter(struct archive *, void *, struct archive_entry *);
-static int write_file(struct kttar *, struct archive *, struct archive *, struct archive_entry *);
-static int write_entry(struct kttar *, struct archive *, struct archive *, struct archive_entry *);
-static int copy_file_data_block(struct kttar *, struct archive *, struct archive *, struct archive_entry *);
-static int create_from_archive_read_disk(struct kttar *, struct archive *, char *, bool, char *, const unsigned int);
+// One payload of a --fanout, shared by every package built around it, cf. kindle_create_fanout
+struct ktartifact
+{
+    unsigned int blocksize;                         // The bundle index in the tarball depends on it, so we may need one tarball per block size
+    char *filename;                                 // Only set for the tarballs we've built here, which we delete once we're done
+    FILE *tgz;
+    struct kttarball tarball;                       // Only its md5 & munged are of any use by then
+    unsigned int bundles;                           // How many of our packages wrap it in a bundle (as opposed to a signed userdata package)
+};
+
+// Signing what we've hashed, cf. sign_file_digests
+struct sign_job
+{
+    struct kttar *kttar;
+    pthread_mutex_t lock;
+    bool failed;
+};
+
+static const char *convert_bundle_version(BundleVersion);
+static void parse_default_key(void);
+static void copy_private_key(struct rsa_private_key *, const struct rsa_private_key *);
 
-static int kindle_create_package_archive(const int, char **, const unsigned int, struct rsa_private_key *, const unsigned int, const unsigned int);
-static int kindle_create(UpdateInformation *, FILE *, FILE *, const bool);
-static int kindle_create_ota_update_v2(UpdateInformation *, FILE *, FILE *, const bool);
+static int exclude_init(struct ktexclude *, char **, const unsigned int);
+static void exclude_free(struct ktexclude *);
+static const char *arena_strndup(struct ktarena *, const char *, size_t);
+static void arena_free(struct ktarena *);
+static bool is_excluded(struct ktexclude *, struct archive_entry *);
+static void walk_free(struct ktwalk *);
+static int walk_add(struct ktwalk_dir *, const char *, const char *);
+static void walk_read_dir(void *, size_t);
+static int compare_walk_nodes(const void *, const void *);
+static int walk_tree(struct kttar *, struct ktwalk *, const char *);
+static int write_file(struct kttar *, struct archive *, int, struct archive_entry *);
+static int write_entry(struct kttar *, struct archive *, int, struct archive_entry *);
+static int copy_file_data_block(struct kttar *, struct archive *, int, struct archive_entry *);
+static void finish_file_data_hash(struct kttar *, unsigned int);
+static void sign_digest_task(void *, size_t);
+static int sign_file_digests(struct kttar *, unsigned int);
+static int write_memory_entry(struct archive *, const char *, const void *, size_t);
+static int grow_file_lists(struct kttar *);
+static int append_index_entry(struct kttar *, unsigned int, const unsigned int);
+static int create_from_disk(struct kttar *, struct archive *, char *, const unsigned int);
+static int tarball_output(struct kttarball *, const unsigned char *, size_t);
+static void gzip_compress_chunk(void *, size_t);
+static int gzip_flush(struct kttarball *, bool);
+static void gzip_free(struct kttarball *);
+static int tarball_open(struct archive *, void *);
+static la_ssize_t tarball_write(struct archive *, void *, const void *, size_t);
+static int tarball_close(struct archive *, void *);
+
+static int kindle_create_package_archive(struct kttarball *, char **, const unsigned int, const struct kt_rsa_signer *, const unsigned int, const unsigned int, const int, kt_hash_cache *, const bool, kt_hash_cache *, char **, const unsigned int);
+static int kindle_create_package(UpdateInformation *, FILE *, const struct kttarball *, FILE *, const bool);
+static void kindle_fill_header(UpdateInformation *, BundleVersion, KTBundleHeader *);
+static int kindle_write_header(const KTBundleHeader *, FILE *, struct kt_sha256_ctx *);
+static int kindle_create_enveloped_bundle(UpdateInformation *, FILE *, const struct kttarball *, FILE *, const bool);
+static int kindle_create_signed_bundle(UpdateInformation *, FILE *, const struct kttarball *, FILE *);
+static int kindle_create_bundle(UpdateInformation *, FILE *, const struct kttarball *, FILE *, const bool, struct kt_sha256_ctx *);
 static int kindle_create_signature(UpdateInformation *, FILE *, FILE *);
-static int kindle_create_ota_update(UpdateInformation *, FILE *, FILE *, const bool);
-static int kindle_create_recovery(UpdateInformation *, FILE *, FILE *, const bool);
-static int kindle_create_recovery_v2(UpdateInformation *, FILE *, FILE *, const bool);
+static int copy_payload(FILE *, FILE *, struct kt_sha256_ctx *);
+static BundleVersion kindle_create_parse_type(const char *);
+static int kindle_create_add_exclude(const char *, KTCreateOptions *);
+static int kindle_create_read_excludes(const char *, KTCreateOptions *);
+static KTSigningKey *kindle_create_key_slot(KTCreateOptions *, unsigned int);
+static char *kindle_create_key_output(const char *, const char *);
+static int kindle_create_other_keys(const KTCreateOptions *, const UpdateInformation *, const char *, FILE *, const struct kttarball *, kt_hash_cache *, const unsigned int);
+static int kindle_create_check_info(UpdateInformation *, const KTCreateOptions *, const bool, const bool);
+static int kindle_create_check_output_name(const char *, const BundleVersion, const bool);
+static FILE *kindle_create_open_output(const char *, const bool, char **);
+static int kindle_create_close_output(FILE *, const char *, char *, const bool);
+static int kindle_create_fanout_info(const KTCreateOptions *, const UpdateInformation *, BundleVersion, UpdateInformation *);
+static int kindle_create_fanout_artifact(const KTCreateOptions *, UpdateInformation *, kt_hash_cache *, struct ktartifact *);
+static int kindle_create_fanout(const KTCreateOptions *, UpdateInformation *, FILE *, const struct kttarball *, FILE *, kt_hash_cache *, const unsigned int);
+
+// Our inotify state, cf. kindle_create_watch
+#ifdef __linux__
+#define WATCH_EVENTS (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+#define WATCH_SETTLE_DELAY 500                      // How long (in ms) the tree has to stay quiet before we rebuild
+
+struct ktwatch_dir
+{
+    int wd;
+    char *path;                                     // Resolved, cf. realpath
+    const char *only;                               // When we're only watching a directory for one of our input files, its basename. NULL for the input directories themselves (and what's below them)
+};
+
+struct ktwatch
+{
+    int fd;
+    struct ktwatch_dir *dirs;
+    size_t count;
+    char **ignore;                                  // Resolved paths of every package we write (and of the temporary files we build them in), we don't want to trigger ourselves
+    size_t ignore_count;
+    char *cache_file;                               // Same for the cache (and its temporary copies), NULL if it only lives in memory
+};
+
+static char *watch_resolve(const char *);
+static int watch_ignore(struct ktwatch *, const char *);
+static bool watch_ignored(const struct ktwatch *, const char *, bool);
+static int watch_add(struct ktwatch *, const char *, const char *);
+static int watch_tree(struct ktwatch *, const char *);
+static int watch_read(struct ktwatch *, int, bool *);
+#endif
+static int kindle_create_watch(KTCreateOptions *);
+
+// What the entries of a manifest share, cf. kindle_create_manifest_main
+#define MANIFEST_MAX_ARGS 4096
+
+struct ktmanifest
+{
+    KTSettings settings;                            // What we were started with, every entry starts from there
+    const char *cache_dir;
+    bool cache_verify;
+    kt_hash_cache **caches;                         // In-memory ones, one per signing key, when we don't have a cache_dir
+    unsigned int cache_count;
+};
+
+static kt_hash_cache *manifest_cache(struct ktmanifest *, const struct rsa_private_key *);
+static int manifest_build(struct ktmanifest *, int, char **);
+static int kindle_create_manifest_main(int, char **);
 
 #endif
 
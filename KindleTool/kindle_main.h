@@ -24,14 +24,41 @@
 #ifndef KINDLEMAIN
 #define KINDLEMAIN
 
-// Ugly global.
-unsigned int kt_with_unknown_devcodes;
+// Ugly (thread-local) global.
+KT_TLS unsigned int kt_with_unknown_devcodes;
+KT_TLS unsigned int kt_threads = 1;
+KT_TLS unsigned int kt_jobs = 1;
+KT_TLS size_t kt_block_size = DEFAULT_STREAM_BLOCK_SIZE;
+
+static void mangle_scalar(unsigned char *, size_t, const uint8_t *, const uint8_t);
+#ifdef KT_HAVE_X86_SIMD
+static void mangle_sse2(unsigned char *, size_t, const uint8_t *, const uint8_t);
+static void mangle_avx2(unsigned char *, size_t, const uint8_t *, const uint8_t);
+#ifdef KT_HAVE_AVX512
+static void mangle_avx512(unsigned char *, size_t, const uint8_t *, const uint8_t);
+#endif
+#endif
+#ifdef KT_HAVE_NEON
+static void mangle_neon(unsigned char *, size_t, const uint8_t *, const uint8_t);
+#endif
+static void pick_mangle_kernel(void);
+static void (*mangle_kernel(void))(unsigned char *, size_t, const uint8_t *, const uint8_t);
+static void *kt_pool_worker(void *);
+static void kt_free_thread_pool(void);
+static int kt_parse_count(const char *, const char *, unsigned int *);
+static void mangle_slice(void *, size_t);
+static int md5_sum_stream(FILE *, char *, const bool);
+
+// CLI only
+#ifndef KT_LIBRARY
+static int mangle_file_in_place(const char *, const bool);
 
 static int kindle_print_help(const char *);
 static int kindle_print_version(const char *);
 static int kindle_deobfuscate_main(int, char **);
 static int kindle_obfuscate_main(int, char **);
 static int kindle_info_main(int, char **);
+#endif
 
 #endif
 
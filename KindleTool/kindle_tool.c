@@ -31,17 +31,34 @@
 //         - MSVCRT's tmpfile() creates files in the root drive, which, as we've already mentioned, is a recipe for disaster...
 // Whip crude hacks around both of these issues without having to resort to GetTempPathW() and deal with wchar_t...
 // Inspired from fontconfig's compatibility helpers (http://cgit.freedesktop.org/fontconfig/tree/src/fccompat.c)
+// NOTE: _mktemp only has 26 names to pick from per template & thread, and may well hand out one that another thread (or process) just grabbed,
+//       so, unlike the real thing, we have to retry with a fresh template when _O_EXCL bites...
+#define KT_WIN_MKSTEMP_TRIES 64
 int kt_win_mkstemp(char *template)
 {
-    if(_mktemp(template) == NULL)
-    {
-        fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+    char *pristine;
+    int fd = -1;
+    unsigned int tries;
+
+    if((pristine = strdup(template)) == NULL)
         return -1;
+    for(tries = 0; tries < KT_WIN_MKSTEMP_TRIES; tries++)
+    {
+        strcpy(template, pristine);
+        if(_mktemp(template) == NULL)
+        {
+            fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+            break;
+        }
+        // NOTE: Don't use _O_TEMPORARY, we expect to handle the unlink ourselves!
+        // NOTE: And while we probably could use _O_NOINHERIT, we do not, for a question of feature parity:
+        //       We don't use O_CLOEXEC on Linux because it depends on Glibc 2.7 & Linux 2.6.23, and we routinely run on stuff much older than that...
+        fd = _open(template, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if(fd != -1 || errno != EEXIST)
+            break;
     }
-    // NOTE: Don't use _O_TEMPORARY, we expect to handle the unlink ourselves!
-    // NOTE: And while we probably could use _O_NOINHERIT, we do not, for a question of feature parity:
-    //       We don't use O_CLOEXEC on Linux because it depends on Glibc 2.7 & Linux 2.6.23, and we routinely run on stuff much older than that...
-    return _open(template, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+    free(pristine);
+    return fd;
 }
 
 // Inspired from gnulib's tmpfile implementation (http://git.savannah.gnu.org/gitweb/?p=gnulib.git;a=blob;f=lib/tmpfile.c)
@@ -49,12 +66,19 @@ FILE *kt_win_tmpfile(void)
 {
     char template[] = KT_TMPDIR "/kindletool_tmpfile_XXXXXX";
     int fd = -1;
-    if(_mktemp(template) == NULL)
+    unsigned int tries;
+    for(tries = 0; tries < KT_WIN_MKSTEMP_TRIES; tries++)
     {
-        fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
-        return NULL;
+        strcpy(template, KT_TMPDIR "/kindletool_tmpfile_XXXXXX");
+        if(_mktemp(template) == NULL)
+        {
+            fprintf(stderr, "Couldn't create temporary file template: %s.\n", strerror(errno));
+            return NULL;
+        }
+        fd = _open(template, _O_CREAT | _O_EXCL | _O_TEMPORARY | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if(fd != -1 || errno != EEXIST)
+            break;
     }
-    fd = _open(template, _O_CREAT | _O_EXCL | _O_TEMPORARY | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
     if(fd == -1)
     {
         fprintf(stderr, "Couldn't open temporary file: %s.\n", strerror(errno));
@@ -74,48 +98,648 @@ FILE *kt_win_tmpfile(void)
 }
 #endif
 
-void md(unsigned char *bytes, size_t length)
+unsigned int kt_cpu_features(void)
 {
-    unsigned int i;
+    unsigned int features = 0;
+
+#ifdef KT_HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2"))
+        features |= KT_CPU_SSE2;
+    if(__builtin_cpu_supports("avx2"))
+        features |= KT_CPU_AVX2;
+#ifdef KT_HAVE_AVX512
+    if(__builtin_cpu_supports("avx512bw"))
+        features |= KT_CPU_AVX512BW;
+#endif
+#ifdef KT_HAVE_SHANI
+    // Not all compilers know about it in __builtin_cpu_supports, so ask CPUID directly (leaf 7, EBX bit 29). The kernel needs SSE4.1, too.
+    {
+        unsigned int eax, ebx, ecx, edx;
+        if(__get_cpuid_max(0, NULL) >= 7 && __builtin_cpu_supports("sse4.1"))
+        {
+            __cpuid_count(7, 0, eax, ebx, ecx, edx);
+            if(ebx & (1U << 29))
+                features |= KT_CPU_SHANI;
+        }
+    }
+#endif
+#endif
+#ifdef KT_HAVE_NEON
+    features |= KT_CPU_NEON;
+#endif
+#ifdef KT_HAVE_ARM_SHA2
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+    features |= KT_CPU_ARM_SHA2;
+#else
+    if(getauxval(AT_HWCAP) & HWCAP_SHA2)
+        features |= KT_CPU_ARM_SHA2;
+#endif
+#endif
+
+    return features;
+}
+
+// The look-up tables boil down to "swap nibbles, then XOR with a constant" (0x7A to mangle, 0xA7 to demangle, cf. tools/TableGen.lua),
+// which is trivial to vectorize. The scalar, table-driven variant is the reference implementation, and handles the odd tails.
+static void mangle_scalar(unsigned char *bytes, size_t length, const uint8_t *table, const uint8_t key __attribute__((unused)))
+{
+    size_t i;
     for(i = 0; i < length; i++)
     {
-        bytes[i] = (unsigned char)ptog[bytes[i]];
+        bytes[i] = (unsigned char)table[bytes[i]];
+    }
+}
+
+#ifdef KT_HAVE_X86_SIMD
+__attribute__((target("sse2")))
+static void mangle_sse2(unsigned char *bytes, size_t length, const uint8_t *table, const uint8_t key)
+{
+    const __m128i lo_mask = _mm_set1_epi8(0x0F);
+    const __m128i xor_key = _mm_set1_epi8((char)key);
+    __m128i v;
+    size_t i = 0;
+
+    for(; i + 16 <= length; i += 16)
+    {
+        v = _mm_loadu_si128((const __m128i *)(bytes + i));
+        // NOTE: There's no 8-bit shift, so shift 16-bit lanes, and mask out what bled over from the neighbouring byte
+        v = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, lo_mask), 4), _mm_and_si128(_mm_srli_epi16(v, 4), lo_mask));
+        _mm_storeu_si128((__m128i *)(bytes + i), _mm_xor_si128(v, xor_key));
+    }
+    mangle_scalar(bytes + i, length - i, table, key);
+}
+
+__attribute__((target("avx2")))
+static void mangle_avx2(unsigned char *bytes, size_t length, const uint8_t *table, const uint8_t key)
+{
+    const __m256i lo_mask = _mm256_set1_epi8(0x0F);
+    const __m256i xor_key = _mm256_set1_epi8((char)key);
+    __m256i v;
+    size_t i = 0;
+
+    for(; i + 32 <= length; i += 32)
+    {
+        v = _mm256_loadu_si256((const __m256i *)(bytes + i));
+        v = _mm256_or_si256(_mm256_slli_epi16(_mm256_and_si256(v, lo_mask), 4), _mm256_and_si256(_mm256_srli_epi16(v, 4), lo_mask));
+        _mm256_storeu_si256((__m256i *)(bytes + i), _mm256_xor_si256(v, xor_key));
+    }
+    // GCC doesn't emit a vzeroupper ahead of this tail call, so clear the upper halves ourselves,
+    // lest every legacy SSE instruction that runs afterwards (zlib, nettle, sha256rnds2...) pays for the dirty state.
+    _mm256_zeroupper();
+    mangle_sse2(bytes + i, length - i, table, key);
+}
+
+#ifdef KT_HAVE_AVX512
+__attribute__((target("avx512f,avx512bw")))
+static void mangle_avx512(unsigned char *bytes, size_t length, const uint8_t *table, const uint8_t key)
+{
+    const __m512i lo_mask = _mm512_set1_epi8(0x0F);
+    const __m512i xor_key = _mm512_set1_epi8((char)key);
+    __m512i v;
+    size_t i = 0;
+
+    for(; i + 64 <= length; i += 64)
+    {
+        v = _mm512_loadu_si512((const void *)(bytes + i));
+        v = _mm512_or_si512(_mm512_slli_epi16(_mm512_and_si512(v, lo_mask), 4), _mm512_and_si512(_mm512_srli_epi16(v, 4), lo_mask));
+        _mm512_storeu_si512((void *)(bytes + i), _mm512_xor_si512(v, xor_key));
+    }
+    // Same as in mangle_avx2
+    _mm256_zeroupper();
+    mangle_sse2(bytes + i, length - i, table, key);
+}
+#endif
+#endif
+
+#ifdef KT_HAVE_NEON
+static void mangle_neon(unsigned char *bytes, size_t length, const uint8_t *table, const uint8_t key)
+{
+    const uint8x16_t xor_key = vdupq_n_u8(key);
+    uint8x16_t v;
+    size_t i = 0;
+
+    for(; i + 16 <= length; i += 16)
+    {
+        v = vld1q_u8(bytes + i);
+        // Unlike SSE, NEON has proper 8-bit shifts, which shift in zeroes, so we don't even need to mask anything
+        v = vorrq_u8(vshlq_n_u8(v, 4), vshrq_n_u8(v, 4));
+        vst1q_u8(bytes + i, veorq_u8(v, xor_key));
     }
+    mangle_scalar(bytes + i, length - i, table, key);
+}
+#endif
+
+// The best kernel for this CPU, picked once, by the first thread that needs it (cf. mangle_kernel)
+static pthread_once_t mangle_kernel_once = PTHREAD_ONCE_INIT;
+static void (*mangle_kernel_best)(unsigned char *, size_t, const uint8_t *, const uint8_t) = mangle_scalar;
+
+static void pick_mangle_kernel(void)
+{
+    unsigned int features;
+
+    features = kt_cpu_features();
+#ifdef KT_HAVE_X86_SIMD
+    if(features & KT_CPU_SSE2)
+        mangle_kernel_best = mangle_sse2;
+    if(features & KT_CPU_AVX2)
+        mangle_kernel_best = mangle_avx2;
+#ifdef KT_HAVE_AVX512
+    if(features & KT_CPU_AVX512BW)
+        mangle_kernel_best = mangle_avx512;
+#endif
+#endif
+#ifdef KT_HAVE_NEON
+    if(features & KT_CPU_NEON)
+        mangle_kernel_best = mangle_neon;
+#endif
+    (void) features;
+}
+
+static void (*mangle_kernel(void))(unsigned char *, size_t, const uint8_t *, const uint8_t)
+{
+    pthread_once(&mangle_kernel_once, pick_mangle_kernel);
+    return mangle_kernel_best;
+}
+
+void md(unsigned char *bytes, size_t length)
+{
+    mangle_kernel()(bytes, length, ptog, 0x7A);
 }
 
 void dm(unsigned char *bytes, size_t length)
 {
+    mangle_kernel()(bytes, length, gtop, 0xA7);
+}
+
+// Dead simple thread pool: the caller hands out a batch of indexed tasks, and joins the workers in churning through them.
+struct kt_pool
+{
+    pthread_t *threads;
+    unsigned int nthreads;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;
+    pthread_cond_t done_cond;
+    kt_task_fn fn;
+    void *arg;
+    size_t count;
+    size_t next;
+    size_t done;
+    bool stop;
+};
+
+static void *kt_pool_worker(void *userdata)
+{
+    kt_pool *pool = userdata;
+    size_t index;
+
+    pthread_mutex_lock(&pool->lock);
+    while(true)
+    {
+        while(!pool->stop && pool->next >= pool->count)
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+        if(pool->stop)
+            break;
+        index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        pool->fn(pool->arg, index);
+
+        pthread_mutex_lock(&pool->lock);
+        if(++pool->done == pool->count)
+            pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+kt_pool *kt_pool_new(unsigned int nthreads)
+{
+    kt_pool *pool;
     unsigned int i;
-    for(i = 0; i < length; i++)
+
+    if((pool = calloc(1, sizeof(*pool))) == NULL)
+    {
+        fprintf(stderr, "Error allocating thread pool.\n");
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    // The caller does its share of the work, so we only need nthreads - 1 extra workers
+    if(nthreads > 1)
+    {
+        if((pool->threads = malloc((nthreads - 1) * sizeof(*pool->threads))) == NULL)
+        {
+            fprintf(stderr, "Error allocating thread pool.\n");
+            kt_pool_free(pool);
+            return NULL;
+        }
+        for(i = 0; i < nthreads - 1; i++)
+        {
+            if(pthread_create(&pool->threads[i], NULL, kt_pool_worker, pool) != 0)
+            {
+                // Make do with what we've got
+                fprintf(stderr, "Couldn't spawn worker thread %u, continuing with %u threads.\n", i + 1, i + 1);
+                break;
+            }
+            pool->nthreads++;
+        }
+    }
+
+    return pool;
+}
+
+// Run fn(arg, 0) to fn(arg, count - 1) across the pool, and return once they're all done.
+// NOTE: Tasks must not call back into the same pool.
+void kt_pool_parallel_for(kt_pool *pool, size_t count, kt_task_fn fn, void *arg)
+{
+    size_t index;
+
+    if(count == 0)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->fn = fn;
+    pool->arg = arg;
+    pool->count = count;
+    pool->next = 0;
+    pool->done = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+    while(pool->next < pool->count)
+    {
+        index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        fn(arg, index);
+        pthread_mutex_lock(&pool->lock);
+        pool->done++;
+    }
+    while(pool->done < pool->count)
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    // Don't let the workers think there's still something to do
+    pool->count = 0;
+    pool->next = 0;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void kt_pool_free(kt_pool *pool)
+{
+    unsigned int i;
+
+    if(pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+    for(i = 0; i < pool->nthreads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+// Each thread gets its own pool, so that concurrent jobs don't fight over it (or respin it from under each other)
+static KT_TLS kt_pool *thread_pool = NULL;
+static KT_TLS unsigned int thread_pool_threads = 0;
+// Whether kt_release_pool should leave it alone, cf. kt_keep_pool
+static KT_TLS bool thread_pool_kept = false;
+
+static void kt_free_thread_pool(void)
+{
+    if(thread_pool != NULL)
+    {
+        kt_pool_free(thread_pool);
+        thread_pool = NULL;
+        thread_pool_threads = 0;
+    }
+}
+
+// Lazily spin up a pool of kt_threads threads for the calling thread (and respin it if kt_threads changed since)
+kt_pool *kt_get_pool(void)
+{
+    if(thread_pool != NULL && thread_pool_threads != kt_threads)
+        kt_free_thread_pool();
+    if(thread_pool == NULL)
+    {
+        thread_pool = kt_pool_new(kt_threads);
+        thread_pool_threads = kt_threads;
+    }
+
+    return thread_pool;
+}
+
+// Tear down the calling thread's pool, if it has one (and we're not keeping it warm)
+void kt_release_pool(void)
+{
+    if(!thread_pool_kept)
+        kt_free_thread_pool();
+}
+
+// Keep the calling thread's pool alive across jobs (for long running threads, i.e., serve). Turning it off tears it down.
+void kt_keep_pool(bool keep)
+{
+    thread_pool_kept = keep;
+    if(!keep)
+        kt_free_thread_pool();
+}
+
+void kt_settings_get(KTSettings *settings)
+{
+    settings->threads = kt_threads;
+    settings->jobs = kt_jobs;
+    settings->block_size = kt_block_size;
+    settings->with_unknown_devcodes = kt_with_unknown_devcodes;
+}
+
+void kt_settings_set(const KTSettings *settings)
+{
+    kt_threads = settings->threads > 0 ? settings->threads : 1;
+    kt_jobs = settings->jobs > 0 ? settings->jobs : 1;
+    kt_block_size = settings->block_size > 0 ? settings->block_size : DEFAULT_STREAM_BLOCK_SIZE;
+    kt_with_unknown_devcodes = settings->with_unknown_devcodes;
+}
+
+// Parse a thread count, where 0 means one per online CPU. what is used to make the error message a bit more helpful.
+static int kt_parse_count(const char *arg, const char *what, unsigned int *count_out)
+{
+    char *endptr;
+    unsigned long threads;
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    SYSTEM_INFO sysinfo;
+#endif
+
+    errno = 0;
+    threads = strtoul(arg, &endptr, 10);
+    if(errno != 0 || endptr == arg || *endptr != '\0' || threads > 1024)
+    {
+        fprintf(stderr, "Invalid %s '%s'.\n", what, arg);
+        return -1;
+    }
+    if(threads == 0)
+    {
+#if defined(_WIN32) && !defined(__CYGWIN__)
+        GetSystemInfo(&sysinfo);
+        threads = sysinfo.dwNumberOfProcessors;
+#else
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = ncpus > 0 ? (unsigned long)ncpus : 1;
+#endif
+    }
+    *count_out = (unsigned int)threads;
+
+    return 0;
+}
+
+// Parse the argument of a --threads switch
+int kt_parse_threads(const char *arg)
+{
+    return kt_parse_count(arg, "thread count", &kt_threads);
+}
+
+// Parse the argument of a --jobs switch
+int kt_parse_jobs(const char *arg)
+{
+    return kt_parse_count(arg, "job count", &kt_jobs);
+}
+
+// Parse a size, with optional K, M & G suffixes, between 1K and 1G. what is used to make the error message a bit more helpful.
+int kt_parse_size(const char *arg, const char *what, size_t *size_out)
+{
+    char *endptr;
+    unsigned long long size;
+    unsigned int shift = 0;
+
+    errno = 0;
+    size = strtoull(arg, &endptr, 10);
+    if(errno == 0 && endptr != arg)
+    {
+        switch(toupper((int)*endptr))
+        {
+            case 'G':
+                shift += 10;
+                // Fall through
+            case 'M':
+                shift += 10;
+                // Fall through
+            case 'K':
+                shift += 10;
+                endptr++;
+                break;
+            default:
+                break;
+        }
+        // Don't let the unit wrap it around into something that looks sane
+        if(size > (ULLONG_MAX >> shift))
+            errno = ERANGE;
+        else
+            size <<= shift;
+    }
+    // Stay within reason: no smaller than our old fixed buffer, and no larger than 1G
+    if(errno != 0 || endptr == arg || *endptr != '\0' || size < BUFFER_SIZE || size > (1ULL << 30))
+    {
+        fprintf(stderr, "Invalid %s '%s' (must be between 1K and 1G).\n", what, arg);
+        return -1;
+    }
+    *size_out = (size_t)size;
+
+    return 0;
+}
+
+// Parse the argument of a --block-size switch
+int kt_parse_block_size(const char *arg)
+{
+    return kt_parse_size(arg, "block size", &kt_block_size);
+}
+
+// Read a whole line, like getline (which MinGW doesn't have). Returns its length (LF included, if any), -1 on EOF or error.
+ssize_t kt_getline(char **line, size_t *line_size, FILE *file)
+{
+    char *buf;
+    size_t len = 0;
+
+    if(*line == NULL || *line_size < 2)
+    {
+        if((buf = realloc(*line, BUFSIZ)) == NULL)
+            return -1;
+        *line = buf;
+        *line_size = BUFSIZ;
+    }
+    while(fgets(*line + len, (int)(*line_size - len), file) != NULL)
+    {
+        len += strlen(*line + len);
+        if(len > 0 && (*line)[len - 1] == '\n')
+            break;
+        // It didn't fit, make some room for the rest of it
+        if(len == *line_size - 1)
+        {
+            if((buf = realloc(*line, *line_size * 2)) == NULL)
+                return -1;
+            *line = buf;
+            *line_size *= 2;
+        }
+    }
+
+    return len > 0 ? (ssize_t)len : -1;
+}
+
+// getopt only resets itself properly on the first call, help it out before parsing another command line (i.e., serve's jobs, or a manifest's entries)
+void kt_reset_getopt(void)
+{
+#ifdef __GLIBC__
+    optind = 0;
+#else
+    optind = 1;
+#if defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) || defined(__DragonFly__)
+    optreset = 1;
+#endif
+#endif
+}
+
+// Split a line into (at most max_args) arguments, in place, with '...', "..." and \ working like in a shell. Returns the number of arguments, or -1 on unbalanced quotes.
+int kt_split_args(char *line, char **args, int max_args)
+{
+    char *src = line;
+    char *dst = line;
+    char quote;
+    int count = 0;
+
+    while(*src != '\0')
+    {
+        // Skip the blanks between arguments
+        while(*src != '\0' && isspace((unsigned char)*src))
+            src++;
+        if(*src == '\0')
+            break;
+        if(count >= max_args)
+        {
+            fprintf(stderr, "Too many arguments (%d at most).\n", max_args);
+            return -1;
+        }
+        args[count++] = dst;
+        quote = '\0';
+        while(*src != '\0' && (quote != '\0' || !isspace((unsigned char)*src)))
+        {
+            if(quote == '\0' && (*src == '\'' || *src == '"'))
+                quote = *src++;
+            else if(quote != '\0' && *src == quote)
+            {
+                quote = '\0';
+                src++;
+            }
+            else if(quote != '\'' && *src == '\\' && src[1] != '\0')
+            {
+                src++;
+                *dst++ = *src++;
+            }
+            else
+                *dst++ = *src++;
+        }
+        if(quote != '\0')
+        {
+            fprintf(stderr, "Unbalanced quotes.\n");
+            return -1;
+        }
+        if(*src != '\0')
+            src++;
+        *dst++ = '\0';
+    }
+
+    return count;
+}
+
+struct mangle_job
+{
+    unsigned char *bytes;
+    size_t length;
+    size_t slice;
+    bool demangle;
+};
+
+static void mangle_slice(void *userdata, size_t index)
+{
+    struct mangle_job *job = userdata;
+    size_t offset = index * job->slice;
+    size_t length = job->length - offset < job->slice ? job->length - offset : job->slice;
+
+    if(job->demangle)
+        dm(job->bytes + offset, length);
+    else
+        md(job->bytes + offset, length);
+}
+
+// Split a buffer in one slice per thread, and (de)mangle those in parallel
+void mangle_parallel(unsigned char *bytes, size_t length, const bool demangle)
+{
+    struct mangle_job job = { bytes, length, length, demangle };
+    kt_pool *pool = NULL;
+
+    // Not worth the hassle for small buffers
+    if(kt_threads > 1 && length >= 2 * PARALLEL_MIN_SLICE_SIZE)
+        pool = kt_get_pool();
+    if(pool == NULL)
     {
-        bytes[i] = (unsigned char)gtop[bytes[i]];
+        mangle_slice(&job, 0);
+        return;
     }
+
+    // Keep slices cacheline aligned, so the workers don't step on each other's toes
+    job.slice = ((length + kt_threads - 1) / kt_threads + 63) & ~(size_t)63;
+    if(job.slice < PARALLEL_MIN_SLICE_SIZE)
+        job.slice = PARALLEL_MIN_SLICE_SIZE;
+    kt_pool_parallel_for(pool, (length + job.slice - 1) / job.slice, mangle_slice, &job);
 }
 
 int munger(FILE *input, FILE *output, size_t length, const bool fake_sign)
 {
-    unsigned char bytes[BUFFER_SIZE];
+    return munger_hash(input, output, length, fake_sign, NULL);
+}
+
+// Same as munger, but also feeds what we write to sha256 (if it's not NULL)
+int munger_hash(FILE *input, FILE *output, size_t length, const bool fake_sign, struct kt_sha256_ctx *sha256)
+{
+    unsigned char *bytes;
+    size_t buffer_size;
     size_t bytes_read;
     size_t bytes_written;
 
-    while((bytes_read = fread(bytes, sizeof(unsigned char), (length < BUFFER_SIZE && length > 0 ? length : BUFFER_SIZE), input)) > 0)
+    // When we've got threads to spare, work in large batches, so that each of them gets a full block of data
+    buffer_size = kt_block_size * (kt_threads > 1 ? kt_threads : 1);
+    if((bytes = malloc(buffer_size)) == NULL)
+    {
+        fprintf(stderr, "Error munging, cannot allocate buffer: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    while((bytes_read = fread(bytes, sizeof(unsigned char), (length < buffer_size && length > 0 ? length : buffer_size), input)) > 0)
     {
         // Don't munge if we asked for a fake package
         if(!fake_sign)
-            md(bytes, bytes_read);
+            mangle_parallel(bytes, bytes_read, false);
+        if(sha256 != NULL)
+            kt_sha256_update(sha256, bytes_read, bytes);
         bytes_written = fwrite(bytes, sizeof(unsigned char), bytes_read, output);
         if(ferror(output) != 0)
         {
             fprintf(stderr, "Error munging, cannot write to output: %s.\n", strerror(errno));
+            free(bytes);
             return -1;
         }
         else if(bytes_written < bytes_read)
         {
             fprintf(stderr, "Error munging, read %zu bytes but only wrote %zu bytes.\n", bytes_read, bytes_written);
+            free(bytes);
             return -1;
         }
         length -= bytes_read;
     }
+    free(bytes);
     if(ferror(input) != 0)
     {
         fprintf(stderr, "Error munging, cannot read input: %s.\n", strerror(errno));
@@ -127,28 +751,40 @@ int munger(FILE *input, FILE *output, size_t length, const bool fake_sign)
 
 int demunger(FILE *input, FILE *output, size_t length, const bool fake_sign)
 {
-    unsigned char bytes[BUFFER_SIZE];
+    unsigned char *bytes;
+    size_t buffer_size;
     size_t bytes_read;
     size_t bytes_written;
 
-    while((bytes_read = fread(bytes, sizeof(unsigned char), (length < BUFFER_SIZE && length > 0 ? length : BUFFER_SIZE), input)) > 0)
+    // When we've got threads to spare, work in large batches, so that each of them gets a full block of data
+    buffer_size = kt_block_size * (kt_threads > 1 ? kt_threads : 1);
+    if((bytes = malloc(buffer_size)) == NULL)
+    {
+        fprintf(stderr, "Error demunging, cannot allocate buffer: %s.\n", strerror(errno));
+        return -1;
+    }
+
+    while((bytes_read = fread(bytes, sizeof(unsigned char), (length < buffer_size && length > 0 ? length : buffer_size), input)) > 0)
     {
         // Don't demunge if we supplied a fake package
         if(!fake_sign)
-            dm(bytes, bytes_read);
+            mangle_parallel(bytes, bytes_read, true);
         bytes_written = fwrite(bytes, sizeof(unsigned char), bytes_read, output);
         if(ferror(output) != 0)
         {
             fprintf(stderr, "Error demunging, cannot write to output: %s.\n", strerror(errno));
+            free(bytes);
             return -1;
         }
         else if(bytes_written < bytes_read)
         {
             fprintf(stderr, "Error demunging, read %zu bytes but only wrote %zu bytes.\n", bytes_read, bytes_written);
+            free(bytes);
             return -1;
         }
         length -= bytes_read;
     }
+    free(bytes);
     if(ferror(input) != 0)
     {
         fprintf(stderr, "Error demunging, cannot read input: %s.\n", strerror(errno));
@@ -158,6 +794,110 @@ int demunger(FILE *input, FILE *output, size_t length, const bool fake_sign)
     return 0;
 }
 
+#ifndef KT_LIBRARY
+// Mangle a file in place, one window at a time, which saves us the extra copy (and the extra disk space) of the streaming path
+static int mangle_file_in_place(const char *filename, const bool demangle)
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    // No mmap here, so just read, rewind & overwrite each block
+    FILE *file;
+    unsigned char *bytes;
+    size_t bytes_read;
+    long offset;
+
+    if((file = fopen(filename, "r+b")) == NULL)
+    {
+        fprintf(stderr, "Cannot open '%s' for read/write: %s.\n", filename, strerror(errno));
+        return -1;
+    }
+    if((bytes = malloc(kt_block_size)) == NULL)
+    {
+        fprintf(stderr, "Error allocating buffer: %s.\n", strerror(errno));
+        fclose(file);
+        return -1;
+    }
+    offset = 0;
+    while((bytes_read = fread(bytes, sizeof(unsigned char), kt_block_size, file)) > 0)
+    {
+        mangle_parallel(bytes, bytes_read, demangle);
+        if(fseek(file, offset, SEEK_SET) != 0 || fwrite(bytes, sizeof(unsigned char), bytes_read, file) < bytes_read || fflush(file) != 0)
+        {
+            fprintf(stderr, "Error writing back to '%s': %s.\n", filename, strerror(errno));
+            free(bytes);
+            fclose(file);
+            return -1;
+        }
+        offset += (long)bytes_read;
+    }
+    free(bytes);
+    if(ferror(file) != 0)
+    {
+        fprintf(stderr, "Error reading '%s': %s.\n", filename, strerror(errno));
+        fclose(file);
+        return -1;
+    }
+    if(fclose(file) != 0)
+    {
+        fprintf(stderr, "Error closing '%s': %s.\n", filename, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+#else
+    int fd;
+    struct stat st;
+    off_t offset;
+    size_t window;
+    size_t length;
+    size_t page_size;
+    unsigned char *map;
+
+    if((fd = open(filename, O_RDWR)) == -1)
+    {
+        fprintf(stderr, "Cannot open '%s' for read/write: %s.\n", filename, strerror(errno));
+        return -1;
+    }
+    if(fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "Cannot stat '%s': %s.\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if(!S_ISREG(st.st_mode))
+    {
+        fprintf(stderr, "Cannot work in place on '%s', it's not a regular file.\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    // Map a block per thread at a time (which keeps us sane on 32-bit boxes), mmap wants page aligned offsets, though.
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    window = kt_block_size * (kt_threads > 1 ? kt_threads : 1);
+    window = (window + page_size - 1) / page_size * page_size;
+    for(offset = 0; offset < st.st_size; offset += (off_t)length)
+    {
+        length = (size_t)(st.st_size - offset) < window ? (size_t)(st.st_size - offset) : window;
+        if((map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, offset)) == MAP_FAILED)
+        {
+            fprintf(stderr, "Cannot map '%s': %s.\n", filename, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        posix_madvise(map, length, POSIX_MADV_SEQUENTIAL);
+        mangle_parallel(map, length, demangle);
+        munmap(map, length);
+    }
+    if(close(fd) != 0)
+    {
+        fprintf(stderr, "Error closing '%s': %s.\n", filename, strerror(errno));
+        return -1;
+    }
+
+    return 0;
+#endif
+}
+#endif
+
 const char *convert_device_id(Device dev)
 {
     switch(dev)
@@ -378,16 +1118,38 @@ BundleVersion get_bundle_version(char magic_number[MAGIC_NUMBER_LENGTH])
 
 int md5_sum(FILE *input, char output_string[BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE)])
 {
-    unsigned char bytes[BUFFER_SIZE];
+    return md5_sum_stream(input, output_string, false);
+}
+
+// The MD5 of what demunger would make of input, without having to write that anywhere
+int demunged_md5_sum(FILE *input, char *output_string)
+{
+    return md5_sum_stream(input, output_string, true);
+}
+
+static int md5_sum_stream(FILE *input, char *output_string, const bool demunge)
+{
+    unsigned char *bytes;
+    size_t buffer_size;
     size_t bytes_read;
     struct md5_ctx md5;
     uint8_t digest[MD5_DIGEST_SIZE];
 
+    // Like demunger, give each thread a full block of data to chew on
+    buffer_size = kt_block_size * (demunge && kt_threads > 1 ? kt_threads : 1);
+    if((bytes = malloc(buffer_size)) == NULL)
+    {
+        fprintf(stderr, "Error allocating hashing buffer: %s.\n", strerror(errno));
+        return -1;
+    }
     md5_init(&md5);
-    while((bytes_read = fread(bytes, sizeof(unsigned char), BUFFER_SIZE, input)) > 0)
+    while((bytes_read = fread(bytes, sizeof(unsigned char), buffer_size, input)) > 0)
     {
+        if(demunge)
+            mangle_parallel(bytes, bytes_read, true);
         md5_update(&md5, bytes_read, bytes);
     }
+    free(bytes);
     if(ferror(input) != 0)
     {
         fprintf(stderr, "Error reading input file: %s.\n", strerror(errno));
@@ -400,20 +1162,31 @@ int md5_sum(FILE *input, char output_string[BASE16_ENCODE_LENGTH(MD5_DIGEST_SIZE
     return 0;
 }
 
+#ifndef KT_LIBRARY
 static int kindle_print_help(const char *prog_name)
 {
     printf(
         "usage:\n"
-        "  %s md [ <input> ] [ <output> ]\n"
+        "  %s md [options] [ <input> ] [ <output> ]\n"
         "    Obfuscates data using Amazon's update algorithm.\n"
         "    If no input is provided, input from stdin\n"
         "    If no output is provided, output to stdout\n"
         "    \n"
-        "  %s dm [ <input> ] [ <output> ]\n"
+        "    Options:\n"
+        "      -i, --in-place              Work in place on the input file, instead of writing a separate output.\n"
+        "      -S, --block-size <size>     Stream data in blocks of size bytes (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Use num threads for the heavy lifting (0 to use one per CPU). Default is 1.\n"
+        "    \n"
+        "  %s dm [options] [ <input> ] [ <output> ]\n"
         "    Deobfuscates data using Amazon's update algorithm.\n"
         "    If no input is provided, input from stdin\n"
         "    If no output is provided, output to stdout\n"
         "    \n"
+        "    Options:\n"
+        "      -i, --in-place              Work in place on the input file, instead of writing a separate output.\n"
+        "      -S, --block-size <size>     Stream data in blocks of size bytes (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Use num threads for the heavy lifting (0 to use one per CPU). Default is 1.\n"
+        "    \n"
         "  %s convert [options] <input>...\n"
         "    Converts a Kindle update package to a gzipped tar archive file, and delete input.\n"
         "    \n"
@@ -424,12 +1197,16 @@ static int kindle_print_help(const char *prog_name)
         "      -k, --keep                  Don't delete the input package.\n"
         "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
         "      -w, --unwrap                Just unwrap the package, if it's wrapped in an UpdateSignature header (especially useful for userdata packages).\n"
+        "      -S, --block-size <size>     Stream data in blocks of size bytes (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Use num threads for the heavy lifting (0 to use one per CPU). Default is 1.\n"
         "      \n"
         "  %s extract [options] <input> <output>\n"
         "    Extracts a Kindle update package to a directory.\n"
         "    \n"
         "    Options:\n"
         "      -u, --unsigned              Assume input is an unsigned & mangled userdata package.\n"
+        "      -S, --block-size <size>     Stream data in blocks of size bytes (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Use num threads for the heavy lifting (0 to use one per CPU). Default is 1.\n"
         "      \n"
         "  %s create <type> <devices> [options] <dir|file>... [ <output> ]\n"
         "    Creates a Kindle update package.\n"
@@ -543,6 +1320,8 @@ static int kindle_print_help(const char *prog_name)
         "    Options:\n"
         "      All the following options are optional and advanced.\n"
         "      -k, --key <file>            PEM file containing RSA private key to sign update. Default is popular jailbreak key.\n"
+        "                                    Can be specified multiple times (each with its own --cert), to also build the same package signed with every other key,\n"
+        "                                    in a directory named after that key, next to output. The files are only hashed once.\n"
         "      -b, --bundle <type>         Manually specify package magic number. May override the value dictated by \"type\", if it makes sense. Valid bundle versions:\n"
         "                                    FB01, FB02 = recovery; FB03 = recovery2; FC02, FD03 = ota; FC04, FD04, FL01 = ota2; SP01 = sig\n"
         "      -s, --srcrev <ulong|uint>   OTA updates only. Source revision. OTA V1 uses uint, OTA V2 uses ulong.\n"
@@ -566,7 +1345,56 @@ static int kindle_print_help(const char *prog_name)
         "      -C, --legacy                Emulate the behaviour of yifanlu's KindleTool regarding directories. By default, we behave like tar:\n"
         "                                    every path passed on the commandline is stored as-is in the archive. This switch changes that, and store paths\n"
         "                                    relative to the path passed on the commandline, like if we had chdir'ed into it.\n"
+        "      -S, --block-size <size>     Stream data in blocks of size bytes (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Use num threads for the heavy lifting (0 to use one per CPU). Default is 1.\n"
+        "      -j, --jobs <num>            Sign num files at once (0 to use one per CPU). Default is 1.\n"
+        "      -z, --compression-level <num>\n"
+        "                                    gzip compression level (0-9) of the intermediate archive, compressed on --threads threads. Default is 6.\n"
+        "      -D, --cache-dir <dir>       Remember the hashes & signatures of the files we sign in dir, and reuse them on the next run\n"
+        "                                    for the files that haven't changed since (same size, mtime & inode).\n"
+        "      -P, --cache-verify          Hash the files anyway, and only reuse their signature from the cache if their content matches.\n"
+        "      -W, --watch                 Stay around after building the package, and rebuild it whenever something changes in our input (Linux only).\n"
+        "                                    Unchanged files aren't hashed nor signed again.\n"
+        "      -F, --fanout <type:output>  Also build a type (ota2, recovery2 or sig) package named output from the same payload. Can be specified multiple times.\n"
+        "                                    The files are only signed once, and the payload only built & munged once per block size.\n"
+        "      -e, --exclude <pattern>     Leave out the files & directories matching pattern (like tar's). Can be specified multiple times.\n"
+        "      -E, --exclude-from <file>   Leave out the files & directories matching any of the patterns (one per line) in file.\n"
         "      \n"
+        "  %s create manifest [options] <manifest>\n"
+        "    Creates every Kindle update package described in manifest (or standard input, if it's a single dash), in one go.\n"
+        "    Each line is a package, written like the create command's arguments (f.g., 'ota2 -d kindle5 -s 1 /path/to/dir /path/to/update_k5.bin'), blank lines & lines starting with a # are skipped.\n"
+        "    The files shared between packages signed with the same key are only hashed & signed once.\n"
+        "    \n"
+        "    Options:\n"
+        "      -S, --block-size <size>     Default block size for the packages (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Default number of threads for each package (0 to use one per CPU). Default is 1.\n"
+        "      -j, --jobs <num>            Default number of files to sign at once for each package (0 to use one per CPU). Default is 1.\n"
+        "      -D, --cache-dir <dir>       Default hash & signature cache directory for the packages, cf. create.\n"
+        "      -P, --cache-verify          Hash the files anyway, and only reuse their signature if their content matches.\n"
+        "    \n"
+        "  %s bench [options]\n"
+        "    Measures the throughput of the heavy lifting kernels (md, dm, munger, md5_sum, sign_file, gzip compression & tar extraction) on this machine.\n"
+        "    \n"
+        "    Options:\n"
+        "      -l, --length <size>         Amount of data to crunch per pass (K, M & G suffixes supported). Default is 32M.\n"
+        "      -f, --file-size <size>      Size of each file for the per-file kernels (md5_sum, sign_file, gzip & tar). Default is 1M.\n"
+        "      -S, --block-size <size>     Only benchmark this buffer size. Multiple \"--block-size\" options supported. Default is 4K, 64K & 1M.\n"
+        "      -T, --threads <num>         Only benchmark this many threads (0 for one per CPU). Multiple \"--threads\" options supported.\n"
+        "                                    Default is 1 up to one per CPU, in powers of two.\n"
+        "      -j, --json                  Output the results as JSON.\n"
+        "    \n"
+        "  %s serve [options] --socket <path>\n"
+        "    Stays in the background, and runs create, convert, extract & verify jobs sent over a Unix socket, with keys & thread pools already set up.\n"
+        "    Each line sent is a job, written like the command's arguments (f.g., 'create ota2 -d kindle5 /path/to/dir /path/to/update.bin'),\n"
+        "    and gets a '<ok|failed> <job id> <command> <seconds>' line back. verify <package> checks a package's integrity without extracting it.\n"
+        "    Relative paths are relative to the server's working directory, and the jobs' messages end up on the server's stderr.\n"
+        "    \n"
+        "    Options:\n"
+        "      -s, --socket <path>         Listen on this Unix socket.\n"
+        "      -w, --workers <num>         Run up to num jobs at once (0 to use one per CPU). Default is 1.\n"
+        "      -S, --block-size <size>     Default block size for the jobs (K, M & G suffixes supported). Default is 1M.\n"
+        "      -T, --threads <num>         Default number of threads for each job (0 to use one per CPU). Default is 1.\n"
+        "    \n"
         "  %s info <serialno>\n"
         "    Get the default root password.\n"
         "    Unless you changed your password manually, the first password shown will be the right one.\n"
@@ -584,7 +1412,7 @@ static int kindle_print_help(const char *prog_name)
         "  \n"
         "  2)  Kindle 4.0+ has a known bug that prevents some updates with meta-strings to run.\n"
         "  3)  Currently, even though OTA V2 supports updates that run on multiple devices, it is not possible to create an update package that will run on both the Kindle 4 (No Touch) and Kindle 5 (Touch/PW).\n"
-        , prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
+        , prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name, prog_name);
     return 0;
 }
 
@@ -603,14 +1431,68 @@ static int kindle_print_version(const char *prog_name)
 
 static int kindle_obfuscate_main(int argc, char *argv[])
 {
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "in-place", no_argument, NULL, 'i' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
     FILE *input;
     FILE *output;
+    bool in_place = false;
     input = stdin;
     output = stdout;
 
-    // Skip command
-    argv++;
-    argc--;
+    while((opt = getopt_long(argc, argv, "iS:T:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'i':
+                in_place = true;
+                break;
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    return -1;
+                break;
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
+                break;
+            case ':':
+                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    // Skip command & switches
+    argv += optind;
+    argc -= optind;
+    if(in_place)
+    {
+        if(argc != 1)
+        {
+            fprintf(stderr, "In-place mode needs exactly one input file (and no output).\n");
+            return -1;
+        }
+        if(mangle_file_in_place(argv[0], false) < 0)
+        {
+            fprintf(stderr, "Cannot obfuscate.\n");
+            return -1;
+        }
+        return 0;
+    }
     if(argc > 1)
     {
         if((output = fopen(argv[1], "wb")) == NULL)
@@ -642,14 +1524,68 @@ static int kindle_obfuscate_main(int argc, char *argv[])
 
 static int kindle_deobfuscate_main(int argc, char *argv[])
 {
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "in-place", no_argument, NULL, 'i' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
     FILE *input;
     FILE *output;
+    bool in_place = false;
     input = stdin;
     output = stdout;
 
-    // Skip command
-    argv++;
-    argc--;
+    while((opt = getopt_long(argc, argv, "iS:T:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 'i':
+                in_place = true;
+                break;
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    return -1;
+                break;
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
+                break;
+            case ':':
+                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+
+    // Skip command & switches
+    argv += optind;
+    argc -= optind;
+    if(in_place)
+    {
+        if(argc != 1)
+        {
+            fprintf(stderr, "In-place mode needs exactly one input file (and no output).\n");
+            return -1;
+        }
+        if(mangle_file_in_place(argv[0], true) < 0)
+        {
+            fprintf(stderr, "Cannot deobfuscate.\n");
+            return -1;
+        }
+        return 0;
+    }
     if(argc > 1)
     {
         if((output = fopen(argv[1], "wb")) == NULL)
@@ -815,6 +1751,10 @@ int main(int argc, char *argv[])
         return kindle_extract_main(argc, argv);
     else if(strncmp(cmd, "create", 6) == 0)
         return kindle_create_main(argc, argv);
+    else if(strncmp(cmd, "bench", 5) == 0)
+        return kindle_bench_main(argc, argv);
+    else if(strncmp(cmd, "serve", 5) == 0)
+        return kindle_serve_main(argc, argv);
     else if(strncmp(cmd, "info", 4) == 0)
         return kindle_info_main(argc, argv);
     else if(strncmp(cmd, "version", 7) == 0)
@@ -830,5 +1770,6 @@ int main(int argc, char *argv[])
 
     return 1;
 }
+#endif
 
 // kate: indent-mode cstyle; indent-width 4; replace-tabs on;
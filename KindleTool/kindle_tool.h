@@ -36,10 +36,31 @@
 #include <getopt.h>
 #include <limits.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 // libarchive does not pull that in for us anymore ;).
 #if defined(_WIN32) && !defined(__CYGWIN__)
 #include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#endif
+
+// For create --watch & --fanout
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#endif
+
+// Only means something on Windows, where it keeps read() from mangling line endings
+#ifndef O_BINARY
+#define O_BINARY 0
 #endif
 
 #include <archive.h>
@@ -53,12 +74,24 @@
 #include <nettle/sha2.h>
 #include <nettle/rsa.h>
 
+// We want zlib's const-correct API
+#define ZLIB_CONST
+#include <zlib.h>
+
 // Die in a slightly more graceful manner than by spewing a whole lot of warnings & errors if we're not building against at least libarchive 3.0.3
 #if ARCHIVE_VERSION_NUMBER < 3000003
 #error Your libarchive version is too old, KindleTool depends on libarchive >= 3.0.3
 #endif
 
 #define BUFFER_SIZE 1024
+// Default size of the blocks we stream (and hash) big files in, cf. kt_block_size
+#define DEFAULT_STREAM_BLOCK_SIZE 1048576
+// Don't bother splitting work between threads in slices smaller than this
+#define PARALLEL_MIN_SLICE_SIZE 65536
+// pigz-style gzip: size of the blocks we compress on their own, and of the history each of them is primed with
+#define GZIP_CHUNK_SIZE 131072
+#define GZIP_DICT_SIZE 32768
+#define DEFAULT_COMPRESSION_LEVEL 6
 #define BLOCK_SIZE 64
 #define RECOVERY_BLOCK_SIZE 131072
 
@@ -110,15 +143,14 @@ FILE *kt_win_tmpfile(void);
 #undef tmpfile
 #endif
 #define tmpfile kt_win_tmpfile
+
+// No symlinks to worry about there, cf. walk_read_dir
+#define lstat stat
 // --
 #else
 #define KT_TMPDIR P_tmpdir
 #endif
 
-// Bundlefile status bitmasks
-#define BUNDLE_OPEN 1           // 1 << 0       (bit 0)
-#define BUNDLE_CREATED 2        // 1 << 1       (bit 1)
-
 // Version tag fallback
 #ifndef KT_VERSION
 #define KT_VERSION "v1.6.4-GIT"
@@ -139,6 +171,64 @@ FILE *kt_win_tmpfile(void);
 #define GCC_VERSION (__GNUC__ * 10000 + __GNUC_MINOR__ * 100 + __GNUC_PATCHLEVEL__)
 #endif
 
+// Thread-local storage, for the per-job settings, cf. KTSettings
+#if defined(__GNUC__) || defined(__clang__)
+#define KT_TLS __thread
+#else
+#define KT_TLS _Thread_local
+#endif
+
+// What libkindletool exports, everything else is hidden (cf. -fvisibility=hidden in the Makefile, and libkindletool.h)
+#if defined(KT_LIBRARY) && (defined(__GNUC__) || defined(__clang__)) && !defined(_WIN32)
+#define KT_API __attribute__((visibility("default")))
+#else
+#define KT_API
+#endif
+
+// SIMD support for our hot loops. The x86 kernels are built via per-function target attributes, and picked at runtime,
+// which requires a compiler that lets us use intrinsics without the matching global -m flags (GCC >= 4.9, or Clang).
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) || (defined(GCC_VERSION) && GCC_VERSION >= 40900))
+#define KT_HAVE_X86_SIMD
+// AVX-512BW & SHA intrinsics appeared in GCC 5
+#if defined(__clang__) || GCC_VERSION >= 50000
+#define KT_HAVE_AVX512
+#define KT_HAVE_SHANI
+#endif
+#endif
+// NEON, on the other hand, is a buildtime affair (it's always there on AArch64, and we don't try to be clever on 32-bit ARM)
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define KT_HAVE_NEON
+#endif
+// The ARMv8 SHA-2 instructions are optional, though. Either the whole build targets them,
+// or we build that one kernel for them (which needs a GCC with a target("+crypto") aware arm_neon.h), and check at runtime on Linux.
+#if defined(__aarch64__) && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define KT_HAVE_ARM_SHA2
+#define KT_ARM_SHA2_TARGET
+#elif defined(__aarch64__) && defined(__linux__) && defined(GCC_VERSION) && GCC_VERSION >= 80000
+#define KT_HAVE_ARM_SHA2
+#define KT_ARM_SHA2_TARGET __attribute__((target("+crypto")))
+#endif
+
+// CPU feature bitmasks, cf. kt_cpu_features
+#define KT_CPU_SSE2 1           // 1 << 0       (bit 0)
+#define KT_CPU_AVX2 2           // 1 << 1       (bit 1)
+#define KT_CPU_AVX512BW 4       // 1 << 2       (bit 2)
+#define KT_CPU_NEON 8           // 1 << 3       (bit 3)
+#define KT_CPU_SHANI 16         // 1 << 4       (bit 4)
+#define KT_CPU_ARM_SHA2 32      // 1 << 5       (bit 5)
+
+#ifdef KT_HAVE_X86_SIMD
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+#ifdef KT_HAVE_NEON
+#include <arm_neon.h>
+#endif
+#if defined(KT_HAVE_ARM_SHA2) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
 typedef enum
 {
     UpdateSignature,
@@ -353,25 +443,220 @@ typedef struct
     } data;
 } UpdateHeader;
 
-// Ugly global. Used to cache the state of the KT_WITH_UNKNOWN_DEVCODES env var...
-extern unsigned int kt_with_unknown_devcodes;
+// Ugly (thread-local) global. Used to cache the state of the KT_WITH_UNKNOWN_DEVCODES env var...
+extern KT_TLS unsigned int kt_with_unknown_devcodes;
+// Ugly (thread-local) global. Number of worker threads to use for the heavy lifting, as set by the --threads switch...
+extern KT_API KT_TLS unsigned int kt_threads;
+// Ugly (thread-local) global. Number of files to sign at once when building a package, as set by the --jobs switch...
+extern KT_TLS unsigned int kt_jobs;
+// Ugly (thread-local) global. Size of the blocks we stream data in, as set by the --block-size switch...
+extern KT_TLS size_t kt_block_size;
+
+// A snapshot of the globals above. kindle_create & kindle_convert switch the calling thread over to the one in their options for the duration of the job,
+// so that jobs running on different threads don't step on each other's toes.
+typedef struct
+{
+    unsigned int threads;
+    unsigned int jobs;
+    size_t block_size;
+    unsigned int with_unknown_devcodes;
+} KTSettings;
+
+// SHA-256, with a hardware accelerated compression function when the CPU has one, cf. sha256_hw.c
+struct kt_sha256_ctx
+{
+    struct sha256_ctx nettle;   // Used as-is when we don't have any hardware support
+    uint32_t state[8];
+    uint64_t count;             // Number of blocks processed so far
+    unsigned int index;         // Bytes buffered in block
+    uint8_t block[SHA256_BLOCK_SIZE];
+    void (*compress)(uint32_t *, const uint8_t *, size_t);
+};
+
+// Fixed-key RSA signer, with the key setup done once, cf. rsa_sign.c
+#define KT_RSA_DIGEST_INFO_SIZE (19 + SHA256_DIGEST_SIZE)
+struct kt_rsa_signer
+{
+    const struct rsa_private_key *key;              // Borrowed, NULL until set up
+    size_t size;                                    // Key size, in bytes
+    uint8_t digest_info[KT_RSA_DIGEST_INFO_SIZE];   // DER DigestInfo for SHA-256, the digest goes at the end
+};
 
+typedef struct
+{
+    char magic_number[MAGIC_NUMBER_LENGTH];
+    BundleVersion version;
+    struct rsa_private_key sign_pkey;
+    uint64_t source_revision;
+    uint64_t target_revision;
+    uint32_t magic_1;
+    uint32_t magic_2;
+    uint32_t minor;
+    uint16_t num_devices;
+    Device *devices;
+    Platform platform;
+    Board board;
+    uint32_t header_rev;
+    CertificateNumber certificate_number;
+    unsigned char optional;
+    unsigned char critical;
+    uint16_t num_meta;
+    char **metastrings;
+    struct kt_rsa_signer signer;    // Set up from sign_pkey by kindle_create
+} UpdateInformation;
+
+// Another package to build around the same payload, cf. create --fanout
+typedef struct
+{
+    BundleVersion version;                  // UpdateSignature for a signed userdata package
+    const char *output_filename;            // Not owned by the options
+} KTFanout;
+
+// Another key to sign the same package with, cf. create with several --key
+typedef struct
+{
+    struct rsa_private_key sign_pkey;
+    CertificateNumber certificate_number;
+    const char *key_filename;               // Not owned by the options
+} KTSigningKey;
+
+// Everything kindle_create needs to know to build a package, cf. kindle_create_init_options & kindle_create_main
+typedef struct
+{
+    UpdateInformation info;
+    char **input_list;                      // Files & directories to package, or a single tarball
+    unsigned int input_count;
+    const char *output_filename;            // NULL to write to output instead. Not owned by the options
+    FILE *output;
+    bool keep_archive;
+    bool fake_sign;
+    bool userdata_only;
+    bool enforce_ota;
+    bool legacy;
+    int compression_level;                  // gzip level of the intermediate tarball (0-9)
+    bool source_rev_set;                    // Whether info.source_revision & info.target_revision were set explicitly
+    bool target_rev_set;
+    const char *cache_dir;                  // Where to keep the hash & signature cache, NULL for none. Not owned by the options
+    bool cache_verify;                      // Don't trust cache hits blindly, check them against the file's content
+    struct kt_hash_cache *cache;            // An already open cache to use instead of cache_dir's (i.e., by --watch). Not owned by the options
+    bool watch;                             // Stay around, and rebuild the package whenever our input changes, cf. kindle_create_watch
+    KTFanout *fanout;                       // Other packages to build from the same payload, cf. kindle_create_fanout
+    unsigned int fanout_count;
+    KTSigningKey *keys;                     // Every --key after the first one, each gets its own package, cf. kindle_create_other_keys
+    unsigned int key_count;
+    char **excludes;                        // --exclude & --exclude-from patterns, for the files & directories we walk
+    unsigned int exclude_count;
+    KTSettings settings;
+} KTCreateOptions;
+
+// What identifies a file on disk as far as the hash cache is concerned, cf. cache.c
+typedef struct
+{
+    const char *path;
+    int64_t size;
+    int64_t mtime;
+    int64_t mtime_nsec;
+    int64_t ino;
+} KTCacheKey;
+
+// Everything kindle_convert needs to know to convert some packages, cf. kindle_convert_main
+typedef struct
+{
+    char **input_list;
+    unsigned int input_count;
+    FILE *output;                           // Write the tarballs there instead of next to each package (i.e., to stdout)
+    bool info_only;
+    bool keep_ori;
+    bool extract_sig;
+    bool fake_sign;
+    bool unwrap_only;
+    KTSettings settings;
+} KTConvertOptions;
+
+// Everything kindle_extract needs to know to extract a package, cf. kindle_extract_main
+typedef struct
+{
+    const char *input;
+    const char *output_dir;                 // NULL to only check the package's integrity
+    bool fake_sign;
+    KTSettings settings;
+} KTExtractOptions;
+
+// Minimal thread pool, cf. kindle_tool.c
+typedef struct kt_pool kt_pool;
+typedef void (*kt_task_fn)(void *, size_t);
+
+unsigned int kt_cpu_features(void);
 void md(unsigned char *, size_t);
 void dm(unsigned char *, size_t);
+kt_pool *kt_pool_new(unsigned int);
+void kt_pool_parallel_for(kt_pool *, size_t, kt_task_fn, void *);
+void kt_pool_free(kt_pool *);
+kt_pool *kt_get_pool(void);
+void kt_release_pool(void);
+void kt_keep_pool(bool);
+void kt_settings_get(KTSettings *);
+void kt_settings_set(const KTSettings *);
+int kt_parse_threads(const char *);
+int kt_parse_jobs(const char *);
+int kt_parse_size(const char *, const char *, size_t *);
+int kt_parse_block_size(const char *);
+ssize_t kt_getline(char **, size_t *, FILE *);
+void kt_reset_getopt(void);
+int kt_split_args(char *, char **, int);
+void mangle_parallel(unsigned char *, size_t, const bool);
 int munger(FILE *, FILE *, size_t, const bool);
+int munger_hash(FILE *, FILE *, size_t, const bool, struct kt_sha256_ctx *);
 int demunger(FILE *, FILE *, size_t, const bool);
 const char *convert_device_id(Device);
 const char *convert_platform_id(Platform);
 const char *convert_board_id(Board);
 BundleVersion get_bundle_version(char *);
 int md5_sum(FILE *, char *);
+int demunged_md5_sum(FILE *, char *);
 
+void kt_sha256_init(struct kt_sha256_ctx *);
+void kt_sha256_update(struct kt_sha256_ctx *, size_t, const uint8_t *);
+void kt_sha256_digest(struct kt_sha256_ctx *, uint8_t *);
+
+KT_API int kt_rsa_signer_init(struct kt_rsa_signer *, const struct rsa_private_key *);
+int kt_rsa_signer_sign(const struct kt_rsa_signer *, const uint8_t *, mpz_t);
+
+int kindle_convert_parse_options(int, char **, KTConvertOptions *);
+int kindle_convert(const KTConvertOptions *);
 int kindle_convert_main(int, char **);
 
+int kindle_extract_parse_options(int, char **, KTExtractOptions *);
+int kindle_extract(const KTExtractOptions *);
 int kindle_extract_main(int, char **);
 
+int kindle_create_init_options(KTCreateOptions *, BundleVersion);
+void kindle_create_free_options(KTCreateOptions *);
+int kindle_create_parse_options(int, char **, KTCreateOptions *);
+int kindle_create(const KTCreateOptions *);
 int kindle_create_main(int, char **);
 
+struct rsa_private_key get_default_key(void);
+void kt_enable_key_cache(void);
+int kt_load_private_key(char *, struct rsa_private_key *);
+int sign_file(FILE *, const struct kt_rsa_signer *, FILE *);
+
+// Persistent hash & signature cache, cf. cache.c
+#define HASH_CACHE_FILE_NAME "kindletool.cache"
+typedef struct kt_hash_cache kt_hash_cache;
+kt_hash_cache *kt_hash_cache_open(const char *, const struct rsa_private_key *);
+bool kt_hash_cache_for_key(const kt_hash_cache *, const struct rsa_private_key *);
+bool kt_hash_cache_lookup(kt_hash_cache *, const KTCacheKey *, char *, uint8_t *, unsigned char *, size_t);
+bool kt_hash_cache_lookup_digests(kt_hash_cache *, const KTCacheKey *, char *, uint8_t *);
+void kt_hash_cache_reject(kt_hash_cache *);
+void kt_hash_cache_report(kt_hash_cache *);
+int kt_hash_cache_store(kt_hash_cache *, const KTCacheKey *, const char *, const uint8_t *, const unsigned char *, size_t);
+int kt_hash_cache_close(kt_hash_cache *, bool);
+
+int kindle_bench_main(int, char **);
+
+int kindle_serve_main(int, char **);
+
 int nettle_rsa_privkey_from_pem(char *, struct rsa_private_key *);
 
 #endif
@@ -0,0 +1,513 @@
+//
+//  libkindletool.c
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "libkindletool.h"
+
+// Buffer to buffer API, cf. libkindletool.h
+// The header layouts are the ones create & convert have always used, and create now builds its headers through kt_header_encode.
+// NOTE: Like everywhere else, the multi-byte fields are stored in host order (i.e., LE, since that's what the Kindle wants)...
+
+void kt_munge_buffer(unsigned char *bytes, size_t length)
+{
+    mangle_parallel(bytes, length, false);
+}
+
+void kt_demunge_buffer(unsigned char *bytes, size_t length)
+{
+    mangle_parallel(bytes, length, true);
+}
+
+// NOTE: output_string must be able to hold MD5_HASH_LENGTH + 1 bytes, it's NUL terminated
+void kt_md5_buffer(const unsigned char *bytes, size_t length, char *output_string)
+{
+    struct md5_ctx md5;
+    uint8_t digest[MD5_DIGEST_SIZE];
+
+    md5_init(&md5);
+    md5_update(&md5, length, bytes);
+    md5_digest(&md5, MD5_DIGEST_SIZE, digest);
+    base16_encode_update(output_string, MD5_DIGEST_SIZE, digest);
+    output_string[MD5_HASH_LENGTH] = '\0';
+}
+
+// NOTE: digest must be able to hold SHA256_DIGEST_SIZE bytes
+void kt_sha256_buffer(const unsigned char *bytes, size_t length, uint8_t *digest)
+{
+    struct kt_sha256_ctx hash;
+
+    kt_sha256_init(&hash);
+    kt_sha256_update(&hash, length, bytes);
+    kt_sha256_digest(&hash, digest);
+}
+
+// Sign a SHA-256 digest, and store the raw signature (signer->size bytes, BE) in raw_sig
+int kt_sign_digest(const struct kt_rsa_signer *signer, const uint8_t *digest, unsigned char *raw_sig)
+{
+    mpz_t sig;
+    size_t siglen;
+
+    mpz_init(sig);
+    if(kt_rsa_signer_sign(signer, digest, sig) != 0)
+    {
+        mpz_clear(sig);
+        return -1;
+    }
+    // Check that the sig looks sane before exporting it...
+    if((mpz_sizeinbase(sig, 2) + 7) / 8 > signer->size)
+    {
+        fprintf(stderr, "Signature is too large for our key!\n");
+        mpz_clear(sig);
+        return -1;
+    }
+
+    // NOTE: mpz_out_raw outputs a format that doesn't quite fit our needs (it prepends 4 bytes of size info)... Do it ourselves with mpz_export!
+    mpz_export(raw_sig, &siglen, 1, sizeof(unsigned char *), 1, 0, sig);   // Words of the proper amount of bytes for the host, most significant word & byte first (BE), full words.
+    mpz_clear(sig);
+    // Check that the sig looks sane...
+    if(siglen * sizeof(unsigned char *) != signer->size)
+    {
+        fprintf(stderr, "Signature is too short (or too large?) for our key!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+int kt_sign_buffer(const struct kt_rsa_signer *signer, const unsigned char *bytes, size_t length, unsigned char *raw_sig)
+{
+    uint8_t digest[SHA256_DIGEST_SIZE];
+
+    kt_sha256_buffer(bytes, length, digest);
+    return kt_sign_digest(signer, digest, raw_sig);
+}
+
+// Size of the signature that goes with a certificate, 0 if we don't know about it
+size_t kt_certificate_size(CertificateNumber cert_num)
+{
+    switch(cert_num)
+    {
+        case CertificateDeveloper:
+            return CERTIFICATE_DEV_SIZE;
+        case Certificate1K:
+            return CERTIFICATE_1K_SIZE;
+        case Certificate2K:
+            return CERTIFICATE_2K_SIZE;
+        case CertificateUnknown:
+        default:
+            return 0;
+    }
+}
+
+// Build the header for header->version in a freshly allocated buffer (to be freed by the caller).
+// The payload that follows it is munged (save for userdata packages, which don't have a header at all, and where we return an empty one).
+int kt_header_encode(const KTBundleHeader *header, unsigned char **header_out, size_t *header_size_out)
+{
+    UpdateHeader fixed_header;
+    unsigned char *buffer = NULL;
+    size_t header_size = 0;
+    size_t hindex = 0;
+    size_t str_len;
+    uint16_t device;
+    uint8_t recovery_num_devices;
+    uint32_t certificate_number;
+    unsigned int i;
+
+    *header_out = NULL;
+    *header_size_out = 0;
+
+    switch(header->version)
+    {
+        case OTAUpdateV2:
+            header_size = MAGIC_NUMBER_LENGTH + OTA_UPDATE_V2_BLOCK_SIZE + header->num_devices * sizeof(uint16_t) + OTA_UPDATE_V2_PART_2_BLOCK_SIZE;
+            for(i = 0; i < header->num_meta; i++)
+            {
+                str_len = strlen(header->metastrings[i]);
+                if(str_len > UINT16_MAX)
+                {
+                    fprintf(stderr, "Metastring is too long (%zu bytes, 65535 at most).\n", str_len);
+                    return -1;
+                }
+                header_size += sizeof(uint16_t) + str_len;
+            }
+            if((buffer = calloc(header_size, sizeof(unsigned char))) == NULL)
+                break;
+
+            memcpy(buffer, header->magic_number, MAGIC_NUMBER_LENGTH);
+            hindex += MAGIC_NUMBER_LENGTH;
+            memcpy(&buffer[hindex], &header->source_revision, sizeof(uint64_t)); // Source
+            hindex += sizeof(uint64_t);
+            memcpy(&buffer[hindex], &header->target_revision, sizeof(uint64_t)); // Target
+            hindex += sizeof(uint64_t);
+            memcpy(&buffer[hindex], &header->num_devices, sizeof(uint16_t)); // Device count
+            hindex += sizeof(uint16_t);
+            for(i = 0; i < header->num_devices; i++)
+            {
+                device = (uint16_t)header->devices[i];
+                memcpy(&buffer[hindex], &device, sizeof(uint16_t)); // Device
+                hindex += sizeof(uint16_t);
+            }
+            buffer[hindex] = header->critical; // Critical
+            hindex += sizeof(uint8_t);
+            hindex += sizeof(uint8_t); // 1 byte padding
+            memcpy(&buffer[hindex], header->md5_sum, MD5_HASH_LENGTH);
+            md(&buffer[hindex], MD5_HASH_LENGTH); // Obfuscate md5 hash
+            hindex += MD5_HASH_LENGTH;
+            memcpy(&buffer[hindex], &header->num_meta, sizeof(uint16_t)); // num_meta
+            hindex += sizeof(uint16_t);
+            for(i = 0; i < header->num_meta; i++)
+            {
+                str_len = strlen(header->metastrings[i]);
+                // String length: BE (cf. the FIXME in convert about otaup vs. otacheck)
+                buffer[hindex++] = (uint8_t)(str_len >> 8);
+                buffer[hindex++] = (uint8_t)str_len;
+                memcpy(&buffer[hindex], header->metastrings[i], str_len);
+                md(&buffer[hindex], str_len); // Obfuscate meta string
+                hindex += str_len;
+            }
+            break;
+        case OTAUpdate:
+        case RecoveryUpdate:
+            if((header->version == OTAUpdate || header->header_rev != 2) && header->num_devices < 1)
+            {
+                fprintf(stderr, "This bundle version needs a device.\n");
+                return -1;
+            }
+            memset(&fixed_header, 0, sizeof(UpdateHeader));
+            memcpy(fixed_header.magic_number, header->magic_number, MAGIC_NUMBER_LENGTH);
+            if(header->version == OTAUpdate)
+            {
+                header_size = MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE;
+                fixed_header.data.ota_update.source_revision = (uint32_t)header->source_revision;
+                fixed_header.data.ota_update.target_revision = (uint32_t)header->target_revision;
+                fixed_header.data.ota_update.device = (uint16_t)header->devices[0];
+                fixed_header.data.ota_update.optional = header->optional;
+                memcpy(fixed_header.data.ota_update.md5_sum, header->md5_sum, MD5_HASH_LENGTH);
+                md((unsigned char *)fixed_header.data.ota_update.md5_sum, MD5_HASH_LENGTH);
+            }
+            else
+            {
+                header_size = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
+                fixed_header.data.recovery_update.magic_1 = header->magic_1;
+                fixed_header.data.recovery_update.magic_2 = header->magic_2;
+                fixed_header.data.recovery_update.minor = header->minor;
+                // FB02 with a V2 Header Rev. has a platform & a board instead of a device
+                if(header->header_rev == 2)
+                {
+                    fixed_header.data.recovery_h2_update.platform = (uint32_t)header->platform;
+                    fixed_header.data.recovery_h2_update.header_rev = header->header_rev;
+                    fixed_header.data.recovery_h2_update.board = (uint32_t)header->board;
+                }
+                else
+                {
+                    fixed_header.data.recovery_update.device = (uint32_t)header->devices[0];
+                }
+                memcpy(fixed_header.data.recovery_update.md5_sum, header->md5_sum, MD5_HASH_LENGTH);
+                md((unsigned char *)fixed_header.data.recovery_update.md5_sum, MD5_HASH_LENGTH);
+            }
+            if((buffer = malloc(header_size)) == NULL)
+                break;
+            memcpy(buffer, &fixed_header, header_size);
+            break;
+        case RecoveryUpdateV2:
+            if(header->num_devices > UINT8_MAX)
+            {
+                fprintf(stderr, "Too many devices for a recovery V2 bundle (%hu, 255 at most).\n", header->num_devices);
+                return -1;
+            }
+            // Its total size is fixed, but some stuff inside are variable/padded...
+            header_size = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
+            if((buffer = calloc(header_size, sizeof(unsigned char))) == NULL)
+                break;
+
+            memcpy(buffer, header->magic_number, MAGIC_NUMBER_LENGTH);
+            hindex += MAGIC_NUMBER_LENGTH;
+            hindex += sizeof(uint32_t); // Padding
+            memcpy(&buffer[hindex], &header->target_revision, sizeof(uint64_t)); // Target
+            hindex += sizeof(uint64_t);
+            memcpy(&buffer[hindex], header->md5_sum, MD5_HASH_LENGTH);
+            md(&buffer[hindex], MD5_HASH_LENGTH); // Obfuscate md5 hash
+            hindex += MD5_HASH_LENGTH;
+            memcpy(&buffer[hindex], &header->magic_1, sizeof(uint32_t)); // Magic 1
+            hindex += sizeof(uint32_t);
+            memcpy(&buffer[hindex], &header->magic_2, sizeof(uint32_t)); // Magic 2
+            hindex += sizeof(uint32_t);
+            memcpy(&buffer[hindex], &header->minor, sizeof(uint32_t)); // Minor
+            hindex += sizeof(uint32_t);
+            memcpy(&buffer[hindex], &header->platform, sizeof(uint32_t)); // Platform
+            hindex += sizeof(uint32_t);
+            memcpy(&buffer[hindex], &header->header_rev, sizeof(uint32_t)); // Header rev
+            hindex += sizeof(uint32_t);
+            memcpy(&buffer[hindex], &header->board, sizeof(uint32_t)); // Board
+            hindex += sizeof(uint32_t);
+            hindex += sizeof(uint32_t); // Padding
+            hindex += sizeof(uint16_t); // ... Padding
+            hindex += sizeof(uint8_t);  // And more weird padding
+            recovery_num_devices = (uint8_t)header->num_devices; // u16 to u8...
+            buffer[hindex] = recovery_num_devices; // Device count
+            hindex += sizeof(uint8_t);
+            for(i = 0; i < header->num_devices; i++)
+            {
+                device = (uint16_t)header->devices[i];
+                memcpy(&buffer[hindex], &device, sizeof(uint16_t)); // Device
+                hindex += sizeof(uint16_t);
+            }
+            break;
+        case UpdateSignature:
+            if(header->signature_size > 0 && header->signature_size != kt_certificate_size(header->certificate_number))
+            {
+                fprintf(stderr, "Signature size doesn't match the certificate.\n");
+                return -1;
+            }
+            header_size = MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE + header->signature_size;
+            if((buffer = calloc(header_size, sizeof(unsigned char))) == NULL)
+                break;
+            memcpy(buffer, header->magic_number, MAGIC_NUMBER_LENGTH);
+            certificate_number = (uint32_t)header->certificate_number; // 4 byte certificate number
+            memcpy(&buffer[MAGIC_NUMBER_LENGTH], &certificate_number, sizeof(uint32_t));
+            memcpy(&buffer[MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE], header->signature, header->signature_size);
+            break;
+        case UserDataPackage:
+            // Just a gzipped tarball, nothing to add
+            return 0;
+            break;
+        case UnknownUpdate:
+        default:
+            fprintf(stderr, "Unknown update bundle version!\n");
+            return -1;
+            break;
+    }
+
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "Error allocating update header: %s.\n", strerror(errno));
+        return -1;
+    }
+    *header_out = buffer;
+    *header_size_out = header_size;
+    return 0;
+}
+
+// Parse the header at the start of data, and tell how large it was through header_size_out (the munged payload, or, for an UpdateSignature, the signed bundle, starts right after it).
+// Release it with kt_header_free.
+int kt_header_decode(const unsigned char *data, size_t length, KTBundleHeader *header, size_t *header_size_out)
+{
+    UpdateHeader fixed_header;
+    size_t hindex = 0;
+    size_t str_len;
+    uint16_t device;
+    uint32_t certificate_number;
+    unsigned int i;
+
+    memset(header, 0, sizeof(KTBundleHeader));
+    *header_size_out = 0;
+
+    if(length < MAGIC_NUMBER_LENGTH)
+        goto truncated;
+    memcpy(header->magic_number, data, MAGIC_NUMBER_LENGTH);
+    hindex += MAGIC_NUMBER_LENGTH;
+    header->version = get_bundle_version(header->magic_number);
+
+    switch(header->version)
+    {
+        case OTAUpdateV2:
+            if(length < hindex + OTA_UPDATE_V2_BLOCK_SIZE)
+                goto truncated;
+            memcpy(&header->source_revision, &data[hindex], sizeof(uint64_t));
+            hindex += sizeof(uint64_t);
+            memcpy(&header->target_revision, &data[hindex], sizeof(uint64_t));
+            hindex += sizeof(uint64_t);
+            memcpy(&header->num_devices, &data[hindex], sizeof(uint16_t));
+            hindex += sizeof(uint16_t);
+
+            if(length < hindex + header->num_devices * sizeof(uint16_t) + OTA_UPDATE_V2_PART_2_BLOCK_SIZE)
+                goto truncated;
+            if(header->num_devices > 0 && (header->devices = malloc(header->num_devices * sizeof(Device))) == NULL)
+                goto oom;
+            for(i = 0; i < header->num_devices; i++)
+            {
+                memcpy(&device, &data[hindex], sizeof(uint16_t));
+                header->devices[i] = (Device)device;
+                hindex += sizeof(uint16_t);
+            }
+            header->critical = data[hindex];
+            hindex += sizeof(uint8_t);
+            header->padding = data[hindex];
+            hindex += sizeof(uint8_t);
+            memcpy(header->md5_sum, &data[hindex], MD5_HASH_LENGTH);
+            dm((unsigned char *)header->md5_sum, MD5_HASH_LENGTH);
+            hindex += MD5_HASH_LENGTH;
+            memcpy(&header->num_meta, &data[hindex], sizeof(uint16_t));
+            hindex += sizeof(uint16_t);
+
+            if(header->num_meta > 0 && (header->metastrings = calloc(header->num_meta, sizeof(char *))) == NULL)
+                goto oom;
+            for(i = 0; i < header->num_meta; i++)
+            {
+                if(length < hindex + sizeof(uint16_t))
+                    goto truncated;
+                // BE string length
+                str_len = (size_t)data[hindex] << 8 | data[hindex + 1];
+                hindex += sizeof(uint16_t);
+                if(length < hindex + str_len)
+                    goto truncated;
+                if((header->metastrings[i] = malloc(str_len + 1)) == NULL)
+                    goto oom;
+                memcpy(header->metastrings[i], &data[hindex], str_len);
+                dm((unsigned char *)header->metastrings[i], str_len);
+                header->metastrings[i][str_len] = '\0';
+                hindex += str_len;
+            }
+            break;
+        case OTAUpdate:
+            if(length < MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE)
+                goto truncated;
+            memcpy(&fixed_header, data, MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE);
+            hindex = MAGIC_NUMBER_LENGTH + OTA_UPDATE_BLOCK_SIZE;
+            header->source_revision = fixed_header.data.ota_update.source_revision;
+            header->target_revision = fixed_header.data.ota_update.target_revision;
+            if((header->devices = malloc(sizeof(Device))) == NULL)
+                goto oom;
+            header->num_devices = 1;
+            header->devices[0] = (Device)fixed_header.data.ota_update.device;
+            header->optional = fixed_header.data.ota_update.optional;
+            header->padding = fixed_header.data.ota_update.unused;
+            memcpy(header->md5_sum, fixed_header.data.ota_update.md5_sum, MD5_HASH_LENGTH);
+            dm((unsigned char *)header->md5_sum, MD5_HASH_LENGTH);
+            break;
+        case RecoveryUpdate:
+            if(length < MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE)
+                goto truncated;
+            // Only the start of it is actually used, the rest is padding
+            memcpy(&fixed_header, data, MAGIC_NUMBER_LENGTH + sizeof(RecoveryH2UpdateHeader));
+            hindex = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
+            header->magic_1 = fixed_header.data.recovery_update.magic_1;
+            header->magic_2 = fixed_header.data.recovery_update.magic_2;
+            header->minor = fixed_header.data.recovery_update.minor;
+            if(fixed_header.data.recovery_h2_update.header_rev == 2)
+            {
+                header->header_rev = fixed_header.data.recovery_h2_update.header_rev;
+                header->platform = (Platform)fixed_header.data.recovery_h2_update.platform;
+                header->board = (Board)fixed_header.data.recovery_h2_update.board;
+            }
+            else
+            {
+                if((header->devices = malloc(sizeof(Device))) == NULL)
+                    goto oom;
+                header->num_devices = 1;
+                header->devices[0] = (Device)fixed_header.data.recovery_update.device;
+            }
+            memcpy(header->md5_sum, fixed_header.data.recovery_update.md5_sum, MD5_HASH_LENGTH);
+            dm((unsigned char *)header->md5_sum, MD5_HASH_LENGTH);
+            break;
+        case RecoveryUpdateV2:
+            if(length < MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE)
+                goto truncated;
+            hindex += sizeof(uint32_t); // Padding
+            memcpy(&header->target_revision, &data[hindex], sizeof(uint64_t));
+            hindex += sizeof(uint64_t);
+            memcpy(header->md5_sum, &data[hindex], MD5_HASH_LENGTH);
+            dm((unsigned char *)header->md5_sum, MD5_HASH_LENGTH);
+            hindex += MD5_HASH_LENGTH;
+            memcpy(&header->magic_1, &data[hindex], sizeof(uint32_t));
+            hindex += sizeof(uint32_t);
+            memcpy(&header->magic_2, &data[hindex], sizeof(uint32_t));
+            hindex += sizeof(uint32_t);
+            memcpy(&header->minor, &data[hindex], sizeof(uint32_t));
+            hindex += sizeof(uint32_t);
+            memcpy(&header->platform, &data[hindex], sizeof(uint32_t));
+            hindex += sizeof(uint32_t);
+            memcpy(&header->header_rev, &data[hindex], sizeof(uint32_t));
+            hindex += sizeof(uint32_t);
+            memcpy(&header->board, &data[hindex], sizeof(uint32_t));
+            hindex += sizeof(uint32_t);
+            hindex += sizeof(uint32_t); // Padding
+            hindex += sizeof(uint16_t); // ... Padding
+            hindex += sizeof(uint8_t);  // And more weird padding
+            header->num_devices = data[hindex];
+            hindex += sizeof(uint8_t);
+            if(header->num_devices > 0 && (header->devices = malloc(header->num_devices * sizeof(Device))) == NULL)
+                goto oom;
+            for(i = 0; i < header->num_devices; i++)
+            {
+                memcpy(&device, &data[hindex], sizeof(uint16_t));
+                header->devices[i] = (Device)device;
+                hindex += sizeof(uint16_t);
+            }
+            hindex = MAGIC_NUMBER_LENGTH + RECOVERY_UPDATE_BLOCK_SIZE;
+            break;
+        case UpdateSignature:
+            if(length < MAGIC_NUMBER_LENGTH + UPDATE_SIGNATURE_BLOCK_SIZE)
+                goto truncated;
+            memcpy(&certificate_number, &data[hindex], sizeof(uint32_t));
+            header->certificate_number = (CertificateNumber)certificate_number;
+            hindex += UPDATE_SIGNATURE_BLOCK_SIZE;
+            if((header->signature_size = kt_certificate_size(header->certificate_number)) == 0)
+            {
+                fprintf(stderr, "Unknown signature size, cannot continue.\n");
+                goto error;
+            }
+            if(length < hindex + header->signature_size)
+                goto truncated;
+            memcpy(header->signature, &data[hindex], header->signature_size);
+            hindex += header->signature_size;
+            break;
+        case UserDataPackage:
+            // It's a straight tarball, the magic number is part of the payload
+            hindex = 0;
+            break;
+        case UnknownUpdate:
+        default:
+            fprintf(stderr, "Unknown update bundle version!\n");
+            goto error;
+            break;
+    }
+
+    *header_size_out = hindex;
+    return 0;
+
+truncated:
+    fprintf(stderr, "Update header is truncated.\n");
+    goto error;
+oom:
+    fprintf(stderr, "Error allocating update header: %s.\n", strerror(errno));
+error:
+    kt_header_free(header);
+    return -1;
+}
+
+// Free what kt_header_decode allocated
+void kt_header_free(KTBundleHeader *header)
+{
+    unsigned int i;
+
+    if(header->metastrings != NULL)
+    {
+        for(i = 0; i < header->num_meta; i++)
+            free(header->metastrings[i]);
+        free(header->metastrings);
+        header->metastrings = NULL;
+    }
+    header->num_meta = 0;
+    free(header->devices);
+    header->devices = NULL;
+    header->num_devices = 0;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,73 @@
+//
+//  libkindletool.h
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef LIBKINDLETOOL
+#define LIBKINDLETOOL
+
+// Buffer to buffer flavor of the heavy lifting done by the CLI, for people who'd rather link against us than spawn us, cf. 'make lib'.
+// Same rules as the rest of the code: errors are printed on stderr, and we return -1.
+// Only what's declared here (and kt_rsa_signer_init & kt_threads, from kindle_tool.h) is exported from the shared library.
+// Threading obeys kt_threads (and the buffer munging is the only thing that uses it), the rest is safe to call from multiple threads at once.
+
+#include "kindle_tool.h"
+
+// Everything we know about a bundle header, in host order, with the MD5 hash deobfuscated.
+// Which fields matter depends on the version, as noted.
+typedef struct
+{
+    BundleVersion version;
+    char magic_number[MAGIC_NUMBER_LENGTH];
+    uint64_t source_revision;                       // OTA, OTA V2
+    uint64_t target_revision;                       // OTA, OTA V2, Recovery V2
+    uint16_t num_devices;                           // OTA (exactly 1), OTA V2, Recovery (exactly 1, unless header_rev is 2), Recovery V2 (255 at most)
+    Device *devices;
+    unsigned char optional;                         // OTA
+    unsigned char critical;                         // OTA V2
+    unsigned char padding;                          // OTA, OTA V2 (decode only, it's always written as 0)
+    char md5_sum[MD5_HASH_LENGTH + 1];              // OTA, OTA V2, Recovery, Recovery V2. NUL terminated.
+    uint16_t num_meta;                              // OTA V2
+    char **metastrings;
+    uint32_t magic_1;                               // Recovery, Recovery V2
+    uint32_t magic_2;
+    uint32_t minor;
+    uint32_t header_rev;                            // Recovery (0 or 2), Recovery V2
+    Platform platform;                              // Recovery (header_rev 2), Recovery V2
+    Board board;
+    CertificateNumber certificate_number;           // UpdateSignature
+    size_t signature_size;                          // UpdateSignature. On encode, may be 0 if you append the signature yourself
+    unsigned char signature[CERTIFICATE_2K_SIZE];
+} KTBundleHeader;
+
+KT_API void kt_munge_buffer(unsigned char *, size_t);
+KT_API void kt_demunge_buffer(unsigned char *, size_t);
+
+KT_API void kt_md5_buffer(const unsigned char *, size_t, char *);
+KT_API void kt_sha256_buffer(const unsigned char *, size_t, uint8_t *);
+KT_API int kt_sign_digest(const struct kt_rsa_signer *, const uint8_t *, unsigned char *);
+KT_API int kt_sign_buffer(const struct kt_rsa_signer *, const unsigned char *, size_t, unsigned char *);
+
+KT_API size_t kt_certificate_size(CertificateNumber);
+KT_API int kt_header_encode(const KTBundleHeader *, unsigned char **, size_t *);
+KT_API int kt_header_decode(const unsigned char *, size_t, KTBundleHeader *, size_t *);
+KT_API void kt_header_free(KTBundleHeader *);
+
+#endif
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,81 @@
+//
+//  rsa_sign.c
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// RSA signing with a fixed key, for when we churn through a whole lot of signatures (one per file in a package, plus the envelope).
+// The actual math is left to nettle (rsa_pkcs1_sign, which is what rsa_sha256_sign_digest boils down to),
+// we just do the per-key checks once in kt_rsa_signer_init, and keep the DigestInfo around so we only have to fill in the digest.
+// kt_rsa_signer_sign never touches the signer (nor the key), so it's safe to call from multiple threads at once.
+
+// DER encoded DigestInfo prefix for SHA-256, cf. RFC 3447, 9.2
+static const uint8_t sha256_digest_info[] =
+{
+    0x30, 0x31, 0x30, 0x0d, 0x06, 0x09, 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01, 0x05, 0x00, 0x04, 0x20
+};
+
+// NOTE: The signer only borrows rsa_pkey, which must outlive it
+int kt_rsa_signer_init(struct kt_rsa_signer *signer, const struct rsa_private_key *rsa_pkey)
+{
+    memset(signer, 0, sizeof(*signer));
+
+    // Handle 2K keys at most (we can't use anything larger anyway)...
+    if(rsa_pkey->size > CERTIFICATE_2K_SIZE)
+    {
+        fprintf(stderr, "RSA key is too large (2K at most)!\n");
+        return -1;
+    }
+    // And make sure the padding fits (PKCS#1 v1.5 wants at least 8 bytes of it)
+    if(rsa_pkey->size < 11 + sizeof(sha256_digest_info) + SHA256_DIGEST_SIZE)
+    {
+        fprintf(stderr, "RSA key is too small!\n");
+        return -1;
+    }
+
+    signer->key = rsa_pkey;
+    signer->size = rsa_pkey->size;
+    memcpy(signer->digest_info, sha256_digest_info, sizeof(sha256_digest_info));
+
+    return 0;
+}
+
+// NOTE: digest must hold SHA256_DIGEST_SIZE bytes
+int kt_rsa_signer_sign(const struct kt_rsa_signer *signer, const uint8_t *digest, mpz_t sig)
+{
+    uint8_t digest_info[KT_RSA_DIGEST_INFO_SIZE];
+
+    if(signer->key == NULL)
+    {
+        fprintf(stderr, "RSA signer was not set up!\n");
+        return -1;
+    }
+
+    memcpy(digest_info, signer->digest_info, sizeof(sha256_digest_info));
+    memcpy(digest_info + sizeof(sha256_digest_info), digest, SHA256_DIGEST_SIZE);
+    if(!rsa_pkcs1_sign(signer->key, sizeof(digest_info), digest_info, sig))
+    {
+        fprintf(stderr, "RSA signing failed!\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
@@ -0,0 +1,350 @@
+//
+//  serve.c
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+#include "serve.h"
+
+// Resident mode: we hang around on a Unix socket, and run the jobs we're sent with keys, pools & co already warmed up.
+// The protocol is line based: each line is a job, written like the arguments of the matching command (e.g., 'create ota2 -d kindle5 /some/dir /out/update.bin'),
+// split on whitespace, with '...', "..." and \ working like in a shell. Each job gets one line back, '<ok|failed> <job id> <command> <seconds>'.
+// Diagnostics end up on our stderr, as usual, and relative paths are relative to *our* working directory.
+// Each worker handles one connection at a time, and keeps its thread pool across connections.
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static double serve_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Run a single job on the calling worker
+static int serve_run_job(struct serve_ctx *ctx, int argc, char **argv)
+{
+    KTCreateOptions create_opts;
+    KTConvertOptions convert_opts;
+    KTExtractOptions extract_opts;
+    int ret;
+
+    // Every job starts from our own settings, not from whatever the previous one asked for
+    kt_settings_set(&ctx->settings);
+
+    if(strcmp(argv[0], "create") == 0)
+    {
+        pthread_mutex_lock(&ctx->getopt_lock);
+        kt_reset_getopt();
+        ret = kindle_create_parse_options(argc, argv, &create_opts);
+        pthread_mutex_unlock(&ctx->getopt_lock);
+        if(ret != 0)
+            return -1;
+        // We'd never get this worker back...
+        if(create_opts.watch)
+        {
+            fprintf(stderr, "Watching for changes isn't supported here.\n");
+            kindle_create_free_options(&create_opts);
+            return -1;
+        }
+        // There's nobody on the other end of our stdout...
+        if(create_opts.output_filename == NULL)
+        {
+            fprintf(stderr, "Creating to stdout isn't supported here.\n");
+            kindle_create_free_options(&create_opts);
+            return -1;
+        }
+        ret = kindle_create(&create_opts);
+        kindle_create_free_options(&create_opts);
+        return ret;
+    }
+    else if(strcmp(argv[0], "convert") == 0)
+    {
+        pthread_mutex_lock(&ctx->getopt_lock);
+        kt_reset_getopt();
+        ret = kindle_convert_parse_options(argc, argv, &convert_opts);
+        pthread_mutex_unlock(&ctx->getopt_lock);
+        if(ret != 0)
+            return -1;
+        // There's nobody on the other end of our stdout...
+        if(convert_opts.output != NULL)
+        {
+            fprintf(stderr, "Converting to stdout isn't supported here.\n");
+            return -1;
+        }
+        return kindle_convert(&convert_opts);
+    }
+    else if(strcmp(argv[0], "extract") == 0)
+    {
+        pthread_mutex_lock(&ctx->getopt_lock);
+        kt_reset_getopt();
+        ret = kindle_extract_parse_options(argc, argv, &extract_opts);
+        pthread_mutex_unlock(&ctx->getopt_lock);
+        if(ret != 0)
+            return -1;
+        return kindle_extract(&extract_opts);
+    }
+    else if(strcmp(argv[0], "verify") == 0)
+    {
+        // Just the extract integrity checks, without the extraction
+        if(argc != 2)
+        {
+            fprintf(stderr, "Invalid number of arguments (need input).\n");
+            return -1;
+        }
+        memset(&extract_opts, 0, sizeof(extract_opts));
+        extract_opts.input = argv[1];
+        kt_settings_get(&extract_opts.settings);
+        return kindle_extract(&extract_opts);
+    }
+
+    fprintf(stderr, "Unknown command '%s'.\n", argv[0]);
+    return -1;
+}
+
+// Run the jobs sent over a connection, until it's closed, or we get a 'quit'
+static void serve_client(struct serve_ctx *ctx, int fd)
+{
+    FILE *in;
+    FILE *out;
+    char *line = NULL;
+    size_t line_size = 0;
+    char **args;
+    int count;
+    unsigned long job;
+    double elapsed;
+    int ret;
+
+    if((in = fdopen(fd, "r")) == NULL)
+    {
+        fprintf(stderr, "Cannot read from client: %s.\n", strerror(errno));
+        close(fd);
+        return;
+    }
+    if((out = fdopen(dup(fd), "w")) == NULL)
+    {
+        fprintf(stderr, "Cannot write to client: %s.\n", strerror(errno));
+        fclose(in);
+        return;
+    }
+    if((args = malloc(SERVE_MAX_ARGS * sizeof(*args))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for client arguments.\n");
+        fclose(out);
+        fclose(in);
+        return;
+    }
+
+    while(kt_getline(&line, &line_size, in) != -1)
+    {
+        if((count = kt_split_args(line, args, SERVE_MAX_ARGS)) == 0)
+            continue;
+        if(count > 0 && strcmp(args[0], "quit") == 0)
+            break;
+
+        pthread_mutex_lock(&ctx->lock);
+        job = ++ctx->next_job;
+        pthread_mutex_unlock(&ctx->lock);
+
+        elapsed = serve_now();
+        ret = (count < 0) ? -1 : serve_run_job(ctx, count, args);
+        elapsed = serve_now() - elapsed;
+        fprintf(stderr, "Job %lu (%s) %s in %.3fs.\n\n", job, (count > 0 ? args[0] : "?"), (ret == 0 ? "done" : "failed"), elapsed);
+        fprintf(out, "%s %lu %s %.6f\n", (ret == 0 ? "ok" : "failed"), job, (count > 0 ? args[0] : "?"), elapsed);
+        if(fflush(out) != 0)
+            break;
+    }
+
+    free(args);
+    free(line);
+    fclose(out);
+    fclose(in);
+}
+
+static void *serve_worker(void *userdata)
+{
+    struct serve_ctx *ctx = userdata;
+    int fd;
+
+    // Spin our pool up now, and keep it around for every job we run
+    kt_settings_set(&ctx->settings);
+    kt_keep_pool(true);
+    if(kt_threads > 1)
+        kt_get_pool();
+
+    for(;;)
+    {
+        if((fd = accept(ctx->listen_fd, NULL, NULL)) == -1)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "accept() failed: %s.\n", strerror(errno));
+            break;
+        }
+        serve_client(ctx, fd);
+    }
+
+    kt_keep_pool(false);
+    return NULL;
+}
+#endif
+
+int kindle_serve_main(int argc, char *argv[])
+{
+#if defined(_WIN32) && !defined(__CYGWIN__)
+    (void) argc;
+    (void) argv;
+    fprintf(stderr, "The serve command isn't supported on Windows.\n");
+    return -1;
+#else
+    int opt;
+    int opt_index;
+    static const struct option opts[] =
+    {
+        { "socket", required_argument, NULL, 's' },
+        { "workers", required_argument, NULL, 'w' },
+        { "block-size", required_argument, NULL, 'S' },
+        { "threads", required_argument, NULL, 'T' },
+        { NULL, 0, NULL, 0 }
+    };
+    struct serve_ctx ctx;
+    struct sockaddr_un addr;
+    struct stat st;
+    struct rsa_private_key rsa_pkey;
+    const char *socket_path = NULL;
+    unsigned int saved_threads;
+    unsigned int workers = 1;
+    pthread_t *threads;
+    unsigned int i;
+    mode_t old_mask;
+    int r;
+
+    while((opt = getopt_long(argc, argv, "s:w:S:T:", opts, &opt_index)) != -1)
+    {
+        switch(opt)
+        {
+            case 's':
+                socket_path = optarg;
+                break;
+            case 'w':
+                saved_threads = kt_threads;
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
+                workers = kt_threads;
+                kt_threads = saved_threads;
+                break;
+            case 'S':
+                if(kt_parse_block_size(optarg) < 0)
+                    return -1;
+                break;
+            case 'T':
+                if(kt_parse_threads(optarg) < 0)
+                    return -1;
+                break;
+            case ':':
+                fprintf(stderr, "Missing argument for switch '%c'.\n", optopt);
+                return -1;
+                break;
+            case '?':
+                fprintf(stderr, "Unknown switch '%c'.\n", optopt);
+                return -1;
+                break;
+            default:
+                fprintf(stderr, "?? Unknown option code 0%o ??\n", opt);
+                return -1;
+                break;
+        }
+    }
+    if(socket_path == NULL)
+    {
+        fprintf(stderr, "No socket specified.\n");
+        return -1;
+    }
+    if(strlen(socket_path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Socket path '%s' is too long (%zu bytes at most).\n", socket_path, sizeof(addr.sun_path) - 1);
+        return -1;
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    kt_settings_get(&ctx.settings);
+    pthread_mutex_init(&ctx.lock, NULL);
+    pthread_mutex_init(&ctx.getopt_lock, NULL);
+
+    // Pay for the key parsing once and for all
+    kt_enable_key_cache();
+    rsa_pkey = get_default_key();
+    rsa_private_key_clear(&rsa_pkey);
+
+    // Clients going away shouldn't take us down with them
+    signal(SIGPIPE, SIG_IGN);
+
+    if((ctx.listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+    {
+        fprintf(stderr, "Cannot create socket: %s.\n", strerror(errno));
+        return -1;
+    }
+    // Clear a stale socket from a previous run, but don't clobber anything else
+    if(lstat(socket_path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(socket_path);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    // Whoever can connect gets to sign with our key, so keep it to ourselves (bind honors the umask, and we don't have any other threads yet)
+    old_mask = umask(0177);
+    r = bind(ctx.listen_fd, (struct sockaddr *) &addr, sizeof(addr));
+    umask(old_mask);
+    if(r == -1 || listen(ctx.listen_fd, SOMAXCONN) == -1)
+    {
+        fprintf(stderr, "Cannot listen on socket '%s': %s.\n", socket_path, strerror(errno));
+        close(ctx.listen_fd);
+        return -1;
+    }
+    fprintf(stderr, "Serving on '%s' with %u worker%s (%u thread%s each).\n", socket_path, workers, (workers > 1 ? "s" : ""), ctx.settings.threads, (ctx.settings.threads > 1 ? "s" : ""));
+
+    if((threads = malloc(workers * sizeof(*threads))) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate memory for workers.\n");
+        close(ctx.listen_fd);
+        unlink(socket_path);
+        pthread_mutex_destroy(&ctx.getopt_lock);
+        pthread_mutex_destroy(&ctx.lock);
+        return -1;
+    }
+    for(i = 0; i < workers; i++)
+    {
+        if(pthread_create(&threads[i], NULL, serve_worker, &ctx) != 0)
+        {
+            fprintf(stderr, "Cannot start worker %u.\n", i);
+            break;
+        }
+    }
+    // Workers only ever give up if the socket does
+    while(i > 0)
+        pthread_join(threads[--i], NULL);
+
+    free(threads);
+    close(ctx.listen_fd);
+    unlink(socket_path);
+    pthread_mutex_destroy(&ctx.getopt_lock);
+    pthread_mutex_destroy(&ctx.lock);
+    return -1;
+#endif
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
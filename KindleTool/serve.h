@@ -0,0 +1,45 @@
+//
+//  serve.h
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#ifndef KINDLESERVE
+#define KINDLESERVE
+
+#define SERVE_MAX_ARGS 4096
+
+// State shared by all our workers
+struct serve_ctx
+{
+    int listen_fd;
+    KTSettings settings;                            // What every job starts from, before its own switches
+    pthread_mutex_t lock;                           // Protects next_job
+    unsigned long next_job;
+    pthread_mutex_t getopt_lock;                    // getopt's state is global, so jobs take turns parsing their switches
+};
+
+#if !defined(_WIN32) || defined(__CYGWIN__)
+static double serve_now(void);
+static int serve_run_job(struct serve_ctx *, int, char **);
+static void serve_client(struct serve_ctx *, int);
+static void *serve_worker(void *);
+#endif
+
+#endif
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;
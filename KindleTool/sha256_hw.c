@@ -0,0 +1,250 @@
+//
+//  sha256_hw.c
+//  KindleTool
+//
+//  Copyright (C) 2012-2016  NiLuJe
+//
+//  This program is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+
+#include "kindle_tool.h"
+
+// SHA-256 on top of the SHA extensions (x86 SHA-NI, or the ARMv8 crypto extensions), when the CPU has them.
+// We only provide the compression function, the rest (buffering, padding) is plain FIPS 180-4.
+// When there's no hardware support, everything is just forwarded to nettle.
+// Either way, the digest is the same, and so are the signatures we build from it.
+
+#if defined(KT_HAVE_SHANI) || defined(KT_HAVE_ARM_SHA2)
+static const uint32_t sha256_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static const uint32_t sha256_iv[8] =
+{
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+#endif
+
+#ifdef KT_HAVE_SHANI
+// Each group of 4 rounds runs through sha256rnds2 twice, while the message schedule for the next groups
+// is computed with sha256msg1/sha256msg2, cf. Intel's "Intel SHA Extensions" whitepaper.
+__attribute__((target("sha,sse4.1")))
+static void sha256_compress_shani(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    const __m128i byteswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef_save, cdgh_save;
+    __m128i msg[4];
+    __m128i wk, tmp;
+    unsigned int g;
+
+    // The instructions want the state as ABEF/CDGH
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);           // CDAB
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);        // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8);                                               // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                            // CDGH
+
+    while(blocks--)
+    {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        for(g = 0; g < 16; g++)
+        {
+            if(g < 4)
+                msg[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16 * g)), byteswap);
+            wk = _mm_add_epi32(msg[g & 3], _mm_loadu_si128((const __m128i *)&sha256_k[4 * g]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+            if(g >= 3 && g <= 14)
+            {
+                tmp = _mm_alignr_epi8(msg[g & 3], msg[(g - 1) & 3], 4);
+                msg[(g + 1) & 3] = _mm_sha256msg2_epu32(_mm_add_epi32(msg[(g + 1) & 3], tmp), msg[g & 3]);
+            }
+            wk = _mm_shuffle_epi32(wk, 0x0E);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, wk);
+            if(g >= 1 && g <= 12)
+                msg[(g - 1) & 3] = _mm_sha256msg1_epu32(msg[(g - 1) & 3], msg[g & 3]);
+        }
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+        data += SHA256_BLOCK_SIZE;
+    }
+
+    // And back to ABCD/EFGH
+    tmp = _mm_shuffle_epi32(state0, 0x1B);                                                  // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);                                               // DCHG
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));             // DCBA
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state1, tmp, 8));                // HGFE
+}
+#endif
+
+#ifdef KT_HAVE_ARM_SHA2
+KT_ARM_SHA2_TARGET
+static void sha256_compress_arm(uint32_t *state, const uint8_t *data, size_t blocks)
+{
+    uint32x4_t state0, state1, abcd_save, efgh_save;
+    uint32x4_t msg[4];
+    uint32x4_t wk, wk_next, tmp;
+    unsigned int g;
+
+    state0 = vld1q_u32(&state[0]);
+    state1 = vld1q_u32(&state[4]);
+
+    while(blocks--)
+    {
+        abcd_save = state0;
+        efgh_save = state1;
+
+        for(g = 0; g < 4; g++)
+            msg[g] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * g)));
+
+        wk = vaddq_u32(msg[0], vld1q_u32(&sha256_k[0]));
+        for(g = 0; g < 16; g++)
+        {
+            if(g < 12)
+                msg[g & 3] = vsha256su0q_u32(msg[g & 3], msg[(g + 1) & 3]);
+            if(g < 15)
+                wk_next = vaddq_u32(msg[(g + 1) & 3], vld1q_u32(&sha256_k[4 * (g + 1)]));
+            else
+                wk_next = wk;
+            tmp = state0;
+            state0 = vsha256hq_u32(state0, state1, wk);
+            state1 = vsha256h2q_u32(state1, tmp, wk);
+            if(g < 12)
+                msg[g & 3] = vsha256su1q_u32(msg[g & 3], msg[(g + 2) & 3], msg[(g + 3) & 3]);
+            wk = wk_next;
+        }
+
+        state0 = vaddq_u32(state0, abcd_save);
+        state1 = vaddq_u32(state1, efgh_save);
+        data += SHA256_BLOCK_SIZE;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+#endif
+
+void kt_sha256_init(struct kt_sha256_ctx *ctx)
+{
+#if defined(KT_HAVE_SHANI) || defined(KT_HAVE_ARM_SHA2)
+    unsigned int features = kt_cpu_features();
+#endif
+
+    memset(ctx, 0, sizeof(*ctx));
+#ifdef KT_HAVE_SHANI
+    if(features & KT_CPU_SHANI)
+        ctx->compress = sha256_compress_shani;
+#endif
+#ifdef KT_HAVE_ARM_SHA2
+    if(features & KT_CPU_ARM_SHA2)
+        ctx->compress = sha256_compress_arm;
+#endif
+
+#if defined(KT_HAVE_SHANI) || defined(KT_HAVE_ARM_SHA2)
+    if(ctx->compress != NULL)
+    {
+        memcpy(ctx->state, sha256_iv, sizeof(ctx->state));
+        return;
+    }
+#endif
+    sha256_init(&ctx->nettle);
+}
+
+void kt_sha256_update(struct kt_sha256_ctx *ctx, size_t length, const uint8_t *data)
+{
+    size_t left;
+    size_t blocks;
+
+    if(ctx->compress == NULL)
+    {
+        sha256_update(&ctx->nettle, length, data);
+        return;
+    }
+
+    // Complete a partial block first
+    if(ctx->index > 0)
+    {
+        left = SHA256_BLOCK_SIZE - ctx->index;
+        if(length < left)
+        {
+            memcpy(ctx->block + ctx->index, data, length);
+            ctx->index += (unsigned int)length;
+            return;
+        }
+        memcpy(ctx->block + ctx->index, data, left);
+        ctx->compress(ctx->state, ctx->block, 1);
+        ctx->count++;
+        data += left;
+        length -= left;
+        ctx->index = 0;
+    }
+    // Then hash as many full blocks as we can straight from the caller's buffer
+    blocks = length / SHA256_BLOCK_SIZE;
+    if(blocks > 0)
+    {
+        ctx->compress(ctx->state, data, blocks);
+        ctx->count += blocks;
+        data += blocks * SHA256_BLOCK_SIZE;
+        length -= blocks * SHA256_BLOCK_SIZE;
+    }
+    // And keep the rest for later
+    memcpy(ctx->block, data, length);
+    ctx->index = (unsigned int)length;
+}
+
+// NOTE: digest must be able to hold SHA256_DIGEST_SIZE bytes
+void kt_sha256_digest(struct kt_sha256_ctx *ctx, uint8_t *digest)
+{
+    uint64_t bits;
+    unsigned int i;
+
+    if(ctx->compress == NULL)
+    {
+        sha256_digest(&ctx->nettle, SHA256_DIGEST_SIZE, digest);
+        return;
+    }
+
+    // Standard padding: 0x80, zeroes up to 56 mod 64, then the message length in bits, BE
+    bits = (ctx->count * SHA256_BLOCK_SIZE + ctx->index) << 3;
+    ctx->block[ctx->index++] = 0x80;
+    if(ctx->index > SHA256_BLOCK_SIZE - 8)
+    {
+        memset(ctx->block + ctx->index, 0, SHA256_BLOCK_SIZE - ctx->index);
+        ctx->compress(ctx->state, ctx->block, 1);
+        ctx->index = 0;
+    }
+    memset(ctx->block + ctx->index, 0, SHA256_BLOCK_SIZE - 8 - ctx->index);
+    for(i = 0; i < 8; i++)
+        ctx->block[SHA256_BLOCK_SIZE - 1 - i] = (uint8_t)(bits >> (8 * i));
+    ctx->compress(ctx->state, ctx->block, 1);
+
+    for(i = 0; i < 8; i++)
+    {
+        digest[4 * i + 0] = (uint8_t)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)(ctx->state[i]);
+    }
+}
+
+// kate: indent-mode cstyle; indent-width 4; replace-tabs on;